@@ -0,0 +1,159 @@
+#include <mmap/mmap.h>
+#include <mmap/mmap_clt.h>
+#include <mmap/mmap_dummy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/* Compares the default GMP allocator with mmap_alloc_install on matrix
+ * products and on churn of short-lived encodings across threads.  Each mode
+ * sets up and tears down everything it uses, so they can run one after the
+ * other; the maximum resident set size is per process, so run one mode at a
+ * time to compare it.
+ *
+ * usage: bench_alloc [default|arena|huge|all] [dummy|clt] [lambda] [n] [rounds]
+ */
+
+static double
+current_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+encode_random(const mmap_vtable *mmap, mmap_sk sk, mmap_enc_mat_t m, int idx,
+              aes_randstate_t rng)
+{
+    const size_t nzs = mmap->sk->nzs(sk);
+    const size_t count = m->nrows * m->ncols;
+    mpz_t *moduli = mmap->sk->plaintext_fields(sk);
+    const mpz_t **plaintexts;
+    const int **ixs;
+    int pows[nzs];
+    mpz_t *xs;
+
+    for (size_t i = 0; i < nzs; i++)
+        pows[i] = (int) i == idx;
+    xs = calloc(count, sizeof xs[0]);
+    plaintexts = calloc(count, sizeof plaintexts[0]);
+    ixs = calloc(count, sizeof ixs[0]);
+    for (size_t k = 0; k < count; k++) {
+        mpz_init(xs[k]);
+        mpz_urandomm_aes(xs[k], rng, moduli[0]);
+        plaintexts[k] = (const mpz_t *) &xs[k];
+        ixs[k] = pows;
+    }
+    mmap->enc->encode_batch(m->data, sk, count, 1, plaintexts, ixs, 0);
+    for (size_t k = 0; k < count; k++)
+        mpz_clear(xs[k]);
+    free(xs);
+    free(plaintexts);
+    free(ixs);
+}
+
+static void
+run(const char *mode, const mmap_vtable *mmap, size_t lambda, int n,
+    int rounds)
+{
+    aes_randstate_t rng;
+    mmap_sk sk;
+    mmap_pp pp;
+    mmap_enc_mat_t a, b, r;
+    mmap_alloc_stats stats;
+    struct rusage usage;
+    const int flags = strcmp(mode, "huge") == 0 ? MMAP_ALLOC_HUGE_PAGES : 0;
+    double start, mul = 0.0, churn;
+
+    if (strcmp(mode, "default") != 0 && mmap_alloc_install(flags) != MMAP_OK) {
+        fprintf(stderr, "error: cannot install the allocator\n");
+        exit(1);
+    }
+
+    aes_randinit(rng);
+    mmap_sk_params params = {
+        .lambda = lambda,
+        .kappa = 2,
+        .gamma = 2,
+        .pows = NULL,
+    };
+    sk = mmap->sk->new(&params, NULL, 0, rng, false);
+    pp = mmap->sk->pp(sk);
+
+    for (int i = 0; i < rounds; ++i) {
+        mmap_enc_mat_init(mmap, pp, a, n, n);
+        mmap_enc_mat_init(mmap, pp, b, n, n);
+        mmap_enc_mat_init(mmap, pp, r, n, n);
+        encode_random(mmap, sk, a, 0, rng);
+        encode_random(mmap, sk, b, 1, rng);
+        start = current_time();
+        mmap_enc_mat_mul_par(mmap, pp, r, a, b);
+        mul += current_time() - start;
+        mmap_enc_mat_clear(mmap, a);
+        mmap_enc_mat_clear(mmap, b);
+        mmap_enc_mat_clear(mmap, r);
+    }
+
+    /* Each thread makes products in fresh encodings and frees them, the
+     * pattern of a circuit evaluator that does not recycle its wires */
+    mmap_enc_mat_init(mmap, pp, a, 1, n);
+    encode_random(mmap, sk, a, 0, rng);
+    start = current_time();
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < rounds * n; ++i) {
+        mmap_enc tmp[8];
+        for (int j = 0; j < 8; ++j) {
+            tmp[j] = mmap->enc->new(pp);
+            mmap->enc->add(tmp[j], pp, a->m[0][(i + j) % n], a->m[0][j % n]);
+        }
+        for (int j = 0; j < 8; ++j)
+            mmap->enc->free(tmp[j]);
+    }
+    churn = current_time() - start;
+    mmap_enc_mat_clear(mmap, a);
+
+    mmap->pp->free(pp);
+    mmap->sk->free(sk);
+    aes_randclear(rng);
+
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-8s %10.2f %10.2f %10ld", mode, mul * 1e3, churn * 1e3,
+           usage.ru_maxrss);
+    if (strcmp(mode, "default") != 0) {
+        mmap_alloc_get_stats(&stats);
+        printf(" %10zu %10zu", stats.peak >> 10, stats.mapped >> 10);
+        mmap_alloc_uninstall();
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = {"default", "arena", "huge"};
+    const char *mode = "all";
+    const mmap_vtable *mmap = &dummy_vtable;
+    size_t lambda = 80;
+    int n = 32, rounds = 8;
+
+    if (argc > 1)
+        mode = argv[1];
+    if (argc > 2 && strcmp(argv[2], "clt") == 0)
+        mmap = &clt_vtable;
+    if (argc > 3)
+        lambda = strtoul(argv[3], NULL, 10);
+    if (argc > 4)
+        n = atoi(argv[4]);
+    if (argc > 5)
+        rounds = atoi(argv[5]);
+
+    printf("%-8s %10s %10s %10s %10s %10s\n", "alloc", "mul ms", "churn ms",
+           "maxrss KiB", "peak KiB", "mapped KiB");
+    for (size_t i = 0; i < sizeof modes / sizeof modes[0]; ++i) {
+        if (strcmp(mode, "all") == 0 || strcmp(mode, modes[i]) == 0)
+            run(modes[i], mmap, lambda, n, rounds);
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <mmap/mmap.h>
+#include <mmap/mmap_dummy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Measures dummy add, sub, mul and is_zero as the number of slots grows.
+ * Set MMAP_DUMMY_SIMD=scalar or avx2 to compare against the default slot
+ * kernels.
+ *
+ * usage: bench_dummy_slots [lambda] [ops per size]
+ */
+
+static double
+current_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    const mmap_vtable *mmap = &dummy_vtable;
+    const size_t sizes[] = {1, 16, 256, 4096};
+    size_t lambda = 31;
+    long nops = 1 << 24;
+    aes_randstate_t rng;
+    int pows[] = {1, 1};
+
+    if (argc > 1)
+        lambda = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        nops = atol(argv[2]);
+
+    aes_randinit(rng);
+    printf("%-8s %12s %12s %12s %12s\n", "slots",
+           "add ns/slot", "sub ns/slot", "mul ns/slot", "zero ns/slot");
+    for (size_t s = 0; s < sizeof sizes / sizeof sizes[0]; ++s) {
+        const size_t nslots = sizes[s];
+        const long iters = nops / nslots > 0 ? nops / nslots : 1;
+        mmap_sk_params params = {
+            .lambda = lambda,
+            .kappa = 2,
+            .gamma = 2,
+            .pows = pows,
+        };
+        mmap_sk_opt_params opts = {
+            .nslots = nslots,
+            .modulus = NULL,
+            .is_polylog = false,
+        };
+        mmap_sk sk;
+        mmap_pp pp;
+        mmap_enc a, b, r;
+        mpz_t *moduli, *x;
+        double times[4];
+        volatile bool zero = false;
+
+        sk = mmap->sk->new(&params, &opts, 1, rng, false);
+        pp = mmap->sk->pp(sk);
+        moduli = mmap->sk->plaintext_fields(sk);
+        x = calloc(nslots, sizeof x[0]);
+        for (size_t i = 0; i < nslots; ++i) {
+            mpz_init(x[i]);
+            mpz_urandomm_aes(x[i], rng, moduli[i]);
+        }
+        a = mmap->enc->new(pp);
+        b = mmap->enc->new(pp);
+        r = mmap->enc->new(pp);
+        mmap->enc->encode(a, sk, nslots, (const mpz_t *) x, pows, 0);
+        mmap->enc->encode(b, sk, nslots, (const mpz_t *) x, pows, 0);
+        mmap->enc->mul(r, pp, a, b);
+
+        for (int op = 0; op < 4; ++op) {
+            const double start = current_time();
+            for (long i = 0; i < iters; ++i) {
+                switch (op) {
+                case 0: mmap->enc->add(r, pp, r, a); break;
+                case 1: mmap->enc->sub(r, pp, r, b); break;
+                case 2: mmap->enc->mul(r, pp, r, a); break;
+                case 3: zero ^= mmap->enc->is_zero(r, pp); break;
+                }
+            }
+            times[op] = (current_time() - start) * 1e9 / ((double) iters * nslots);
+        }
+        printf("%-8zu %12.2f %12.2f %12.2f %12.2f\n", nslots,
+               times[0], times[1], times[2], times[3]);
+
+        for (size_t i = 0; i < nslots; ++i)
+            mpz_clear(x[i]);
+        free(x);
+        mmap->enc->free(a);
+        mmap->enc->free(b);
+        mmap->enc->free(r);
+        mmap->pp->free(pp);
+        mmap->sk->free(sk);
+    }
+    aes_randclear(rng);
+    return 0;
+}
@@ -0,0 +1,327 @@
+#include <mmap/mmap.h>
+#include <mmap/mmap_clt.h>
+#include <mmap/mmap_dummy.h>
+#include <malloc.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Measures how mmap_enc_mat_mul_par scales against mmap_enc_mat_mul over
+ * matrix shapes, sizes, thread counts and backends, and prints the size at
+ * which the parallel kernel starts to win as a threshold table for
+ * mmap_enc_mat_mul_set_thresholds.
+ *
+ * usage: bench_mat_mul [dummy|clt|all] [lambda] [widths] [max threads] [trials]
+ *
+ * widths is a comma-separated list.  For each width w the shapes are a row
+ * (1 x w times w x w), a square (w x w times w x w) and a tall, skinny
+ * product (4w x 4 times 4 x 4).
+ *
+ * The last column is the peak resident memory the shape has added so far,
+ * from allocating and encoding its matrices up to that row, over what the
+ * process held before the shape started.  Memory freed by earlier shapes
+ * and reused without being returned to the system is not counted.
+ */
+
+#define MAX_WIDTHS 16
+#define NSHAPES 3
+/* Calls per trial are repeated until a trial takes at least this long */
+#define MIN_TRIAL_SECONDS 1e-3
+
+static const char *const shape_names[NSHAPES] = { "row", "square", "tall" };
+
+struct sample {
+    int nthreads;
+    size_t muls;
+    bool par_wins;
+};
+
+static double
+current_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A "Vm..." field of /proc/self/status in KiB, or -1 */
+static long
+status_kib(const char *field)
+{
+    const size_t len = strlen(field);
+    char line[256];
+    long kib = -1;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/status", "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof line, fp)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            kib = strtol(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return kib;
+}
+
+/* Returns freed memory to the system and restarts the peak RSS from the
+ * current RSS, which it returns.  Returns -1 if the kernel cannot reset the
+ * peak (Linux before 4.0). */
+static long
+rss_reset(void)
+{
+    FILE *fp;
+    bool ok;
+
+    malloc_trim(0);
+    if ((fp = fopen("/proc/self/clear_refs", "w")) == NULL)
+        return -1;
+    ok = fputs("5", fp) != EOF;
+    ok &= fclose(fp) == 0;
+    return ok ? status_kib("VmRSS") : -1;
+}
+
+/* Peak RSS above base since rss_reset returned base, or -1 */
+static long
+rss_peak_kib(long base)
+{
+    const long peak = status_kib("VmHWM");
+    return base < 0 || peak < 0 ? -1 : peak - base;
+}
+
+static void
+encode_random(const mmap_vtable *mmap, mmap_sk sk, mmap_enc_mat_t m, int idx,
+              aes_randstate_t rng)
+{
+    const size_t nzs = mmap->sk->nzs(sk);
+    const size_t count = m->nrows * m->ncols;
+    mpz_t *moduli = mmap->sk->plaintext_fields(sk);
+    const mpz_t **plaintexts;
+    const int **ixs;
+    int pows[nzs];
+    mpz_t *xs;
+
+    for (size_t i = 0; i < nzs; i++)
+        pows[i] = (int) i == idx;
+    xs = calloc(count, sizeof xs[0]);
+    plaintexts = calloc(count, sizeof plaintexts[0]);
+    ixs = calloc(count, sizeof ixs[0]);
+    for (size_t k = 0; k < count; k++) {
+        mpz_init(xs[k]);
+        mpz_urandomm_aes(xs[k], rng, moduli[0]);
+        plaintexts[k] = (const mpz_t *) &xs[k];
+        ixs[k] = pows;
+    }
+    mmap->enc->encode_batch(m->data, sk, count, 1, plaintexts, ixs, 0);
+    for (size_t k = 0; k < count; k++)
+        mpz_clear(xs[k]);
+    free(xs);
+    free(plaintexts);
+    free(ixs);
+}
+
+static int
+cmp_double(const void *a_, const void *b_)
+{
+    const double a = *(const double *) a_, b = *(const double *) b_;
+    return (a > b) - (a < b);
+}
+
+typedef void (*mul_fn)(const_mmap_vtable, const mmap_pp, mmap_enc_mat_t,
+                       mmap_enc_mat_t, mmap_enc_mat_t);
+
+/* Median seconds per call of f over trials trials, after a warmup call */
+static double
+time_mul(mul_fn f, const mmap_vtable *mmap, const mmap_pp pp,
+         mmap_enc_mat_t r, mmap_enc_mat_t a, mmap_enc_mat_t b, int trials)
+{
+    double times[trials];
+
+    f(mmap, pp, r, a, b);
+    for (int i = 0; i < trials; ++i) {
+        const double start = current_time();
+        double elapsed;
+        size_t calls = 0;
+        do {
+            f(mmap, pp, r, a, b);
+            ++calls;
+        } while ((elapsed = current_time() - start) < MIN_TRIAL_SECONDS);
+        times[i] = elapsed / calls;
+    }
+    qsort(times, trials, sizeof times[0], cmp_double);
+    return times[trials / 2];
+}
+
+static void
+shape_dims(int shape, int w, int *m, int *k, int *n)
+{
+    switch (shape) {
+    case 0:
+        *m = 1, *k = w, *n = w;
+        break;
+    case 1:
+        *m = w, *k = w, *n = w;
+        break;
+    default:
+        *m = 4 * w, *k = 4, *n = 4;
+        break;
+    }
+}
+
+/* The smallest product such that mul_par won on every measured product at
+ * least as large with t threads, or SIZE_MAX if it never did */
+static size_t
+threshold(const struct sample *samples, size_t nsamples, int t)
+{
+    size_t min_muls = SIZE_MAX, lost = 0;
+
+    for (size_t i = 0; i < nsamples; ++i) {
+        if (samples[i].nthreads == t && !samples[i].par_wins
+            && samples[i].muls > lost)
+            lost = samples[i].muls;
+    }
+    for (size_t i = 0; i < nsamples; ++i) {
+        if (samples[i].nthreads == t && samples[i].par_wins
+            && samples[i].muls > lost && samples[i].muls < min_muls)
+            min_muls = samples[i].muls;
+    }
+    return min_muls;
+}
+
+static void
+run(const char *name, const mmap_vtable *mmap, size_t lambda,
+    const int *widths, size_t nwidths, int max_threads, int trials)
+{
+    const size_t max_samples = nwidths * NSHAPES * 32;
+    struct sample *samples = calloc(max_samples, sizeof samples[0]);
+    size_t nsamples = 0;
+    aes_randstate_t rng;
+    mmap_sk sk;
+    mmap_pp pp;
+
+    aes_randinit(rng);
+    mmap_sk_params params = {
+        .lambda = lambda,
+        .kappa = 2,
+        .gamma = 2,
+        .pows = NULL,
+    };
+    sk = mmap->sk->new(&params, NULL, max_threads, rng, false);
+    pp = mmap->sk->pp(sk);
+
+    for (size_t wi = 0; wi < nwidths; ++wi) {
+        for (int shape = 0; shape < NSHAPES; ++shape) {
+            mmap_enc_mat_t a, b, r;
+            double serial;
+            size_t muls;
+            long base;
+            int m, k, n;
+
+            shape_dims(shape, widths[wi], &m, &k, &n);
+            base = rss_reset();
+            muls = (size_t) m * k * n;
+            mmap_enc_mat_init(mmap, pp, a, m, k);
+            mmap_enc_mat_init(mmap, pp, b, k, n);
+            mmap_enc_mat_init(mmap, pp, r, m, n);
+            encode_random(mmap, sk, a, 0, rng);
+            encode_random(mmap, sk, b, 1, rng);
+
+            omp_set_num_threads(1);
+            serial = time_mul(mmap_enc_mat_mul, mmap, pp, r, a, b, trials);
+            printf("%-7s %-7s %4dx%-4d %4dx%-4d %10zu %8s %14.0f %8.2f %6.2f %10ld\n",
+                   name, shape_names[shape], m, k, k, n, muls, "serial",
+                   muls / serial, 1.0, 1.0, rss_peak_kib(base));
+            for (int t = 1; ; t *= 2) {
+                double par, speedup;
+
+                if (t > max_threads)
+                    t = max_threads;
+                omp_set_num_threads(t);
+                par = time_mul(mmap_enc_mat_mul_par, mmap, pp, r, a, b, trials);
+                speedup = serial / par;
+                printf("%-7s %-7s %4dx%-4d %4dx%-4d %10zu %8d %14.0f %8.2f %6.2f %10ld\n",
+                       name, shape_names[shape], m, k, k, n, muls, t,
+                       muls / par, speedup, speedup / t, rss_peak_kib(base));
+                if (nsamples < max_samples)
+                    samples[nsamples++] = (struct sample) {
+                        .nthreads = t,
+                        .muls = muls,
+                        .par_wins = par < serial,
+                    };
+                if (t == max_threads)
+                    break;
+            }
+            mmap_enc_mat_clear(mmap, a);
+            mmap_enc_mat_clear(mmap, b);
+            mmap_enc_mat_clear(mmap, r);
+        }
+    }
+
+    printf("\n/* %s, lambda = %zu */\n", name, lambda);
+    printf("static const mmap_mat_threshold %s_thresholds[] = {\n", name);
+    for (int t = 2; t / 2 < max_threads; t *= 2) {
+        const int nthreads = t > max_threads ? max_threads : t;
+        const size_t min_muls = threshold(samples, nsamples, nthreads);
+        if (min_muls == SIZE_MAX)
+            printf("    { %d, SIZE_MAX },\n", nthreads);
+        else
+            printf("    { %d, %zu },\n", nthreads, min_muls);
+    }
+    printf("};\n\n");
+
+    mmap->pp->free(pp);
+    mmap->sk->free(sk);
+    aes_randclear(rng);
+    free(samples);
+}
+
+int main(int argc, char **argv)
+{
+    const char *backend = "all";
+    size_t lambda = 16;
+    int widths[MAX_WIDTHS] = { 4, 8, 16, 32 };
+    size_t nwidths = 4;
+    int max_threads = omp_get_num_procs(), trials = 5;
+
+    if (argc > 1)
+        backend = argv[1];
+    if (argc > 2)
+        lambda = strtoul(argv[2], NULL, 10);
+    if (argc > 3) {
+        char *s = argv[3];
+        for (nwidths = 0; nwidths < MAX_WIDTHS && *s; ) {
+            if ((widths[nwidths] = strtol(s, &s, 10)) > 0)
+                ++nwidths;
+            if (*s == ',')
+                ++s;
+            else if (*s)
+                break;
+        }
+        if (nwidths == 0) {
+            fprintf(stderr, "error: bad widths '%s'\n", argv[3]);
+            return 1;
+        }
+    }
+    if (argc > 4)
+        max_threads = atoi(argv[4]);
+    if (argc > 5)
+        trials = atoi(argv[5]);
+    if (max_threads < 1)
+        max_threads = 1;
+    if (trials < 1)
+        trials = 1;
+
+    printf("%-7s %-7s %9s %9s %10s %8s %14s %8s %6s %10s\n", "backend",
+           "shape", "a", "b", "muls", "threads", "mul calls/s", "speedup",
+           "eff", "+rss KiB");
+    if (strcmp(backend, "dummy") == 0 || strcmp(backend, "all") == 0)
+        run("dummy", &dummy_vtable, lambda, widths, nwidths, max_threads,
+            trials);
+    if (strcmp(backend, "clt") == 0 || strcmp(backend, "all") == 0)
+        run("clt", &clt_vtable, lambda, widths, nwidths, max_threads, trials);
+    return 0;
+}
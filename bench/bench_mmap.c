@@ -0,0 +1,467 @@
+#include <mmap/mmap.h>
+#include <mmap/mmap_clt.h>
+#include <mmap/mmap_dummy.h>
+#ifdef HAVE_GGHLITE
+#include <mmap/mmap_gghlite.h>
+#endif
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Measures key generation and the encoding operations of every backend over
+ * a sweep of parameters.  Each operation runs a number of times per trial,
+ * spread over ncores threads, after some untimed warmup trials; the time per
+ * operation of each trial is kept, and their median and percentiles are
+ * reported, one row per backend, parameter set and operation.
+ *
+ * usage: bench_mmap [-b backends] [-l lambdas] [-k kappas] [-g gammas]
+ *                   [-s nslots] [-c ncores] [-n ops per trial]
+ *                   [-w warmup trials] [-t trials] [-f csv|json] [-o file]
+ *
+ * Lists are comma-separated, for instance -b dummy,clt -l 8,16,32, and every
+ * combination is run.  gamma is at least 2, so that two encodings at
+ * complementary index sets multiply to the top level for zero-testing.
+ */
+
+#define MAX_VALUES 16
+
+enum {
+    OP_ENCODE,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_IS_ZERO,
+    OP_SET,
+    OP_SERIALIZE,
+    OP_DESERIALIZE,
+    NOPS
+};
+
+static const char *const op_names[NOPS] = {
+    "encode", "add", "sub", "mul", "is_zero", "set", "serialize", "deserialize",
+};
+
+static const struct {
+    const char *name;
+    const mmap_vtable *vtable;
+} backends[] = {
+    { "dummy", &dummy_vtable },
+    { "clt", &clt_vtable },
+#ifdef HAVE_GGHLITE
+    { "gghlite", &gghlite_vtable },
+#endif
+};
+
+struct config {
+    const char *backend;
+    const mmap_vtable *mmap;
+    size_t lambda, kappa, gamma, nslots, ncores;
+};
+
+/* Inputs and outputs of n operations of each kind */
+struct state {
+    const mmap_vtable *mmap;
+    mmap_sk sk;
+    mmap_pp pp;
+    size_t n;
+    size_t nslots;
+    mpz_t *plaintexts;          /* nslots per operation */
+    int *pows_a, *pows_b;       /* complementary index sets */
+    const mpz_t **xs;           /* per operation, for encode_batch */
+    const int **pows;
+    mmap_enc *a, *b, *top, *r, *decoded;
+    bool *zero;
+    char *buf;                  /* serialized a */
+    size_t *offsets;
+};
+
+struct stats {
+    double median, p10, p90, p99, min, max;
+};
+
+static double
+current_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+parse_list(const char *arg, size_t *values)
+{
+    char *copy = strdup(arg), *save = NULL;
+    size_t n = 0;
+
+    for (char *tok = strtok_r(copy, ",", &save); tok && n < MAX_VALUES;
+         tok = strtok_r(NULL, ",", &save))
+        values[n++] = strtoul(tok, NULL, 10);
+    free(copy);
+    return n;
+}
+
+static int
+cmp_double(const void *a_, const void *b_)
+{
+    const double a = *(const double *) a_, b = *(const double *) b_;
+    return (a > b) - (a < b);
+}
+
+/* Sorts samples and takes their median and nearest-rank percentiles */
+static struct stats
+summarize(double *samples, size_t n)
+{
+    struct stats s;
+
+    qsort(samples, n, sizeof samples[0], cmp_double);
+#define RANK(p) samples[(size_t) ((p) * (n - 1) / 100.0 + 0.5)]
+    s.median = n % 2 ? samples[n / 2]
+                     : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    s.p10 = RANK(10);
+    s.p90 = RANK(90);
+    s.p99 = RANK(99);
+#undef RANK
+    s.min = samples[0];
+    s.max = samples[n - 1];
+    return s;
+}
+
+static bool
+supported(const struct state *s, int op)
+{
+    switch (op) {
+    case OP_SERIALIZE:
+        return s->mmap->enc->to_buf != NULL;
+    case OP_DESERIALIZE:
+        return s->mmap->enc->from_buf != NULL;
+    default:
+        return true;
+    }
+}
+
+static void
+state_init(struct state *s, const struct config *c, mmap_sk sk, size_t n,
+           aes_randstate_t rng)
+{
+    const mmap_vtable *const mmap = c->mmap;
+    mpz_t *moduli;
+
+    s->mmap = mmap;
+    s->sk = sk;
+    s->pp = mmap->sk->pp(sk);
+    s->n = n;
+    s->nslots = mmap->sk->nslots(sk);
+    moduli = mmap->sk->plaintext_fields(sk);
+
+    s->plaintexts = calloc(n * s->nslots, sizeof s->plaintexts[0]);
+    for (size_t k = 0; k < n * s->nslots; ++k) {
+        mpz_init(s->plaintexts[k]);
+        mpz_urandomm_aes(s->plaintexts[k], rng, moduli[k % s->nslots]);
+    }
+    s->pows_a = calloc(c->gamma, sizeof s->pows_a[0]);
+    s->pows_b = calloc(c->gamma, sizeof s->pows_b[0]);
+    for (size_t i = 0; i < c->gamma; ++i) {
+        s->pows_a[i] = i == 0;
+        s->pows_b[i] = i != 0;
+    }
+
+    s->a = calloc(n, sizeof s->a[0]);
+    s->b = calloc(n, sizeof s->b[0]);
+    s->top = calloc(n, sizeof s->top[0]);
+    s->r = calloc(n, sizeof s->r[0]);
+    s->decoded = calloc(n, sizeof s->decoded[0]);
+    s->zero = calloc(n, sizeof s->zero[0]);
+    s->offsets = calloc(n + 1, sizeof s->offsets[0]);
+    s->xs = calloc(n, sizeof s->xs[0]);
+    s->pows = calloc(n, sizeof s->pows[0]);
+    for (size_t k = 0; k < n; ++k) {
+        const mpz_t *x = (const mpz_t *) &s->plaintexts[k * s->nslots];
+        s->xs[k] = x;
+        s->pows[k] = s->pows_a;
+        s->a[k] = mmap->enc->new(s->pp);
+        s->b[k] = mmap->enc->new(s->pp);
+        s->top[k] = mmap->enc->new(s->pp);
+        s->r[k] = mmap->enc->new(s->pp);
+        mmap->enc->encode(s->a[k], sk, s->nslots, x, s->pows_a, 0);
+        mmap->enc->encode(s->b[k], sk, s->nslots, x, s->pows_b, 0);
+        mmap->enc->mul(s->top[k], s->pp, s->a[k], s->b[k]);
+        s->offsets[k + 1] = s->offsets[k]
+            + (mmap->enc->serialized_size
+               ? mmap->enc->serialized_size(s->a[k]) : 0);
+    }
+    s->buf = malloc(s->offsets[n] ? s->offsets[n] : 1);
+    for (size_t k = 0; mmap->enc->to_buf && k < n; ++k)
+        mmap->enc->to_buf(s->a[k], s->buf + s->offsets[k],
+                          s->offsets[k + 1] - s->offsets[k]);
+}
+
+static void
+state_clear(struct state *s)
+{
+    const mmap_vtable *const mmap = s->mmap;
+
+    for (size_t k = 0; k < s->n * s->nslots; ++k)
+        mpz_clear(s->plaintexts[k]);
+    for (size_t k = 0; k < s->n; ++k) {
+        mmap->enc->free(s->a[k]);
+        mmap->enc->free(s->b[k]);
+        mmap->enc->free(s->top[k]);
+        mmap->enc->free(s->r[k]);
+    }
+    free(s->plaintexts);
+    free(s->pows_a);
+    free(s->pows_b);
+    free(s->a);
+    free(s->b);
+    free(s->top);
+    free(s->r);
+    free(s->decoded);
+    free(s->zero);
+    free(s->buf);
+    free(s->offsets);
+    free(s->xs);
+    free(s->pows);
+    mmap->pp->free(s->pp);
+}
+
+/* Runs n operations of one kind over the threads.  Encodings share the key's
+ * randomness, so they go through one encode_batch call, which the backend
+ * parallelizes as it safely can. */
+static void
+run(struct state *s, int op)
+{
+    const mmap_vtable *const mmap = s->mmap;
+
+    if (op == OP_ENCODE) {
+        if (mmap->enc->encode_batch) {
+            mmap->enc->encode_batch(s->r, s->sk, s->n, s->nslots, s->xs,
+                                    s->pows, 0);
+        } else {
+            for (size_t k = 0; k < s->n; ++k)
+                mmap->enc->encode(s->r[k], s->sk, s->nslots, s->xs[k],
+                                  s->pows[k], 0);
+        }
+        return;
+    }
+#pragma omp parallel for schedule(static)
+    for (size_t k = 0; k < s->n; ++k) {
+        const size_t size = s->offsets[k + 1] - s->offsets[k];
+        switch (op) {
+        case OP_ADD:
+            mmap->enc->add(s->r[k], s->pp, s->a[k], s->a[k]);
+            break;
+        case OP_SUB:
+            mmap->enc->sub(s->r[k], s->pp, s->a[k], s->a[k]);
+            break;
+        case OP_MUL:
+            mmap->enc->mul(s->r[k], s->pp, s->a[k], s->b[k]);
+            break;
+        case OP_IS_ZERO:
+            s->zero[k] = mmap->enc->is_zero(s->top[k], s->pp);
+            break;
+        case OP_SET:
+            mmap->enc->set(s->r[k], s->a[k]);
+            break;
+        case OP_SERIALIZE:
+            mmap->enc->to_buf(s->a[k], s->buf + s->offsets[k], size);
+            break;
+        case OP_DESERIALIZE:
+            s->decoded[k] = mmap->enc->from_buf(s->buf + s->offsets[k], size);
+            break;
+        }
+    }
+}
+
+/* Nanoseconds per operation in each trial */
+static void
+measure(struct state *s, int op, size_t warmup, size_t trials,
+        double *samples)
+{
+    for (size_t t = 0; t < warmup + trials; ++t) {
+        const double start = current_time();
+        run(s, op);
+        if (t >= warmup)
+            samples[t - warmup] = (current_time() - start) * 1e9 / s->n;
+        for (size_t k = 0; op == OP_DESERIALIZE && k < s->n; ++k) {
+            if (s->decoded[k])
+                s->mmap->enc->free(s->decoded[k]);
+        }
+    }
+}
+
+static void
+report(FILE *out, bool json, bool *first, const struct config *c,
+       const char *op, size_t n, size_t trials, double *samples,
+       size_t bytes)
+{
+    const struct stats s = summarize(samples, trials);
+
+    if (json) {
+        fprintf(out, "%s  {\"backend\": \"%s\", \"op\": \"%s\", "
+                "\"lambda\": %zu, \"kappa\": %zu, \"gamma\": %zu, "
+                "\"nslots\": %zu, \"ncores\": %zu, \"ops_per_trial\": %zu, "
+                "\"trials\": %zu, \"median_ns\": %.1f, \"p10_ns\": %.1f, "
+                "\"p90_ns\": %.1f, \"p99_ns\": %.1f, \"min_ns\": %.1f, "
+                "\"max_ns\": %.1f, \"ops_per_sec\": %.1f, "
+                "\"bytes_per_op\": %zu}",
+                *first ? "" : ",\n", c->backend, op, c->lambda, c->kappa,
+                c->gamma, c->nslots, c->ncores, n, trials, s.median, s.p10,
+                s.p90, s.p99, s.min, s.max, 1e9 / s.median, bytes);
+    } else {
+        fprintf(out, "%s,%s,%zu,%zu,%zu,%zu,%zu,%zu,%zu,"
+                "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%zu\n",
+                c->backend, op, c->lambda, c->kappa, c->gamma, c->nslots,
+                c->ncores, n, trials, s.median, s.p10, s.p90, s.p99, s.min,
+                s.max, 1e9 / s.median, bytes);
+    }
+    *first = false;
+    fflush(out);
+}
+
+static void
+bench(FILE *out, bool json, bool *first, const struct config *c, size_t n,
+      size_t warmup, size_t trials, aes_randstate_t rng)
+{
+    const mmap_vtable *const mmap = c->mmap;
+    mmap_sk_params params = {
+        .lambda = c->lambda,
+        .kappa = c->kappa,
+        .gamma = c->gamma,
+        .pows = NULL,
+    };
+    mmap_sk_opt_params opts = {
+        .nslots = c->nslots,
+        .modulus = NULL,
+        .is_polylog = false,
+    };
+    double samples[trials];
+    struct state s;
+    mmap_sk sk = NULL;
+    int pows[c->gamma];
+
+    for (size_t i = 0; i < c->gamma; ++i)
+        pows[i] = 1;
+    params.pows = pows;
+    omp_set_num_threads(c->ncores);
+
+    fprintf(stderr, "%s lambda=%zu kappa=%zu gamma=%zu nslots=%zu ncores=%zu\n",
+            c->backend, c->lambda, c->kappa, c->gamma, c->nslots, c->ncores);
+    for (size_t t = 0; t < warmup + trials; ++t) {
+        const double start = current_time();
+        if (sk)
+            mmap->sk->free(sk);
+        sk = mmap->sk->new(&params, &opts, c->ncores, rng, false);
+        if (t >= warmup)
+            samples[t - warmup] = (current_time() - start) * 1e9;
+    }
+    if (sk == NULL) {
+        fprintf(stderr, "error: key generation failed\n");
+        return;
+    }
+    report(out, json, first, c, "keygen", 1, trials, samples, 0);
+
+    state_init(&s, c, sk, n, rng);
+    for (int op = 0; op < NOPS; ++op) {
+        const bool serial = op == OP_SERIALIZE || op == OP_DESERIALIZE;
+        if (!supported(&s, op))
+            continue;
+        measure(&s, op, warmup, trials, samples);
+        report(out, json, first, c, op_names[op], n, trials, samples,
+               serial ? s.offsets[n] / n : 0);
+    }
+    state_clear(&s);
+    mmap->sk->free(sk);
+}
+
+int main(int argc, char **argv)
+{
+    const mmap_vtable *mmaps[MAX_VALUES];
+    const char *names[MAX_VALUES];
+    size_t lambdas[MAX_VALUES] = {16}, kappas[MAX_VALUES] = {2},
+        gammas[MAX_VALUES] = {2}, nslots[MAX_VALUES] = {1},
+        ncores[MAX_VALUES] = {1};
+    size_t nmmaps = 0, nlambdas = 1, nkappas = 1, ngammas = 1, nnslots = 1,
+        nncores = 1;
+    size_t n = 256, warmup = 1, trials = 5;
+    const char *backend_arg = NULL;
+    bool json = false, first = true;
+    FILE *out = stdout;
+    aes_randstate_t rng;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:l:k:g:s:c:n:w:t:f:o:")) != -1) {
+        switch (opt) {
+        case 'b': backend_arg = optarg; break;
+        case 'l': nlambdas = parse_list(optarg, lambdas); break;
+        case 'k': nkappas = parse_list(optarg, kappas); break;
+        case 'g': ngammas = parse_list(optarg, gammas); break;
+        case 's': nnslots = parse_list(optarg, nslots); break;
+        case 'c': nncores = parse_list(optarg, ncores); break;
+        case 'n': n = strtoul(optarg, NULL, 10); break;
+        case 'w': warmup = strtoul(optarg, NULL, 10); break;
+        case 't': trials = strtoul(optarg, NULL, 10); break;
+        case 'f': json = strcmp(optarg, "json") == 0; break;
+        case 'o':
+            if ((out = fopen(optarg, "w")) == NULL) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b backends] [-l lambdas] [-k kappas] "
+                    "[-g gammas] [-s nslots] [-c ncores] [-n ops] "
+                    "[-w warmup] [-t trials] [-f csv|json] [-o file]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (n == 0 || trials == 0) {
+        fprintf(stderr, "error: -n and -t must be positive\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof backends / sizeof backends[0]; ++i) {
+        if (backend_arg == NULL || strstr(backend_arg, backends[i].name)) {
+            names[nmmaps] = backends[i].name;
+            mmaps[nmmaps++] = backends[i].vtable;
+        }
+    }
+    if (nmmaps == 0) {
+        fprintf(stderr, "error: no backend matches %s\n", backend_arg);
+        return 1;
+    }
+
+    aes_randinit(rng);
+    if (json)
+        fprintf(out, "[\n");
+    else
+        fprintf(out, "backend,op,lambda,kappa,gamma,nslots,ncores,"
+                "ops_per_trial,trials,median_ns,p10_ns,p90_ns,p99_ns,min_ns,"
+                "max_ns,ops_per_sec,bytes_per_op\n");
+    for (size_t ib = 0; ib < nmmaps; ++ib)
+    for (size_t il = 0; il < nlambdas; ++il)
+    for (size_t ik = 0; ik < nkappas; ++ik)
+    for (size_t ig = 0; ig < ngammas; ++ig)
+    for (size_t is = 0; is < nnslots; ++is)
+    for (size_t ic = 0; ic < nncores; ++ic) {
+        const struct config c = {
+            .backend = names[ib],
+            .mmap = mmaps[ib],
+            .lambda = lambdas[il],
+            .kappa = kappas[ik],
+            .gamma = gammas[ig] < 2 ? 2 : gammas[ig],
+            .nslots = nslots[is] ? nslots[is] : 1,
+            .ncores = ncores[ic] ? ncores[ic] : 1,
+        };
+        bench(out, json, &first, &c, n, warmup, trials, rng);
+    }
+    if (json)
+        fprintf(out, "\n]\n");
+    aes_randclear(rng);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
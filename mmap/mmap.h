@@ -3,6 +3,8 @@
 
 #include <aesrand.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h> /* for FILE */
 #include <flint/fmpz.h>
 #include <gmp.h>
@@ -19,11 +21,25 @@ typedef void *mmap_sk;
 typedef void *mmap_enc;
 
 /* If we call fread, we will call free. In particular, we will not call free
- * on the mmap_pp we retrieve from an mmap_sk. */
+ * on the mmap_pp we retrieve from an mmap_sk.
+ *
+ * Encodings do not depend on the public parameters they were computed under
+ * staying alive: backends that defer reductions keep what they need.
+ *
+ * Every object also serializes to memory, in the same format as fwrite:
+ * serialized_size gives the number of bytes to_buf writes, and to_buf fails
+ * if they do not fit in size.  from_buf reads an object from the first size
+ * bytes of buf, and returns NULL if they do not hold one.  Backends without
+ * them leave these NULL.  The dummy backend's write straight into buf; CLT's
+ * objects are opaque, so its buffer methods run fwrite and fread over a
+ * stream on buf, and serialized_size costs a full serialization. */
 typedef struct {
     void (*const free)(const mmap_pp pp);
     mmap_pp (*const fread)(FILE *fp);
     int (*const fwrite)(const mmap_pp pp, FILE *fp);
+    size_t (*const serialized_size)(const mmap_pp pp);
+    int (*const to_buf)(const mmap_pp pp, void *buf, size_t size);
+    mmap_pp (*const from_buf)(const void *buf, size_t size);
 } mmap_pp_vtable;
 
 typedef struct {
@@ -46,6 +62,9 @@ typedef struct {
     void (*const free)(mmap_sk sk);
     mmap_sk (*const fread)(FILE *fp);
     int (*const fwrite)(const mmap_sk sk, FILE *fp);
+    size_t (*const serialized_size)(const mmap_sk sk);
+    int (*const to_buf)(const mmap_sk sk, void *buf, size_t size);
+    mmap_sk (*const from_buf)(const void *buf, size_t size);
     mmap_pp (*const pp)(mmap_sk sk);
     mpz_t * (*const plaintext_fields)(const mmap_sk sk);
     size_t (*const nslots)(const mmap_sk sk);
@@ -57,37 +76,137 @@ typedef struct {
     void (*const free)(mmap_enc enc);
     mmap_enc (*const fread)(FILE *fp);
     int (*const fwrite)(const mmap_enc enc, FILE *fp);
+    size_t (*const serialized_size)(const mmap_enc enc);
+    int (*const to_buf)(const mmap_enc enc, void *buf, size_t size);
+    mmap_enc (*const from_buf)(const void *buf, size_t size);
+    /* Optional check that enc, typically one just read, has the shape of
+     * encodings made under pp, so it may be combined with them.  Readers
+     * that take a pp reject encodings that fail it. */
+    bool (*const compatible)(const mmap_enc enc, const mmap_pp pp);
     void (*const set)(mmap_enc dest, const mmap_enc src);
+    /* Exchanges the encodings *a and *b without copying them.  A backend may
+     * exchange either the contents or the handles themselves, so reload *a
+     * and *b afterwards. */
+    void (*const swap)(mmap_enc *a, mmap_enc *b);
     int (*const add)(mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b);
     int (*const sub)(mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b);
     int (*const mul)(mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b);
+    /* Optional fused operations: fma sets dest += a * b, and dot sets dest to
+     * the inner product of as and bs, each reduced once.  dest may alias any
+     * input.  mmap_enc_fma and mmap_enc_dot fall back to mul and add for
+     * backends that leave these NULL. */
+    int (*const fma)(mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b);
+    int (*const dot)(mmap_enc dest, const mmap_pp pp, const mmap_enc *as,
+                     const mmap_enc *bs, size_t n);
     bool (*const is_zero)(const mmap_enc enc, const mmap_pp pp);
+    /* Zero-tests count encodings in parallel: results[k] is set to
+     * is_zero(encs[k], pp). */
+    void (*const is_zero_batch)(bool *results, const mmap_enc *encs,
+                                size_t count, const mmap_pp pp);
     int (*const encode)(mmap_enc enc, const mmap_sk sk, size_t n,
                         const mpz_t *plaintext, const int *pows, size_t level);
+    /* Encodes count plaintexts in one call: encs[k] gets the n elements of
+     * plaintexts[k] at index set pows[k].  Backends spread the batch over the
+     * ncores given at key generation. */
+    int (*const encode_batch)(mmap_enc *encs, const mmap_sk sk, size_t count,
+                              size_t n, const mpz_t *const *plaintexts,
+                              const int *const *pows, size_t level);
     unsigned int (*const degree)(const mmap_enc enc);
     void (*const print)(const mmap_enc enc);
+    /* Optional in-place construction.  If set, an encoding can live in
+     * caller-provided memory of size(pp) bytes: init() it there and clear() it
+     * when done, instead of calling new()/free(). */
+    size_t (*const size)(const mmap_pp pp);
+    void (*const init)(mmap_enc enc, const mmap_pp pp);
+    void (*const clear)(mmap_enc enc);
+    /* Optional fixed-layout payloads, which mmap_store maps in place of
+     * fwrite output.  Every encoding of pp takes payload_size(pp) bytes,
+     * filled by payload_write.  payload_view returns an encoding that reads
+     * its slots straight from such a payload, which must stay unchanged
+     * until the view is freed; a view may only be used as an operand. */
+    size_t (*const payload_size)(const mmap_pp pp);
+    void (*const payload_write)(void *buf, const mmap_enc enc, const mmap_pp pp);
+    mmap_enc (*const payload_view)(const mmap_pp pp, const void *buf);
 } mmap_enc_vtable;
 
 typedef struct {
     const mmap_pp_vtable  *const pp;
     const mmap_sk_vtable  *const sk;
     const mmap_enc_vtable *const enc;
+    const char *const name;     /* identifies the backend in files */
 } mmap_vtable;
 typedef const mmap_vtable *const const_mmap_vtable;
 
+/* A matrix is a single allocation holding the row pointers, the row-major
+ * array of handles, and (if the backend supports in-place construction) the
+ * encodings themselves.  m[i][j] stays valid for existing callers. */
 struct _mmap_enc_mat_struct {
     int nrows; // number of rows in the matrix
     int ncols; // number of columns in the matrix
-    mmap_enc **m;
+    mmap_enc **m;     // row pointers into data
+    mmap_enc *data;   // nrows * ncols handles, row-major
+    bool inplace;     // encodings live in the same allocation as m
 };
 
 typedef struct _mmap_enc_mat_struct mmap_enc_mat_t[1];
 
+/* A strided window onto the handles of a matrix.  Views do not own anything
+ * and are only valid as long as the underlying matrix is. */
+typedef struct {
+    mmap_enc *data;
+    int nrows;
+    int ncols;
+    int rstride; // distance (in handles) between consecutive rows
+    int cstride; // distance (in handles) between consecutive columns
+} mmap_enc_mat_view;
+
+static inline mmap_enc
+mmap_enc_mat_view_get(const mmap_enc_mat_view v, int i, int j)
+{
+    return v.data[i * v.rstride + j * v.cstride];
+}
+
 void
 mmap_enc_mat_init(const_mmap_vtable mmap, const mmap_pp params,
                   mmap_enc_mat_t m, int nrows, int ncols);
 void
 mmap_enc_mat_clear(const_mmap_vtable mmap, mmap_enc_mat_t m);
+
+mmap_enc_mat_view
+mmap_enc_mat_as_view(const mmap_enc_mat_t m);
+mmap_enc_mat_view
+mmap_enc_mat_row(const mmap_enc_mat_t m, int i);
+mmap_enc_mat_view
+mmap_enc_mat_col(const mmap_enc_mat_t m, int j);
+mmap_enc_mat_view
+mmap_enc_mat_block(const mmap_enc_mat_t m, int i, int j, int nrows, int ncols);
+mmap_enc_mat_view
+mmap_enc_mat_view_block(const mmap_enc_mat_view v, int i, int j, int nrows,
+                        int ncols);
+mmap_enc_mat_view
+mmap_enc_mat_view_transpose(const mmap_enc_mat_view v);
+
+/* Entry-wise copy of src into dest; shapes must match. */
+void
+mmap_enc_mat_view_set(const_mmap_vtable mmap, mmap_enc_mat_view dest,
+                      const mmap_enc_mat_view src);
+/* Entry-wise exchange of a and b; shapes must match. */
+void
+mmap_enc_mat_view_swap(const_mmap_vtable mmap, mmap_enc_mat_view a,
+                       mmap_enc_mat_view b);
+/* r = m1 * m2 computed directly into the encodings of r, which must not
+ * overlap m1 or m2. */
+void
+mmap_enc_mat_view_mul(const_mmap_vtable mmap, const mmap_pp params,
+                      mmap_enc_mat_view r, const mmap_enc_mat_view m1,
+                      const mmap_enc_mat_view m2);
+void
+mmap_enc_mat_view_mul_par(const_mmap_vtable mmap, const mmap_pp params,
+                          mmap_enc_mat_view r, const mmap_enc_mat_view m1,
+                          const mmap_enc_mat_view m2);
+/* r = m1 * m2.  The product is computed directly into r when r already has
+ * the right shape; if r is also one of the operands, the product is built in
+ * a fresh matrix whose storage then replaces that of r. */
 void
 mmap_enc_mat_mul(const_mmap_vtable mmap, const mmap_pp params,
                  mmap_enc_mat_t r, mmap_enc_mat_t m1, mmap_enc_mat_t m2);
@@ -95,6 +214,337 @@ void
 mmap_enc_mat_mul_par(const_mmap_vtable mmap, const mmap_pp params,
                      mmap_enc_mat_t r, mmap_enc_mat_t m1, mmap_enc_mat_t m2);
 
+/* r = m1 * m2 with whichever of the two above is faster.  The parallel kernel
+ * is used, outside parallel regions, when the product takes at least as many
+ * encoding multiplications as the backend's threshold for the number of
+ * threads available.  bench_mat_mul measures thresholds and prints them as a
+ * table for mmap_enc_mat_mul_set_thresholds; without one, products of
+ * MMAP_MAT_PAR_MIN_MULS multiplications or more go parallel. */
+#define MMAP_MAT_PAR_MIN_MULS 256
+#define MMAP_MAT_THRESHOLDS_MAX 16
+
+typedef struct {
+    int nthreads;               // threads available
+    size_t min_muls;            // smallest product for which mul_par wins
+} mmap_mat_threshold;
+
+void
+mmap_enc_mat_mul_auto(const_mmap_vtable mmap, const mmap_pp params,
+                      mmap_enc_mat_t r, mmap_enc_mat_t m1, mmap_enc_mat_t m2);
+/* Replaces the backend's table.  With t threads, the entry with the largest
+ * nthreads not above t applies.  Returns MMAP_ERR if the table has more than
+ * MMAP_MAT_THRESHOLDS_MAX entries or too many backends have tables. */
+int
+mmap_enc_mat_mul_set_thresholds(const_mmap_vtable mmap,
+                                const mmap_mat_threshold *table, size_t n);
+
+/* r = v * m for a row vector v (and r = m * v for a column vector v).  Besides
+ * the output entries, the inner index is split across threads: each slice
+ * produces a partial sum and the partial sums are added at the end, so short
+ * vectors still keep every core busy. */
+void
+mmap_enc_vec_mat_mul(const_mmap_vtable mmap, const mmap_pp params,
+                     mmap_enc_mat_t r, mmap_enc_mat_t v, mmap_enc_mat_t m);
+void
+mmap_enc_mat_vec_mul(const_mmap_vtable mmap, const mmap_pp params,
+                     mmap_enc_mat_t r, mmap_enc_mat_t m, mmap_enc_mat_t v);
+
+/* Workspace for evaluating v * M_1 * M_2 * ... one matrix at a time.  The two
+ * accumulators are used in turn, and they, the partial sums and the
+ * per-thread scratch are only reallocated when a step needs more room. */
+struct _mmap_enc_vec_eval_struct {
+    mmap_enc_mat_t bufs[2];  // ping-pong accumulators
+    int cur;                 // which of bufs holds the current vector
+    int width;               // length of the current vector
+    mmap_enc_mat_t partials; // partial sums, one row per slice of the inner index
+    mmap_enc_mat_t scratch;  // one scratch encoding per thread, without fma/dot
+};
+
+typedef struct _mmap_enc_vec_eval_struct mmap_enc_vec_eval_t[1];
+
+void
+mmap_enc_vec_eval_init(const_mmap_vtable mmap, const mmap_pp params,
+                       mmap_enc_vec_eval_t ev, mmap_enc_mat_t v);
+void
+mmap_enc_vec_eval_step(const_mmap_vtable mmap, const mmap_pp params,
+                       mmap_enc_vec_eval_t ev, mmap_enc_mat_t m);
+/* The current vector, valid until the next step */
+mmap_enc_mat_view
+mmap_enc_vec_eval_result(const mmap_enc_vec_eval_t ev);
+void
+mmap_enc_vec_eval_clear(const_mmap_vtable mmap, mmap_enc_vec_eval_t ev);
+
+/* r = mats[0] * ... * mats[n-1], multiplied in the order that minimizes the
+ * number of encoding multiplications, with independent sub-products running
+ * concurrently.  r may be one of the inputs. */
+void
+mmap_enc_mat_chain_mul(const_mmap_vtable mmap, const mmap_pp params,
+                       mmap_enc_mat_t r, mmap_enc_mat_t *mats, int n);
+/* Number of encoding multiplications mmap_enc_mat_chain_mul will perform */
+size_t
+mmap_enc_mat_chain_cost(mmap_enc_mat_t *mats, int n);
+
+/* Bulk I/O.  Entries are serialized and decoded in parallel, and reads
+ * overlap reading the file with decoding what has been read.  A matrix read
+ * with mmap_enc_mat_fread is initialized by it and cleared by the caller. */
+int
+mmap_enc_mat_fwrite(const_mmap_vtable mmap, const mmap_enc_mat_t m, FILE *fp);
+int
+mmap_enc_mat_fread(const_mmap_vtable mmap, const mmap_pp params,
+                   mmap_enc_mat_t m, FILE *fp);
+int
+mmap_enc_array_fwrite(const_mmap_vtable mmap, const mmap_enc *encs, size_t n,
+                      FILE *fp);
+/* Returns n fresh encodings in a malloc'd array, or NULL on error */
+mmap_enc *
+mmap_enc_array_fread(const_mmap_vtable mmap, size_t *n, FILE *fp);
+
+/* Reads matrices written one after another with mmap_enc_mat_fwrite until
+ * the end of fp, passing the k-th to f and clearing it when f returns, so
+ * only one is in memory at a time.  Stops early with whatever f returns if
+ * that is not MMAP_OK. */
+typedef int (*mmap_enc_mat_fn)(mmap_enc_mat_t m, size_t k, void *arg);
+int
+mmap_enc_mat_fread_stream(const_mmap_vtable mmap, const mmap_pp params,
+                          FILE *fp, mmap_enc_mat_fn f, void *arg);
+
+/* dest += a * b */
+int
+mmap_enc_fma(const_mmap_vtable mmap, const mmap_pp params, mmap_enc dest,
+             const mmap_enc a, const mmap_enc b);
+/* dest = as[0] * bs[0] + ... + as[n-1] * bs[n-1] */
+int
+mmap_enc_dot(const_mmap_vtable mmap, const mmap_pp params, mmap_enc dest,
+             const mmap_enc *as, const mmap_enc *bs, size_t n);
+
+typedef enum {
+    MMAP_ZT_ALL,           // test every entry
+    MMAP_ZT_UNTIL_NONZERO, // stop at the first nonzero entry
+    MMAP_ZT_UNTIL_ZERO,    // stop at the first zero entry
+} mmap_zt_mode;
+
+/* Number of words in a bitmap of n bits */
+#define MMAP_BITMAP_WORDS(n) (((size_t) (n) + 63) / 64)
+
+/* Zero-tests the entries of m in parallel.  Bit i * ncols + j of bitmap, which
+ * holds MMAP_BITMAP_WORDS(nrows * ncols) words, is set iff m[i][j] is zero.
+ * The early-exit modes test entries in row-major batches and return the index
+ * of the first entry that stopped the test, leaving the bits after it clear,
+ * or -1 if no entry did.  MMAP_ZT_ALL always returns -1. */
+int
+mmap_enc_mat_is_zero(const_mmap_vtable mmap, const mmap_pp params,
+                     uint64_t *bitmap, const mmap_enc_mat_t m,
+                     mmap_zt_mode mode);
+
+/* Recycles encodings of one public parameter set.  Released encodings are
+ * kept as they are, so the dummy backend reuses their GMP limbs, and each
+ * thread takes from and returns to a small cache of its own, touching the
+ * shared list (and the allocator) only when that cache runs empty or full.
+ * An acquired encoding holds whatever value it was released with.  Any
+ * thread may use a pool; encodings still out when it is freed must be freed
+ * with mmap->enc->free. */
+typedef struct _mmap_enc_pool_struct mmap_enc_pool;
+
+/* Starts with capacity encodings ready */
+mmap_enc_pool *
+mmap_enc_pool_new(const_mmap_vtable mmap, const mmap_pp params,
+                  size_t capacity);
+void
+mmap_enc_pool_free(mmap_enc_pool *pool);
+mmap_enc
+mmap_enc_pool_acquire(mmap_enc_pool *pool);
+void
+mmap_enc_pool_release(mmap_enc_pool *pool, mmap_enc enc);
+
+/* An optional GMP allocator for every big integer in the process, installed
+ * with mp_set_memory_functions.  Blocks up to 64 KiB come from power-of-two
+ * size classes, each thread allocating from and freeing into caches of its
+ * own; larger blocks are mapped directly.  Install it before any GMP object
+ * exists and uninstall it only once all are freed, since neither allocator
+ * can free the other's blocks.  Memory for the size classes is kept for
+ * reuse rather than returned to the system. */
+
+/* Back blocks of 2 MiB or more with transparent huge pages */
+#define MMAP_ALLOC_HUGE_PAGES 0x1
+
+typedef struct {
+    size_t in_use; // bytes in live blocks, rounded up to their size class
+    size_t peak;   // most bytes in use at once
+    size_t mapped; // bytes obtained from the system
+} mmap_alloc_stats;
+
+/* Returns MMAP_ERR if already installed */
+int
+mmap_alloc_install(int flags);
+void
+mmap_alloc_uninstall(void);
+/* Threads publish their allocations in steps of 64 KiB, so in_use and peak
+ * may lag by that much per thread */
+void
+mmap_alloc_get_stats(mmap_alloc_stats *stats);
+
+/* A store keeps encodings of one public parameter set in a file that is read
+ * with mmap(2), so opening it costs nothing beyond checking its header.  With
+ * backends that have payload_view (the dummy backend), encodings are used
+ * straight from the mapped pages; others (CLT) are read from them with
+ * from_buf when first requested.  Either way the encodings belong to the store, are
+ * valid until it is closed, and may only be used as operands. */
+typedef struct _mmap_store_struct mmap_store;
+
+/* Writes a store in one go */
+int
+mmap_store_write(const_mmap_vtable mmap, const mmap_pp params,
+                 const char *path, const mmap_enc *encs, size_t n);
+
+/* Writes a store incrementally.  Encodings are numbered in the order they are
+ * added, and matrices, numbered separately, take the next nrows * ncols
+ * numbers for their entries in row-major order.  The offset tables go at the
+ * end of the file, written by close, which also frees the writer. */
+typedef struct _mmap_store_writer_struct mmap_store_writer;
+
+mmap_store_writer *
+mmap_store_writer_new(const_mmap_vtable mmap, const mmap_pp params,
+                      const char *path);
+int
+mmap_store_writer_add(mmap_store_writer *w, const mmap_enc *encs, size_t n);
+int
+mmap_store_writer_add_mat(mmap_store_writer *w, const mmap_enc_mat_t m);
+int
+mmap_store_writer_close(mmap_store_writer *w);
+
+/* Returns NULL if the file is not a store for this backend, or its payloads
+ * do not fit params */
+mmap_store *
+mmap_store_open(const_mmap_vtable mmap, const mmap_pp params,
+                const char *path);
+size_t
+mmap_store_count(const mmap_store *store);
+/* The i-th encoding, or NULL if out of range.  Safe to call concurrently. */
+mmap_enc
+mmap_store_get(mmap_store *store, size_t i);
+/* Loads encodings first to first + n - 1 in parallel and returns their
+ * handles, or NULL if the range is out of bounds.  Other encodings are not
+ * touched, so processes sharing one store can each load only their part. */
+mmap_enc *
+mmap_store_get_range(mmap_store *store, size_t first, size_t n);
+size_t
+mmap_store_nmats(const mmap_store *store);
+/* The k-th matrix, loaded with mmap_store_get_range, as a view onto the
+ * store's handles; its data is NULL if k is out of range. */
+mmap_enc_mat_view
+mmap_store_get_mat(mmap_store *store, size_t k);
+void
+mmap_store_close(mmap_store *store);
+
+/* Generates a secret key, or loads the one generated earlier with the same
+ * backend, parameters, ncores and seed from the cache directory dir.  rng,
+ * which must not be initialized, is seeded from seed with aes_randinit_seedn,
+ * and is left in the state key generation leaves it in either way.  Keys are stored under
+ * a hash of everything they were generated from, and that is kept in full in
+ * the file and compared on load, so a key is never reused for other inputs.
+ * Files are written to a temporary name and renamed into place.  If the
+ * directory holds more than max_bytes (0 for no limit), the least recently
+ * used keys are removed.  Any cache failure falls back to key generation. */
+mmap_sk
+mmap_sk_cache_new(const_mmap_vtable mmap, const char *dir, size_t max_bytes,
+                  const mmap_sk_params *params, const mmap_sk_opt_params *opts,
+                  size_t ncores, const void *seed, size_t seed_len,
+                  aes_randstate_t rng, bool verbose);
+
+/* Wraps a backend in a vtable that forwards every call to it, counting the
+ * calls to each pp, sk and enc method and recording their latencies in
+ * log-linear histograms (each bucket within 1/16 of its values).  Handles are
+ * the backend's own, so objects can be passed between the two vtables, and
+ * methods the backend lacks are NULL in the wrapper too.  Each thread counts
+ * into counters of its own, which are merged when stats are read.  At most
+ * four wrappers exist at once; mmap_vtable_instrument returns NULL beyond
+ * that. */
+const mmap_vtable *
+mmap_vtable_instrument(const_mmap_vtable inner);
+/* Frees a wrapper and its counters, once no thread is calling through it */
+void
+mmap_vtable_instrument_free(const_mmap_vtable vt);
+
+typedef struct {
+    const char *name;           // method, as "enc.mul"
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} mmap_op_stats;
+
+/* Largest number of entries mmap_instrument_stats returns */
+#define MMAP_INSTRUMENT_NOPS 44
+
+typedef enum {
+    MMAP_INSTRUMENT_TEXT,
+    MMAP_INSTRUMENT_JSON,
+} mmap_instrument_format;
+
+/* Fills stats with up to n methods that were called through vt, the most
+ * time-consuming first, and returns how many it filled in.  Percentiles are
+ * the upper ends of histogram buckets, capped at max_ns. */
+size_t
+mmap_instrument_stats(const_mmap_vtable vt, mmap_op_stats *stats, size_t n);
+/* Writes the stats as a table, or as one JSON object */
+int
+mmap_instrument_dump(const_mmap_vtable vt, FILE *fp,
+                     mmap_instrument_format format);
+/* Zeroes the counters.  It may run while other threads make calls, which
+ * are then counted either before or after the reset, or partly lost. */
+void
+mmap_instrument_reset(const_mmap_vtable vt);
+
+/* Wraps a backend in a vtable that writes a trace of its calls to fp, for
+ * mmap_replay: one record per call that generates or loads a key, or that
+ * creates, encodes, changes, zero-tests or frees an encoding, with its
+ * operands as encoding numbers, its start and its duration.  Other methods
+ * are the backend's own.  Calls are recorded in the order they return, under
+ * a lock.  At most four tracing wrappers exist at once; mmap_vtable_trace
+ * returns NULL beyond that, or if it cannot write the trace header. */
+const mmap_vtable *
+mmap_vtable_trace(const_mmap_vtable inner, FILE *fp);
+/* Flushes fp, which the caller closes, and frees the wrapper.  Returns
+ * MMAP_ERR if any part of the trace could not be written. */
+int
+mmap_vtable_trace_close(const_mmap_vtable vt);
+
+/* A circuit of additions, subtractions and multiplications over input
+ * encodings, with zero-tested outputs, evaluated against any backend.  Gates
+ * are numbered in the order they are added; an operand that is not an
+ * existing gate makes the call return SIZE_MAX and the circuit unevaluable. */
+typedef struct _mmap_circuit_struct mmap_circuit;
+
+mmap_circuit *
+mmap_circuit_new(void);
+void
+mmap_circuit_free(mmap_circuit *c);
+/* The i-th input added is inputs[i] of mmap_circuit_eval */
+size_t
+mmap_circuit_input(mmap_circuit *c);
+size_t
+mmap_circuit_add(mmap_circuit *c, size_t a, size_t b);
+size_t
+mmap_circuit_sub(mmap_circuit *c, size_t a, size_t b);
+size_t
+mmap_circuit_mul(mmap_circuit *c, size_t a, size_t b);
+/* Returns the output's number, from 0, in results of mmap_circuit_eval */
+size_t
+mmap_circuit_output(mmap_circuit *c, size_t g);
+/* Computes only the gates the outputs need, running gates whose operands are
+ * ready concurrently on the OpenMP threads, which steal ready gates from each
+ * other.  An intermediate encoding is recycled as soon as its last consumer
+ * has run.  Sets results[o] to whether output o is zero. */
+int
+mmap_circuit_eval(const_mmap_vtable mmap, const mmap_pp params,
+                  mmap_circuit *c, const mmap_enc *inputs, bool *results);
+/* The most intermediate encodings alive at once in the last evaluation */
+size_t
+mmap_circuit_peak(const mmap_circuit *c);
+
 #ifdef __cplusplus
 }
 #endif
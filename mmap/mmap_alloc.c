@@ -0,0 +1,347 @@
+#define _GNU_SOURCE             /* for mremap */
+#include "mmap.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Blocks of up to 2^ALLOC_MAX_SHIFT bytes come from power-of-two size
+ * classes; larger ones are mapped directly. */
+#define ALLOC_MIN_SHIFT 4
+#define ALLOC_MAX_SHIFT 16
+#define ALLOC_NCLASSES (ALLOC_MAX_SHIFT - ALLOC_MIN_SHIFT + 1)
+/* Bytes of each class a thread keeps before handing half back */
+#define ALLOC_CACHE_BYTES (256 << 10)
+/* Bytes a thread carves blocks from at a time, and the regions those come
+ * from */
+#define ALLOC_CHUNK_BYTES (64 << 10)
+#define ALLOC_REGION_BYTES (32 << 20)
+/* Threads add up their change in bytes in use and publish it in steps of at
+ * least this much, so the counters cost no shared writes per block */
+#define ALLOC_FLUSH_BYTES (64 << 10)
+
+#define ALLOC_PAGE_BYTES 4096
+#define ALLOC_HUGE_PAGE_BYTES (2 << 20)
+
+struct alloc_block {
+    struct alloc_block *next;
+};
+
+struct alloc_cache {
+    struct alloc_block *head;
+    size_t n;
+    char *bump, *end;           /* uncarved part of the current chunk */
+};
+
+struct alloc_thread {
+    bool registered;
+    int64_t pending;            /* change in bytes in use not yet published */
+    struct alloc_cache classes[ALLOC_NCLASSES];
+};
+
+static struct {
+    pthread_once_t once;
+    pthread_key_t key;          /* runs alloc_thread_exit */
+    atomic_bool installed;
+    int flags;
+    void *(*prev_alloc)(size_t);
+    void *(*prev_realloc)(void *, size_t, size_t);
+    void (*prev_free)(void *, size_t);
+    pthread_mutex_t lock;       /* guards lists and the current region */
+    struct alloc_block *lists[ALLOC_NCLASSES];
+    size_t nlists[ALLOC_NCLASSES];
+    char *region, *region_end;
+    atomic_int_fast64_t in_use, peak;
+    atomic_size_t mapped;
+} arena = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static _Thread_local struct alloc_thread tl_arena;
+
+static inline size_t
+class_size(int c)
+{
+    return (size_t) 1 << (c + ALLOC_MIN_SHIFT);
+}
+
+static inline int
+size_class(size_t size)
+{
+    if (size <= class_size(0))
+        return 0;
+    return 64 - __builtin_clzll(size - 1) - ALLOC_MIN_SHIFT;
+}
+
+static inline size_t
+class_cache_cap(int c)
+{
+    const size_t cap = ALLOC_CACHE_BYTES / class_size(c);
+    return cap < 8 ? 8 : cap;
+}
+
+static size_t
+large_size(size_t size)
+{
+    const size_t align =
+        (arena.flags & MMAP_ALLOC_HUGE_PAGES) && size >= ALLOC_HUGE_PAGE_BYTES
+        ? ALLOC_HUGE_PAGE_BYTES : ALLOC_PAGE_BYTES;
+    return (size + align - 1) / align * align;
+}
+
+static void *
+map_pages(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if ((arena.flags & MMAP_ALLOC_HUGE_PAGES) && size >= ALLOC_HUGE_PAGE_BYTES)
+        (void) madvise(p, size, MADV_HUGEPAGE);
+    atomic_fetch_add(&arena.mapped, size);
+    return p;
+}
+
+/* What GMP's own allocator does when it runs out of memory */
+static void
+alloc_fail(size_t size)
+{
+    fprintf(stderr, "GNU MP: Cannot allocate memory (size=%zu)\n", size);
+    abort();
+}
+
+static void
+publish(struct alloc_thread *t)
+{
+    int_fast64_t now, peak;
+
+    now = atomic_fetch_add(&arena.in_use, t->pending) + t->pending;
+    t->pending = 0;
+    peak = atomic_load(&arena.peak);
+    while (now > peak && !atomic_compare_exchange_weak(&arena.peak, &peak, now))
+        ;
+}
+
+static inline void
+account(struct alloc_thread *t, int64_t delta)
+{
+    t->pending += delta;
+    if (t->pending >= ALLOC_FLUSH_BYTES || t->pending <= -ALLOC_FLUSH_BYTES)
+        publish(t);
+}
+
+/* Moves n blocks from the front of a thread's list to the shared one; the
+ * lock must be held */
+static void
+give_back(struct alloc_cache *cache, int c, size_t n)
+{
+    while (n-- && cache->head) {
+        struct alloc_block *b = cache->head;
+        cache->head = b->next;
+        cache->n--;
+        b->next = arena.lists[c];
+        arena.lists[c] = b;
+        arena.nlists[c]++;
+    }
+}
+
+static void
+alloc_thread_exit(void *arg)
+{
+    struct alloc_thread *t = arg;
+
+    publish(t);
+    pthread_mutex_lock(&arena.lock);
+    for (int c = 0; c < ALLOC_NCLASSES; ++c) {
+        struct alloc_cache *const cache = &t->classes[c];
+        /* Carve up the rest of the current chunk so others can use it */
+        for (; cache->bump != cache->end; cache->bump += class_size(c)) {
+            struct alloc_block *b = (struct alloc_block *) cache->bump;
+            b->next = arena.lists[c];
+            arena.lists[c] = b;
+            arena.nlists[c]++;
+        }
+        give_back(cache, c, cache->n);
+    }
+    pthread_mutex_unlock(&arena.lock);
+}
+
+static void
+alloc_once(void)
+{
+    pthread_key_create(&arena.key, alloc_thread_exit);
+}
+
+static struct alloc_thread *
+alloc_thread(void)
+{
+    struct alloc_thread *t = &tl_arena;
+
+    if (!t->registered) {
+        pthread_setspecific(arena.key, t);
+        t->registered = true;
+    }
+    return t;
+}
+
+/* Takes blocks from the shared list, or else a fresh chunk to carve */
+static bool
+refill(struct alloc_cache *cache, int c)
+{
+    const size_t size = class_size(c);
+    const size_t chunk =
+        size * 8 > ALLOC_CHUNK_BYTES ? size * 8 : ALLOC_CHUNK_BYTES;
+    size_t n = class_cache_cap(c) / 2;
+
+    pthread_mutex_lock(&arena.lock);
+    if (arena.nlists[c]) {
+        while (n-- && arena.lists[c]) {
+            struct alloc_block *b = arena.lists[c];
+            arena.lists[c] = b->next;
+            arena.nlists[c]--;
+            b->next = cache->head;
+            cache->head = b;
+            cache->n++;
+        }
+    } else {
+        if ((size_t) (arena.region_end - arena.region) < chunk) {
+            arena.region = map_pages(ALLOC_REGION_BYTES);
+            arena.region_end =
+                arena.region ? arena.region + ALLOC_REGION_BYTES : NULL;
+        }
+        if (arena.region) {
+            cache->bump = arena.region;
+            cache->end = arena.region + chunk;
+            arena.region += chunk;
+        }
+    }
+    pthread_mutex_unlock(&arena.lock);
+    return cache->head || cache->bump != cache->end;
+}
+
+static void *
+arena_alloc(size_t size)
+{
+    struct alloc_thread *t = alloc_thread();
+    struct alloc_cache *cache;
+    void *p;
+    int c;
+
+    if (size > class_size(ALLOC_NCLASSES - 1)) {
+        size = large_size(size);
+        if ((p = map_pages(size)) == NULL)
+            alloc_fail(size);
+        account(t, size);
+        return p;
+    }
+    c = size_class(size);
+    cache = &t->classes[c];
+    if (cache->head == NULL && cache->bump == cache->end
+        && !refill(cache, c))
+        alloc_fail(size);
+    if (cache->head) {
+        p = cache->head;
+        cache->head = cache->head->next;
+        cache->n--;
+    } else {
+        p = cache->bump;
+        cache->bump += class_size(c);
+    }
+    account(t, class_size(c));
+    return p;
+}
+
+static void
+arena_free(void *p, size_t size)
+{
+    struct alloc_thread *t = alloc_thread();
+    struct alloc_cache *cache;
+    struct alloc_block *b = p;
+    int c;
+
+    if (p == NULL)
+        return;
+    if (size > class_size(ALLOC_NCLASSES - 1)) {
+        size = large_size(size);
+        munmap(p, size);
+        atomic_fetch_sub(&arena.mapped, size);
+        account(t, -(int64_t) size);
+        return;
+    }
+    c = size_class(size);
+    cache = &t->classes[c];
+    b->next = cache->head;
+    cache->head = b;
+    if (++cache->n > class_cache_cap(c)) {
+        pthread_mutex_lock(&arena.lock);
+        give_back(cache, c, cache->n / 2);
+        pthread_mutex_unlock(&arena.lock);
+    }
+    account(t, -(int64_t) class_size(c));
+}
+
+static void *
+arena_realloc(void *p, size_t old_size, size_t new_size)
+{
+    const size_t max = class_size(ALLOC_NCLASSES - 1);
+    void *q;
+
+    if (old_size > max && new_size > max) {
+        const size_t from = large_size(old_size), to = large_size(new_size);
+        if (from == to)
+            return p;
+        if ((q = mremap(p, from, to, MREMAP_MAYMOVE)) == MAP_FAILED)
+            alloc_fail(new_size);
+        atomic_fetch_add(&arena.mapped, to - from);
+        account(alloc_thread(), (int64_t) to - (int64_t) from);
+        return q;
+    }
+    if (old_size <= max && new_size <= max
+        && size_class(old_size) == size_class(new_size))
+        return p;
+    q = arena_alloc(new_size);
+    memcpy(q, p, old_size < new_size ? old_size : new_size);
+    arena_free(p, old_size);
+    return q;
+}
+
+int
+mmap_alloc_install(int flags)
+{
+    bool expected = false;
+
+    pthread_once(&arena.once, alloc_once);
+    if (!atomic_compare_exchange_strong(&arena.installed, &expected, true))
+        return MMAP_ERR;
+    arena.flags = flags;
+    mp_get_memory_functions(&arena.prev_alloc, &arena.prev_realloc,
+                            &arena.prev_free);
+    mp_set_memory_functions(arena_alloc, arena_realloc, arena_free);
+    return MMAP_OK;
+}
+
+void
+mmap_alloc_uninstall(void)
+{
+    bool expected = true;
+
+    if (!atomic_compare_exchange_strong(&arena.installed, &expected, false))
+        return;
+    mp_set_memory_functions(arena.prev_alloc, arena.prev_realloc,
+                            arena.prev_free);
+}
+
+void
+mmap_alloc_get_stats(mmap_alloc_stats *stats)
+{
+    int_fast64_t in_use;
+
+    publish(&tl_arena);
+    in_use = atomic_load(&arena.in_use);
+    stats->in_use = in_use > 0 ? (size_t) in_use : 0;
+    stats->peak = (size_t) atomic_load(&arena.peak);
+    stats->mapped = atomic_load(&arena.mapped);
+}
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE             /* for fopencookie */
+#include "mmap.h"
+#include "mmap_buf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static ssize_t
+count_write(void *cookie, const char *buf, size_t size)
+{
+    (void) buf;
+    *(size_t *) cookie += size;
+    return size;
+}
+
+size_t
+mmap_buf_size(mmap_buf_fwrite_fn fwrite, void *obj)
+{
+    const cookie_io_functions_t io = { .write = count_write };
+    size_t size = 0;
+    FILE *fp;
+
+    if ((fp = fopencookie(&size, "w", io)) == NULL)
+        return 0;
+    (void) fwrite(obj, fp);
+    fclose(fp);
+    return size;
+}
+
+struct bounded {
+    char *buf;
+    size_t size, used;
+    bool overflow;
+};
+
+static ssize_t
+bounded_write(void *cookie, const char *buf, size_t size)
+{
+    struct bounded *const b = cookie;
+
+    if (size > b->size - b->used) {
+        b->overflow = true;
+        return 0;
+    }
+    memcpy(b->buf + b->used, buf, size);
+    b->used += size;
+    return size;
+}
+
+int
+mmap_buf_write(mmap_buf_fwrite_fn fwrite, void *obj, void *buf, size_t size)
+{
+    const cookie_io_functions_t io = { .write = bounded_write };
+    struct bounded b = { .buf = buf, .size = size };
+    int ret;
+    FILE *fp;
+
+    if ((fp = fopencookie(&b, "w", io)) == NULL)
+        return MMAP_ERR;
+    ret = fwrite(obj, fp);
+    if (fclose(fp) != 0 || b.overflow)
+        return MMAP_ERR;
+    return ret;
+}
+
+int
+mmap_buf_dump(mmap_buf_fwrite_fn fwrite, void *obj, char **buf, size_t *size)
+{
+    int ret;
+    FILE *fp;
+
+    *buf = NULL;
+    *size = 0;
+    if ((fp = open_memstream(buf, size)) == NULL)
+        return MMAP_ERR;
+    ret = fwrite(obj, fp);
+    if (fclose(fp) != 0 || ret != MMAP_OK) {
+        free(*buf);
+        *buf = NULL;
+        return MMAP_ERR;
+    }
+    return MMAP_OK;
+}
+
+FILE *
+mmap_buf_open(const void *buf, size_t size)
+{
+    /* fmemopen does not write through a stream opened for reading */
+    return fmemopen((void *) buf, size, "rb");
+}
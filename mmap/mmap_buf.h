@@ -0,0 +1,24 @@
+#ifndef _LIBMMAP_MMAP_BUF_H
+#define _LIBMMAP_MMAP_BUF_H
+
+/* Buffer serialization in terms of fwrite and fread, for backends whose
+ * objects are opaque.  Not installed. */
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef int (*mmap_buf_fwrite_fn)(void *obj, FILE *fp);
+
+/* Number of bytes fwrite writes for obj, counted without storing them */
+size_t mmap_buf_size(mmap_buf_fwrite_fn fwrite, void *obj);
+/* Runs fwrite into buf, failing if the output does not fit in size bytes */
+int mmap_buf_write(mmap_buf_fwrite_fn fwrite, void *obj, void *buf,
+                   size_t size);
+/* Runs fwrite into a newly allocated buffer, returned in *buf with its
+ * length in *size.  On failure *buf is NULL. */
+int mmap_buf_dump(mmap_buf_fwrite_fn fwrite, void *obj, char **buf,
+                  size_t *size);
+/* A read-only stream over buf, for fread */
+FILE *mmap_buf_open(const void *buf, size_t size);
+
+#endif
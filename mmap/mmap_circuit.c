@@ -0,0 +1,372 @@
+#include "mmap.h"
+#include <assert.h>
+#include <omp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Gates are numbered in the order they are added, so operands always come
+ * before the gates that use them and the numbering is a topological order. */
+
+enum { GATE_INPUT, GATE_ADD, GATE_SUB, GATE_MUL };
+
+struct gate {
+    int op;
+    size_t a;                   // operand, or input index for GATE_INPUT
+    size_t b;
+};
+
+struct _mmap_circuit_struct {
+    struct gate *gates;
+    size_t ngates, cap;
+    size_t ninputs;
+    size_t *outputs;            // gate of each output
+    size_t noutputs, outputs_cap;
+    bool bad;                   // a gate was given an operand that is not one
+    size_t peak;
+};
+
+mmap_circuit *
+mmap_circuit_new(void)
+{
+    mmap_circuit *c = calloc(1, sizeof c[0]);
+    assert(c);
+    return c;
+}
+
+void
+mmap_circuit_free(mmap_circuit *c)
+{
+    if (c == NULL)
+        return;
+    free(c->gates);
+    free(c->outputs);
+    free(c);
+}
+
+static size_t
+circuit_gate(mmap_circuit *c, int op, size_t a, size_t b)
+{
+    if (op != GATE_INPUT && (a >= c->ngates || b >= c->ngates)) {
+        c->bad = true;
+        return SIZE_MAX;
+    }
+    if (c->ngates == c->cap) {
+        c->cap = c->cap ? 2 * c->cap : 64;
+        c->gates = realloc(c->gates, c->cap * sizeof c->gates[0]);
+        assert(c->gates);
+    }
+    c->gates[c->ngates] = (struct gate) { .op = op, .a = a, .b = b };
+    return c->ngates++;
+}
+
+size_t
+mmap_circuit_input(mmap_circuit *c)
+{
+    return circuit_gate(c, GATE_INPUT, c->ninputs++, 0);
+}
+
+size_t
+mmap_circuit_add(mmap_circuit *c, size_t a, size_t b)
+{
+    return circuit_gate(c, GATE_ADD, a, b);
+}
+
+size_t
+mmap_circuit_sub(mmap_circuit *c, size_t a, size_t b)
+{
+    return circuit_gate(c, GATE_SUB, a, b);
+}
+
+size_t
+mmap_circuit_mul(mmap_circuit *c, size_t a, size_t b)
+{
+    return circuit_gate(c, GATE_MUL, a, b);
+}
+
+size_t
+mmap_circuit_output(mmap_circuit *c, size_t g)
+{
+    if (g >= c->ngates) {
+        c->bad = true;
+        return SIZE_MAX;
+    }
+    if (c->noutputs == c->outputs_cap) {
+        c->outputs_cap = c->outputs_cap ? 2 * c->outputs_cap : 16;
+        c->outputs = realloc(c->outputs, c->outputs_cap * sizeof c->outputs[0]);
+        assert(c->outputs);
+    }
+    c->outputs[c->noutputs] = g;
+    return c->noutputs++;
+}
+
+size_t
+mmap_circuit_peak(const mmap_circuit *c)
+{
+    return c->peak;
+}
+
+/* Ready gates of one thread.  The owner pushes and pops at the tail, so it
+ * keeps working depth-first on what it just made ready, which keeps few
+ * intermediate encodings alive; thieves take the oldest from the head. */
+struct deque {
+    pthread_mutex_t lock;
+    size_t *items;
+    size_t head, tail, cap;
+} __attribute__((aligned(64)));
+
+static void
+deque_push(struct deque *d, size_t g)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head,
+                    (d->tail - d->head) * sizeof d->items[0]);
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            d->cap = d->cap ? 2 * d->cap : 64;
+            d->items = realloc(d->items, d->cap * sizeof d->items[0]);
+            assert(d->items);
+        }
+    }
+    d->items[d->tail++] = g;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static bool
+deque_take(struct deque *d, size_t *g, bool steal)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) {
+        *g = steal ? d->items[d->head++] : d->items[--d->tail];
+        if (d->head == d->tail)
+            d->head = d->tail = 0;
+        ok = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+struct eval {
+    const mmap_vtable *mmap;
+    mmap_pp pp;
+    const mmap_circuit *c;
+    mmap_enc *vals;
+    size_t *uses;               // consumers, gates and outputs, not yet done
+    size_t *pending;            // operands not yet computed
+    size_t *succ_first, *succs; // gates using each gate
+    size_t *out_first, *outs;   // outputs of each gate
+    bool *results;
+    mmap_enc_pool *pool;
+    struct deque *deques;
+    int nthreads;
+    size_t remaining;           // gates not yet computed
+    size_t live, peak;
+    bool failed;
+};
+
+static bool
+is_input(const struct eval *e, size_t g)
+{
+    return e->c->gates[g].op == GATE_INPUT;
+}
+
+/* Drops n uses of g, recycling its encoding after the last one */
+static void
+release(struct eval *e, size_t g, size_t n)
+{
+    if (n == 0 || is_input(e, g))
+        return;
+    if (__atomic_sub_fetch(&e->uses[g], n, __ATOMIC_ACQ_REL) == 0) {
+        mmap_enc_pool_release(e->pool, e->vals[g]);
+        __atomic_sub_fetch(&e->live, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+run_gate(struct eval *e, int tid, size_t g)
+{
+    const struct gate *const gate = &e->c->gates[g];
+    const mmap_enc a = e->vals[gate->a], b = e->vals[gate->b];
+    mmap_enc r = mmap_enc_pool_acquire(e->pool);
+    size_t live, peak;
+    int ret;
+
+    live = __atomic_add_fetch(&e->live, 1, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&e->peak, __ATOMIC_RELAXED);
+    while (live > peak
+           && !__atomic_compare_exchange_n(&e->peak, &peak, live, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    switch (gate->op) {
+    case GATE_ADD:
+        ret = e->mmap->enc->add(r, e->pp, a, b);
+        break;
+    case GATE_SUB:
+        ret = e->mmap->enc->sub(r, e->pp, a, b);
+        break;
+    default:
+        ret = e->mmap->enc->mul(r, e->pp, a, b);
+        break;
+    }
+    if (ret != MMAP_OK)
+        __atomic_store_n(&e->failed, true, __ATOMIC_RELAXED);
+    e->vals[g] = r;
+
+    for (size_t k = e->out_first[g]; k < e->out_first[g + 1]; ++k)
+        e->results[e->outs[k]] = e->mmap->enc->is_zero(r, e->pp);
+    release(e, g, e->out_first[g + 1] - e->out_first[g]);
+    release(e, gate->a, 1);
+    release(e, gate->b, 1);
+
+    for (size_t k = e->succ_first[g]; k < e->succ_first[g + 1]; ++k) {
+        const size_t s = e->succs[k];
+        if (__atomic_sub_fetch(&e->pending[s], 1, __ATOMIC_ACQ_REL) == 0)
+            deque_push(&e->deques[tid], s);
+    }
+    __atomic_sub_fetch(&e->remaining, 1, __ATOMIC_RELEASE);
+}
+
+static void
+worker(struct eval *e, int tid)
+{
+    while (__atomic_load_n(&e->remaining, __ATOMIC_ACQUIRE) > 0) {
+        size_t g = 0;
+        bool found = deque_take(&e->deques[tid], &g, false);
+        for (int k = 1; !found && k < e->nthreads; ++k)
+            found = deque_take(&e->deques[(tid + k) % e->nthreads], &g, true);
+        if (found)
+            run_gate(e, tid, g);
+        else
+            sched_yield();
+    }
+}
+
+/* Sets up counts for the gates the outputs need, and no others */
+static void
+eval_init(struct eval *e, const mmap_enc *inputs)
+{
+    const mmap_circuit *const c = e->c;
+    const size_t n = c->ngates;
+    bool *needed = calloc(n ? n : 1, sizeof needed[0]);
+    size_t *fill;
+
+    e->vals = calloc(n ? n : 1, sizeof e->vals[0]);
+    e->uses = calloc(n ? n : 1, sizeof e->uses[0]);
+    e->pending = calloc(n ? n : 1, sizeof e->pending[0]);
+    e->succ_first = calloc(n + 1, sizeof e->succ_first[0]);
+    e->out_first = calloc(n + 1, sizeof e->out_first[0]);
+    e->outs = malloc((c->noutputs ? c->noutputs : 1) * sizeof e->outs[0]);
+    assert(needed && e->vals && e->uses && e->pending && e->succ_first
+           && e->out_first && e->outs);
+
+    for (size_t o = 0; o < c->noutputs; ++o) {
+        needed[c->outputs[o]] = true;
+        e->uses[c->outputs[o]]++;
+        e->out_first[c->outputs[o] + 1]++;
+    }
+    for (size_t g = n; g-- > 0;) {
+        const struct gate *const gate = &c->gates[g];
+        if (gate->op == GATE_INPUT) {
+            e->vals[g] = inputs[gate->a];
+            continue;
+        }
+        if (!needed[g])
+            continue;
+        needed[gate->a] = needed[gate->b] = true;
+        e->uses[gate->a]++;
+        e->uses[gate->b]++;
+        if (c->gates[gate->a].op != GATE_INPUT) {
+            e->pending[g]++;
+            e->succ_first[gate->a + 1]++;
+        }
+        if (c->gates[gate->b].op != GATE_INPUT) {
+            e->pending[g]++;
+            e->succ_first[gate->b + 1]++;
+        }
+        e->remaining++;
+    }
+    for (size_t g = 0; g < n; ++g) {
+        e->succ_first[g + 1] += e->succ_first[g];
+        e->out_first[g + 1] += e->out_first[g];
+    }
+    e->succs = malloc((e->succ_first[n] ? e->succ_first[n] : 1)
+                      * sizeof e->succs[0]);
+    fill = calloc(n ? n : 1, sizeof fill[0]);
+    assert(e->succs && fill);
+    for (size_t g = 0; g < n; ++g) {
+        const struct gate *const gate = &c->gates[g];
+        if (gate->op == GATE_INPUT || !needed[g])
+            continue;
+        if (c->gates[gate->a].op != GATE_INPUT)
+            e->succs[e->succ_first[gate->a] + fill[gate->a]++] = g;
+        if (c->gates[gate->b].op != GATE_INPUT)
+            e->succs[e->succ_first[gate->b] + fill[gate->b]++] = g;
+    }
+    memset(fill, 0, (n ? n : 1) * sizeof fill[0]);
+    for (size_t o = 0; o < c->noutputs; ++o) {
+        const size_t g = c->outputs[o];
+        e->outs[e->out_first[g] + fill[g]++] = o;
+    }
+
+    /* Spread the gates that are ready from the start */
+    for (size_t g = 0, k = 0; g < n; ++g) {
+        if (c->gates[g].op != GATE_INPUT && needed[g] && e->pending[g] == 0)
+            deque_push(&e->deques[k++ % e->nthreads], g);
+    }
+    free(fill);
+    free(needed);
+}
+
+int
+mmap_circuit_eval(const_mmap_vtable mmap, const mmap_pp params,
+                  mmap_circuit *c, const mmap_enc *inputs, bool *results)
+{
+    struct eval e = {
+        .mmap = mmap,
+        .pp = params,
+        .c = c,
+        .results = results,
+        .nthreads = omp_in_parallel() ? 1 : omp_get_max_threads(),
+    };
+
+    if (c->bad)
+        return MMAP_ERR;
+    e.deques = calloc(e.nthreads, sizeof e.deques[0]);
+    assert(e.deques);
+    for (int t = 0; t < e.nthreads; ++t)
+        pthread_mutex_init(&e.deques[t].lock, NULL);
+    eval_init(&e, inputs);
+
+    /* Outputs of inputs need no gates */
+    for (size_t o = 0; o < c->noutputs; ++o) {
+        if (c->gates[c->outputs[o]].op == GATE_INPUT)
+            results[o] = mmap->enc->is_zero(e.vals[c->outputs[o]], params);
+    }
+    if (e.remaining > 0) {
+        e.pool = mmap_enc_pool_new(mmap, params, 0);
+#pragma omp parallel num_threads(e.nthreads)
+        worker(&e, omp_get_thread_num());
+        mmap_enc_pool_free(e.pool);
+    }
+    c->peak = e.peak;
+
+    for (int t = 0; t < e.nthreads; ++t) {
+        pthread_mutex_destroy(&e.deques[t].lock);
+        free(e.deques[t].items);
+    }
+    free(e.deques);
+    free(e.vals);
+    free(e.uses);
+    free(e.pending);
+    free(e.succ_first);
+    free(e.succs);
+    free(e.out_first);
+    free(e.outs);
+    return e.failed ? MMAP_ERR : MMAP_OK;
+}
@@ -1,4 +1,5 @@
 #include "mmap.h"
+#include "mmap_buf.h"
 #include "mmap_clt.h"
 
 #include <clt13.h>
@@ -22,10 +23,41 @@ clt_pp_fwrite_wrapper(const mmap_pp pp, FILE *fp)
     return clt_pp_fwrite(pp, fp);
 }
 
+/* The CLT types are opaque, so their buffer methods go through fwrite and
+ * fread on streams over the buffer. */
+
+static size_t
+clt_pp_serialized_size(const mmap_pp pp)
+{
+    return mmap_buf_size(clt_pp_fwrite_wrapper, pp);
+}
+
+static int
+clt_pp_to_buf(const mmap_pp pp, void *buf, size_t size)
+{
+    return mmap_buf_write(clt_pp_fwrite_wrapper, pp, buf, size);
+}
+
+static mmap_pp
+clt_pp_from_buf(const void *buf, size_t size)
+{
+    FILE *fp;
+    mmap_pp pp;
+
+    if ((fp = mmap_buf_open(buf, size)) == NULL)
+        return NULL;
+    pp = clt_pp_fread(fp);
+    fclose(fp);
+    return pp;
+}
+
 static const mmap_pp_vtable clt_pp_vtable =
   { .free  = clt_pp_free_wrapper
   , .fread  = clt_pp_fread_wrapper
   , .fwrite = clt_pp_fwrite_wrapper
+  , .serialized_size = clt_pp_serialized_size
+  , .to_buf = clt_pp_to_buf
+  , .from_buf = clt_pp_from_buf
   };
 
 static mmap_sk
@@ -39,6 +71,10 @@ clt_state_new_wrapper(const mmap_sk_params *params_,
     int flags = CLT_FLAG_OPT_CRT_TREE | CLT_FLAG_OPT_COMPOSITE_PS;
     if (verbose)
         flags |= CLT_FLAG_VERBOSE;
+    /* Gives each prime its own randomness, so clt_encode can spread the
+     * primes of one encoding over the ncores threads */
+    if (ncores > 1)
+        flags |= CLT_FLAG_OPT_PARALLEL_ENCODE;
 
     if (params_ == NULL)
         return NULL;
@@ -86,6 +122,31 @@ clt_state_fwrite_wrapper(const mmap_sk sk, FILE *fp)
     return clt_state_fwrite(sk, fp);
 }
 
+static size_t
+clt_state_serialized_size(const mmap_sk sk)
+{
+    return mmap_buf_size(clt_state_fwrite_wrapper, sk);
+}
+
+static int
+clt_state_to_buf(const mmap_sk sk, void *buf, size_t size)
+{
+    return mmap_buf_write(clt_state_fwrite_wrapper, sk, buf, size);
+}
+
+static mmap_sk
+clt_state_from_buf(const void *buf, size_t size)
+{
+    FILE *fp;
+    mmap_sk sk;
+
+    if ((fp = mmap_buf_open(buf, size)) == NULL)
+        return NULL;
+    sk = clt_state_fread(fp);
+    fclose(fp);
+    return sk;
+}
+
 static mpz_t *
 clt_state_get_moduli(const mmap_sk sk)
 {
@@ -116,6 +177,9 @@ mmap_sk_vtable clt_sk_vtable =
   , .free   = clt_state_free_wrapper
   , .fread  = clt_state_fread_wrapper
   , .fwrite = clt_state_fwrite_wrapper
+  , .serialized_size = clt_state_serialized_size
+  , .to_buf = clt_state_to_buf
+  , .from_buf = clt_state_from_buf
   , .pp     = clt_pp_init_wrapper
   , .plaintext_fields = clt_state_get_moduli
   , .nslots = clt_state_nslots_wrapper
@@ -150,12 +214,51 @@ clt_enc_fwrite_wrapper(const mmap_enc enc, FILE *fp)
     return clt_elem_fwrite(enc, fp);
 }
 
+static size_t
+clt_enc_serialized_size(const mmap_enc enc)
+{
+    return mmap_buf_size(clt_enc_fwrite_wrapper, enc);
+}
+
+static int
+clt_enc_to_buf(const mmap_enc enc, void *buf, size_t size)
+{
+    return mmap_buf_write(clt_enc_fwrite_wrapper, enc, buf, size);
+}
+
+static mmap_enc
+clt_enc_from_buf(const void *buf, size_t size)
+{
+    clt_elem_t *enc;
+    FILE *fp;
+
+    if ((fp = mmap_buf_open(buf, size)) == NULL)
+        return NULL;
+    enc = clt_elem_new();
+    if (clt_elem_fread(enc, fp) != 0) {
+        clt_elem_free(enc);
+        enc = NULL;
+    }
+    fclose(fp);
+    return enc;
+}
+
 static void
 clt_enc_set_wrapper(mmap_enc dest, const mmap_enc src)
 {
     clt_elem_set(dest, src);
 }
 
+static void
+clt_enc_swap_wrapper(mmap_enc *a, mmap_enc *b)
+{
+    /* CLT encodings are always separate heap objects, so exchanging the
+     * handles moves them */
+    mmap_enc tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
 static int
 clt_enc_add_wrapper(mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b)
 {
@@ -180,6 +283,17 @@ clt_enc_is_zero_wrapper(const mmap_enc enc, const mmap_pp pp)
     return clt_is_zero(enc, pp);
 }
 
+/* Each zero-test is a big-integer product that only reads pp, so the batch
+ * runs one encoding per thread */
+static void
+clt_enc_is_zero_batch_wrapper(bool *results, const mmap_enc *encs,
+                              size_t count, const mmap_pp pp)
+{
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t k = 0; k < count; ++k)
+        results[k] = clt_is_zero(encs[k], pp);
+}
+
 static int
 clt_encode_wrapper(mmap_enc enc, const mmap_sk sk, size_t n, const mpz_t *plaintext, const int *pows, size_t level)
 {
@@ -187,6 +301,23 @@ clt_encode_wrapper(mmap_enc enc, const mmap_sk sk, size_t n, const mpz_t *plaint
     return clt_encode(enc, sk, n, plaintext, pows);
 }
 
+/* With ncores > 1 the state is made with CLT_FLAG_OPT_PARALLEL_ENCODE, so
+ * clt_encode spreads each encoding over the threads itself.  Its randomness
+ * is shared state, so the batch is encoded one element at a time. */
+static int
+clt_encode_batch_wrapper(mmap_enc *encs, const mmap_sk sk, size_t count,
+                         size_t n, const mpz_t *const *plaintexts,
+                         const int *const *pows, size_t level)
+{
+    (void) level;
+    for (size_t k = 0; k < count; ++k) {
+        const int ret = clt_encode(encs[k], sk, n, plaintexts[k], pows[k]);
+        if (ret != MMAP_OK)
+            return ret;
+    }
+    return MMAP_OK;
+}
+
 static void
 clt_print_wrapper(const mmap_enc enc)
 {
@@ -198,18 +329,38 @@ static const mmap_enc_vtable clt_enc_vtable =
   , .free    = clt_enc_free_wrapper
   , .fread   = clt_enc_fread_wrapper
   , .fwrite  = clt_enc_fwrite_wrapper
+  , .serialized_size = clt_enc_serialized_size
+  , .to_buf  = clt_enc_to_buf
+  , .from_buf = clt_enc_from_buf
   , .set     = clt_enc_set_wrapper
+  , .swap    = clt_enc_swap_wrapper
   , .add     = clt_enc_add_wrapper
   , .sub     = clt_enc_sub_wrapper
   , .mul     = clt_enc_mul_wrapper
+    /* clt_elem_t is opaque, so products cannot be accumulated before
+     * reduction; callers fall back to mul and add */
+  , .fma     = NULL
+  , .dot     = NULL
   , .is_zero = clt_enc_is_zero_wrapper
+  , .is_zero_batch = clt_enc_is_zero_batch_wrapper
   , .encode  = clt_encode_wrapper
+  , .encode_batch = clt_encode_batch_wrapper
   , .degree  = NULL
   , .print   = clt_print_wrapper
+    /* clt_elem_t is opaque, so CLT encodings are always heap-allocated */
+  , .size    = NULL
+  , .init    = NULL
+  , .clear   = NULL
+    /* Nor can it point into a mapped payload; mmap_store reads CLT
+     * encodings back with from_buf when they are first used */
+  , .payload_size  = NULL
+  , .payload_write = NULL
+  , .payload_view  = NULL
   };
 
 const mmap_vtable clt_vtable =
   { .pp  = &clt_pp_vtable
   , .sk  = &clt_sk_vtable
   , .enc = &clt_enc_vtable
+  , .name = "clt"
   };
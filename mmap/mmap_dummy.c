@@ -1,52 +1,268 @@
 #include "mmap.h"
+#include "mmap_dummy_slots.h"
 
 #include <assert.h>
+#include <inttypes.h>
+#include <omp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+/* When every modulus is odd and fits in a 64-bit word, slots are stored as
+ * raw words instead of mpz_t's and handled by the kernels in
+ * mmap_dummy_slots.c.  Words hold ordinary (not Montgomery-form) residues, so
+ * that encodings can be printed, written and compared without access to the
+ * public parameters. */
+
 typedef struct dummy_pp_t {
-    mpz_t *moduli;
+    mpz_t *moduli;              /* see dummy_moduli_t */
     size_t nslots;
     unsigned int kappa;
     int verbose;
+    dummy_slots_t slots;        /* slots.p is NULL unless word sized */
+    size_t bits;                /* size of the largest modulus */
+    size_t lazy_bits;           /* see dummy_enc_op_mpz */
 } dummy_pp_t;
 
 typedef struct dummy_sk_t {
     dummy_pp_t pp;
     size_t nzs;
+    size_t ncores;              /* threads for encode_batch, 0 for default */
 } dummy_sk_t;
 
 typedef struct dummy_enc_t {
-    mpz_t *elems;
+    mpz_t *elems;               /* slots, if !fast */
+    uint64_t *words;            /* slots, if fast */
     unsigned int degree;
     size_t nslots;
+    bool fast;
+    /* mpz_t slots are below 2^bits in absolute value.  They may also be
+     * unreduced, in which case lazy holds a reference to the moduli of the
+     * public parameters that produced them. */
+    size_t bits;
+    const mpz_t *lazy;
+    /* Slots point into a payload owned by someone else; see
+     * dummy_enc_payload_view */
+    bool borrowed;
 } dummy_enc_t;
 
+/* Moduli are shared, read-only, by a pp, the copies sk->pp hands out, and
+ * the lazily reduced encodings computed under any of them.  Each holds a
+ * reference, so encodings stay valid after the pp is freed. */
+typedef struct dummy_moduli_t {
+    size_t refs;                /* updated atomically */
+    size_t n;
+} dummy_moduli_t;
+
+/* The moduli follow their header, at an offset that keeps them aligned */
+#define DUMMY_MODULI_OFFSET \
+    ((sizeof(dummy_moduli_t) + sizeof(mpz_t) - 1) / sizeof(mpz_t) * sizeof(mpz_t))
+
+static dummy_moduli_t *
+dummy_moduli_of(const void *m)
+{
+    return (dummy_moduli_t *) ((char *) m - DUMMY_MODULI_OFFSET);
+}
+
+/* Returns n moduli set to zero, holding one reference */
+static mpz_t *
+dummy_moduli_new(size_t n)
+{
+    char *p = malloc(DUMMY_MODULI_OFFSET + n * sizeof(mpz_t));
+    dummy_moduli_t *const mod = (dummy_moduli_t *) p;
+    mpz_t *const m = (mpz_t *) (p + DUMMY_MODULI_OFFSET);
+
+    assert(p);
+    mod->refs = 1;
+    mod->n = n;
+    for (size_t i = 0; i < n; ++i)
+        mpz_init(m[i]);
+    return m;
+}
+
+static mpz_t *
+dummy_moduli_ref(const void *m)
+{
+    __atomic_add_fetch(&dummy_moduli_of(m)->refs, 1, __ATOMIC_RELAXED);
+    return (mpz_t *) m;
+}
+
+static void
+dummy_moduli_unref(const void *m_)
+{
+    mpz_t *const m = (mpz_t *) m_;
+    dummy_moduli_t *mod;
+
+    if (m == NULL)
+        return;
+    mod = dummy_moduli_of(m);
+    if (__atomic_sub_fetch(&mod->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    for (size_t i = 0; i < mod->n; ++i)
+        mpz_clear(m[i]);
+    free(mod);
+}
+
+/* Headroom for unreduced sums, in bits beyond the largest modulus */
+#define DUMMY_LAZY_SLACK 64
+
 #define max(a, b) (a) > (b) ? (a) : (b)
 
+static void
+dummy_slot_get(mpz_t rop, const dummy_enc_t *enc, size_t i)
+{
+    if (enc->fast)
+        mpz_set_ui(rop, enc->words[i]);
+    else
+        mpz_set(rop, enc->elems[i]);
+}
+
+static void
+dummy_slot_set(dummy_enc_t *enc, size_t i, const mpz_t x)
+{
+    if (enc->fast)
+        enc->words[i] = mpz_get_ui(x);
+    else
+        mpz_set(enc->elems[i], x);
+}
+
+static void
+dummy_pp_init_derived(dummy_pp_t *pp)
+{
+    dummy_slots_init(&pp->slots, pp->moduli, pp->nslots);
+    pp->bits = 0;
+    for (size_t i = 0; i < pp->nslots; ++i)
+        pp->bits = max(pp->bits, mpz_sizeinbase(pp->moduli[i], 2));
+    /* Word-sized slots reduce with one compare, so only mpz_t slots are
+     * reduced lazily */
+    pp->lazy_bits = pp->slots.p ? 0 : pp->bits + DUMMY_LAZY_SLACK;
+}
+
+/* Points enc's lazy at moduli, or at nothing, moving the reference.
+ * Chains of sums under the same pp take no new references. */
+static void
+dummy_enc_set_lazy(dummy_enc_t *enc, const mpz_t *moduli)
+{
+    if (enc->lazy == moduli)
+        return;
+    if (moduli)
+        (void) dummy_moduli_ref(moduli);
+    dummy_moduli_unref(enc->lazy);
+    enc->lazy = moduli;
+}
+
+/* Reads slot i as a residue in [0, p) */
+static void
+dummy_slot_get_reduced(mpz_t rop, const dummy_enc_t *enc, size_t i)
+{
+    dummy_slot_get(rop, enc, i);
+    if (!enc->fast && enc->lazy)
+        mpz_mod(rop, rop, enc->lazy[i]);
+}
+
+static size_t
+dummy_slots_bits(const mpz_t *xs, size_t n)
+{
+    size_t bits = 0;
+    for (size_t i = 0; i < n; ++i)
+        bits = max(bits, mpz_sizeinbase(xs[i], 2));
+    return bits;
+}
+
+/* Buffer counterparts of fwrite, fread, mpz_out_raw and mpz_inp_raw.  The
+ * raw format is a 4-byte big-endian byte count, negated for negative numbers,
+ * followed by the magnitude in big-endian bytes. */
+
+typedef struct {
+    const char *p, *end;
+} dummy_rbuf_t;
+
+static char *
+dummy_put(char *p, const void *x, size_t n)
+{
+    memcpy(p, x, n);
+    return p + n;
+}
+
+static bool
+dummy_get(dummy_rbuf_t *r, void *x, size_t n)
+{
+    if (n > (size_t) (r->end - r->p))
+        return false;
+    memcpy(x, r->p, n);
+    r->p += n;
+    return true;
+}
+
+static size_t
+dummy_raw_size(mpz_srcptr x)
+{
+    return 4 + (mpz_sgn(x) ? (mpz_sizeinbase(x, 2) + 7) / 8 : 0);
+}
+
+static char *
+dummy_put_raw(char *p, mpz_srcptr x)
+{
+    size_t n = 0;
+    uint32_t csize;
+
+    mpz_export(p + 4, &n, 1, 1, 1, 0, x);
+    csize = mpz_sgn(x) < 0 ? -(uint32_t) n : (uint32_t) n;
+    for (int i = 0; i < 4; ++i)
+        p[i] = (char) (csize >> (24 - 8 * i));
+    return p + 4 + n;
+}
+
+static bool
+dummy_get_raw(dummy_rbuf_t *r, mpz_t x)
+{
+    unsigned char b[4];
+    uint32_t csize;
+    size_t n;
+
+    if (!dummy_get(r, b, sizeof b))
+        return false;
+    csize = (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16
+        | (uint32_t) b[2] << 8 | b[3];
+    n = (int32_t) csize < 0 ? -csize : csize;
+    if (n > (size_t) (r->end - r->p))
+        return false;
+    mpz_import(x, n, 1, 1, 1, 0, r->p);
+    if ((int32_t) csize < 0)
+        mpz_neg(x, x);
+    r->p += n;
+    return true;
+}
+
 static void
 dummy_pp_free(mmap_pp pp_)
 {
     dummy_pp_t *const pp = pp_;
-    for (size_t i = 0; i < pp->nslots; ++i)
-        mpz_clear(pp->moduli[i]);
-    free(pp->moduli);
+    dummy_moduli_unref(pp->moduli);
+    dummy_slots_clear(&pp->slots);
     free(pp);
 }
 
+static void
+dummy_pp_fread_into(dummy_pp_t *pp, FILE *fp)
+{
+    fread(&pp->kappa, sizeof pp->kappa, 1, fp);
+    fread(&pp->nslots, sizeof pp->nslots, 1, fp);
+    pp->moduli = dummy_moduli_new(pp->nslots);
+    for (size_t i = 0; i < pp->nslots; ++i)
+        mpz_inp_raw(pp->moduli[i], fp);
+    fread(&pp->verbose, sizeof pp->verbose, 1, fp);
+    dummy_pp_init_derived(pp);
+}
+
 static mmap_pp
 dummy_pp_fread(FILE *fp)
 {
     dummy_pp_t *pp;
 
     pp = calloc(1, sizeof pp[0]);
-    fread(&pp->kappa, sizeof pp->kappa, 1, fp);
-    fread(&pp->nslots, sizeof pp->nslots, 1, fp);
-    pp->moduli = calloc(pp->nslots, sizeof(mpz_t));
-    for (size_t i = 0; i < pp->nslots; ++i) {
-        mpz_init(pp->moduli[i]);
-        mpz_inp_raw(pp->moduli[i], fp);
-    }
-    fread(&pp->verbose, sizeof pp->verbose, 1, fp);
+    dummy_pp_fread_into(pp, fp);
     return pp;
 }
 
@@ -63,10 +279,78 @@ dummy_pp_fwrite(const mmap_pp pp_, FILE *const fp)
     return MMAP_OK;
 }
 
+static size_t
+dummy_pp_serialized_size(const mmap_pp pp_)
+{
+    const dummy_pp_t *const pp = pp_;
+    size_t size = sizeof pp->kappa + sizeof pp->nslots + sizeof pp->verbose;
+    for (size_t i = 0; i < pp->nslots; ++i)
+        size += dummy_raw_size(pp->moduli[i]);
+    return size;
+}
+
+static char *
+dummy_pp_put(char *p, const dummy_pp_t *pp)
+{
+    p = dummy_put(p, &pp->kappa, sizeof pp->kappa);
+    p = dummy_put(p, &pp->nslots, sizeof pp->nslots);
+    for (size_t i = 0; i < pp->nslots; ++i)
+        p = dummy_put_raw(p, pp->moduli[i]);
+    return dummy_put(p, &pp->verbose, sizeof pp->verbose);
+}
+
+static int
+dummy_pp_to_buf(const mmap_pp pp, void *buf, size_t size)
+{
+    if (size < dummy_pp_serialized_size(pp))
+        return MMAP_ERR;
+    (void) dummy_pp_put(buf, pp);
+    return MMAP_OK;
+}
+
+/* On failure, pp holds nothing that needs freeing */
+static bool
+dummy_pp_get(dummy_rbuf_t *r, dummy_pp_t *pp)
+{
+    if (!dummy_get(r, &pp->kappa, sizeof pp->kappa)
+        || !dummy_get(r, &pp->nslots, sizeof pp->nslots)
+        || pp->nslots > (size_t) (r->end - r->p) / 4)
+        return false;
+    pp->moduli = dummy_moduli_new(pp->nslots);
+    for (size_t i = 0; i < pp->nslots; ++i) {
+        if (!dummy_get_raw(r, pp->moduli[i]))
+            goto error;
+    }
+    if (!dummy_get(r, &pp->verbose, sizeof pp->verbose))
+        goto error;
+    dummy_pp_init_derived(pp);
+    return true;
+error:
+    dummy_moduli_unref(pp->moduli);
+    return false;
+}
+
+static mmap_pp
+dummy_pp_from_buf(const void *buf, size_t size)
+{
+    dummy_rbuf_t r = { buf, (const char *) buf + size };
+    dummy_pp_t *pp;
+
+    pp = calloc(1, sizeof pp[0]);
+    if (!dummy_pp_get(&r, pp)) {
+        free(pp);
+        return NULL;
+    }
+    return pp;
+}
+
 static const mmap_pp_vtable dummy_pp_vtable = {
     .free = dummy_pp_free,
     .fread = dummy_pp_fread,
     .fwrite = dummy_pp_fwrite,
+    .serialized_size = dummy_pp_serialized_size,
+    .to_buf = dummy_pp_to_buf,
+    .from_buf = dummy_pp_from_buf,
 };
 
 static mmap_sk
@@ -85,9 +369,8 @@ dummy_sk_new(const mmap_sk_params *params,
         fprintf(stderr, "  ncores: %lu\n", ncores);
     }
     nslots = opts && opts->nslots ? opts->nslots : 1;
-    sk->pp.moduli = calloc(nslots, sizeof sk->pp.moduli[0]);
+    sk->pp.moduli = dummy_moduli_new(nslots);
     for (size_t i = 0; i < nslots; ++i) {
-        mpz_init(sk->pp.moduli[i]);
         mpz_urandomb_aes(sk->pp.moduli[i], rng, params->lambda);
         mpz_nextprime(sk->pp.moduli[i], sk->pp.moduli[i]);
     }
@@ -96,7 +379,9 @@ dummy_sk_new(const mmap_sk_params *params,
     sk->pp.nslots = nslots;
     sk->pp.verbose = verbose;
     sk->nzs = params->gamma;
+    sk->ncores = ncores;
     sk->pp.kappa = params->kappa;
+    dummy_pp_init_derived(&sk->pp);
     return sk;
 }
 
@@ -110,9 +395,8 @@ dummy_sk_pp(mmap_sk sk_)
     pp->nslots = sk->pp.nslots;
     pp->kappa = sk->pp.kappa;
     pp->verbose = sk->pp.verbose;
-    pp->moduli = calloc(pp->nslots, sizeof pp->moduli[0]);
-    for (size_t i = 0; i < pp->nslots; ++i)
-        mpz_init_set(pp->moduli[i], sk->pp.moduli[i]);
+    pp->moduli = dummy_moduli_ref(sk->pp.moduli);
+    dummy_pp_init_derived(pp);
     return pp;
 }
 
@@ -120,24 +404,72 @@ static void
 dummy_sk_free(mmap_sk sk_)
 {
     dummy_sk_t *sk = sk_;
-    for (size_t i = 0; i < sk->pp.nslots; ++i) {
-        mpz_clear(sk->pp.moduli[i]);
-    }
-    free(sk->pp.moduli);
+    dummy_moduli_unref(sk->pp.moduli);
+    dummy_slots_clear(&sk->pp.slots);
     free(sk);
 }
 
 static mmap_sk
 dummy_sk_fread(FILE *const fp)
 {
-    return dummy_pp_fread(fp);
+    dummy_sk_t *sk;
+
+    sk = calloc(1, sizeof sk[0]);
+    dummy_pp_fread_into(&sk->pp, fp);
+    fread(&sk->nzs, sizeof sk->nzs, 1, fp);
+    fread(&sk->ncores, sizeof sk->ncores, 1, fp);
+    return sk;
 }
 
 static int
 dummy_sk_fwrite(const mmap_sk sk_, FILE *const fp)
 {
     const dummy_sk_t *const sk = sk_;
-    return dummy_pp_fwrite((mmap_pp) &sk->pp, fp);
+    dummy_pp_fwrite((mmap_pp) &sk->pp, fp);
+    fwrite(&sk->nzs, sizeof sk->nzs, 1, fp);
+    fwrite(&sk->ncores, sizeof sk->ncores, 1, fp);
+    return MMAP_OK;
+}
+
+static size_t
+dummy_sk_serialized_size(const mmap_sk sk_)
+{
+    const dummy_sk_t *const sk = sk_;
+    return dummy_pp_serialized_size((mmap_pp) &sk->pp)
+        + sizeof sk->nzs + sizeof sk->ncores;
+}
+
+static int
+dummy_sk_to_buf(const mmap_sk sk_, void *buf, size_t size)
+{
+    const dummy_sk_t *const sk = sk_;
+    char *p;
+
+    if (size < dummy_sk_serialized_size(sk_))
+        return MMAP_ERR;
+    p = dummy_pp_put(buf, &sk->pp);
+    p = dummy_put(p, &sk->nzs, sizeof sk->nzs);
+    (void) dummy_put(p, &sk->ncores, sizeof sk->ncores);
+    return MMAP_OK;
+}
+
+static mmap_sk
+dummy_sk_from_buf(const void *buf, size_t size)
+{
+    dummy_rbuf_t r = { buf, (const char *) buf + size };
+    dummy_sk_t *sk;
+
+    sk = calloc(1, sizeof sk[0]);
+    if (!dummy_pp_get(&r, &sk->pp)) {
+        free(sk);
+        return NULL;
+    }
+    if (!dummy_get(&r, &sk->nzs, sizeof sk->nzs)
+        || !dummy_get(&r, &sk->ncores, sizeof sk->ncores)) {
+        dummy_sk_free(sk);
+        return NULL;
+    }
+    return sk;
 }
 
 static mpz_t *
@@ -166,78 +498,351 @@ static const mmap_sk_vtable dummy_sk_vtable =
   .free = dummy_sk_free,
   .fread = dummy_sk_fread,
   .fwrite = dummy_sk_fwrite,
+  .serialized_size = dummy_sk_serialized_size,
+  .to_buf = dummy_sk_to_buf,
+  .from_buf = dummy_sk_from_buf,
   .pp = dummy_sk_pp,
   .plaintext_fields = dummy_sk_get_moduli,
   .nslots = dummy_sk_nslots,
   .nzs = dummy_sk_nzs,
 };
 
-static mmap_enc
-dummy_enc_new(const mmap_pp pp_)
+/* An encoding and its slots share one allocation: the slot array (mpz_t's,
+ * or words on the fast path) follows the dummy_enc_t header directly. */
+static size_t
+dummy_enc_size_n(size_t nslots, bool fast)
 {
-    const dummy_pp_t *const pp = pp_;
-    dummy_enc_t *enc;
+    return sizeof(dummy_enc_t)
+        + nslots * (fast ? sizeof(uint64_t) : sizeof(mpz_t));
+}
 
-    enc = calloc(1, sizeof enc[0]);
-    enc->elems = calloc(pp->nslots, sizeof(mpz_t));
-    for (size_t i = 0; i < pp->nslots; ++i) {
-        mpz_init(enc->elems[i]);
+static void
+dummy_enc_init_n(dummy_enc_t *enc, size_t nslots, bool fast)
+{
+    if (fast) {
+        enc->elems = NULL;
+        enc->words = (uint64_t *) (enc + 1);
+        memset(enc->words, 0, nslots * sizeof enc->words[0]);
+    } else {
+        enc->elems = (mpz_t *) (enc + 1);
+        enc->words = NULL;
+        for (size_t i = 0; i < nslots; ++i) {
+            mpz_init(enc->elems[i]);
+        }
     }
-    enc->nslots = pp->nslots;
+    enc->fast = fast;
+    enc->nslots = nslots;
     enc->degree = 0;        /* Set when encoding */
-    return enc;
+    enc->bits = 0;
+    enc->lazy = NULL;
+    enc->borrowed = false;
+}
+
+static size_t
+dummy_enc_size(const mmap_pp pp_)
+{
+    const dummy_pp_t *const pp = pp_;
+    return dummy_enc_size_n(pp->nslots, pp->slots.p != NULL);
+}
+
+static void
+dummy_enc_init(const mmap_enc enc, const mmap_pp pp_)
+{
+    const dummy_pp_t *const pp = pp_;
+    dummy_enc_init_n(enc, pp->nslots, pp->slots.p != NULL);
 }
 
 static void
-dummy_enc_free(const mmap_enc enc_)
+dummy_enc_clear(const mmap_enc enc_)
 {
     dummy_enc_t *const enc = enc_;
+    dummy_enc_set_lazy(enc, NULL);
+    if (enc->fast || enc->borrowed)
+        return;
     for (size_t i = 0; i < enc->nslots; ++i) {
         mpz_clear(enc->elems[i]);
     }
-    free(enc->elems);
+}
+
+static mmap_enc
+dummy_enc_new(const mmap_pp pp)
+{
+    dummy_enc_t *enc;
+
+    enc = malloc(dummy_enc_size(pp));
+    dummy_enc_init(enc, pp);
+    return enc;
+}
+
+static void
+dummy_enc_free(const mmap_enc enc)
+{
+    dummy_enc_clear(enc);
     free(enc);
 }
 
+/* Without the public parameters we cannot tell whether the moduli are word
+ * sized, so encodings read from disk always use mpz_t slots. */
 static mmap_enc
 dummy_enc_fread(FILE *const fp)
 {
     dummy_enc_t *enc;
+    unsigned int degree;
+    size_t nslots;
 
-    enc = calloc(1, sizeof enc[0]);
-    (void) fread(&enc->degree, sizeof enc->degree, 1, fp);
-    (void) fread(&enc->nslots, sizeof enc->nslots, 1, fp);
-    enc->elems = calloc(enc->nslots, sizeof enc->elems[0]);
+    (void) fread(&degree, sizeof degree, 1, fp);
+    (void) fread(&nslots, sizeof nslots, 1, fp);
+    enc = malloc(dummy_enc_size_n(nslots, false));
+    dummy_enc_init_n(enc, nslots, false);
+    enc->degree = degree;
     for (size_t i = 0; i < enc->nslots; ++i) {
-        mpz_init(enc->elems[i]);
         mpz_inp_raw(enc->elems[i], fp);
     }
+    enc->bits = dummy_slots_bits((const mpz_t *) enc->elems, enc->nslots);
     return enc;
 }
 
+/* The value serialized for slot i: the slot itself if it is stored as an
+ * mpz_t that needs no reduction, and otherwise its residue, computed in x */
+static mpz_srcptr
+dummy_slot_out(mpz_t x, const dummy_enc_t *enc, size_t i)
+{
+    if (!enc->fast && !enc->lazy)
+        return enc->elems[i];
+    dummy_slot_get_reduced(x, enc, i);
+    return x;
+}
+
 static int
 dummy_enc_fwrite(const mmap_enc enc_, FILE *const fp)
 {
     const dummy_enc_t *const enc = enc_;
+    mpz_t x;
+
     (void) fwrite(&enc->degree, sizeof enc->degree, 1, fp);
     (void) fwrite(&enc->nslots, sizeof enc->nslots, 1, fp);
+    mpz_init(x);
     for (size_t i = 0; i < enc->nslots; ++i)
-        mpz_out_raw(fp, enc->elems[i]);
+        mpz_out_raw(fp, dummy_slot_out(x, enc, i));
+    mpz_clear(x);
     return MMAP_OK;
 }
 
+static size_t
+dummy_enc_serialized_size(const mmap_enc enc_)
+{
+    const dummy_enc_t *const enc = enc_;
+    size_t size = sizeof enc->degree + sizeof enc->nslots;
+    mpz_t x;
+
+    mpz_init(x);
+    for (size_t i = 0; i < enc->nslots; ++i)
+        size += dummy_raw_size(dummy_slot_out(x, enc, i));
+    mpz_clear(x);
+    return size;
+}
+
+static int
+dummy_enc_to_buf(const mmap_enc enc_, void *buf, size_t size)
+{
+    const dummy_enc_t *const enc = enc_;
+    char *p = buf, *const end = p + size;
+    mpz_t x;
+    int ret = MMAP_OK;
+
+    if (size < sizeof enc->degree + sizeof enc->nslots)
+        return MMAP_ERR;
+    p = dummy_put(p, &enc->degree, sizeof enc->degree);
+    p = dummy_put(p, &enc->nslots, sizeof enc->nslots);
+    mpz_init(x);
+    for (size_t i = 0; i < enc->nslots; ++i) {
+        mpz_srcptr y = dummy_slot_out(x, enc, i);
+        if (dummy_raw_size(y) > (size_t) (end - p)) {
+            ret = MMAP_ERR;
+            break;
+        }
+        p = dummy_put_raw(p, y);
+    }
+    mpz_clear(x);
+    return ret;
+}
+
+/* Like fread, produces mpz_t slots */
+static mmap_enc
+dummy_enc_from_buf(const void *buf, size_t size)
+{
+    dummy_rbuf_t r = { buf, (const char *) buf + size };
+    dummy_enc_t *enc;
+    unsigned int degree;
+    size_t nslots;
+
+    if (!dummy_get(&r, &degree, sizeof degree)
+        || !dummy_get(&r, &nslots, sizeof nslots)
+        || nslots > (size_t) (r.end - r.p) / 4)
+        return NULL;
+    enc = malloc(dummy_enc_size_n(nslots, false));
+    dummy_enc_init_n(enc, nslots, false);
+    enc->degree = degree;
+    for (size_t i = 0; i < nslots; ++i) {
+        if (!dummy_get_raw(&r, enc->elems[i])) {
+            dummy_enc_free(enc);
+            return NULL;
+        }
+    }
+    enc->bits = dummy_slots_bits((const mpz_t *) enc->elems, enc->nslots);
+    return enc;
+}
+
 static void
 dummy_enc_set(const mmap_enc dest_, const mmap_enc src_)
 {
     dummy_enc_t *const dest = dest_;
     const dummy_enc_t *const src = src_;
+    mpz_t x;
+
     assert(dest->nslots == src->nslots);
     dest->degree = src->degree;
-    for (size_t i = 0; i < dest->nslots; ++i) {
-        mpz_set(dest->elems[i], src->elems[i]);
+    if (dest->fast && src->fast) {
+        memcpy(dest->words, src->words, dest->nslots * sizeof dest->words[0]);
+    } else if (!dest->fast) {
+        /* Copies are reduced, so that they do not refer to the parameters
+         * src was computed under */
+        for (size_t i = 0; i < dest->nslots; ++i)
+            dummy_slot_get_reduced(dest->elems[i], src, i);
+        if (src->fast)
+            dest->bits = 64;
+        else if (src->lazy)
+            dest->bits = dummy_slots_bits(src->lazy, dest->nslots);
+        else
+            dest->bits = src->bits;
+        dummy_enc_set_lazy(dest, NULL);
+    } else {
+        mpz_init(x);
+        for (size_t i = 0; i < dest->nslots; ++i) {
+            dummy_slot_get_reduced(x, src, i);
+            dummy_slot_set(dest, i, x);
+        }
+        mpz_clear(x);
+    }
+}
+
+static void
+dummy_enc_swap(mmap_enc *a_, mmap_enc *b_)
+{
+    dummy_enc_t *const a = *a_;
+    dummy_enc_t *const b = *b_;
+    const unsigned int degree = a->degree;
+    assert(a->nslots == b->nslots);
+    /* Swap contents rather than handles: either encoding may live inside a
+     * matrix allocation */
+    a->degree = b->degree;
+    b->degree = degree;
+    if (a->fast && b->fast) {
+        for (size_t i = 0; i < a->nslots; ++i) {
+            const uint64_t w = a->words[i];
+            a->words[i] = b->words[i];
+            b->words[i] = w;
+        }
+    } else if (!a->fast && !b->fast) {
+        const size_t bits = a->bits;
+        const mpz_t *const lazy = a->lazy;
+        for (size_t i = 0; i < a->nslots; ++i) {
+            mpz_swap(a->elems[i], b->elems[i]);
+        }
+        a->bits = b->bits;
+        a->lazy = b->lazy;
+        b->bits = bits;
+        b->lazy = lazy;
+    } else {
+        dummy_enc_t *const f = a->fast ? a : b;
+        dummy_enc_t *const z = a->fast ? b : a;
+        for (size_t i = 0; i < a->nslots; ++i) {
+            const uint64_t w = f->words[i];
+            if (z->lazy)
+                mpz_mod(z->elems[i], z->elems[i], z->lazy[i]);
+            f->words[i] = mpz_get_ui(z->elems[i]);
+            mpz_set_ui(z->elems[i], w);
+        }
+        z->bits = 64;
+        dummy_enc_set_lazy(z, NULL);
     }
 }
 
+typedef enum { DUMMY_ADD, DUMMY_SUB, DUMMY_MUL } dummy_op_t;
+
+/* Slow path, used when any operand holds mpz_t slots.
+ *
+ * Sums and differences of mpz_t slots are left unreduced, which saves an
+ * mpz_mod per term in the long addition chains of matrix products, as long as
+ * their bound stays within pp->lazy_bits.  Products are always reduced, since
+ * they would otherwise double in size. */
+static void
+dummy_enc_op_mpz(dummy_op_t op, dummy_enc_t *dest, const dummy_pp_t *pp,
+                 const dummy_enc_t *a, const dummy_enc_t *b)
+{
+    mpz_t x, y;
+
+    if (!dest->fast && !a->fast && !b->fast) {
+        const size_t bits = max(a->bits, b->bits);
+        if (op != DUMMY_MUL && bits + 1 <= pp->lazy_bits) {
+            for (size_t i = 0; i < pp->nslots; ++i) {
+                if (op == DUMMY_ADD)
+                    mpz_add(dest->elems[i], a->elems[i], b->elems[i]);
+                else
+                    mpz_sub(dest->elems[i], a->elems[i], b->elems[i]);
+            }
+            dest->bits = bits + 1;
+            dummy_enc_set_lazy(dest, (const mpz_t *) pp->moduli);
+            return;
+        }
+        for (size_t i = 0; i < pp->nslots; ++i) {
+            switch (op) {
+            case DUMMY_ADD:
+                mpz_add(dest->elems[i], a->elems[i], b->elems[i]);
+                break;
+            case DUMMY_SUB:
+                mpz_sub(dest->elems[i], a->elems[i], b->elems[i]);
+                break;
+            case DUMMY_MUL:
+                mpz_mul(dest->elems[i], a->elems[i], b->elems[i]);
+                break;
+            }
+            mpz_mod(dest->elems[i], dest->elems[i], pp->moduli[i]);
+        }
+        dest->bits = pp->bits;
+        dummy_enc_set_lazy(dest, NULL);
+        return;
+    }
+    mpz_inits(x, y, NULL);
+    for (size_t i = 0; i < pp->nslots; ++i) {
+        dummy_slot_get(x, a, i);
+        dummy_slot_get(y, b, i);
+        switch (op) {
+        case DUMMY_ADD:
+            mpz_add(x, x, y);
+            break;
+        case DUMMY_SUB:
+            mpz_sub(x, x, y);
+            break;
+        case DUMMY_MUL:
+            mpz_mul(x, x, y);
+            break;
+        }
+        mpz_mod(x, x, pp->moduli[i]);
+        dummy_slot_set(dest, i, x);
+    }
+    dest->bits = pp->bits;
+    dummy_enc_set_lazy(dest, NULL);
+    mpz_clears(x, y, NULL);
+}
+
+static inline bool
+dummy_all_fast(const dummy_pp_t *pp, const dummy_enc_t *dest,
+               const dummy_enc_t *a, const dummy_enc_t *b)
+{
+    return pp->slots.p && dest->fast && a->fast && b->fast;
+}
+
 static int
 dummy_enc_add(const mmap_enc dest_, const mmap_pp pp_,
               const mmap_enc a_, const mmap_enc b_)
@@ -251,10 +856,11 @@ dummy_enc_add(const mmap_enc dest_, const mmap_pp pp_,
     assert(dest->nslots == b->nslots);
 
     dest->degree = max(a->degree, b->degree);
-    for (size_t i = 0; i < pp->nslots; ++i) {
-        mpz_add(dest->elems[i], a->elems[i], b->elems[i]);
-        mpz_mod(dest->elems[i], dest->elems[i], pp->moduli[i]);
+    if (!dummy_all_fast(pp, dest, a, b)) {
+        dummy_enc_op_mpz(DUMMY_ADD, dest, pp, a, b);
+        return MMAP_OK;
     }
+    pp->slots.ops->add(dest->words, a->words, b->words, &pp->slots);
     return MMAP_OK;
 }
 
@@ -271,10 +877,11 @@ dummy_enc_sub(const mmap_enc dest_, const mmap_pp pp_,
     assert(dest->nslots == b->nslots);
 
     dest->degree = max(a->degree, b->degree);
-    for (size_t i = 0; i < pp->nslots; ++i) {
-        mpz_sub(dest->elems[i], a->elems[i], b->elems[i]);
-        mpz_mod(dest->elems[i], dest->elems[i], pp->moduli[i]);
+    if (!dummy_all_fast(pp, dest, a, b)) {
+        dummy_enc_op_mpz(DUMMY_SUB, dest, pp, a, b);
+        return MMAP_OK;
     }
+    pp->slots.ops->sub(dest->words, a->words, b->words, &pp->slots);
     return MMAP_OK;
 }
 
@@ -290,9 +897,112 @@ dummy_enc_mul(const mmap_enc dest_, const mmap_pp pp_, const mmap_enc a_, const
     assert(dest->nslots == b->nslots);
 
     dest->degree = a->degree + b->degree;
+    if (!dummy_all_fast(pp, dest, a, b)) {
+        dummy_enc_op_mpz(DUMMY_MUL, dest, pp, a, b);
+        return MMAP_OK;
+    }
+    pp->slots.ops->mul(dest->words, a->words, b->words, &pp->slots);
+    return MMAP_OK;
+}
+
+/* dest = (acc ? dest : 0) + as[0] * bs[0] + ... + as[n-1] * bs[n-1] through
+ * mpz_t arithmetic, with a single reduction per slot */
+static void
+dummy_enc_dot_mpz(dummy_enc_t *dest, const dummy_pp_t *pp,
+                  const dummy_enc_t *const *as, const dummy_enc_t *const *bs,
+                  size_t n, bool acc)
+{
+    mpz_t sum, x, y;
+
+    mpz_inits(sum, x, y, NULL);
     for (size_t i = 0; i < pp->nslots; ++i) {
-        mpz_mul(dest->elems[i], a->elems[i], b->elems[i]);
-        mpz_mod(dest->elems[i], dest->elems[i], pp->moduli[i]);
+        if (acc)
+            dummy_slot_get(sum, dest, i);
+        else
+            mpz_set_ui(sum, 0);
+        for (size_t k = 0; k < n; ++k) {
+            if (!as[k]->fast && !bs[k]->fast) {
+                mpz_addmul(sum, as[k]->elems[i], bs[k]->elems[i]);
+            } else {
+                dummy_slot_get(x, as[k], i);
+                dummy_slot_get(y, bs[k], i);
+                mpz_addmul(sum, x, y);
+            }
+        }
+        mpz_mod(sum, sum, pp->moduli[i]);
+        dummy_slot_set(dest, i, sum);
+    }
+    dest->bits = pp->bits;
+    dummy_enc_set_lazy(dest, NULL);
+    mpz_clears(sum, x, y, NULL);
+}
+
+static int
+dummy_enc_fma(const mmap_enc dest_, const mmap_pp pp_, const mmap_enc a_,
+              const mmap_enc b_)
+{
+    dummy_enc_t *const dest = dest_;
+    const dummy_pp_t *const pp = pp_;
+    const dummy_enc_t *const a = a_;
+    const dummy_enc_t *const b = b_;
+    const dummy_slots_t *const s = &pp->slots;
+
+    assert(dest->nslots == a->nslots);
+    assert(dest->nslots == b->nslots);
+
+    dest->degree = max(dest->degree, a->degree + b->degree);
+    if (!dummy_all_fast(pp, dest, a, b)) {
+        dummy_enc_dot_mpz(dest, pp, &a, &b, 1, true);
+        return MMAP_OK;
+    }
+    for (size_t i = 0; i < pp->nslots; ++i) {
+        const uint64_t p = s->p[i], pinv = s->pinv[i];
+        const uint64_t ab = mont_redc((dummy_u128) a->words[i] * b->words[i],
+                                      p, pinv);
+        const uint64_t x = mont_redc((dummy_u128) ab * s->r2[i], p, pinv);
+        const uint64_t sum = dest->words[i] + x;
+        dest->words[i] = (sum < x || sum >= p) ? sum - p : sum;
+    }
+    return MMAP_OK;
+}
+
+/* On word-sized slots, each term is reduced only once, to ab/R < p, and the
+ * terms are summed without reduction: up to 2^64 of them stay below
+ * p * 2^64, which one more REDC takes to sum(ab)/R^2.  Multiplying by R^3
+ * and reducing again leaves sum(ab). */
+static int
+dummy_enc_dot(const mmap_enc dest_, const mmap_pp pp_, const mmap_enc *as_,
+              const mmap_enc *bs_, size_t n)
+{
+    dummy_enc_t *const dest = dest_;
+    const dummy_pp_t *const pp = pp_;
+    const dummy_enc_t *const *const as = (const dummy_enc_t *const *) as_;
+    const dummy_enc_t *const *const bs = (const dummy_enc_t *const *) bs_;
+    const dummy_slots_t *const s = &pp->slots;
+    unsigned int degree = 0;
+    bool fast = s->p && dest->fast;
+
+    for (size_t k = 0; k < n; ++k) {
+        assert(as[k]->nslots == dest->nslots);
+        assert(bs[k]->nslots == dest->nslots);
+        degree = max(degree, as[k]->degree + bs[k]->degree);
+        fast = fast && as[k]->fast && bs[k]->fast;
+    }
+    dest->degree = degree;
+    if (!fast) {
+        dummy_enc_dot_mpz(dest, pp, as, bs, n, false);
+        return MMAP_OK;
+    }
+    for (size_t i = 0; i < pp->nslots; ++i) {
+        const uint64_t p = s->p[i], pinv = s->pinv[i];
+        dummy_u128 acc = 0;
+        uint64_t y;
+
+        for (size_t k = 0; k < n; ++k)
+            acc += mont_redc((dummy_u128) as[k]->words[i] * bs[k]->words[i],
+                             p, pinv);
+        y = mont_redc(acc, p, pinv);
+        dest->words[i] = mont_redc((dummy_u128) y * s->r3[i], p, pinv);
     }
     return MMAP_OK;
 }
@@ -307,21 +1017,62 @@ dummy_enc_is_zero(const mmap_enc enc_, const mmap_pp pp_)
         if (pp->verbose)
             fprintf(stderr, "warning: degrees not equal (%u != %u)\n", enc->degree, pp->kappa);
     }
-    for (size_t i = 0; i < pp->nslots; ++i)
-        ret &= (mpz_cmp_ui(enc->elems[i], 0) == 0);
+    if (enc->fast && pp->slots.p) {
+        ret = pp->slots.ops->is_zero(enc->words, pp->nslots);
+    } else if (enc->fast) {
+        for (size_t i = 0; i < pp->nslots; ++i)
+            ret &= (enc->words[i] == 0);
+    } else if (enc->lazy) {
+        for (size_t i = 0; i < pp->nslots; ++i)
+            ret &= mpz_divisible_p(enc->elems[i], enc->lazy[i]) != 0;
+    } else {
+        for (size_t i = 0; i < pp->nslots; ++i)
+            ret &= (mpz_cmp_ui(enc->elems[i], 0) == 0);
+    }
     return ret;
 }
 
+static void
+dummy_enc_is_zero_batch(bool *results, const mmap_enc *encs, size_t count,
+                        const mmap_pp pp)
+{
+#pragma omp parallel for schedule(static)
+    for (size_t k = 0; k < count; ++k)
+        results[k] = dummy_enc_is_zero(encs[k], pp);
+}
+
 static int
 dummy_encode(const mmap_enc enc_, const mmap_sk sk_, size_t n,
              const mpz_t *plaintext, const int *pows, size_t level)
 {
-    (void) sk_; (void) pows; (void) level;
+    (void) pows; (void) level;
     dummy_enc_t *const enc = enc_;
+    const dummy_sk_t *const sk = sk_;
     enc->degree = 1;
     for (size_t i = 0; i < n; ++i) {
-        mpz_set(enc->elems[i], plaintext[i]);
+        if (enc->fast)
+            enc->words[i] = mpz_fdiv_ui(plaintext[i], sk->pp.slots.p[i]);
+        else
+            mpz_set(enc->elems[i], plaintext[i]);
     }
+    if (!enc->fast) {
+        enc->bits = dummy_slots_bits(plaintext, n);
+        dummy_enc_set_lazy(enc, NULL);
+    }
+    return MMAP_OK;
+}
+
+static int
+dummy_encode_batch(mmap_enc *const encs, const mmap_sk sk_, size_t count,
+                   size_t n, const mpz_t *const *plaintexts,
+                   const int *const *pows, size_t level)
+{
+    const dummy_sk_t *const sk = sk_;
+    const int nthreads = sk->ncores ? (int) sk->ncores : omp_get_max_threads();
+
+#pragma omp parallel for num_threads(nthreads) schedule(static)
+    for (size_t k = 0; k < count; ++k)
+        (void) dummy_encode(encs[k], sk_, n, plaintexts[k], pows[k], level);
     return MMAP_OK;
 }
 
@@ -330,7 +1081,17 @@ dummy_print(const mmap_enc enc_)
 {
     const dummy_enc_t *const enc = enc_;
     for (size_t i = 0; i < enc->nslots; ++i) {
-        gmp_printf("%Zd ", enc->elems[i]);
+        if (enc->fast) {
+            printf("%" PRIu64 " ", enc->words[i]);
+        } else if (enc->lazy) {
+            mpz_t x;
+            mpz_init(x);
+            dummy_slot_get_reduced(x, enc, i);
+            gmp_printf("%Zd ", x);
+            mpz_clear(x);
+        } else {
+            gmp_printf("%Zd ", enc->elems[i]);
+        }
     }
     printf("\n");
 }
@@ -342,23 +1103,139 @@ dummy_degree(const mmap_enc enc_)
     return enc->degree;
 }
 
+/* A payload is the degree followed by every slot reduced and zero-padded to
+ * the limbs of the largest modulus, so that views can point their slots
+ * straight at it: as words when the moduli are word sized, and otherwise as
+ * read-only mpz_t's. */
+typedef struct {
+    uint64_t degree;
+    mp_limb_t limbs[];
+} dummy_payload_t;
+
+static inline size_t
+dummy_payload_limbs(const dummy_pp_t *pp)
+{
+    return (pp->bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+}
+
+static size_t
+dummy_enc_payload_size(const mmap_pp pp_)
+{
+    const dummy_pp_t *const pp = pp_;
+    return sizeof(dummy_payload_t)
+        + pp->nslots * dummy_payload_limbs(pp) * sizeof(mp_limb_t);
+}
+
+static void
+dummy_enc_payload_write(void *buf, const mmap_enc enc_, const mmap_pp pp_)
+{
+    const dummy_enc_t *const enc = enc_;
+    const dummy_pp_t *const pp = pp_;
+    const size_t nlimbs = dummy_payload_limbs(pp);
+    dummy_payload_t *const payload = buf;
+    mpz_t x;
+
+    assert(enc->nslots == pp->nslots);
+    payload->degree = enc->degree;
+    mpz_init(x);
+    for (size_t i = 0; i < pp->nslots; ++i) {
+        mp_limb_t *const limbs = payload->limbs + i * nlimbs;
+        dummy_slot_get(x, enc, i);
+        mpz_mod(x, x, pp->moduli[i]);
+        memset(limbs, 0, nlimbs * sizeof limbs[0]);
+        memcpy(limbs, mpz_limbs_read(x), mpz_size(x) * sizeof limbs[0]);
+    }
+    mpz_clear(x);
+}
+
+/* Slot operations index both operands up to nslots.  Decoded encodings hold
+ * mpz_t slots, which go into word slots only if they are residues of the
+ * word-sized moduli, and otherwise must leave the headroom lazy sums rely
+ * on. */
+static bool
+dummy_enc_compatible(const mmap_enc enc_, const mmap_pp pp_)
+{
+    const dummy_enc_t *const enc = enc_;
+    const dummy_pp_t *const pp = pp_;
+    const bool fast = pp->slots.p != NULL;
+
+    if (enc->nslots != pp->nslots)
+        return false;
+    if (enc->fast)
+        return fast;
+    if (!fast)
+        return enc->lazy == NULL && enc->bits <= pp->lazy_bits;
+    for (size_t i = 0; i < enc->nslots; ++i) {
+        if (mpz_sgn(enc->elems[i]) < 0
+            || mpz_cmp(enc->elems[i], pp->moduli[i]) >= 0)
+            return false;
+    }
+    return true;
+}
+
+static mmap_enc
+dummy_enc_payload_view(const mmap_pp pp_, const void *buf)
+{
+    const dummy_pp_t *const pp = pp_;
+    const size_t nlimbs = dummy_payload_limbs(pp);
+    const dummy_payload_t *const payload = buf;
+    const bool fast = pp->slots.p != NULL;
+    dummy_enc_t *enc;
+
+    enc = malloc(sizeof enc[0] + (fast ? 0 : pp->nslots * sizeof(mpz_t)));
+    enc->nslots = pp->nslots;
+    enc->degree = payload->degree;
+    enc->fast = fast;
+    enc->bits = pp->bits;
+    enc->lazy = NULL;
+    enc->borrowed = true;
+    if (fast) {
+        _Static_assert(sizeof(mp_limb_t) == sizeof(uint64_t),
+                       "word slots are limbs");
+        enc->elems = NULL;
+        enc->words = (uint64_t *) payload->limbs;
+    } else {
+        enc->elems = (mpz_t *) (enc + 1);
+        enc->words = NULL;
+        for (size_t i = 0; i < pp->nslots; ++i)
+            mpz_roinit_n(enc->elems[i], payload->limbs + i * nlimbs, nlimbs);
+    }
+    return enc;
+}
+
 static const mmap_enc_vtable dummy_enc_vtable =
 { .new = dummy_enc_new,
   .free = dummy_enc_free,
   .fread = dummy_enc_fread,
   .fwrite = dummy_enc_fwrite,
+  .serialized_size = dummy_enc_serialized_size,
+  .to_buf = dummy_enc_to_buf,
+  .from_buf = dummy_enc_from_buf,
+  .compatible = dummy_enc_compatible,
   .set = dummy_enc_set,
+  .swap = dummy_enc_swap,
   .add = dummy_enc_add,
   .sub = dummy_enc_sub,
   .mul = dummy_enc_mul,
+  .fma = dummy_enc_fma,
+  .dot = dummy_enc_dot,
   .is_zero = dummy_enc_is_zero,
+  .is_zero_batch = dummy_enc_is_zero_batch,
   .encode = dummy_encode,
+  .encode_batch = dummy_encode_batch,
   .degree = dummy_degree,
   .print = dummy_print,
+  .size = dummy_enc_size,
+  .init = dummy_enc_init,
+  .clear = dummy_enc_clear,
+  .payload_size = dummy_enc_payload_size,
+  .payload_write = dummy_enc_payload_write,
+  .payload_view = dummy_enc_payload_view,
 };
 
 const mmap_vtable dummy_vtable =
 { .pp  = &dummy_pp_vtable,
   .sk  = &dummy_sk_vtable,
   .enc = &dummy_enc_vtable,
+  .name = "dummy",
 };
@@ -0,0 +1,355 @@
+#include "mmap_dummy_slots.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#  define DUMMY_SLOTS_X86 1
+#  include <immintrin.h>
+#endif
+
+static const dummy_slots_ops *dummy_slots_ops_select(void);
+
+void
+dummy_slots_init(dummy_slots_t *s, mpz_t *moduli, size_t n)
+{
+    bool narrow = true;
+    mpz_t r2;
+
+    memset(s, 0, sizeof s[0]);
+    s->n = n;
+    if (sizeof(unsigned long) < sizeof(uint64_t))
+        return;
+    for (size_t i = 0; i < n; ++i) {
+        if (mpz_sizeinbase(moduli[i], 2) > 64 || mpz_even_p(moduli[i]))
+            return;
+        if (mpz_sizeinbase(moduli[i], 2) > 32)
+            narrow = false;
+    }
+    s->p = calloc((narrow ? 6 : 4) * n, sizeof s->p[0]);
+    s->pinv = s->p + n;
+    s->r2 = s->pinv + n;
+    s->r3 = s->r2 + n;
+    if (narrow) {
+        s->pinv32 = s->r3 + n;
+        s->r2_32 = s->pinv32 + n;
+    }
+    s->ops = dummy_slots_ops_select();
+    mpz_init(r2);
+    for (size_t i = 0; i < n; ++i) {
+        const uint64_t p = mpz_get_ui(moduli[i]);
+        uint64_t inv = p;       /* correct to 3 bits for odd p */
+        for (int j = 0; j < 5; ++j)
+            inv *= 2 - p * inv;
+        s->p[i] = p;
+        s->pinv[i] = inv;
+        mpz_set_ui(r2, 0);
+        mpz_setbit(r2, 128);
+        s->r2[i] = mpz_fdiv_ui(r2, p);
+        mpz_set_ui(r2, 0);
+        mpz_setbit(r2, 192);
+        s->r3[i] = mpz_fdiv_ui(r2, p);
+        if (narrow) {
+            s->pinv32[i] = (uint32_t) inv;
+            mpz_set_ui(r2, 0);
+            mpz_setbit(r2, 64);
+            s->r2_32[i] = mpz_fdiv_ui(r2, p);
+        }
+    }
+    mpz_clear(r2);
+}
+
+void
+dummy_slots_clear(dummy_slots_t *s)
+{
+    free(s->p);
+    memset(s, 0, sizeof s[0]);
+}
+
+/* Scalar kernels.  These also finish off the slots left over after the
+ * vector loops, starting at slot i. */
+
+static void
+scalar_add_from(uint64_t *r, const uint64_t *a, const uint64_t *b,
+                const dummy_slots_t *s, size_t i)
+{
+    for (; i < s->n; ++i) {
+        const uint64_t x = a[i] + b[i];
+        r[i] = (x < a[i] || x >= s->p[i]) ? x - s->p[i] : x;
+    }
+}
+
+static void
+scalar_sub_from(uint64_t *r, const uint64_t *a, const uint64_t *b,
+                const dummy_slots_t *s, size_t i)
+{
+    for (; i < s->n; ++i)
+        r[i] = a[i] >= b[i] ? a[i] - b[i] : a[i] - b[i] + s->p[i];
+}
+
+/* Words hold ordinary residues, so a product takes two reductions: the
+ * first leaves ab/R, the second multiplies by R^2 and divides by R again. */
+static void
+scalar_mul_from(uint64_t *r, const uint64_t *a, const uint64_t *b,
+                const dummy_slots_t *s, size_t i)
+{
+    for (; i < s->n; ++i) {
+        const uint64_t ab = mont_redc((dummy_u128) a[i] * b[i],
+                                      s->p[i], s->pinv[i]);
+        r[i] = mont_redc((dummy_u128) ab * s->r2[i], s->p[i], s->pinv[i]);
+    }
+}
+
+static bool
+scalar_is_zero_from(const uint64_t *a, size_t n, size_t i)
+{
+    uint64_t acc = 0;
+    for (; i < n; ++i)
+        acc |= a[i];
+    return acc == 0;
+}
+
+static void
+scalar_add(uint64_t *r, const uint64_t *a, const uint64_t *b,
+           const dummy_slots_t *s)
+{
+    scalar_add_from(r, a, b, s, 0);
+}
+
+static void
+scalar_sub(uint64_t *r, const uint64_t *a, const uint64_t *b,
+           const dummy_slots_t *s)
+{
+    scalar_sub_from(r, a, b, s, 0);
+}
+
+static void
+scalar_mul(uint64_t *r, const uint64_t *a, const uint64_t *b,
+           const dummy_slots_t *s)
+{
+    scalar_mul_from(r, a, b, s, 0);
+}
+
+static bool
+scalar_is_zero(const uint64_t *a, size_t n)
+{
+    return scalar_is_zero_from(a, n, 0);
+}
+
+static const dummy_slots_ops scalar_ops = {
+    .name = "scalar",
+    .add = scalar_add,
+    .sub = scalar_sub,
+    .mul = scalar_mul,
+    .is_zero = scalar_is_zero,
+};
+
+#ifdef DUMMY_SLOTS_X86
+
+/* AVX2 kernels, four slots at a time.  AVX2 has no unsigned 64-bit compare,
+ * so operands are offset by 2^63 and compared as signed.  There is no
+ * 64x64->128 multiply either: products are vectorized only when every
+ * modulus is below 2^32, using 32-bit Montgomery steps, and fall back to the
+ * scalar kernel otherwise. */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i
+avx2_cmpgt_epu64(__m256i a, __m256i b)
+{
+    const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+    return _mm256_cmpgt_epi64(_mm256_xor_si256(a, bias),
+                              _mm256_xor_si256(b, bias));
+}
+
+/* t * 2^-32 mod p, for t < p * 2^32 and p < 2^32 */
+AVX2 static inline __m256i
+avx2_redc32(__m256i t, __m256i p, __m256i pinv)
+{
+    const __m256i m = _mm256_mul_epu32(t, pinv);
+    const __m256i t_hi = _mm256_srli_epi64(t, 32);
+    const __m256i mp_hi = _mm256_srli_epi64(_mm256_mul_epu32(m, p), 32);
+    const __m256i borrow = _mm256_cmpgt_epi64(mp_hi, t_hi);
+    return _mm256_add_epi64(_mm256_sub_epi64(t_hi, mp_hi),
+                            _mm256_and_si256(borrow, p));
+}
+
+AVX2 static void
+avx2_add(uint64_t *r, const uint64_t *a, const uint64_t *b,
+         const dummy_slots_t *s)
+{
+    size_t i = 0;
+    for (; i + 4 <= s->n; i += 4) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+        const __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+        const __m256i p = _mm256_loadu_si256((const __m256i *) (s->p + i));
+        const __m256i sum = _mm256_add_epi64(x, y);
+        /* keep the sum iff it did not wrap and is below p */
+        const __m256i keep = _mm256_andnot_si256(avx2_cmpgt_epu64(x, sum),
+                                                 avx2_cmpgt_epu64(p, sum));
+        _mm256_storeu_si256((__m256i *) (r + i),
+                            _mm256_sub_epi64(sum, _mm256_andnot_si256(keep, p)));
+    }
+    scalar_add_from(r, a, b, s, i);
+}
+
+AVX2 static void
+avx2_sub(uint64_t *r, const uint64_t *a, const uint64_t *b,
+         const dummy_slots_t *s)
+{
+    size_t i = 0;
+    for (; i + 4 <= s->n; i += 4) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+        const __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+        const __m256i p = _mm256_loadu_si256((const __m256i *) (s->p + i));
+        const __m256i borrow = avx2_cmpgt_epu64(y, x);
+        _mm256_storeu_si256((__m256i *) (r + i),
+                            _mm256_add_epi64(_mm256_sub_epi64(x, y),
+                                             _mm256_and_si256(borrow, p)));
+    }
+    scalar_sub_from(r, a, b, s, i);
+}
+
+AVX2 static void
+avx2_mul(uint64_t *r, const uint64_t *a, const uint64_t *b,
+         const dummy_slots_t *s)
+{
+    size_t i = 0;
+    if (s->pinv32) {
+        for (; i + 4 <= s->n; i += 4) {
+            const __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+            const __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+            const __m256i p = _mm256_loadu_si256((const __m256i *) (s->p + i));
+            const __m256i pinv = _mm256_loadu_si256((const __m256i *) (s->pinv32 + i));
+            const __m256i r2 = _mm256_loadu_si256((const __m256i *) (s->r2_32 + i));
+            const __m256i xy = avx2_redc32(_mm256_mul_epu32(x, y), p, pinv);
+            _mm256_storeu_si256((__m256i *) (r + i),
+                                avx2_redc32(_mm256_mul_epu32(xy, r2), p, pinv));
+        }
+    }
+    scalar_mul_from(r, a, b, s, i);
+}
+
+AVX2 static bool
+avx2_is_zero(const uint64_t *a, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *) (a + i)));
+    return _mm256_testz_si256(acc, acc) && scalar_is_zero_from(a, n, i);
+}
+
+static const dummy_slots_ops avx2_ops = {
+    .name = "avx2",
+    .add = avx2_add,
+    .sub = avx2_sub,
+    .mul = avx2_mul,
+    .is_zero = avx2_is_zero,
+};
+
+/* AVX-512 kernels, eight slots at a time, using mask registers for the
+ * conditional corrections. */
+
+#define AVX512 __attribute__((target("avx512f")))
+
+AVX512 static inline __m512i
+avx512_redc32(__m512i t, __m512i p, __m512i pinv)
+{
+    const __m512i m = _mm512_mul_epu32(t, pinv);
+    const __m512i t_hi = _mm512_srli_epi64(t, 32);
+    const __m512i mp_hi = _mm512_srli_epi64(_mm512_mul_epu32(m, p), 32);
+    const __m512i d = _mm512_sub_epi64(t_hi, mp_hi);
+    return _mm512_mask_add_epi64(d, _mm512_cmplt_epu64_mask(t_hi, mp_hi), d, p);
+}
+
+AVX512 static void
+avx512_add(uint64_t *r, const uint64_t *a, const uint64_t *b,
+           const dummy_slots_t *s)
+{
+    size_t i = 0;
+    for (; i + 8 <= s->n; i += 8) {
+        const __m512i x = _mm512_loadu_si512(a + i);
+        const __m512i y = _mm512_loadu_si512(b + i);
+        const __m512i p = _mm512_loadu_si512(s->p + i);
+        const __m512i sum = _mm512_add_epi64(x, y);
+        const __mmask8 fix = _mm512_cmplt_epu64_mask(sum, x)
+            | _mm512_cmpge_epu64_mask(sum, p);
+        _mm512_storeu_si512(r + i, _mm512_mask_sub_epi64(sum, fix, sum, p));
+    }
+    scalar_add_from(r, a, b, s, i);
+}
+
+AVX512 static void
+avx512_sub(uint64_t *r, const uint64_t *a, const uint64_t *b,
+           const dummy_slots_t *s)
+{
+    size_t i = 0;
+    for (; i + 8 <= s->n; i += 8) {
+        const __m512i x = _mm512_loadu_si512(a + i);
+        const __m512i y = _mm512_loadu_si512(b + i);
+        const __m512i p = _mm512_loadu_si512(s->p + i);
+        const __m512i d = _mm512_sub_epi64(x, y);
+        _mm512_storeu_si512(r + i, _mm512_mask_add_epi64(
+                                d, _mm512_cmplt_epu64_mask(x, y), d, p));
+    }
+    scalar_sub_from(r, a, b, s, i);
+}
+
+AVX512 static void
+avx512_mul(uint64_t *r, const uint64_t *a, const uint64_t *b,
+           const dummy_slots_t *s)
+{
+    size_t i = 0;
+    if (s->pinv32) {
+        for (; i + 8 <= s->n; i += 8) {
+            const __m512i x = _mm512_loadu_si512(a + i);
+            const __m512i y = _mm512_loadu_si512(b + i);
+            const __m512i p = _mm512_loadu_si512(s->p + i);
+            const __m512i pinv = _mm512_loadu_si512(s->pinv32 + i);
+            const __m512i r2 = _mm512_loadu_si512(s->r2_32 + i);
+            const __m512i xy = avx512_redc32(_mm512_mul_epu32(x, y), p, pinv);
+            _mm512_storeu_si512(r + i,
+                                avx512_redc32(_mm512_mul_epu32(xy, r2), p, pinv));
+        }
+    }
+    scalar_mul_from(r, a, b, s, i);
+}
+
+AVX512 static bool
+avx512_is_zero(const uint64_t *a, size_t n)
+{
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        acc = _mm512_or_si512(acc, _mm512_loadu_si512(a + i));
+    return _mm512_test_epi64_mask(acc, acc) == 0
+        && scalar_is_zero_from(a, n, i);
+}
+
+static const dummy_slots_ops avx512_ops = {
+    .name = "avx512",
+    .add = avx512_add,
+    .sub = avx512_sub,
+    .mul = avx512_mul,
+    .is_zero = avx512_is_zero,
+};
+
+#endif
+
+static const dummy_slots_ops *
+dummy_slots_ops_select(void)
+{
+#ifdef DUMMY_SLOTS_X86
+    const char *cap = getenv("MMAP_DUMMY_SIMD");
+
+    if (cap && strcmp(cap, "scalar") == 0)
+        return &scalar_ops;
+    __builtin_cpu_init();
+    if (!(cap && strcmp(cap, "avx2") == 0) && __builtin_cpu_supports("avx512f"))
+        return &avx512_ops;
+    if (__builtin_cpu_supports("avx2"))
+        return &avx2_ops;
+#endif
+    return &scalar_ops;
+}
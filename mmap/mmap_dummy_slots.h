@@ -0,0 +1,61 @@
+#ifndef _LIBMMAP_MMAP_DUMMY_SLOTS_H
+#define _LIBMMAP_MMAP_DUMMY_SLOTS_H
+
+/* Word-sized slot arithmetic for the dummy backend.  Not installed. */
+
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+__extension__ typedef unsigned __int128 dummy_u128;
+
+struct dummy_slots_ops;
+
+/* Per-slot constants, kept as parallel arrays so that the vector kernels
+ * load one register's worth of slots from each.  All arrays share the
+ * allocation pointed to by p, which is NULL when some modulus is even or
+ * does not fit in a word. */
+typedef struct {
+    size_t n;
+    uint64_t *p;                /* moduli */
+    uint64_t *pinv;             /* p^{-1} mod 2^64 */
+    uint64_t *r2;               /* 2^128 mod p */
+    uint64_t *r3;               /* 2^192 mod p */
+    /* When every modulus is below 2^32, products are reduced with 32-bit
+     * Montgomery steps, which vectorize; otherwise these are NULL. */
+    uint64_t *pinv32;           /* p^{-1} mod 2^32 */
+    uint64_t *r2_32;            /* 2^64 mod p */
+    const struct dummy_slots_ops *ops;
+} dummy_slots_t;
+
+/* Slot kernels.  Inputs and outputs are reduced residues; r may alias a or
+ * b. */
+typedef struct dummy_slots_ops {
+    const char *name;
+    void (*const add)(uint64_t *r, const uint64_t *a, const uint64_t *b,
+                      const dummy_slots_t *s);
+    void (*const sub)(uint64_t *r, const uint64_t *a, const uint64_t *b,
+                      const dummy_slots_t *s);
+    void (*const mul)(uint64_t *r, const uint64_t *a, const uint64_t *b,
+                      const dummy_slots_t *s);
+    bool (*const is_zero)(const uint64_t *a, size_t n);
+} dummy_slots_ops;
+
+/* Computes the constants and picks the widest kernels the CPU supports.
+ * Setting MMAP_DUMMY_SIMD to "scalar" or "avx2" caps the choice, which is
+ * how the tests cover every implementation on one machine. */
+void dummy_slots_init(dummy_slots_t *s, mpz_t *moduli, size_t n);
+void dummy_slots_clear(dummy_slots_t *s);
+
+/* t * 2^-64 mod p, for t < p * 2^64 */
+static inline uint64_t
+mont_redc(dummy_u128 t, uint64_t p, uint64_t pinv)
+{
+    const uint64_t m = (uint64_t) t * pinv;
+    const uint64_t mp_hi = (uint64_t) (((dummy_u128) m * p) >> 64);
+    const uint64_t t_hi = (uint64_t) (t >> 64);
+    return t_hi >= mp_hi ? t_hi - mp_hi : t_hi - mp_hi + p;
+}
+
+#endif
@@ -1,19 +1,42 @@
 #include "mmap.h"
 #include <assert.h>
+#include <omp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
 
 void
 mmap_enc_mat_init(const_mmap_vtable mmap, const mmap_pp params,
                   mmap_enc_mat_t m, int nrows, int ncols)
 {
+    const size_t n = (size_t) nrows * ncols;
+    const size_t align = _Alignof(max_align_t);
+    size_t hdr, total, stride = 0;
+    char *block;
+
     m->nrows = nrows;
     m->ncols = ncols;
-    m->m = malloc(nrows * sizeof(mmap_enc *));
-    assert(m->m);
-    for(int i = 0; i < m->nrows; i++) {
-        m->m[i] = malloc(m->ncols * sizeof(mmap_enc));
-        assert(m->m[i]);
-        for(int j = 0; j < m->ncols; j++) {
-            m->m[i][j] = mmap->enc->new(params);
+    m->inplace = mmap->enc->size && mmap->enc->init && mmap->enc->clear;
+
+    hdr = ALIGN_UP(nrows * sizeof(mmap_enc *) + n * sizeof(mmap_enc), align);
+    if (m->inplace)
+        stride = ALIGN_UP(mmap->enc->size(params), align);
+    total = hdr + n * stride;
+    block = malloc(total ? total : 1);
+    assert(block);
+    m->m = (mmap_enc **) block;
+    m->data = (mmap_enc *) (block + nrows * sizeof(mmap_enc *));
+    for (int i = 0; i < m->nrows; i++)
+        m->m[i] = m->data + (size_t) i * ncols;
+    for (size_t i = 0; i < n; i++) {
+        if (m->inplace) {
+            m->data[i] = block + hdr + i * stride;
+            mmap->enc->init(m->data[i], params);
+        } else {
+            m->data[i] = mmap->enc->new(params);
         }
     }
 }
@@ -21,82 +44,841 @@ mmap_enc_mat_init(const_mmap_vtable mmap, const mmap_pp params,
 void
 mmap_enc_mat_clear(const_mmap_vtable mmap, mmap_enc_mat_t m)
 {
-    for(int i = 0; i < m->nrows; i++) {
-        for(int j = 0; j < m->ncols; j++) {
-            mmap->enc->free(m->m[i][j]);
-        }
-        free(m->m[i]);
+    const size_t n = (size_t) m->nrows * m->ncols;
+    for (size_t i = 0; i < n; i++) {
+        if (m->inplace)
+            mmap->enc->clear(m->data[i]);
+        else
+            mmap->enc->free(m->data[i]);
     }
     free(m->m);
 }
 
+mmap_enc_mat_view
+mmap_enc_mat_as_view(const mmap_enc_mat_t m)
+{
+    return (mmap_enc_mat_view) {
+        .data = m->data,
+        .nrows = m->nrows,
+        .ncols = m->ncols,
+        .rstride = m->ncols,
+        .cstride = 1,
+    };
+}
+
+mmap_enc_mat_view
+mmap_enc_mat_view_block(const mmap_enc_mat_view v, int i, int j, int nrows,
+                        int ncols)
+{
+    assert(i >= 0 && nrows >= 0 && i + nrows <= v.nrows);
+    assert(j >= 0 && ncols >= 0 && j + ncols <= v.ncols);
+    return (mmap_enc_mat_view) {
+        .data = v.data + i * v.rstride + j * v.cstride,
+        .nrows = nrows,
+        .ncols = ncols,
+        .rstride = v.rstride,
+        .cstride = v.cstride,
+    };
+}
+
+mmap_enc_mat_view
+mmap_enc_mat_view_transpose(const mmap_enc_mat_view v)
+{
+    return (mmap_enc_mat_view) {
+        .data = v.data,
+        .nrows = v.ncols,
+        .ncols = v.nrows,
+        .rstride = v.cstride,
+        .cstride = v.rstride,
+    };
+}
+
+mmap_enc_mat_view
+mmap_enc_mat_block(const mmap_enc_mat_t m, int i, int j, int nrows, int ncols)
+{
+    return mmap_enc_mat_view_block(mmap_enc_mat_as_view(m), i, j, nrows, ncols);
+}
+
+mmap_enc_mat_view
+mmap_enc_mat_row(const mmap_enc_mat_t m, int i)
+{
+    return mmap_enc_mat_block(m, i, 0, 1, m->ncols);
+}
+
+mmap_enc_mat_view
+mmap_enc_mat_col(const mmap_enc_mat_t m, int j)
+{
+    return mmap_enc_mat_block(m, 0, j, m->nrows, 1);
+}
 
 void
-mmap_enc_mat_mul(const_mmap_vtable mmap, const mmap_pp params,
-                 mmap_enc_mat_t r, mmap_enc_mat_t m1, mmap_enc_mat_t m2)
+mmap_enc_mat_view_set(const_mmap_vtable mmap, mmap_enc_mat_view dest,
+                      const mmap_enc_mat_view src)
+{
+    assert(dest.nrows == src.nrows && dest.ncols == src.ncols);
+    for (int i = 0; i < dest.nrows; i++) {
+        for (int j = 0; j < dest.ncols; j++) {
+            mmap->enc->set(mmap_enc_mat_view_get(dest, i, j),
+                           mmap_enc_mat_view_get(src, i, j));
+        }
+    }
+}
+
+void
+mmap_enc_mat_view_swap(const_mmap_vtable mmap, mmap_enc_mat_view a,
+                       mmap_enc_mat_view b)
+{
+    assert(a.nrows == b.nrows && a.ncols == b.ncols);
+    for (int i = 0; i < a.nrows; i++) {
+        for (int j = 0; j < a.ncols; j++) {
+            mmap->enc->swap(&a.data[i * a.rstride + j * a.cstride],
+                            &b.data[i * b.rstride + j * b.cstride]);
+        }
+    }
+}
+
+/* Fused operations, with fallbacks for backends that lack them */
+
+int
+mmap_enc_fma(const_mmap_vtable mmap, const mmap_pp params, mmap_enc dest,
+             const mmap_enc a, const mmap_enc b)
 {
     mmap_enc tmp;
-    mmap_enc_mat_t tmp_mat;
+    int ret;
 
+    if (mmap->enc->fma)
+        return mmap->enc->fma(dest, params, a, b);
     tmp = mmap->enc->new(params);
+    ret = mmap->enc->mul(tmp, params, a, b);
+    if (ret == MMAP_OK)
+        ret = mmap->enc->add(dest, params, dest, tmp);
+    mmap->enc->free(tmp);
+    return ret;
+}
 
-    mmap_enc_mat_init(mmap, params, tmp_mat, m1->nrows, m2->ncols);
+int
+mmap_enc_dot(const_mmap_vtable mmap, const mmap_pp params, mmap_enc dest,
+             const mmap_enc *as, const mmap_enc *bs, size_t n)
+{
+    mmap_enc acc;
+    int ret;
 
-    assert(m1->ncols == m2->nrows);
+    if (mmap->enc->dot)
+        return mmap->enc->dot(dest, params, as, bs, n);
+    assert(n > 0);
+    /* dest may be one of the inputs, so accumulate elsewhere */
+    acc = mmap->enc->new(params);
+    ret = mmap->enc->mul(acc, params, as[0], bs[0]);
+    for (size_t k = 1; k < n && ret == MMAP_OK; k++)
+        ret = mmap_enc_fma(mmap, params, acc, as[k], bs[k]);
+    if (ret == MMAP_OK)
+        mmap->enc->set(dest, acc);
+    mmap->enc->free(acc);
+    return ret;
+}
+
+/* Per-thread scratch for view_mul_entry.  Backends with dot get room to
+ * gather a row of m1 and a column of m2; backends with neither dot nor fma
+ * get an encoding to hold each product before it is added. */
+typedef struct {
+    mmap_enc *as;
+    mmap_enc *bs;
+    mmap_enc tmp;
+    bool own_tmp;
+} entry_scratch;
 
-    for(int i = 0; i < m1->nrows; i++) {
-        for(int j = 0; j < m2->ncols; j++) {
-            for(int k = 0; k < m1->ncols; k++) {
-                mmap->enc->mul(tmp, params, m1->m[i][k], m2->m[k][j]);
-                mmap->enc->add(tmp_mat->m[i][j], params, tmp_mat->m[i][j], tmp);
+static bool
+entry_scratch_needs_tmp(const_mmap_vtable mmap)
+{
+    return !mmap->enc->dot && !mmap->enc->fma;
+}
+
+/* Sets up s for inner dimensions up to k, using tmp as the scratch encoding
+ * if one is needed and tmp is not NULL */
+static void
+entry_scratch_init(const_mmap_vtable mmap, const mmap_pp params,
+                   entry_scratch *s, int k, mmap_enc tmp)
+{
+    s->as = s->bs = NULL;
+    s->tmp = NULL;
+    s->own_tmp = false;
+    if (mmap->enc->dot) {
+        s->as = malloc(2 * (size_t) (k > 0 ? k : 1) * sizeof s->as[0]);
+        s->bs = s->as + k;
+    } else if (entry_scratch_needs_tmp(mmap)) {
+        s->own_tmp = tmp == NULL;
+        s->tmp = tmp ? tmp : mmap->enc->new(params);
+    }
+}
+
+static void
+entry_scratch_clear(const_mmap_vtable mmap, entry_scratch *s)
+{
+    free(s->as);
+    if (s->own_tmp)
+        mmap->enc->free(s->tmp);
+}
+
+/* Computes one entry of r, as a single dot product if the backend has one.
+ * Otherwise the first product is written straight into the destination, so
+ * r need not be zero beforehand. */
+static inline void
+view_mul_entry(const_mmap_vtable mmap, const mmap_pp params, mmap_enc dest,
+               const mmap_enc_mat_view m1, const mmap_enc_mat_view m2,
+               int i, int j, const entry_scratch *s)
+{
+    if (mmap->enc->dot) {
+        for (int k = 0; k < m1.ncols; k++) {
+            s->as[k] = mmap_enc_mat_view_get(m1, i, k);
+            s->bs[k] = mmap_enc_mat_view_get(m2, k, j);
+        }
+        mmap->enc->dot(dest, params, s->as, s->bs, m1.ncols);
+        return;
+    }
+    for (int k = 0; k < m1.ncols; k++) {
+        if (k == 0) {
+            mmap->enc->mul(dest, params, mmap_enc_mat_view_get(m1, i, k),
+                           mmap_enc_mat_view_get(m2, k, j));
+        } else if (mmap->enc->fma) {
+            mmap->enc->fma(dest, params, mmap_enc_mat_view_get(m1, i, k),
+                           mmap_enc_mat_view_get(m2, k, j));
+        } else {
+            mmap->enc->mul(s->tmp, params, mmap_enc_mat_view_get(m1, i, k),
+                           mmap_enc_mat_view_get(m2, k, j));
+            mmap->enc->add(dest, params, dest, s->tmp);
+        }
+    }
+}
+
+/* Sets every entry of r to a fresh encoding, which is an encoding of zero;
+ * this is the product when the inner dimension is empty. */
+static void
+view_set_zero(const_mmap_vtable mmap, const mmap_pp params,
+              mmap_enc_mat_view r)
+{
+    mmap_enc zero = mmap->enc->new(params);
+
+    for (int i = 0; i < r.nrows; i++)
+        for (int j = 0; j < r.ncols; j++)
+            mmap->enc->set(mmap_enc_mat_view_get(r, i, j), zero);
+    mmap->enc->free(zero);
+}
+
+void
+mmap_enc_mat_view_mul(const_mmap_vtable mmap, const mmap_pp params,
+                      mmap_enc_mat_view r, const mmap_enc_mat_view m1,
+                      const mmap_enc_mat_view m2)
+{
+    entry_scratch s;
+
+    assert(m1.ncols == m2.nrows);
+    assert(r.nrows == m1.nrows && r.ncols == m2.ncols);
+
+    if (m1.ncols == 0) {
+        view_set_zero(mmap, params, r);
+        return;
+    }
+    entry_scratch_init(mmap, params, &s, m1.ncols, NULL);
+    for(int i = 0; i < m1.nrows; i++) {
+        for(int j = 0; j < m2.ncols; j++) {
+            view_mul_entry(mmap, params, mmap_enc_mat_view_get(r, i, j),
+                           m1, m2, i, j, &s);
+        }
+    }
+    entry_scratch_clear(mmap, &s);
+}
+
+/* Each thread sets up its scratch once and reuses it for every entry it
+ * computes, so the loop itself never allocates. */
+void
+mmap_enc_mat_view_mul_par(const_mmap_vtable mmap, const mmap_pp params,
+                          mmap_enc_mat_view r, const mmap_enc_mat_view m1,
+                          const mmap_enc_mat_view m2)
+{
+    assert(m1.ncols == m2.nrows);
+    assert(r.nrows == m1.nrows && r.ncols == m2.ncols);
+
+    if (m1.ncols == 0) {
+        view_set_zero(mmap, params, r);
+        return;
+    }
+#pragma omp parallel
+    {
+        entry_scratch s;
+
+        entry_scratch_init(mmap, params, &s, m1.ncols, NULL);
+#pragma omp for schedule(dynamic,1) collapse(2)
+        for(int i = 0; i < m1.nrows; i++) {
+            for(int j = 0; j < m2.ncols; j++) {
+                view_mul_entry(mmap, params, mmap_enc_mat_view_get(r, i, j),
+                               m1, m2, i, j, &s);
             }
         }
+        entry_scratch_clear(mmap, &s);
     }
+}
 
-    mmap_enc_mat_clear(mmap, r);
-    mmap_enc_mat_init(mmap, params, r, m1->nrows, m2->ncols);
+/* Vector-matrix products.  The output has few entries, so the inner index
+ * is also cut into slices whose partial sums are combined afterwards. */
+
+/* Grows m to hold at least n encodings, used as a flat array */
+static void
+mat_reserve(const_mmap_vtable mmap, const mmap_pp params, mmap_enc_mat_t m,
+            int n)
+{
+    if (m->nrows * m->ncols >= n)
+        return;
+    mmap_enc_mat_clear(mmap, m);
+    mmap_enc_mat_init(mmap, params, m, 1, n);
+}
+
+/* r = v * m for a 1 x k view v, using the workspace in ev */
+static void
+vec_mat_kernel(const_mmap_vtable mmap, const mmap_pp params,
+               mmap_enc_vec_eval_t ev, mmap_enc_mat_view r,
+               const mmap_enc_mat_view v, const mmap_enc_mat_view m)
+{
+    const int n = m.ncols, k = m.nrows;
+    const int nthreads = omp_get_max_threads();
+    int nslices;
+    mmap_enc *scratch, *partials;
 
-    for(int i = 0; i < r->nrows; i++) {
-        for(int j = 0; j < r->ncols; j++) {
-            mmap->enc->set(r->m[i][j], tmp_mat->m[i][j]);
+    assert(v.nrows == 1 && v.ncols == k);
+    assert(r.nrows == 1 && r.ncols == n);
+
+    if (n == 0)
+        return;
+    if (k == 0) {
+        view_set_zero(mmap, params, r);
+        return;
+    }
+    nslices = (nthreads + n - 1) / n;
+    if (nslices > k)
+        nslices = k;
+    if (nslices < 1)
+        nslices = 1;
+    if (entry_scratch_needs_tmp(mmap))
+        mat_reserve(mmap, params, ev->scratch, nthreads);
+    if (nslices > 1)
+        mat_reserve(mmap, params, ev->partials, nslices * n);
+    scratch = ev->scratch->data;
+    partials = ev->partials->data;
+
+#pragma omp parallel
+    {
+        entry_scratch es;
+
+        entry_scratch_init(mmap, params, &es, (k + nslices - 1) / nslices,
+                           entry_scratch_needs_tmp(mmap)
+                           ? scratch[omp_get_thread_num()] : NULL);
+#pragma omp for schedule(dynamic,1) collapse(2)
+        for (int s = 0; s < nslices; s++) {
+            for (int j = 0; j < n; j++) {
+                const int k0 = s * k / nslices, k1 = (s + 1) * k / nslices;
+                view_mul_entry(mmap, params,
+                               nslices == 1 ? mmap_enc_mat_view_get(r, 0, j)
+                                            : partials[s * n + j],
+                               mmap_enc_mat_view_block(v, 0, k0, 1, k1 - k0),
+                               mmap_enc_mat_view_block(m, k0, 0, k1 - k0, n),
+                               0, j, &es);
+            }
         }
+        entry_scratch_clear(mmap, &es);
     }
+    if (nslices == 1)
+        return;
 
-    mmap_enc_mat_clear(mmap, tmp_mat);
-    mmap->enc->free(tmp);
+#pragma omp parallel for schedule(static)
+    for (int j = 0; j < n; j++) {
+        mmap_enc *const rj = &r.data[j * r.cstride];
+        mmap->enc->swap(rj, &partials[j]);
+        for (int s = 1; s < nslices; s++)
+            mmap->enc->add(*rj, params, *rj, partials[s * n + j]);
+    }
+}
+
+static void
+vec_ws_init(const_mmap_vtable mmap, const mmap_pp params,
+            mmap_enc_vec_eval_t ev)
+{
+    mmap_enc_mat_init(mmap, params, ev->bufs[0], 0, 0);
+    mmap_enc_mat_init(mmap, params, ev->bufs[1], 0, 0);
+    mmap_enc_mat_init(mmap, params, ev->partials, 0, 0);
+    mmap_enc_mat_init(mmap, params, ev->scratch, 0, 0);
+    ev->cur = 0;
+    ev->width = 0;
+}
+
+static void
+vec_mat_view_mul(const_mmap_vtable mmap, const mmap_pp params,
+                 mmap_enc_mat_view r, const mmap_enc_mat_view v,
+                 const mmap_enc_mat_view m)
+{
+    mmap_enc_vec_eval_t ws;
+
+    vec_ws_init(mmap, params, ws);
+    vec_mat_kernel(mmap, params, ws, r, v, m);
+    mmap_enc_vec_eval_clear(mmap, ws);
+}
+
+/* m * v == (v^T * m^T)^T */
+static void
+mat_vec_view_mul(const_mmap_vtable mmap, const mmap_pp params,
+                 mmap_enc_mat_view r, const mmap_enc_mat_view m,
+                 const mmap_enc_mat_view v)
+{
+    vec_mat_view_mul(mmap, params, mmap_enc_mat_view_transpose(r),
+                     mmap_enc_mat_view_transpose(v),
+                     mmap_enc_mat_view_transpose(m));
+}
+
+void
+mmap_enc_vec_eval_init(const_mmap_vtable mmap, const mmap_pp params,
+                       mmap_enc_vec_eval_t ev, mmap_enc_mat_t v)
+{
+    assert(v->nrows == 1);
+    vec_ws_init(mmap, params, ev);
+    mat_reserve(mmap, params, ev->bufs[0], v->ncols);
+    ev->width = v->ncols;
+    mmap_enc_mat_view_set(mmap, mmap_enc_vec_eval_result(ev),
+                          mmap_enc_mat_as_view(v));
+}
+
+void
+mmap_enc_vec_eval_step(const_mmap_vtable mmap, const mmap_pp params,
+                       mmap_enc_vec_eval_t ev, mmap_enc_mat_t m)
+{
+    const int next = !ev->cur;
+
+    assert(ev->width == m->nrows);
+    mat_reserve(mmap, params, ev->bufs[next], m->ncols);
+    vec_mat_kernel(mmap, params, ev,
+                   mmap_enc_mat_block(ev->bufs[next], 0, 0, 1, m->ncols),
+                   mmap_enc_vec_eval_result(ev), mmap_enc_mat_as_view(m));
+    ev->cur = next;
+    ev->width = m->ncols;
+}
+
+mmap_enc_mat_view
+mmap_enc_vec_eval_result(const mmap_enc_vec_eval_t ev)
+{
+    return mmap_enc_mat_block(ev->bufs[ev->cur], 0, 0, 1, ev->width);
+}
+
+void
+mmap_enc_vec_eval_clear(const_mmap_vtable mmap, mmap_enc_vec_eval_t ev)
+{
+    mmap_enc_mat_clear(mmap, ev->bufs[0]);
+    mmap_enc_mat_clear(mmap, ev->bufs[1]);
+    mmap_enc_mat_clear(mmap, ev->partials);
+    mmap_enc_mat_clear(mmap, ev->scratch);
+}
+
+typedef void (*mat_kernel)(const_mmap_vtable, const mmap_pp, mmap_enc_mat_view,
+                           const mmap_enc_mat_view, const mmap_enc_mat_view);
+
+static void
+mat_mul(const_mmap_vtable mmap, const mmap_pp params, mmap_enc_mat_t r,
+        mmap_enc_mat_t m1, mmap_enc_mat_t m2, mat_kernel kernel)
+{
+    assert(m1->ncols == m2->nrows);
+
+    if (r->data == m1->data || r->data == m2->data) {
+        mmap_enc_mat_t tmp_mat;
+
+        mmap_enc_mat_init(mmap, params, tmp_mat, m1->nrows, m2->ncols);
+        kernel(mmap, params, mmap_enc_mat_as_view(tmp_mat),
+               mmap_enc_mat_as_view(m1), mmap_enc_mat_as_view(m2));
+        mmap_enc_mat_clear(mmap, r);
+        r[0] = tmp_mat[0];
+    } else {
+        if (r->nrows != m1->nrows || r->ncols != m2->ncols) {
+            mmap_enc_mat_clear(mmap, r);
+            mmap_enc_mat_init(mmap, params, r, m1->nrows, m2->ncols);
+        }
+        kernel(mmap, params, mmap_enc_mat_as_view(r),
+               mmap_enc_mat_as_view(m1), mmap_enc_mat_as_view(m2));
+    }
+}
+
+void
+mmap_enc_mat_mul(const_mmap_vtable mmap, const mmap_pp params,
+                 mmap_enc_mat_t r, mmap_enc_mat_t m1, mmap_enc_mat_t m2)
+{
+    mat_mul(mmap, params, r, m1, m2, mmap_enc_mat_view_mul);
 }
 
 void
 mmap_enc_mat_mul_par(const_mmap_vtable mmap, const mmap_pp params,
                      mmap_enc_mat_t r, mmap_enc_mat_t m1, mmap_enc_mat_t m2)
 {
-    mmap_enc_mat_t tmp_mat;
+    mat_kernel kernel = mmap_enc_mat_view_mul_par;
 
-    mmap_enc_mat_init(mmap, params, tmp_mat, m1->nrows, m2->ncols);
+    if (m1->nrows == 1)
+        kernel = vec_mat_view_mul;
+    else if (m2->ncols == 1)
+        kernel = mat_vec_view_mul;
+    mat_mul(mmap, params, r, m1, m2, kernel);
+}
 
-    assert(m1->ncols == m2->nrows);
+/* Threshold tables for mmap_enc_mat_mul_auto, each sorted by nthreads */
+#define MUL_AUTO_BACKENDS 8
+
+static struct {
+    pthread_mutex_t lock;
+    size_t nbackends;
+    struct {
+        const mmap_vtable *mmap;
+        size_t n;
+        mmap_mat_threshold table[MMAP_MAT_THRESHOLDS_MAX];
+    } backends[MUL_AUTO_BACKENDS];
+} mul_auto = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t
+mul_auto_min_muls(const mmap_vtable *mmap, int nthreads)
+{
+    size_t min_muls = MMAP_MAT_PAR_MIN_MULS;
+
+    pthread_mutex_lock(&mul_auto.lock);
+    for (size_t b = 0; b < mul_auto.nbackends; ++b) {
+        if (mul_auto.backends[b].mmap != mmap)
+            continue;
+        for (size_t i = 0; i < mul_auto.backends[b].n; ++i) {
+            const mmap_mat_threshold *const t = &mul_auto.backends[b].table[i];
+            if (t->nthreads <= nthreads)
+                min_muls = t->min_muls;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&mul_auto.lock);
+    return min_muls;
+}
+
+int
+mmap_enc_mat_mul_set_thresholds(const_mmap_vtable mmap,
+                                const mmap_mat_threshold *table, size_t n)
+{
+    size_t b;
+
+    if (n > MMAP_MAT_THRESHOLDS_MAX)
+        return MMAP_ERR;
+    pthread_mutex_lock(&mul_auto.lock);
+    for (b = 0; b < mul_auto.nbackends; ++b) {
+        if (mul_auto.backends[b].mmap == mmap)
+            break;
+    }
+    if (b == MUL_AUTO_BACKENDS) {
+        pthread_mutex_unlock(&mul_auto.lock);
+        return MMAP_ERR;
+    }
+    if (b == mul_auto.nbackends)
+        mul_auto.nbackends++;
+    mul_auto.backends[b].mmap = mmap;
+    mul_auto.backends[b].n = n;
+    /* Insertion sort by nthreads */
+    for (size_t i = 0; i < n; ++i) {
+        mmap_mat_threshold *const t = mul_auto.backends[b].table;
+        size_t j = i;
+        for (; j > 0 && t[j - 1].nthreads > table[i].nthreads; --j)
+            t[j] = t[j - 1];
+        t[j] = table[i];
+    }
+    pthread_mutex_unlock(&mul_auto.lock);
+    return MMAP_OK;
+}
+
+void
+mmap_enc_mat_mul_auto(const_mmap_vtable mmap, const mmap_pp params,
+                      mmap_enc_mat_t r, mmap_enc_mat_t m1, mmap_enc_mat_t m2)
+{
+    const size_t muls = (size_t) m1->nrows * m1->ncols * m2->ncols;
+    const int nthreads = omp_in_parallel() ? 1 : omp_get_max_threads();
+
+    if (nthreads > 1 && muls >= mul_auto_min_muls(mmap, nthreads))
+        mmap_enc_mat_mul_par(mmap, params, r, m1, m2);
+    else
+        mmap_enc_mat_mul(mmap, params, r, m1, m2);
+}
 
-#pragma omp parallel for schedule(dynamic,1) collapse(2)
-    for(int i = 0; i < m1->nrows; i++) {
-        for(int j = 0; j < m2->ncols; j++) {
-            for(int k = 0; k < m1->ncols; k++) {
-                mmap_enc *tmp;
-                tmp = mmap->enc->new(params);
-                mmap->enc->mul(tmp, params, m1->m[i][k], m2->m[k][j]);
-                mmap->enc->add(tmp_mat->m[i][j], params, tmp_mat->m[i][j], tmp);
-                mmap->enc->free(tmp);
+void
+mmap_enc_vec_mat_mul(const_mmap_vtable mmap, const mmap_pp params,
+                     mmap_enc_mat_t r, mmap_enc_mat_t v, mmap_enc_mat_t m)
+{
+    assert(v->nrows == 1);
+    mat_mul(mmap, params, r, v, m, vec_mat_view_mul);
+}
+
+void
+mmap_enc_mat_vec_mul(const_mmap_vtable mmap, const mmap_pp params,
+                     mmap_enc_mat_t r, mmap_enc_mat_t m, mmap_enc_mat_t v)
+{
+    assert(v->ncols == 1);
+    mat_mul(mmap, params, r, m, v, mat_vec_view_mul);
+}
+
+/* Matrix-chain products.  The multiplication order is chosen by the usual
+ * O(n^3) dynamic program over the chain dimensions, counting calls to the
+ * encoding mul.  Among orders of equal cost the most balanced split wins, so
+ * that independent sub-products can run concurrently.  Chains longer than
+ * CHAIN_DP_MAX are not planned: a chain starting (ending) with a row (column)
+ * vector is evaluated from that end, and anything else as a balanced tree. */
+
+#define CHAIN_DP_MAX 256
+
+typedef struct {
+    const mmap_vtable *mmap;
+    mmap_pp params;
+    mmap_enc_mat_t *mats;
+    int n;
+    size_t *dims;               /* n + 1 chain dimensions */
+    int *split;                 /* n x n, or NULL if not planned */
+} chain_t;
+
+static void
+chain_init(chain_t *c, const_mmap_vtable mmap, const mmap_pp params,
+           mmap_enc_mat_t *mats, int n)
+{
+    size_t *cost;
+
+    assert(n > 0);
+    c->mmap = mmap;
+    c->params = params;
+    c->mats = mats;
+    c->n = n;
+    c->dims = malloc((n + 1) * sizeof c->dims[0]);
+    for (int i = 0; i < n; i++) {
+        assert(i == 0 || mats[i - 1]->ncols == mats[i]->nrows);
+        c->dims[i] = mats[i]->nrows;
+    }
+    c->dims[n] = mats[n - 1]->ncols;
+    c->split = NULL;
+    if (n > CHAIN_DP_MAX)
+        return;
+
+    cost = calloc((size_t) n * n, sizeof cost[0]);
+    c->split = calloc((size_t) n * n, sizeof c->split[0]);
+    for (int len = 2; len <= n; len++) {
+        for (int i = 0; i + len - 1 < n; i++) {
+            const int j = i + len - 1;
+            size_t best = SIZE_MAX;
+            int best_k = i, best_skew = n;
+            for (int k = i; k < j; k++) {
+                const size_t q = cost[i * n + k] + cost[(k + 1) * n + j]
+                    + c->dims[i] * c->dims[k + 1] * c->dims[j + 1];
+                const int skew = abs((k - i) - (j - k - 1));
+                if (q < best || (q == best && skew < best_skew)) {
+                    best = q;
+                    best_k = k;
+                    best_skew = skew;
+                }
             }
+            cost[i * n + j] = best;
+            c->split[i * n + j] = best_k;
         }
     }
+    free(cost);
+}
 
-    mmap_enc_mat_clear(mmap, r);
-    mmap_enc_mat_init(mmap, params, r, m1->nrows, m2->ncols);
+static void
+chain_clear(chain_t *c)
+{
+    free(c->dims);
+    free(c->split);
+}
+
+static int
+chain_split(const chain_t *c, int i, int j)
+{
+    if (c->split)
+        return c->split[i * c->n + j];
+    else if (c->dims[0] == 1)
+        return j - 1;
+    else if (c->dims[c->n] == 1)
+        return i;
+    else
+        return (i + j) / 2;
+}
+
+static bool
+chain_is_left_deep(const chain_t *c)
+{
+    for (int j = 1; j < c->n; j++) {
+        if (chain_split(c, 0, j) != j - 1)
+            return false;
+    }
+    return true;
+}
+
+static size_t
+chain_cost(const chain_t *c, int i, int j)
+{
+    int k;
 
-    for(int i = 0; i < r->nrows; i++) {
-        for(int j = 0; j < r->ncols; j++) {
-            mmap->enc->set(r->m[i][j], tmp_mat->m[i][j]);
+    if (i == j)
+        return 0;
+    k = chain_split(c, i, j);
+    return chain_cost(c, i, k) + chain_cost(c, k + 1, j)
+        + c->dims[i] * c->dims[k + 1] * c->dims[j + 1];
+}
+
+/* r = m1 * m2 inside an enclosing parallel region, split into one task per
+ * block of output entries, each with its own scratch. */
+static void
+chain_product(const chain_t *c, mmap_enc_mat_t r, mmap_enc_mat_t m1,
+              mmap_enc_mat_t m2)
+{
+    const mmap_enc_mat_view v1 = mmap_enc_mat_as_view(m1);
+    const mmap_enc_mat_view v2 = mmap_enc_mat_as_view(m2);
+    const int ncells = r->nrows * r->ncols;
+    int nblocks = 4 * omp_get_num_threads();
+
+    if (nblocks > ncells)
+        nblocks = ncells;
+    for (int b = 0; b < nblocks; b++) {
+#pragma omp task firstprivate(b)
+        {
+            entry_scratch s;
+
+            entry_scratch_init(c->mmap, c->params, &s, v1.ncols, NULL);
+            for (int cell = b * ncells / nblocks;
+                 cell < (b + 1) * ncells / nblocks; cell++) {
+                view_mul_entry(c->mmap, c->params, r->data[cell], v1, v2,
+                               cell / r->ncols, cell % r->ncols, &s);
+            }
+            entry_scratch_clear(c->mmap, &s);
         }
     }
+#pragma omp taskwait
+}
+
+/* Returns the product of mats[i..j].  For i == j this is the input matrix
+ * itself; otherwise it is a new matrix owned by the caller. */
+static struct _mmap_enc_mat_struct *
+chain_eval(const chain_t *c, int i, int j)
+{
+    struct _mmap_enc_mat_struct *left, *right, *r;
+    int k;
+
+    if (i == j)
+        return c->mats[i];
+    k = chain_split(c, i, j);
+    /* Only fork when both sides do actual work */
+#pragma omp task shared(left) if(k > i && j > k + 1)
+    left = chain_eval(c, i, k);
+    right = chain_eval(c, k + 1, j);
+#pragma omp taskwait
+
+    r = malloc(sizeof r[0]);
+    mmap_enc_mat_init(c->mmap, c->params, r, left->nrows, right->ncols);
+    chain_product(c, r, left, right);
+    if (k > i) {
+        mmap_enc_mat_clear(c->mmap, left);
+        free(left);
+    }
+    if (j > k + 1) {
+        mmap_enc_mat_clear(c->mmap, right);
+        free(right);
+    }
+    return r;
+}
 
-    mmap_enc_mat_clear(mmap, tmp_mat);
+size_t
+mmap_enc_mat_chain_cost(mmap_enc_mat_t *mats, int n)
+{
+    chain_t c;
+    size_t cost;
+
+    chain_init(&c, NULL, NULL, mats, n);
+    cost = chain_cost(&c, 0, n - 1);
+    chain_clear(&c);
+    return cost;
+}
+
+void
+mmap_enc_mat_chain_mul(const_mmap_vtable mmap, const mmap_pp params,
+                       mmap_enc_mat_t r, mmap_enc_mat_t *mats, int n)
+{
+    struct _mmap_enc_mat_struct *result = NULL;
+    chain_t c;
+
+    if (n == 1) {
+        if (r->data != mats[0]->data) {
+            mmap_enc_mat_clear(mmap, r);
+            mmap_enc_mat_init(mmap, params, r, mats[0]->nrows, mats[0]->ncols);
+            mmap_enc_mat_view_set(mmap, mmap_enc_mat_as_view(r),
+                                  mmap_enc_mat_as_view(mats[0]));
+        }
+        return;
+    }
+
+    chain_init(&c, mmap, params, mats, n);
+    if (c.dims[0] == 1 && chain_is_left_deep(&c)) {
+        mmap_enc_vec_eval_t ev;
+
+        mmap_enc_vec_eval_init(mmap, params, ev, mats[0]);
+        for (int i = 1; i < n; i++)
+            mmap_enc_vec_eval_step(mmap, params, ev, mats[i]);
+        result = malloc(sizeof result[0]);
+        mmap_enc_mat_init(mmap, params, result, 1, ev->width);
+        mmap_enc_mat_view_swap(mmap, mmap_enc_mat_as_view(result),
+                               mmap_enc_vec_eval_result(ev));
+        mmap_enc_vec_eval_clear(mmap, ev);
+    } else {
+#pragma omp parallel
+#pragma omp single
+        result = chain_eval(&c, 0, n - 1);
+    }
+    chain_clear(&c);
+
+    mmap_enc_mat_clear(mmap, r);
+    r[0] = result[0];
+    free(result);
+}
+
+/* Zero-testing */
+
+static void
+zero_test(const_mmap_vtable mmap, const mmap_pp params, bool *results,
+          const mmap_enc *encs, size_t count)
+{
+    if (mmap->enc->is_zero_batch) {
+        mmap->enc->is_zero_batch(results, encs, count, params);
+        return;
+    }
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t k = 0; k < count; k++)
+        results[k] = mmap->enc->is_zero(encs[k], params);
+}
+
+int
+mmap_enc_mat_is_zero(const_mmap_vtable mmap, const mmap_pp params,
+                     uint64_t *bitmap, const mmap_enc_mat_t m,
+                     mmap_zt_mode mode)
+{
+    const size_t count = (size_t) m->nrows * m->ncols;
+    /* Early exits start with one entry per thread and double the batch each
+     * round, so that an early hit wastes little work while long runs still
+     * amortize the parallel region */
+    size_t batch = mode == MMAP_ZT_ALL ? count : (size_t) omp_get_max_threads();
+    bool *results;
+    int ret = -1;
+
+    memset(bitmap, 0, MMAP_BITMAP_WORDS(count) * sizeof bitmap[0]);
+    results = malloc(count * sizeof results[0]);
+    for (size_t start = 0; start < count && ret < 0; start += batch, batch *= 2) {
+        const size_t n = batch < count - start ? batch : count - start;
+
+        zero_test(mmap, params, results + start, m->data + start, n);
+        for (size_t k = start; k < start + n; k++) {
+            if (results[k])
+                bitmap[k / 64] |= UINT64_C(1) << (k % 64);
+            if ((mode == MMAP_ZT_UNTIL_NONZERO && !results[k])
+                || (mode == MMAP_ZT_UNTIL_ZERO && results[k])) {
+                ret = (int) k;
+                break;
+            }
+        }
+    }
+    free(results);
+    return ret;
 }
@@ -0,0 +1,314 @@
+#include "mmap.h"
+#include "mmap_buf.h"
+#include <assert.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Matrices and arrays are written as a header (nrows and ncols as ints, or
+ * the count as a uint64_t) followed by one frame per encoding, in row-major
+ * order: a uint64_t byte count and then the fwrite (equivalently, to_buf)
+ * output.  The counts let reads hand whole frames to decoder threads without
+ * parsing them. */
+
+/* Encodings serialized or decoded per task */
+#define IO_CHUNK_ENCS 256
+#define IO_CHUNK_BYTES (1 << 20)
+/* Bytes read ahead of the decoders before the reader waits for them */
+#define IO_INFLIGHT_BYTES (64 << 20)
+
+/* Backends without from_buf are read through fread */
+static mmap_enc
+enc_from_buf(const mmap_vtable *mmap, const void *buf, size_t size)
+{
+    mmap_enc enc;
+    FILE *fp;
+
+    if (mmap->enc->from_buf)
+        return mmap->enc->from_buf(buf, size);
+    if ((fp = mmap_buf_open(buf, size)) == NULL)
+        return NULL;
+    enc = mmap->enc->fread(fp);
+    fclose(fp);
+    return enc;
+}
+
+/* Serializes chunks of encodings in parallel, then writes them in order.
+ * Each encoding is serialized once, with fwrite into a growing buffer whose
+ * final length is its frame size: serialized_size may cost as much as
+ * serializing (it does for CLT), so it is not used here. */
+static int
+write_frames(const mmap_vtable *mmap, const mmap_enc *encs, size_t n,
+             FILE *fp)
+{
+    char *bufs[IO_CHUNK_ENCS];
+    size_t sizes[IO_CHUNK_ENCS];
+    bool ok = true;
+
+    for (size_t first = 0; ok && first < n; first += IO_CHUNK_ENCS) {
+        const size_t count =
+            n - first < IO_CHUNK_ENCS ? n - first : IO_CHUNK_ENCS;
+
+#pragma omp parallel for schedule(dynamic, 1) reduction(&&:ok)
+        for (size_t i = 0; i < count; ++i)
+            ok = mmap_buf_dump(mmap->enc->fwrite, encs[first + i], &bufs[i],
+                               &sizes[i]) == MMAP_OK && ok;
+        for (size_t i = 0; i < count; ++i) {
+            const uint64_t size = sizes[i];
+            ok = ok && bufs[i]
+                && fwrite(&size, sizeof size, 1, fp) == 1
+                && fwrite(bufs[i], 1, sizes[i], fp) == sizes[i];
+            free(bufs[i]);
+        }
+    }
+    return ok ? MMAP_OK : MMAP_ERR;
+}
+
+static void
+decode_chunk(const mmap_vtable *mmap, mmap_enc *out, const char *buf,
+             const uint64_t *sizes, size_t count, bool *ok)
+{
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = enc_from_buf(mmap, buf, sizes[i]);
+        if (out[i] == NULL) {
+#pragma omp atomic write
+            *ok = false;
+        }
+        buf += sizes[i];
+    }
+}
+
+/* Bytes left in fp, or UINT64_MAX if fp is not a regular file */
+static uint64_t
+stream_left(FILE *fp)
+{
+    struct stat st;
+    off_t pos;
+    int fd;
+
+    if ((fd = fileno(fp)) == -1 || fstat(fd, &st) == -1
+        || !S_ISREG(st.st_mode) || (pos = ftello(fp)) == -1
+        || pos > st.st_size)
+        return UINT64_MAX;
+    return st.st_size - pos;
+}
+
+/* Appends size bytes from fp to *buf at offset bytes.  The buffer grows as
+ * the data arrives, so a corrupt size costs no more memory than the stream
+ * actually holds. */
+static bool
+read_frame(FILE *fp, char **buf, size_t *cap, size_t bytes, uint64_t size)
+{
+    for (uint64_t done = 0; done < size;) {
+        const size_t step =
+            size - done < IO_CHUNK_BYTES ? size - done : IO_CHUNK_BYTES;
+        const size_t end = bytes + done + step;
+        if (end > *cap) {
+            const size_t want = 2 * *cap > end ? 2 * *cap : end;
+            char *const p = realloc(*buf, want);
+            if (p == NULL)
+                return false;
+            *buf = p;
+            *cap = want;
+        }
+        if (fread(*buf + bytes + done, 1, step, fp) != step)
+            return false;
+        done += step;
+    }
+    return true;
+}
+
+/* Reads n frames into fresh encodings.  One thread reads chunks of frames
+ * and hands each to a decoding task, so reading overlaps decoding.  On
+ * failure out holds NULLs in place of the encodings that were not read. */
+static int
+read_frames(const mmap_vtable *mmap, mmap_enc *out, size_t n, FILE *fp)
+{
+    bool ok = true;
+
+    for (size_t k = 0; k < n; ++k)
+        out[k] = NULL;
+#pragma omp parallel
+#pragma omp single
+    {
+        size_t inflight = 0, k = 0;
+        uint64_t left = stream_left(fp);
+        bool reading = true;
+
+        while (reading && k < n) {
+            uint64_t *sizes = malloc(IO_CHUNK_ENCS * sizeof sizes[0]);
+            size_t count = 0, bytes = 0, cap = IO_CHUNK_BYTES;
+            char *buf = malloc(cap);
+            const size_t first = k;
+
+            if (sizes == NULL || buf == NULL) {
+                free(sizes);
+                free(buf);
+#pragma omp atomic write
+                ok = false;
+                break;
+            }
+            while (k < n && count < IO_CHUNK_ENCS && bytes < IO_CHUNK_BYTES) {
+                uint64_t size;
+                if (fread(&size, sizeof size, 1, fp) != 1
+                    || size > (uint64_t) SIZE_MAX - bytes
+                    || (left != UINT64_MAX && size > left - sizeof size)
+                    || !read_frame(fp, &buf, &cap, bytes, size)) {
+                    reading = false;
+                    break;
+                }
+                if (left != UINT64_MAX)
+                    left -= sizeof size + size;
+                sizes[count++] = size;
+                bytes += size;
+                ++k;
+            }
+            if (!reading) {
+#pragma omp atomic write
+                ok = false;
+            }
+            inflight += bytes;
+#pragma omp task firstprivate(buf, sizes, count, first) shared(ok)
+            {
+                decode_chunk(mmap, out + first, buf, sizes, count, &ok);
+                free(buf);
+                free(sizes);
+            }
+            /* Bound the memory held by frames not yet decoded */
+            if (inflight >= IO_INFLIGHT_BYTES) {
+#pragma omp taskwait
+                inflight = 0;
+            }
+        }
+    }
+    return ok ? MMAP_OK : MMAP_ERR;
+}
+
+static void
+free_encs(const mmap_vtable *mmap, mmap_enc *encs, size_t n)
+{
+    for (size_t k = 0; k < n; ++k) {
+        if (encs[k])
+            mmap->enc->free(encs[k]);
+    }
+}
+
+int
+mmap_enc_array_fwrite(const_mmap_vtable mmap, const mmap_enc *encs, size_t n,
+                      FILE *fp)
+{
+    const uint64_t count = n;
+
+    if (fwrite(&count, sizeof count, 1, fp) != 1)
+        return MMAP_ERR;
+    return write_frames(mmap, encs, n, fp);
+}
+
+mmap_enc *
+mmap_enc_array_fread(const_mmap_vtable mmap, size_t *n, FILE *fp)
+{
+    mmap_enc *encs;
+    uint64_t count;
+
+    if (fread(&count, sizeof count, 1, fp) != 1
+        || count > SIZE_MAX / sizeof encs[0])
+        return NULL;
+    encs = malloc((count ? count : 1) * sizeof encs[0]);
+    if (encs == NULL)
+        return NULL;
+    if (read_frames(mmap, encs, count, fp) != MMAP_OK) {
+        free_encs(mmap, encs, count);
+        free(encs);
+        return NULL;
+    }
+    *n = count;
+    return encs;
+}
+
+/* Whether encodings read from a file may be swapped into a matrix of params */
+static bool
+encs_compatible(const mmap_vtable *mmap, const mmap_pp params,
+                const mmap_enc *encs, size_t n)
+{
+    for (size_t k = 0; mmap->enc->compatible && k < n; ++k) {
+        if (!mmap->enc->compatible(encs[k], params))
+            return false;
+    }
+    return true;
+}
+
+int
+mmap_enc_mat_fwrite(const_mmap_vtable mmap, const mmap_enc_mat_t m, FILE *fp)
+{
+    if (fwrite(&m->nrows, sizeof m->nrows, 1, fp) != 1
+        || fwrite(&m->ncols, sizeof m->ncols, 1, fp) != 1)
+        return MMAP_ERR;
+    return write_frames(mmap, m->data, (size_t) m->nrows * m->ncols, fp);
+}
+
+/* Returns MMAP_ERR, leaving m uninitialized, at end of file as well as on
+ * malformed input; eof tells the two apart */
+static int
+mat_fread(const mmap_vtable *mmap, const mmap_pp params, mmap_enc_mat_t m,
+          FILE *fp, bool *eof)
+{
+    mmap_enc *encs;
+    size_t n;
+    int nrows, ncols;
+
+    *eof = false;
+    if (fread(&nrows, sizeof nrows, 1, fp) != 1) {
+        *eof = feof(fp) != 0;
+        return MMAP_ERR;
+    }
+    if (fread(&ncols, sizeof ncols, 1, fp) != 1 || nrows < 0 || ncols < 0)
+        return MMAP_ERR;
+    n = (size_t) nrows * ncols;
+    encs = malloc((n ? n : 1) * sizeof encs[0]);
+    if (encs == NULL)
+        return MMAP_ERR;
+    if (read_frames(mmap, encs, n, fp) != MMAP_OK
+        || !encs_compatible(mmap, params, encs, n)) {
+        free_encs(mmap, encs, n);
+        free(encs);
+        return MMAP_ERR;
+    }
+    /* Move the decoded encodings into the matrix's own, which may live
+     * inside its allocation */
+    mmap_enc_mat_init(mmap, params, m, nrows, ncols);
+#pragma omp parallel for schedule(static)
+    for (size_t k = 0; k < n; ++k) {
+        mmap->enc->swap(&m->data[k], &encs[k]);
+        mmap->enc->free(encs[k]);
+    }
+    free(encs);
+    return MMAP_OK;
+}
+
+int
+mmap_enc_mat_fread(const_mmap_vtable mmap, const mmap_pp params,
+                   mmap_enc_mat_t m, FILE *fp)
+{
+    bool eof;
+    return mat_fread(mmap, params, m, fp, &eof);
+}
+
+int
+mmap_enc_mat_fread_stream(const_mmap_vtable mmap, const mmap_pp params,
+                          FILE *fp, mmap_enc_mat_fn f, void *arg)
+{
+    mmap_enc_mat_t m;
+    bool eof;
+    int ret;
+
+    for (size_t k = 0;; ++k) {
+        if (mat_fread(mmap, params, m, fp, &eof) != MMAP_OK)
+            return eof ? MMAP_OK : MMAP_ERR;
+        ret = f(m, k, arg);
+        mmap_enc_mat_clear(mmap, m);
+        if (ret != MMAP_OK)
+            return ret;
+    }
+}
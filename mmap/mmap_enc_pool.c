@@ -0,0 +1,165 @@
+#include "mmap.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* Encodings a thread keeps for itself before handing half of them back */
+#define POOL_CACHE_SIZE 32
+/* Pools a thread remembers a cache for */
+#define POOL_TL_ENTRIES 8
+
+struct pool_cache {
+    struct pool_cache *next;    /* in the owning pool's list */
+    pthread_t owner;            /* the only thread that uses it */
+    size_t n;
+    mmap_enc encs[POOL_CACHE_SIZE];
+};
+
+struct _mmap_enc_pool_struct {
+    const mmap_vtable *mmap;
+    mmap_pp pp;
+    uint64_t id;
+    pthread_mutex_t lock;       /* guards everything below */
+    mmap_enc *spare;
+    size_t nspare, cap;
+    struct pool_cache *caches;
+};
+
+/* Each thread maps the pools it has used to its cache in that pool.  Pools
+ * are identified by address and id so that a new pool allocated where a freed
+ * one was never picks up a dangling cache.  Entries are replaced round-robin;
+ * the cache of a forgotten entry stays linked in its pool, which hands it
+ * back to the same thread on its next use there, so a pool holds at most one
+ * cache per thread until mmap_enc_pool_free reclaims them. */
+struct pool_tl_entry {
+    const mmap_enc_pool *pool;
+    uint64_t id;
+    struct pool_cache *cache;
+};
+
+static _Thread_local struct pool_tl_entry tl_entries[POOL_TL_ENTRIES];
+static _Thread_local unsigned int tl_next;
+static atomic_uint_fast64_t pool_ids = 1;
+
+static struct pool_cache *
+pool_cache(mmap_enc_pool *pool)
+{
+    struct pool_tl_entry *e;
+    struct pool_cache *cache;
+
+    for (int i = 0; i < POOL_TL_ENTRIES; ++i) {
+        if (tl_entries[i].pool == pool && tl_entries[i].id == pool->id)
+            return tl_entries[i].cache;
+    }
+    pthread_mutex_lock(&pool->lock);
+    for (cache = pool->caches; cache; cache = cache->next) {
+        if (pthread_equal(cache->owner, pthread_self()))
+            break;
+    }
+    if (cache == NULL) {
+        cache = calloc(1, sizeof cache[0]);
+        assert(cache);
+        cache->owner = pthread_self();
+        cache->next = pool->caches;
+        pool->caches = cache;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    e = &tl_entries[tl_next++ % POOL_TL_ENTRIES];
+    e->pool = pool;
+    e->id = pool->id;
+    e->cache = cache;
+    return cache;
+}
+
+/* Moves up to n encodings from the shared list into the cache */
+static void
+pool_refill(mmap_enc_pool *pool, struct pool_cache *cache, size_t n)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (n > pool->nspare)
+        n = pool->nspare;
+    for (size_t i = 0; i < n; ++i)
+        cache->encs[cache->n++] = pool->spare[--pool->nspare];
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Moves n encodings from the cache into the shared list */
+static void
+pool_flush(mmap_enc_pool *pool, struct pool_cache *cache, size_t n)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nspare + n > pool->cap) {
+        pool->cap *= 2;
+        if (pool->cap < pool->nspare + n)
+            pool->cap = pool->nspare + n;
+        pool->spare = realloc(pool->spare, pool->cap * sizeof pool->spare[0]);
+        assert(pool->spare);
+    }
+    for (size_t i = 0; i < n; ++i)
+        pool->spare[pool->nspare++] = cache->encs[--cache->n];
+    pthread_mutex_unlock(&pool->lock);
+}
+
+mmap_enc_pool *
+mmap_enc_pool_new(const_mmap_vtable mmap, const mmap_pp params,
+                  size_t capacity)
+{
+    mmap_enc_pool *pool;
+
+    pool = calloc(1, sizeof pool[0]);
+    assert(pool);
+    pool->mmap = mmap;
+    pool->pp = params;
+    pool->id = atomic_fetch_add(&pool_ids, 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->cap = capacity ? capacity : POOL_CACHE_SIZE;
+    pool->spare = calloc(pool->cap, sizeof pool->spare[0]);
+    assert(pool->spare);
+    for (size_t i = 0; i < capacity; ++i)
+        pool->spare[pool->nspare++] = mmap->enc->new(params);
+    return pool;
+}
+
+void
+mmap_enc_pool_free(mmap_enc_pool *pool)
+{
+    struct pool_cache *cache, *next;
+
+    if (pool == NULL)
+        return;
+    for (cache = pool->caches; cache; cache = next) {
+        next = cache->next;
+        for (size_t i = 0; i < cache->n; ++i)
+            pool->mmap->enc->free(cache->encs[i]);
+        free(cache);
+    }
+    for (size_t i = 0; i < pool->nspare; ++i)
+        pool->mmap->enc->free(pool->spare[i]);
+    free(pool->spare);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+mmap_enc
+mmap_enc_pool_acquire(mmap_enc_pool *pool)
+{
+    struct pool_cache *cache = pool_cache(pool);
+
+    if (cache->n == 0)
+        pool_refill(pool, cache, POOL_CACHE_SIZE / 2);
+    if (cache->n == 0)
+        return pool->mmap->enc->new(pool->pp);
+    return cache->encs[--cache->n];
+}
+
+void
+mmap_enc_pool_release(mmap_enc_pool *pool, mmap_enc enc)
+{
+    struct pool_cache *cache = pool_cache(pool);
+
+    if (cache->n == POOL_CACHE_SIZE)
+        pool_flush(pool, cache, POOL_CACHE_SIZE / 2);
+    cache->encs[cache->n++] = enc;
+}
@@ -1,492 +1,814 @@
 #include "mmap_gghlite.h"
+#include "mmap_buf.h"
 
 #include <gghlite.h>
 #include <gghlite/gghlite-defs.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define debug_printf printf
-#define CHECK(x, y) if((x) < (y)) { debug_printf(                       \
-            "ERROR: fscanf() error encountered when trying to read from file\n" \
-            ); }
-
-static void fread_gghlite_params(FILE *fp, gghlite_params_t params);
-static void fwrite_gghlite_params(FILE *fp, const gghlite_params_t params);
-static void fread_gghlite_sk(FILE *fp, gghlite_sk_t self);
-static void fwrite_gghlite_sk(FILE *fp, const gghlite_sk_t self);
-
-/* functions dealing with file reading and writing for encodings */
-#define gghlite_enc_fprint fmpz_mod_poly_fprint
-#define gghlite_enc_fread fmpz_mod_poly_fread
-#define gghlite_enc_fprint_raw fmpz_mod_poly_fprint_raw
-#define gghlite_enc_fread_raw fmpz_mod_poly_fread_raw
-static int fmpz_mod_poly_fprint_raw(FILE * file, const fmpz_mod_poly_t poly);
-static int gghlite_enc_fread_raw(FILE * f, gghlite_enc_t poly);
-static int fmpz_poly_fprint_raw(FILE * file, const fmpz_poly_t poly);
-static int fmpz_poly_fread_raw(FILE * file, fmpz_poly_t poly);
-
-static void gghlite_params_clear_read_wrapper(const mmap_pp pp)
+
+static int fread_gghlite_params(FILE *fp, gghlite_params_t params);
+static int fwrite_gghlite_params(FILE *fp, const gghlite_params_t params);
+static int fread_gghlite_sk(FILE *fp, gghlite_sk_t self);
+static int fwrite_gghlite_sk(FILE *fp, gghlite_sk_t self);
+
+/* Encodings are written in the same binary format as the polynomials of the
+ * key */
+static int gghlite_enc_fwrite_bin(FILE *fp, const gghlite_enc_t enc);
+static int gghlite_enc_fread_bin(FILE *fp, gghlite_enc_t enc);
+
+static void gghlite_pp_free_wrapper(mmap_pp pp)
 {
     gghlite_params_clear(pp);
+    free(pp);
 }
-static void fread_gghlite_params_wrapper(const mmap_pp pp, FILE *const fp)
+
+static mmap_pp gghlite_pp_fread_wrapper(FILE *fp)
 {
-    fread_gghlite_params(fp, pp);
+    struct _gghlite_params_struct *pp;
+
+    if ((pp = malloc(sizeof(gghlite_params_t))) == NULL)
+        return NULL;
+    if (!fread_gghlite_params(fp, pp)) {
+        free(pp);
+        return NULL;
+    }
+    return pp;
 }
-static void fwrite_gghlite_params_wrapper(const mmap_ro_pp pp, FILE *const fp)
+
+static int gghlite_pp_fwrite_wrapper(const mmap_pp pp, FILE *fp)
 {
-    fwrite_gghlite_params(fp, pp);
+    return fwrite_gghlite_params(fp, pp) ? MMAP_OK : MMAP_ERR;
 }
 
 static const mmap_pp_vtable gghlite_pp_vtable =
-{ .clear = gghlite_params_clear_read_wrapper
-  , .fread = fread_gghlite_params_wrapper
-  , .fwrite = fwrite_gghlite_params_wrapper
-  , .size = sizeof(gghlite_params_t)
+{ .free = gghlite_pp_free_wrapper
+  , .fread = gghlite_pp_fread_wrapper
+  , .fwrite = gghlite_pp_fwrite_wrapper
 };
 
-static int
-gghlite_jigsaw_init_gamma_wrapper(const mmap_sk sk, size_t lambda, size_t kappa,
-                                  size_t gamma, int *pows, size_t nslots,
-                                  unsigned long ncores, aes_randstate_t randstate,
-                                  bool verbose)
+static mmap_sk
+gghlite_sk_new_wrapper(const mmap_sk_params *params,
+                       const mmap_sk_opt_params *opts, size_t ncores,
+                       aes_randstate_t rng, bool verbose)
 {
-    (void) pows, (void) ncores;
+    (void) ncores;
+    struct _gghlite_sk_struct *sk;
     gghlite_flag_t flags;
 
-    if (nslots > 1) {
+    if (params == NULL)
+        return NULL;
+    if (opts && opts->nslots > 1) {
         fprintf(stderr, "Error: gghlite only supports a single slot\n");
-        return MMAP_ERR;
+        return NULL;
     }
     flags = GGHLITE_FLAGS_GOOD_G_INV;
     if (verbose)
         flags |= GGHLITE_FLAGS_VERBOSE;
     else
         flags |= GGHLITE_FLAGS_QUIET;
-    gghlite_jigsaw_init_gamma(sk, lambda, kappa, gamma, flags,
-                              randstate);
-    return MMAP_OK;
+    if ((sk = malloc(sizeof(gghlite_sk_t))) == NULL)
+        return NULL;
+    gghlite_jigsaw_init_gamma(sk, params->lambda, params->kappa, params->gamma,
+                              flags, rng);
+    return sk;
+}
+
+static void gghlite_sk_free_wrapper(mmap_sk sk)
+{
+    gghlite_sk_clear(sk, 1);
+    free(sk);
+}
+
+static mmap_sk gghlite_sk_fread_wrapper(FILE *fp)
+{
+    struct _gghlite_sk_struct *sk;
+
+    if ((sk = malloc(sizeof(gghlite_sk_t))) == NULL)
+        return NULL;
+    if (!fread_gghlite_sk(fp, sk)) {
+        free(sk);
+        return NULL;
+    }
+    return sk;
 }
 
-static void gghlite_sk_clear_wrapper(const mmap_sk sk)
-{ gghlite_sk_clear(sk, 1); }
-static void fread_gghlite_sk_wrapper(const mmap_sk sk, FILE *const fp)
-{ fread_gghlite_sk(fp, sk); }
-static void fwrite_gghlite_sk_wrapper(const mmap_ro_sk sk, FILE *const fp)
-{ fwrite_gghlite_sk(fp, sk); }
-static mmap_ro_pp gghlite_sk_to_pp(const mmap_ro_sk sk)
-{ return ((const struct _gghlite_sk_struct *const)sk)->params; }
+static int gghlite_sk_fwrite_wrapper(const mmap_sk sk, FILE *fp)
+{
+    return fwrite_gghlite_sk(fp, sk) ? MMAP_OK : MMAP_ERR;
+}
 
-static fmpz_t * fmpz_poly_oz_ideal_norm_wrapper(const mmap_ro_sk sk)
+/* The parameters live inside the key, so the caller gets a copy of its own,
+ * made by writing them out and reading them back */
+static mmap_pp gghlite_sk_to_pp(const mmap_sk sk)
 {
-    fmpz_t *moduli;
+    const struct _gghlite_sk_struct *const self = sk;
+    mmap_pp pp = NULL;
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *fp;
+    int ok;
+
+    if ((fp = open_memstream(&buf, &size)) == NULL)
+        return NULL;
+    ok = fwrite_gghlite_params(fp, self->params);
+    if (fclose(fp) == 0 && ok && (fp = mmap_buf_open(buf, size)) != NULL) {
+        pp = gghlite_pp_fread_wrapper(fp);
+        fclose(fp);
+    }
+    free(buf);
+    return pp;
+}
 
-    moduli = calloc(1, sizeof(fmpz_t));
-    fmpz_init(moduli[0]);
-    fmpz_poly_oz_ideal_norm(moduli[0], ((const struct _gghlite_sk_struct *const)sk)->g, ((const struct _gghlite_sk_struct *const)sk)->params->n, 0);
+static mpz_t * fmpz_poly_oz_ideal_norm_wrapper(const mmap_sk sk)
+{
+    const struct _gghlite_sk_struct *const self = sk;
+    mpz_t *moduli;
+    fmpz_t norm;
+
+    moduli = calloc(1, sizeof(mpz_t));
+    assert(moduli);
+    fmpz_init(norm);
+    fmpz_poly_oz_ideal_norm(norm, self->g, self->params->n, 0);
+    mpz_init(moduli[0]);
+    fmpz_get_mpz(moduli[0], norm);
+    fmpz_clear(norm);
     return moduli;
 }
 
-static size_t gghlite_nslots(const mmap_ro_sk sk __attribute__ ((unused)))
+static size_t gghlite_nslots(const mmap_sk sk __attribute__ ((unused)))
 {
     return 1;
 }
 
-static size_t gghlite_nzs(const mmap_ro_sk sk)
+static size_t gghlite_nzs(const mmap_sk sk)
 {
-    return ((const struct _gghlite_sk_struct *const)sk)->params->gamma;
+    return ((const struct _gghlite_sk_struct *) sk)->params->gamma;
 }
 
 static const mmap_sk_vtable gghlite_sk_vtable =
-{ .init = gghlite_jigsaw_init_gamma_wrapper
-  , .clear = gghlite_sk_clear_wrapper
-  , .fread = fread_gghlite_sk_wrapper
-  , .fwrite = fwrite_gghlite_sk_wrapper
+{ .new = gghlite_sk_new_wrapper
+  , .free = gghlite_sk_free_wrapper
+  , .fread = gghlite_sk_fread_wrapper
+  , .fwrite = gghlite_sk_fwrite_wrapper
   , .pp = gghlite_sk_to_pp
   , .plaintext_fields = fmpz_poly_oz_ideal_norm_wrapper
   , .nslots = gghlite_nslots
   , .nzs = gghlite_nzs
-  , .size = sizeof(gghlite_sk_t)
 };
 
-static void gghlite_enc_init_wrapper(const mmap_enc enc, const mmap_ro_pp pp)
+static mmap_enc gghlite_enc_new_wrapper(const mmap_pp pp)
 {
+    fmpz_mod_poly_struct *enc;
+
+    enc = malloc(sizeof(gghlite_enc_t));
+    assert(enc);
     gghlite_enc_init(enc, pp);
+    return enc;
 }
-static void gghlite_enc_clear_wrapper(const mmap_enc enc)
+static void gghlite_enc_free_wrapper(mmap_enc enc)
 {
     gghlite_enc_clear(enc);
+    free(enc);
 }
-static void gghlite_enc_fread_raw_wrapper(const mmap_enc enc, FILE *const fp)
+static mmap_enc gghlite_enc_fread_wrapper(FILE *fp)
 {
-    gghlite_enc_fread_raw(fp, enc);
+    fmpz_mod_poly_struct *enc;
+
+    if ((enc = malloc(sizeof(gghlite_enc_t))) == NULL)
+        return NULL;
+    if (!gghlite_enc_fread_bin(fp, enc)) {
+        free(enc);
+        return NULL;
+    }
+    return enc;
 }
-static void gghlite_enc_fprint_raw_wrapper(const mmap_ro_enc enc, FILE *const fp)
+static int gghlite_enc_fwrite_wrapper(const mmap_enc enc, FILE *fp)
 {
-    gghlite_enc_fprint_raw(fp, enc);
+    return gghlite_enc_fwrite_bin(fp, enc) ? MMAP_OK : MMAP_ERR;
 }
-static void gghlite_enc_set_wrapper(const mmap_enc dest, const mmap_ro_enc src)
+static void gghlite_enc_set_wrapper(mmap_enc dest, const mmap_enc src)
 {
     gghlite_enc_set(dest, src);
 }
-static void gghlite_enc_add_wrapper(const mmap_enc dest, const mmap_ro_pp pp,
-                                    const mmap_ro_enc a, const mmap_ro_enc b)
+static void gghlite_enc_swap_wrapper(mmap_enc *a, mmap_enc *b)
+{
+    mmap_enc tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+static int gghlite_enc_add_wrapper(mmap_enc dest, const mmap_pp pp,
+                                   const mmap_enc a, const mmap_enc b)
 {
     gghlite_enc_add(dest, pp, a, b);
+    return MMAP_OK;
 }
-static void gghlite_enc_sub_wrapper(const mmap_enc dest, const mmap_ro_pp pp,
-                                    const mmap_ro_enc a, const mmap_ro_enc b)
+static int gghlite_enc_sub_wrapper(mmap_enc dest, const mmap_pp pp,
+                                   const mmap_enc a, const mmap_enc b)
 {
     gghlite_enc_sub(dest, pp, a, b);
+    return MMAP_OK;
 }
-static void gghlite_enc_mul_wrapper(const mmap_enc dest, const mmap_ro_pp pp,
-                                    const mmap_ro_enc a, const mmap_ro_enc b)
+static int gghlite_enc_mul_wrapper(mmap_enc dest, const mmap_pp pp,
+                                   const mmap_enc a, const mmap_enc b)
 {
     gghlite_enc_mul(dest, pp, a, b);
+    return MMAP_OK;
 }
-static bool gghlite_enc_is_zero_wrapper(const mmap_ro_enc enc, const mmap_ro_pp pp)
+static bool gghlite_enc_is_zero_wrapper(const mmap_enc enc, const mmap_pp pp)
 {
     return gghlite_enc_is_zero(pp, enc);
 }
 
-static void
-gghlite_enc_set_gghlite_clr_wrapper(const mmap_enc enc,
-                                    const mmap_ro_sk sk, size_t n,
-                                    const fmpz_t *plaintext, int *group)
+static int
+gghlite_enc_set_gghlite_clr_wrapper(mmap_enc enc, const mmap_sk sk, size_t n,
+                                    const mpz_t *plaintext, const int *pows,
+                                    size_t level)
 {
-    (void) n;
+    (void) n, (void) level;
     gghlite_clr_t e;
+    fmpz_t x;
+
     gghlite_clr_init(e);
-    fmpz_poly_set_coeff_fmpz(e, 0, plaintext[0]);
-    gghlite_enc_set_gghlite_clr(enc, sk, e, 1, group, 1);
+    fmpz_init(x);
+    fmpz_set_mpz(x, plaintext[0]);
+    fmpz_poly_set_coeff_fmpz(e, 0, x);
+    gghlite_enc_set_gghlite_clr(enc, sk, e, 1, pows, 1);
+    fmpz_clear(x);
     gghlite_clr_clear(e);
+    return MMAP_OK;
 }
 
-static void fread_gghlite_params(FILE *fp, gghlite_params_t params) {
-    int mpfr_base = 10;
-    size_t lambda, kappa, gamma, n, ell;
-    uint64_t rerand_mask;
-    int gghlite_flag_int;
-    CHECK(fscanf(fp, "%zu %zu %zu %lu %lu %lu %d\n",
-                 &lambda,
-                 &gamma,
-                 &kappa,
-                 &n,
-                 &ell,
-                 &rerand_mask,
-                 &gghlite_flag_int
-              ), 7);
+/* Parameters and secret keys are written in a versioned binary format,
+ * in host byte order.  An integer is a uint64_t holding its number of limbs,
+ * with its sign in the top bit, followed by the limbs, least significant
+ * first.  A polynomial is its length and the total size in bytes of its
+ * coefficients, followed by the coefficients, so that a reader loads it with
+ * one fread and copies the limbs straight into place. */
 
-    gghlite_params_initzero(params, lambda, kappa, gamma);
-    params->n = n;
-    params->ell = ell;
-    params->rerand_mask = rerand_mask;
-    params->flags = gghlite_flag_int;
-
-    fmpz_inp_raw(params->q, fp);
-    CHECK(fscanf(fp, "\n"), 0);
-    mpfr_inp_str(params->sigma, fp, mpfr_base, MPFR_RNDN);
-    CHECK(fscanf(fp, "\n"), 0);
-    mpfr_inp_str(params->sigma_p, fp, mpfr_base, MPFR_RNDN);
-    CHECK(fscanf(fp, "\n"), 0);
-    mpfr_inp_str(params->sigma_s, fp, mpfr_base, MPFR_RNDN);
-    CHECK(fscanf(fp, "\n"), 0);
-    mpfr_inp_str(params->ell_b, fp, mpfr_base, MPFR_RNDN);
-    CHECK(fscanf(fp, "\n"), 0);
-    mpfr_inp_str(params->ell_g, fp, mpfr_base, MPFR_RNDN);
-    CHECK(fscanf(fp, "\n"), 0);
-    mpfr_inp_str(params->xi, fp, mpfr_base, MPFR_RNDN);
-    CHECK(fscanf(fp, "\n"), 0);
-
-    gghlite_enc_fread_raw(fp, params->pzt);
-    CHECK(fscanf(fp, "\n"), 0);
-    CHECK(fscanf(fp, "%zu\n", &params->ntt->n), 1);
-    gghlite_enc_fread_raw(fp, params->ntt->w);
-    CHECK(fscanf(fp, "\n"), 0);
-    gghlite_enc_fread_raw(fp, params->ntt->w_inv);
-    CHECK(fscanf(fp, "\n"), 0);
-    gghlite_enc_fread_raw(fp, params->ntt->phi);
-    CHECK(fscanf(fp, "\n"), 0);
-    gghlite_enc_fread_raw(fp, params->ntt->phi_inv);
-}
-
-static void fwrite_gghlite_params(FILE *fp, const gghlite_params_t params) {
-    int mpfr_base = 10;
-    fprintf(fp, "%zd %zd %zd %ld %ld %lu %d\n",
-            params->lambda,
-            params->gamma,
-            params->kappa,
-            params->n,
-            params->ell,
-            params->rerand_mask,
-            params->flags
-        );
-    fmpz_out_raw(fp, params->q);
-    fprintf(fp, "\n");
-    mpfr_out_str(fp, mpfr_base, 0, params->sigma, MPFR_RNDN);
-    fprintf(fp, "\n");
-    mpfr_out_str(fp, mpfr_base, 0, params->sigma_p, MPFR_RNDN);
-    fprintf(fp, "\n");
-    mpfr_out_str(fp, mpfr_base, 0, params->sigma_s, MPFR_RNDN);
-    fprintf(fp, "\n");
-    mpfr_out_str(fp, mpfr_base, 0, params->ell_b, MPFR_RNDN);
-    fprintf(fp, "\n");
-    mpfr_out_str(fp, mpfr_base, 0, params->ell_g, MPFR_RNDN);
-    fprintf(fp, "\n");
-    mpfr_out_str(fp, mpfr_base, 0, params->xi, MPFR_RNDN);
-    fprintf(fp, "\n");
-    gghlite_enc_fprint_raw(fp, params->pzt);
-    fprintf(fp, "\n");
-    fprintf(fp, "%zd\n", params->ntt->n);
-    fmpz_mod_poly_fprint_raw(fp, params->ntt->w);
-    fprintf(fp, "\n");
-    fmpz_mod_poly_fprint_raw(fp, params->ntt->w_inv);
-    fprintf(fp, "\n");
-    fmpz_mod_poly_fprint_raw(fp, params->ntt->phi);
-    fprintf(fp, "\n");
-    fmpz_mod_poly_fprint_raw(fp, params->ntt->phi_inv);
-}
-
-void fread_gghlite_sk(FILE *fp, gghlite_sk_t gghlite_self) {
-    uint64_t t = ggh_walltime(0);
-    timer_printf("Starting reading gghlite params...\n");
-    fread_gghlite_params(fp, gghlite_self->params);
-    CHECK(fscanf(fp, "\n"), 0);
-    timer_printf("Finished reading gghlite params %8.2fs\n",
-                 ggh_seconds(ggh_walltime(t)));
+#define GGHLITE_MAGIC "GGHLITE"
+#define GGHLITE_VERSION 1
+#define GGHLITE_SIGN_BIT ((uint64_t) 1 << 63)
 
-    t = ggh_walltime(0);
-    timer_printf("Starting reading g, g_inv, h...\n");
-    fmpz_poly_init(gghlite_self->g);
-    fmpz_poly_fread_raw(fp, gghlite_self->g);
-    CHECK(fscanf(fp, "\n"), 0);
-    fmpq_poly_init(gghlite_self->g_inv);
-    fmpq_poly_fread(fp, gghlite_self->g_inv);
-    CHECK(fscanf(fp, "\n"), 0);
-    fmpz_poly_init(gghlite_self->h);
-    fmpz_poly_fread_raw(fp, gghlite_self->h);
-    CHECK(fscanf(fp, "\n"), 0);
-    timer_printf("Finished reading g, g_inv, h %8.2fs\n",
-                 ggh_seconds(ggh_walltime(t)));
+static int write_u64(FILE *fp, uint64_t x)
+{
+    return fwrite(&x, sizeof x, 1, fp) == 1;
+}
 
-    t = ggh_walltime(0);
-    timer_printf("Starting reading z, z_inv, a, b...\n");
-    gghlite_self->z = malloc(gghlite_self->params->gamma * sizeof(gghlite_enc_t));
-    gghlite_self->z_inv = malloc(gghlite_self->params->gamma * sizeof(gghlite_enc_t));
-    for(unsigned int i = 0; i < gghlite_self->params->gamma; i++) {
-        fmpz_t p1, p2;
-        fmpz_init(p1);
-        fmpz_init(p2);
-        fmpz_inp_raw(p1, fp);
-        CHECK(fscanf(fp, "\n"), 0);
-        fmpz_mod_poly_fread_raw(fp, gghlite_self->z[i]);
-        CHECK(fscanf(fp, "\n"), 0);
-        fmpz_inp_raw(p2, fp);
-        CHECK(fscanf(fp, "\n"), 0);
-        fmpz_mod_poly_fread_raw(fp, gghlite_self->z_inv[i]);
-        CHECK(fscanf(fp, "\n"), 0);
-        fmpz_clear(p1);
-        fmpz_clear(p2);
-        timer_printf("\r    Progress: [%lu / %lu] %8.2fs",
-                     i, gghlite_self->params->gamma, ggh_seconds(ggh_walltime(t)));
+static int read_u64(FILE *fp, uint64_t *x)
+{
+    return fread(x, sizeof x[0], 1, fp) == 1;
+}
+
+static size_t fmpz_bin_size(const fmpz_t x)
+{
+    return sizeof(uint64_t) + fmpz_size(x) * sizeof(mp_limb_t);
+}
+
+static unsigned char *fmpz_bin_put(unsigned char *p, const fmpz_t x)
+{
+    const uint64_t n = fmpz_size(x);
+    const uint64_t header = fmpz_sgn(x) < 0 ? n | GGHLITE_SIGN_BIT : n;
+
+    memcpy(p, &header, sizeof header);
+    p += sizeof header;
+    if (!COEFF_IS_MPZ(*x)) {
+        const mp_limb_t limb = FLINT_ABS(*x);
+        memcpy(p, &limb, n * sizeof limb);
+    } else {
+        memcpy(p, COEFF_TO_PTR(*x)->_mp_d, n * sizeof(mp_limb_t));
     }
-    timer_printf("\n");
-    timer_printf("Finished reading z, z_inv, a, b %8.2fs\n",
-                 ggh_seconds(ggh_walltime(t)));
+    return p + n * sizeof(mp_limb_t);
+}
 
-    t = ggh_walltime(0);
-    timer_printf("Starting setting D_g...\n");
-    gghlite_sk_set_D_g(gghlite_self);
-    timer_printf("Finished setting D_g %8.2fs\n",
-                 ggh_seconds(ggh_walltime(t)));
-    aes_randstate_fread(gghlite_self->rng, fp);
+/* Returns NULL if the integer runs past end */
+static const unsigned char *fmpz_bin_get(fmpz_t x, const unsigned char *p,
+                                         const unsigned char *end)
+{
+    uint64_t header, n;
+    mp_limb_t limb;
+    int negative;
+
+    if ((size_t) (end - p) < sizeof header)
+        return NULL;
+    memcpy(&header, p, sizeof header);
+    p += sizeof header;
+    n = header & ~GGHLITE_SIGN_BIT;
+    negative = (header & GGHLITE_SIGN_BIT) != 0;
+    if (n > (size_t) (end - p) / sizeof(mp_limb_t))
+        return NULL;
+    if (n == 0) {
+        fmpz_zero(x);
+    } else if (n == 1) {
+        memcpy(&limb, p, sizeof limb);
+        fmpz_set_ui(x, limb);
+        if (negative)
+            fmpz_neg(x, x);
+    } else {
+        __mpz_struct *z = _fmpz_promote(x);
+        memcpy(mpz_limbs_write(z, n), p, n * sizeof(mp_limb_t));
+        mpz_limbs_finish(z, negative ? -(mp_size_t) n : (mp_size_t) n);
+        _fmpz_demote_val(x);
+    }
+    return p + n * sizeof(mp_limb_t);
 }
 
-void fwrite_gghlite_sk(FILE *fp, const gghlite_sk_t gghlite_self) {
-    uint64_t t = ggh_walltime(0);
-    timer_printf("Starting writing gghlite params...\n");
-    fwrite_gghlite_params(fp, gghlite_self->params);
-    fprintf(fp, "\n");
-    timer_printf("Finished writing gghlite params %8.2fs\n",
-                 ggh_seconds(ggh_walltime(t)));
+static int fmpz_fwrite_bin(FILE *fp, const fmpz_t x)
+{
+    unsigned char *buf;
+    int r;
 
-    t = ggh_walltime(0);
-    timer_printf("Starting writing g, g_inv, h...\n");
-    fmpz_poly_fprint_raw(fp, gghlite_self->g);
-    fprintf(fp, "\n");
-    fmpq_poly_fprint(fp, gghlite_self->g_inv);
-    fprintf(fp, "\n");
-    fmpz_poly_fprint_raw(fp, gghlite_self->h);
-    fprintf(fp, "\n");
-    timer_printf("Finished writing g, g_inv, h %8.2fs\n",
-                 ggh_seconds(ggh_walltime(t)));
+    if ((buf = malloc(fmpz_bin_size(x))) == NULL)
+        return 0;
+    fmpz_bin_put(buf, x);
+    r = fwrite(buf, fmpz_bin_size(x), 1, fp) == 1;
+    free(buf);
+    return r;
+}
 
-    t = ggh_walltime(0);
-    timer_printf("Starting writing z, z_inv, a, b...\n");
-    for(unsigned int i = 0; i < gghlite_self->params->gamma; i++) {
-        fmpz_out_raw(fp, fmpz_mod_poly_modulus(gghlite_self->z[i]));
-        fprintf(fp, "\n");
-        fmpz_mod_poly_fprint_raw(fp, gghlite_self->z[i]);
-        fprintf(fp, "\n");
-        fmpz_out_raw(fp, fmpz_mod_poly_modulus(gghlite_self->z_inv[i]));
-        fprintf(fp, "\n");
-        fmpz_mod_poly_fprint_raw(fp, gghlite_self->z_inv[i]);
-        fprintf(fp, "\n");
-        timer_printf("\r    Progress: [%lu / %lu] %8.2fs",
-                     i, gghlite_self->params->gamma, ggh_seconds(ggh_walltime(t)));
-    }
-    timer_printf("\n");
-    timer_printf("Finished writing z, z_inv, a, b %8.2fs\n",
-                 ggh_seconds(ggh_walltime(t)));
-    aes_randstate_fwrite(gghlite_self->rng, fp);
+static int fmpz_fread_bin(FILE *fp, fmpz_t x)
+{
+    unsigned char *buf;
+    uint64_t header, n;
+    int r;
+
+    if (!read_u64(fp, &header))
+        return 0;
+    n = header & ~GGHLITE_SIGN_BIT;
+    if (n > (SIZE_MAX - sizeof header) / sizeof(mp_limb_t))
+        return 0;
+    if ((buf = malloc(sizeof header + n * sizeof(mp_limb_t))) == NULL)
+        return 0;
+    memcpy(buf, &header, sizeof header);
+    r = fread(buf + sizeof header, sizeof(mp_limb_t), n, fp) == n
+        && fmpz_bin_get(x, buf, buf + sizeof header + n * sizeof(mp_limb_t));
+    free(buf);
+    return r;
 }
 
-static int fmpz_poly_fread_raw(FILE * file, fmpz_poly_t poly)
+static int fmpz_vec_fwrite_bin(FILE *fp, const fmpz *vec, slong len)
 {
+    unsigned char *buf, *p;
+    size_t size = 0;
     int r;
-    slong i, len;
-    mpz_t t;
-
-    mpz_init(t);
-    r = mpz_inp_str(t, file, 10);
-    if (r == 0)
-    {
-        mpz_clear(t);
+
+    for (slong i = 0; i < len; i++)
+        size += fmpz_bin_size(vec + i);
+    if ((buf = p = malloc(size ? size : 1)) == NULL)
+        return 0;
+    for (slong i = 0; i < len; i++)
+        p = fmpz_bin_put(p, vec + i);
+    r = write_u64(fp, len) && write_u64(fp, size)
+        && fwrite(buf, 1, size, fp) == size;
+    free(buf);
+    return r;
+}
+
+/* Reads the length of a vector and all of its coefficients, which the
+ * caller decodes with fmpz_vec_bin_get and then frees */
+static int fmpz_vec_fread_bin(FILE *fp, slong *len, unsigned char **buf,
+                              size_t *size)
+{
+    uint64_t n, bytes;
+
+    if (!read_u64(fp, &n) || !read_u64(fp, &bytes) || n > WORD_MAX
+        || n > bytes / sizeof(uint64_t) || bytes > SIZE_MAX)
+        return 0;
+    /* bytes comes from the file, so a corrupt length fails here or in the
+     * fread below rather than being trusted */
+    if ((*buf = malloc(bytes ? bytes : 1)) == NULL)
+        return 0;
+    if (fread(*buf, 1, bytes, fp) != bytes) {
+        free(*buf);
         return 0;
     }
-    if (!mpz_fits_slong_p(t))
-    {
-        flint_printf("Exception (fmpz_poly_fread). Length does not fit into a slong.\n");
-        abort();
+    *len = n;
+    *size = bytes;
+    return 1;
+}
+
+static int fmpz_vec_bin_get(fmpz *vec, slong len, const unsigned char *buf,
+                            size_t size)
+{
+    const unsigned char *const end = buf + size;
+
+    for (slong i = 0; i < len; i++) {
+        if ((buf = fmpz_bin_get(vec + i, buf, end)) == NULL)
+            return 0;
     }
-    len = flint_mpz_get_si(t);
-    mpz_clear(t);
+    return buf == end;
+}
 
+static int fmpz_poly_fwrite_bin(FILE *fp, const fmpz_poly_t poly)
+{
+    return fmpz_vec_fwrite_bin(fp, poly->coeffs, poly->length);
+}
+
+static int fmpz_poly_fread_bin(FILE *fp, fmpz_poly_t poly)
+{
+    unsigned char *buf;
+    size_t size;
+    slong len;
+    int r;
+
+    if (!fmpz_vec_fread_bin(fp, &len, &buf, &size))
+        return 0;
     fmpz_poly_fit_length(poly, len);
+    r = fmpz_vec_bin_get(poly->coeffs, len, buf, size);
+    _fmpz_poly_set_length(poly, r ? len : 0);
+    _fmpz_poly_normalise(poly);
+    free(buf);
+    return r;
+}
+
+static int fmpq_poly_fwrite_bin(FILE *fp, const fmpq_poly_t poly)
+{
+    return fmpz_fwrite_bin(fp, poly->den)
+        && fmpz_vec_fwrite_bin(fp, poly->coeffs, poly->length);
+}
 
-    for (i = 0; i < len; i++)
-    {
-        r = fmpz_inp_raw(poly->coeffs + i, file);
-        if (r <= 0)
-            return r;
+static int fmpq_poly_fread_bin(FILE *fp, fmpq_poly_t poly)
+{
+    unsigned char *buf;
+    size_t size;
+    slong len;
+    fmpz_t den;
+    int r;
+
+    fmpz_init(den);
+    if (!fmpz_fread_bin(fp, den) || fmpz_is_zero(den)
+        || !fmpz_vec_fread_bin(fp, &len, &buf, &size)) {
+        fmpz_clear(den);
+        return 0;
     }
+    fmpq_poly_fit_length(poly, len);
+    r = fmpz_vec_bin_get(poly->coeffs, len, buf, size);
+    fmpz_swap(poly->den, den);
+    _fmpq_poly_set_length(poly, r ? len : 0);
+    _fmpq_poly_normalise(poly);
+    fmpz_clear(den);
+    free(buf);
+    return r;
+}
 
-    _fmpz_poly_set_length(poly, len);
-    _fmpz_poly_normalise(poly);
+/* The modulus, then the coefficients */
+static int fmpz_mod_poly_fwrite_bin(FILE *fp, const fmpz_mod_poly_t poly)
+{
+    return fmpz_fwrite_bin(fp, &poly->p)
+        && fmpz_vec_fwrite_bin(fp, poly->coeffs, poly->length);
+}
+
+/* A polynomial read but not yet decoded, so that the slow part of loading
+ * many of them can run in parallel */
+struct mod_poly_blob {
+    fmpz_t p;
+    slong len;
+    unsigned char *buf;
+    size_t size;
+};
 
+/* Returns 0, leaving nothing to clear, if the polynomial is not all there */
+static int fmpz_mod_poly_fread_blob(FILE *fp, struct mod_poly_blob *blob)
+{
+    fmpz_init(blob->p);
+    if (!fmpz_fread_bin(fp, blob->p) || fmpz_sgn(blob->p) <= 0
+        || !fmpz_vec_fread_bin(fp, &blob->len, &blob->buf, &blob->size)) {
+        fmpz_clear(blob->p);
+        return 0;
+    }
     return 1;
 }
 
+static void fmpz_mod_poly_blob_clear(struct mod_poly_blob *blob)
+{
+    fmpz_clear(blob->p);
+    free(blob->buf);
+}
 
-static int _fmpz_poly_fprint_raw(FILE * file, const fmpz * vec, slong len)
+/* Initializes poly and clears the blob.  The coefficients were reduced when
+ * they were written, so they go straight into place. */
+static int fmpz_mod_poly_blob_get(fmpz_mod_poly_t poly,
+                                  struct mod_poly_blob *blob)
 {
     int r;
-    slong i;
-
-    r = flint_fprintf(file, "%li", len);
-    if ((len > 0) && (r > 0))
-    {
-        for (i = 0; (i < len) && (r > 0); i++)
-        {
-            r = fmpz_out_raw(file, vec + i);
-        }
-    }
 
+    fmpz_mod_poly_init(poly, blob->p);
+    fmpz_mod_poly_fit_length(poly, blob->len);
+    r = fmpz_vec_bin_get(poly->coeffs, blob->len, blob->buf, blob->size);
+    _fmpz_mod_poly_set_length(poly, r ? blob->len : 0);
+    _fmpz_mod_poly_normalise(poly);
+    fmpz_mod_poly_blob_clear(blob);
     return r;
 }
 
-static int fmpz_poly_fprint_raw(FILE * file, const fmpz_poly_t poly)
+/* Initializes poly, with modulus q if it could not be read */
+static int fmpz_mod_poly_fread_bin(FILE *fp, fmpz_mod_poly_t poly,
+                                   const fmpz_t q)
 {
-    return _fmpz_poly_fprint_raw(file, poly->coeffs, poly->length);
+    struct mod_poly_blob blob;
+
+    if (!fmpz_mod_poly_fread_blob(fp, &blob)) {
+        fmpz_mod_poly_init(poly, q);
+        return 0;
+    }
+    return fmpz_mod_poly_blob_get(poly, &blob);
 }
 
+/* The precision, kind and exponent, then the significand's limbs */
+static int mpfr_fwrite_bin(FILE *fp, const mpfr_t x)
+{
+    const mpfr_prec_t prec = mpfr_get_prec(x);
+    const int kind = mpfr_custom_get_kind(x);
+    const int64_t exp = kind == MPFR_REGULAR_KIND || kind == -MPFR_REGULAR_KIND
+        ? mpfr_custom_get_exp(x) : 0;
+
+    return write_u64(fp, prec) && write_u64(fp, (uint64_t) (int64_t) kind)
+        && write_u64(fp, (uint64_t) exp)
+        && fwrite(mpfr_custom_get_significand(x), mpfr_custom_get_size(prec),
+                  1, fp) == 1;
+}
 
+/* Whether a kind, exponent and significand read from a file make a valid
+ * number: mpfr_custom_init_set trusts all three */
+static int mpfr_bin_valid(int64_t kind, int64_t exp, mpfr_prec_t prec,
+                          const mp_limb_t *d)
+{
+    const size_t n = (prec + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+    const unsigned int unused = n * GMP_NUMB_BITS - prec;
+
+    switch (kind < 0 ? -kind : kind) {
+    case MPFR_NAN_KIND:
+    case MPFR_INF_KIND:
+    case MPFR_ZERO_KIND:
+        return 1;
+    case MPFR_REGULAR_KIND:
+        /* Normalized, with the bits past the precision clear */
+        return exp >= mpfr_get_emin() && exp <= mpfr_get_emax()
+            && d[n - 1] >> (GMP_NUMB_BITS - 1) == 1
+            && (unused == 0 || (d[0] & (((mp_limb_t) 1 << unused) - 1)) == 0);
+    default:
+        return 0;
+    }
+}
 
-static int _fmpz_mod_poly_fprint_raw(FILE * file, const fmpz *poly, slong len,
-                                     const fmpz_t p)
+static int mpfr_fread_bin(FILE *fp, mpfr_t x)
 {
+    uint64_t prec, kind, exp;
+    mpfr_t t;
+    void *d;
     int r;
-    slong i;
-
-    r = flint_fprintf(file, "%wd ", len);
-    if (r <= 0)
-        return r;
-
-    r = fmpz_out_raw(file, p);
-    if (r <= 0)
-        return r;
-
-    if (len == 0)
-        return r;
-
-    r = flint_fprintf(file, " ");
-    if (r <= 0)
-        return r;
-
-    for (i = 0; (r > 0) && (i < len); i++)
-    {
-        r = flint_fprintf(file, " ");
-        if (r <= 0)
-            return r;
-        r = fmpz_out_raw(file, poly + i);
-        if (r <= 0)
-            return r;
+
+    if (!read_u64(fp, &prec) || !read_u64(fp, &kind) || !read_u64(fp, &exp)
+        || prec < MPFR_PREC_MIN || prec > MPFR_PREC_MAX)
+        return 0;
+    if ((d = malloc(mpfr_custom_get_size(prec))) == NULL)
+        return 0;
+    r = fread(d, mpfr_custom_get_size(prec), 1, fp) == 1
+        && mpfr_bin_valid((int64_t) kind, (int64_t) exp, prec, d);
+    if (r) {
+        mpfr_custom_init_set(t, (int) (int64_t) kind, (mpfr_exp_t) exp, prec, d);
+        mpfr_set_prec(x, prec);
+        mpfr_set(x, t, MPFR_RNDN);
     }
+    free(d);
+    return r;
+}
 
+/* Returns 0, leaving nothing to clear, if fp does not hold whole parameters */
+static int fread_gghlite_params(FILE *fp, gghlite_params_t params) {
+    fmpz_mod_poly_struct *const polys[] = {
+        params->pzt, params->ntt->w, params->ntt->w_inv, params->ntt->phi,
+        params->ntt->phi_inv,
+    };
+    char magic[sizeof GGHLITE_MAGIC];
+    uint64_t version, lambda, kappa, gamma, n, ell, rerand_mask, flags;
+    uint64_t ntt_n = 0;
+    int r;
+
+    if (fread(magic, sizeof magic, 1, fp) != 1
+        || memcmp(magic, GGHLITE_MAGIC, sizeof magic) != 0
+        || !read_u64(fp, &version) || version != GGHLITE_VERSION) {
+        debug_printf("ERROR: not a version %d gghlite file\n", GGHLITE_VERSION);
+        return 0;
+    }
+    if (!read_u64(fp, &lambda) || !read_u64(fp, &gamma) || !read_u64(fp, &kappa)
+        || !read_u64(fp, &n) || !read_u64(fp, &ell)
+        || !read_u64(fp, &rerand_mask) || !read_u64(fp, &flags))
+        return 0;
+
+    gghlite_params_initzero(params, lambda, kappa, gamma);
+    params->n = n;
+    params->ell = ell;
+    params->rerand_mask = rerand_mask;
+    params->flags = flags;
+
+    r = fmpz_fread_bin(fp, params->q)
+        && mpfr_fread_bin(fp, params->sigma)
+        && mpfr_fread_bin(fp, params->sigma_p)
+        && mpfr_fread_bin(fp, params->sigma_s)
+        && mpfr_fread_bin(fp, params->ell_b)
+        && mpfr_fread_bin(fp, params->ell_g)
+        && mpfr_fread_bin(fp, params->xi);
+    /* Every polynomial is initialized, read or not, so that the parameters
+     * can be cleared */
+    for (size_t i = 0; i < sizeof polys / sizeof polys[0]; i++) {
+        if (r && i == 1)
+            r = read_u64(fp, &ntt_n);
+        if (r)
+            r = fmpz_mod_poly_fread_bin(fp, polys[i], params->q);
+        else
+            fmpz_mod_poly_init(polys[i], params->q);
+    }
+    params->ntt->n = ntt_n;
+    if (!r) {
+        debug_printf("ERROR: truncated gghlite parameters\n");
+        gghlite_params_clear(params);
+    }
     return r;
 }
 
-static int fmpz_mod_poly_fprint_raw(FILE * file, const fmpz_mod_poly_t poly)
-{
-    return _fmpz_mod_poly_fprint_raw(file, poly->coeffs, poly->length,
-                                     &(poly->p));
+static int fwrite_gghlite_params(FILE *fp, const gghlite_params_t params) {
+    return fwrite(GGHLITE_MAGIC, sizeof GGHLITE_MAGIC, 1, fp) == 1
+        && write_u64(fp, GGHLITE_VERSION)
+        && write_u64(fp, params->lambda)
+        && write_u64(fp, params->gamma)
+        && write_u64(fp, params->kappa)
+        && write_u64(fp, params->n)
+        && write_u64(fp, params->ell)
+        && write_u64(fp, params->rerand_mask)
+        && write_u64(fp, params->flags)
+        && fmpz_fwrite_bin(fp, params->q)
+        && mpfr_fwrite_bin(fp, params->sigma)
+        && mpfr_fwrite_bin(fp, params->sigma_p)
+        && mpfr_fwrite_bin(fp, params->sigma_s)
+        && mpfr_fwrite_bin(fp, params->ell_b)
+        && mpfr_fwrite_bin(fp, params->ell_g)
+        && mpfr_fwrite_bin(fp, params->xi)
+        && fmpz_mod_poly_fwrite_bin(fp, params->pzt)
+        && write_u64(fp, params->ntt->n)
+        && fmpz_mod_poly_fwrite_bin(fp, params->ntt->w)
+        && fmpz_mod_poly_fwrite_bin(fp, params->ntt->w_inv)
+        && fmpz_mod_poly_fwrite_bin(fp, params->ntt->phi)
+        && fmpz_mod_poly_fwrite_bin(fp, params->ntt->phi_inv);
 }
 
-/* copied from fmpz_mod_poly_fread, mostly (but fixed) */
-static int fmpz_mod_poly_fread_raw(FILE * f, fmpz_mod_poly_t poly)
-{
-    slong i, length;
-    fmpz_t coeff;
-    ulong res;
+/* Returns 0, leaving nothing to clear, if fp does not hold a whole key */
+static int fread_gghlite_sk(FILE *fp, gghlite_sk_t gghlite_self) {
+    uint64_t t = ggh_walltime(0);
+    struct mod_poly_blob *blobs = NULL;
+    size_t gamma, nread = 0;
+    int ok;
 
-    fmpz_init(coeff);
-    if (flint_fscanf(f, "%wd ", &length) != 1) {
-        fmpz_clear(coeff);
+    timer_printf("Starting reading gghlite params...\n");
+    if (!fread_gghlite_params(fp, gghlite_self->params))
         return 0;
+    timer_printf("Finished reading gghlite params %8.2fs\n",
+                 ggh_seconds(ggh_walltime(t)));
+
+    t = ggh_walltime(0);
+    timer_printf("Starting reading g, g_inv, h...\n");
+    fmpz_poly_init(gghlite_self->g);
+    fmpq_poly_init(gghlite_self->g_inv);
+    fmpz_poly_init(gghlite_self->h);
+    if (!fmpz_poly_fread_bin(fp, gghlite_self->g)
+        || !fmpq_poly_fread_bin(fp, gghlite_self->g_inv)
+        || !fmpz_poly_fread_bin(fp, gghlite_self->h)) {
+        debug_printf("ERROR: truncated gghlite g, g_inv or h\n");
+        goto clear_polys;
     }
+    timer_printf("Finished reading g, g_inv, h %8.2fs\n",
+                 ggh_seconds(ggh_walltime(t)));
 
-    fmpz_inp_raw(coeff,f);
-    fmpz_mod_poly_init(poly, coeff);
-    fmpz_mod_poly_fit_length(poly, length);
+    t = ggh_walltime(0);
+    timer_printf("Starting reading z, z_inv...\n");
+    gamma = gghlite_self->params->gamma;
+    gghlite_self->z = gghlite_self->z_inv = NULL;
+    ok = gamma <= SIZE_MAX / (2 * sizeof blobs[0])
+        && (blobs = malloc(2 * gamma * sizeof blobs[0])) != NULL
+        && (gghlite_self->z = malloc(gamma * sizeof(gghlite_enc_t))) != NULL
+        && (gghlite_self->z_inv = malloc(gamma * sizeof(gghlite_enc_t))) != NULL;
+    while (ok && nread < 2 * gamma) {
+        if (fmpz_mod_poly_fread_blob(fp, &blobs[nread]))
+            nread++;
+        else
+            ok = 0;
+    }
+    if (!ok) {
+        debug_printf("ERROR: truncated gghlite z or z_inv\n");
+        for (size_t i = 0; i < nread; i++)
+            fmpz_mod_poly_blob_clear(&blobs[i]);
+        goto free_z;
+    }
+    timer_printf("Finished reading z, z_inv %8.2fs\n",
+                 ggh_seconds(ggh_walltime(t)));
 
-    poly->length = length;
-    flint_fscanf(f, " ");
+    t = ggh_walltime(0);
+    timer_printf("Starting decoding z, z_inv...\n");
+#pragma omp parallel for schedule(dynamic, 1) reduction(&:ok)
+    for (size_t i = 0; i < 2 * gamma; i++) {
+        fmpz_mod_poly_struct *const poly = i % 2
+            ? gghlite_self->z_inv[i / 2] : gghlite_self->z[i / 2];
+        ok &= fmpz_mod_poly_blob_get(poly, &blobs[i]);
+    }
+    timer_printf("Finished decoding z, z_inv %8.2fs\n",
+                 ggh_seconds(ggh_walltime(t)));
+    if (!ok) {
+        debug_printf("ERROR: malformed gghlite z or z_inv\n");
+        for (size_t i = 0; i < gamma; i++) {
+            fmpz_mod_poly_clear(gghlite_self->z[i]);
+            fmpz_mod_poly_clear(gghlite_self->z_inv[i]);
+        }
+        goto free_z;
+    }
+    free(blobs);
 
-    for (i = 0; i < length; i++)
-    {
-        flint_fscanf(f, " ");
-        res = fmpz_inp_raw(coeff, f);
+    /* The key format does not store the D_g sampler, so it is rebuilt from
+     * g and sigma_p on every load, once the rest of the key is in place.
+     * gghlite parallelizes this setup on its own. */
+    t = ggh_walltime(0);
+    timer_printf("Starting setting D_g...\n");
+    gghlite_sk_set_D_g(gghlite_self);
+    timer_printf("Finished setting D_g %8.2fs\n",
+                 ggh_seconds(ggh_walltime(t)));
+    aes_randstate_fread(gghlite_self->rng, fp);
+    return 1;
 
-        fmpz_mod_poly_set_coeff_fmpz(poly,i,coeff);
+free_z:
+    free(blobs);
+    free(gghlite_self->z);
+    free(gghlite_self->z_inv);
+clear_polys:
+    fmpz_poly_clear(gghlite_self->g);
+    fmpq_poly_clear(gghlite_self->g_inv);
+    fmpz_poly_clear(gghlite_self->h);
+    gghlite_params_clear(gghlite_self->params);
+    return 0;
+}
 
-        if (!res)
-        {
-            poly->length = i;
-            fmpz_clear(coeff);
-            return 0;
-        }
+static int fwrite_gghlite_sk(FILE *fp, gghlite_sk_t gghlite_self) {
+    uint64_t t = ggh_walltime(0);
+    int r;
+
+    timer_printf("Starting writing gghlite params...\n");
+    r = fwrite_gghlite_params(fp, gghlite_self->params);
+    timer_printf("Finished writing gghlite params %8.2fs\n",
+                 ggh_seconds(ggh_walltime(t)));
+
+    t = ggh_walltime(0);
+    timer_printf("Starting writing g, g_inv, h...\n");
+    r = r && fmpz_poly_fwrite_bin(fp, gghlite_self->g)
+        && fmpq_poly_fwrite_bin(fp, gghlite_self->g_inv)
+        && fmpz_poly_fwrite_bin(fp, gghlite_self->h);
+    timer_printf("Finished writing g, g_inv, h %8.2fs\n",
+                 ggh_seconds(ggh_walltime(t)));
+
+    t = ggh_walltime(0);
+    timer_printf("Starting writing z, z_inv...\n");
+    for (size_t i = 0; r && i < gghlite_self->params->gamma; i++) {
+        r = fmpz_mod_poly_fwrite_bin(fp, gghlite_self->z[i])
+            && fmpz_mod_poly_fwrite_bin(fp, gghlite_self->z_inv[i]);
+        timer_printf("\r    Progress: [%zu / %zu] %8.2fs",
+                     i, gghlite_self->params->gamma, ggh_seconds(ggh_walltime(t)));
     }
+    timer_printf("\n");
+    timer_printf("Finished writing z, z_inv %8.2fs\n",
+                 ggh_seconds(ggh_walltime(t)));
+    if (!r) {
+        debug_printf("ERROR: failed writing gghlite secret key\n");
+        return 0;
+    }
+    aes_randstate_fwrite(gghlite_self->rng, fp);
+    return 1;
+}
 
-    fmpz_clear(coeff);
-    _fmpz_mod_poly_normalise(poly);
+static int gghlite_enc_fwrite_bin(FILE *fp, const gghlite_enc_t enc)
+{
+    return fmpz_mod_poly_fwrite_bin(fp, enc);
+}
+
+/* Leaves enc uninitialized on failure */
+static int gghlite_enc_fread_bin(FILE *fp, gghlite_enc_t enc)
+{
+    struct mod_poly_blob blob;
 
+    if (!fmpz_mod_poly_fread_blob(fp, &blob))
+        return 0;
+    if (!fmpz_mod_poly_blob_get(enc, &blob)) {
+        fmpz_mod_poly_clear(enc);
+        return 0;
+    }
     return 1;
 }
 
 static const mmap_enc_vtable gghlite_enc_vtable =
-{ .init = gghlite_enc_init_wrapper
-  , .clear = gghlite_enc_clear_wrapper
-  , .fread = gghlite_enc_fread_raw_wrapper
-  , .fwrite = gghlite_enc_fprint_raw_wrapper
+{ .new = gghlite_enc_new_wrapper
+  , .free = gghlite_enc_free_wrapper
+  , .fread = gghlite_enc_fread_wrapper
+  , .fwrite = gghlite_enc_fwrite_wrapper
   , .set = gghlite_enc_set_wrapper
+  , .swap = gghlite_enc_swap_wrapper
   , .add = gghlite_enc_add_wrapper
   , .sub = gghlite_enc_sub_wrapper
   , .mul = gghlite_enc_mul_wrapper
@@ -494,12 +816,11 @@ static const mmap_enc_vtable gghlite_enc_vtable =
   , .encode = gghlite_enc_set_gghlite_clr_wrapper
   , .degree = NULL
   , .print = NULL
-  , .size = sizeof(gghlite_enc_t)
 };
 
-
 const mmap_vtable gghlite_vtable =
 { .pp  = &gghlite_pp_vtable
   , .sk  = &gghlite_sk_vtable
   , .enc = &gghlite_enc_vtable
+  , .name = "gghlite"
 };
@@ -0,0 +1,481 @@
+#include "mmap.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Backend methods do not get their vtable, so each decorated vtable needs
+ * methods of its own that know which backend to forward to.  They are
+ * generated for a fixed number of slots from the method lists below, which
+ * give each method's group, name, return type (for methods returning
+ * values), parameters and arguments. */
+
+#define INSTRUMENT_SLOTS 4
+
+#define PP_OPS(V, R, S)                                                 \
+    V(S, pp, free, (const mmap_pp pp), (pp))                            \
+    R(S, pp, fread, mmap_pp, (FILE *fp), (fp))                          \
+    R(S, pp, fwrite, int, (const mmap_pp pp, FILE *fp), (pp, fp))       \
+    R(S, pp, serialized_size, size_t, (const mmap_pp pp), (pp))         \
+    R(S, pp, to_buf, int, (const mmap_pp pp, void *buf, size_t size),   \
+      (pp, buf, size))                                                  \
+    R(S, pp, from_buf, mmap_pp, (const void *buf, size_t size), (buf, size))
+
+#define SK_OPS(V, R, S)                                                 \
+    R(S, sk, new, mmap_sk,                                              \
+      (const mmap_sk_params *params, const mmap_sk_opt_params *opts,    \
+       size_t ncores, aes_randstate_t rng, bool verbose),               \
+      (params, opts, ncores, rng, verbose))                             \
+    V(S, sk, free, (mmap_sk sk), (sk))                                  \
+    R(S, sk, fread, mmap_sk, (FILE *fp), (fp))                          \
+    R(S, sk, fwrite, int, (const mmap_sk sk, FILE *fp), (sk, fp))       \
+    R(S, sk, serialized_size, size_t, (const mmap_sk sk), (sk))         \
+    R(S, sk, to_buf, int, (const mmap_sk sk, void *buf, size_t size),   \
+      (sk, buf, size))                                                  \
+    R(S, sk, from_buf, mmap_sk, (const void *buf, size_t size), (buf, size)) \
+    R(S, sk, pp, mmap_pp, (mmap_sk sk), (sk))                           \
+    R(S, sk, plaintext_fields, mpz_t *, (const mmap_sk sk), (sk))       \
+    R(S, sk, nslots, size_t, (const mmap_sk sk), (sk))                  \
+    R(S, sk, nzs, size_t, (const mmap_sk sk), (sk))
+
+#define ENC_OPS(V, R, S)                                                \
+    R(S, enc, new, mmap_enc, (const mmap_pp pp), (pp))                  \
+    V(S, enc, free, (mmap_enc enc), (enc))                              \
+    R(S, enc, fread, mmap_enc, (FILE *fp), (fp))                        \
+    R(S, enc, fwrite, int, (const mmap_enc enc, FILE *fp), (enc, fp))   \
+    R(S, enc, serialized_size, size_t, (const mmap_enc enc), (enc))     \
+    R(S, enc, to_buf, int, (const mmap_enc enc, void *buf, size_t size), \
+      (enc, buf, size))                                                 \
+    R(S, enc, from_buf, mmap_enc, (const void *buf, size_t size), (buf, size)) \
+    R(S, enc, compatible, bool, (const mmap_enc enc, const mmap_pp pp),  \
+      (enc, pp))                                                        \
+    V(S, enc, set, (mmap_enc dest, const mmap_enc src), (dest, src))    \
+    V(S, enc, swap, (mmap_enc *a, mmap_enc *b), (a, b))                 \
+    R(S, enc, add, int,                                                 \
+      (mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b), \
+      (dest, pp, a, b))                                                 \
+    R(S, enc, sub, int,                                                 \
+      (mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b), \
+      (dest, pp, a, b))                                                 \
+    R(S, enc, mul, int,                                                 \
+      (mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b), \
+      (dest, pp, a, b))                                                 \
+    R(S, enc, fma, int,                                                 \
+      (mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b), \
+      (dest, pp, a, b))                                                 \
+    R(S, enc, dot, int,                                                 \
+      (mmap_enc dest, const mmap_pp pp, const mmap_enc *as,             \
+       const mmap_enc *bs, size_t n),                                   \
+      (dest, pp, as, bs, n))                                            \
+    R(S, enc, is_zero, bool, (const mmap_enc enc, const mmap_pp pp), (enc, pp)) \
+    V(S, enc, is_zero_batch,                                            \
+      (bool *results, const mmap_enc *encs, size_t count, const mmap_pp pp), \
+      (results, encs, count, pp))                                       \
+    R(S, enc, encode, int,                                              \
+      (mmap_enc enc, const mmap_sk sk, size_t n, const mpz_t *plaintext, \
+       const int *pows, size_t level),                                  \
+      (enc, sk, n, plaintext, pows, level))                             \
+    R(S, enc, encode_batch, int,                                        \
+      (mmap_enc *encs, const mmap_sk sk, size_t count, size_t n,        \
+       const mpz_t *const *plaintexts, const int *const *pows, size_t level), \
+      (encs, sk, count, n, plaintexts, pows, level))                    \
+    R(S, enc, degree, unsigned int, (const mmap_enc enc), (enc))        \
+    V(S, enc, print, (const mmap_enc enc), (enc))                       \
+    R(S, enc, size, size_t, (const mmap_pp pp), (pp))                   \
+    V(S, enc, init, (mmap_enc enc, const mmap_pp pp), (enc, pp))        \
+    V(S, enc, clear, (mmap_enc enc), (enc))                             \
+    R(S, enc, payload_size, size_t, (const mmap_pp pp), (pp))           \
+    V(S, enc, payload_write, (void *buf, const mmap_enc enc, const mmap_pp pp), \
+      (buf, enc, pp))                                                   \
+    R(S, enc, payload_view, mmap_enc, (const mmap_pp pp, const void *buf), \
+      (pp, buf))
+
+#define ALL_OPS(V, R, S) PP_OPS(V, R, S) SK_OPS(V, R, S) ENC_OPS(V, R, S)
+
+#define OP_ENUM_V(S, g, n, p, a) OP_##g##_##n,
+#define OP_ENUM_R(S, g, n, t, p, a) OP_##g##_##n,
+enum { ALL_OPS(OP_ENUM_V, OP_ENUM_R, 0) NOPS };
+_Static_assert(NOPS == MMAP_INSTRUMENT_NOPS, "MMAP_INSTRUMENT_NOPS is stale");
+
+#define OP_NAME_V(S, g, n, p, a) #g "." #n,
+#define OP_NAME_R(S, g, n, t, p, a) #g "." #n,
+static const char *const op_names[NOPS] = { ALL_OPS(OP_NAME_V, OP_NAME_R, 0) };
+
+/* Latencies in nanoseconds go into log-linear buckets, HDR style: values
+ * below 2^SUB_BITS get a bucket each, and every larger power-of-two range is
+ * split into 2^SUB_BITS buckets, so a bucket is within 1/2^SUB_BITS of any
+ * value in it. */
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define NBUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+static unsigned
+bucket_of(uint64_t ns)
+{
+    unsigned e;
+
+    if (ns < SUB_COUNT)
+        return ns;
+    e = 63 - __builtin_clzll(ns);
+    return (e - SUB_BITS + 1) * SUB_COUNT
+        + ((ns >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* The largest value in bucket b */
+static uint64_t
+bucket_max(unsigned b)
+{
+    const unsigned e = b / SUB_COUNT + SUB_BITS - 1;
+
+    if (b < SUB_COUNT)
+        return b;
+    return ((uint64_t) (SUB_COUNT + b % SUB_COUNT + 1) << (e - SUB_BITS)) - 1;
+}
+
+/* Counters of one thread for one slot.  Only that thread and reset write
+ * them, with relaxed atomics so that merging may read them at any time. */
+struct op_counters {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t hist[NBUCKETS];
+};
+
+struct thread_counters {
+    struct thread_counters *next;
+    struct op_counters ops[NOPS];
+};
+
+/* The decorated vtable.  It is filled in once with memcpy, as its members
+ * are const. */
+struct decorated {
+    mmap_vtable vt;
+    mmap_pp_vtable pp;
+    mmap_sk_vtable sk;
+    mmap_enc_vtable enc;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct {
+        const mmap_vtable *inner;
+        struct decorated *dec;
+        unsigned gen;                   // bumped whenever the slot is freed
+        struct thread_counters *threads;
+    } slots[INSTRUMENT_SLOTS];
+} instrument = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct {
+    unsigned gen;
+    struct thread_counters *counters;
+} tls[INSTRUMENT_SLOTS];
+
+static struct thread_counters *
+thread_counters_new(int s)
+{
+    struct thread_counters *tc = calloc(1, sizeof tc[0]);
+
+    assert(tc);
+    for (size_t op = 0; op < NOPS; ++op)
+        tc->ops[op].min_ns = UINT64_MAX;
+    pthread_mutex_lock(&instrument.lock);
+    tc->next = instrument.slots[s].threads;
+    instrument.slots[s].threads = tc;
+    tls[s].gen = instrument.slots[s].gen;
+    tls[s].counters = tc;
+    pthread_mutex_unlock(&instrument.lock);
+    return tc;
+}
+
+static inline uint64_t
+op_begin(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define RELAXED_ADD(p, x) \
+    __atomic_store_n((p), __atomic_load_n((p), __ATOMIC_RELAXED) + (x), \
+                     __ATOMIC_RELAXED)
+
+static inline void
+op_end(int s, int op, uint64_t start)
+{
+    const uint64_t ns = op_begin() - start;
+    struct thread_counters *tc = tls[s].counters;
+    struct op_counters *c;
+
+    if (tc == NULL
+        || tls[s].gen != __atomic_load_n(&instrument.slots[s].gen,
+                                         __ATOMIC_RELAXED))
+        tc = thread_counters_new(s);
+    c = &tc->ops[op];
+    RELAXED_ADD(&c->calls, 1);
+    RELAXED_ADD(&c->total_ns, ns);
+    RELAXED_ADD(&c->hist[bucket_of(ns)], 1);
+    if (ns < __atomic_load_n(&c->min_ns, __ATOMIC_RELAXED))
+        __atomic_store_n(&c->min_ns, ns, __ATOMIC_RELAXED);
+    if (ns > __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED))
+        __atomic_store_n(&c->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+#define INNER(S) (instrument.slots[S].inner)
+
+#define TRAMPOLINE_V(S, g, n, p, a)                                     \
+    static void                                                         \
+    slot##S##_##g##_##n p                                               \
+    {                                                                   \
+        const uint64_t start = op_begin();                              \
+        INNER(S)->g->n a;                                               \
+        op_end(S, OP_##g##_##n, start);                                 \
+    }
+#define TRAMPOLINE_R(S, g, n, t, p, a)                                  \
+    static t                                                            \
+    slot##S##_##g##_##n p                                               \
+    {                                                                   \
+        const uint64_t start = op_begin();                              \
+        t ret = INNER(S)->g->n a;                                       \
+        op_end(S, OP_##g##_##n, start);                                 \
+        return ret;                                                     \
+    }
+
+/* Methods the backend lacks stay NULL, since callers test for them */
+#define INIT_V(S, g, n, p, a) .n = inner->g->n ? slot##S##_##g##_##n : NULL,
+#define INIT_R(S, g, n, t, p, a) INIT_V(S, g, n, p, a)
+
+#define DEFINE_SLOT(S)                                                  \
+    ALL_OPS(TRAMPOLINE_V, TRAMPOLINE_R, S)                              \
+    static void                                                         \
+    slot##S##_init(struct decorated *dec, const mmap_vtable *inner)     \
+    {                                                                   \
+        const mmap_pp_vtable pp = { PP_OPS(INIT_V, INIT_R, S) };        \
+        const mmap_sk_vtable sk = { SK_OPS(INIT_V, INIT_R, S) };        \
+        const mmap_enc_vtable enc = { ENC_OPS(INIT_V, INIT_R, S) };     \
+        memcpy(&dec->pp, &pp, sizeof pp);                               \
+        memcpy(&dec->sk, &sk, sizeof sk);                               \
+        memcpy(&dec->enc, &enc, sizeof enc);                            \
+    }
+
+DEFINE_SLOT(0)
+DEFINE_SLOT(1)
+DEFINE_SLOT(2)
+DEFINE_SLOT(3)
+
+static void (*const slot_init[INSTRUMENT_SLOTS])(struct decorated *,
+                                                 const mmap_vtable *) = {
+    slot0_init, slot1_init, slot2_init, slot3_init,
+};
+
+/* The slot of a decorated vtable, or -1; call with the lock held */
+static int
+slot_of(const mmap_vtable *vt)
+{
+    for (int s = 0; s < INSTRUMENT_SLOTS; ++s) {
+        if (instrument.slots[s].dec && &instrument.slots[s].dec->vt == vt)
+            return s;
+    }
+    return -1;
+}
+
+const mmap_vtable *
+mmap_vtable_instrument(const_mmap_vtable inner)
+{
+    struct decorated *dec;
+    int s;
+
+    pthread_mutex_lock(&instrument.lock);
+    for (s = 0; s < INSTRUMENT_SLOTS; ++s) {
+        if (instrument.slots[s].inner == NULL)
+            break;
+    }
+    if (s == INSTRUMENT_SLOTS) {
+        pthread_mutex_unlock(&instrument.lock);
+        return NULL;
+    }
+    dec = malloc(sizeof dec[0]);
+    assert(dec);
+    slot_init[s](dec, inner);
+    {
+        const mmap_vtable vt = {
+            .pp = &dec->pp,
+            .sk = &dec->sk,
+            .enc = &dec->enc,
+            .name = inner->name,
+        };
+        memcpy(&dec->vt, &vt, sizeof vt);
+    }
+    instrument.slots[s].inner = inner;
+    instrument.slots[s].dec = dec;
+    pthread_mutex_unlock(&instrument.lock);
+    return &dec->vt;
+}
+
+void
+mmap_vtable_instrument_free(const_mmap_vtable vt)
+{
+    struct thread_counters *tc, *next;
+    int s;
+
+    pthread_mutex_lock(&instrument.lock);
+    if ((s = slot_of(vt)) != -1) {
+        for (tc = instrument.slots[s].threads; tc; tc = next) {
+            next = tc->next;
+            free(tc);
+        }
+        free(instrument.slots[s].dec);
+        instrument.slots[s].inner = NULL;
+        instrument.slots[s].dec = NULL;
+        instrument.slots[s].threads = NULL;
+        __atomic_store_n(&instrument.slots[s].gen, instrument.slots[s].gen + 1,
+                         __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&instrument.lock);
+}
+
+void
+mmap_instrument_reset(const_mmap_vtable vt)
+{
+    int s;
+
+    pthread_mutex_lock(&instrument.lock);
+    if ((s = slot_of(vt)) != -1) {
+        /* The owning threads may be counting meanwhile, so store each field
+         * atomically, as they do */
+        for (struct thread_counters *tc = instrument.slots[s].threads; tc;
+             tc = tc->next) {
+            for (size_t op = 0; op < NOPS; ++op) {
+                struct op_counters *const c = &tc->ops[op];
+                __atomic_store_n(&c->calls, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&c->total_ns, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&c->min_ns, UINT64_MAX, __ATOMIC_RELAXED);
+                __atomic_store_n(&c->max_ns, 0, __ATOMIC_RELAXED);
+                for (unsigned b = 0; b < NBUCKETS; ++b)
+                    __atomic_store_n(&c->hist[b], 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&instrument.lock);
+}
+
+/* The smallest bucket maximum covering a fraction q of the calls, but no
+ * more than the largest value seen */
+static uint64_t
+percentile(const uint64_t *hist, uint64_t calls, double q, uint64_t max)
+{
+    const uint64_t rank = (uint64_t) (q * calls + 0.5);
+    uint64_t seen = 0;
+
+    for (unsigned b = 0; b < NBUCKETS; ++b) {
+        seen += hist[b];
+        if (seen >= rank && seen > 0)
+            return bucket_max(b) < max ? bucket_max(b) : max;
+    }
+    return max;
+}
+
+static int
+stats_cmp(const void *a_, const void *b_)
+{
+    const mmap_op_stats *a = a_, *b = b_;
+
+    if (a->total_ns != b->total_ns)
+        return a->total_ns > b->total_ns ? -1 : 1;
+    return strcmp(a->name, b->name);
+}
+
+size_t
+mmap_instrument_stats(const_mmap_vtable vt, mmap_op_stats *stats, size_t n)
+{
+    mmap_op_stats all[NOPS];
+    uint64_t *hist = malloc(NBUCKETS * sizeof hist[0]);
+    size_t count = 0;
+    int s;
+
+    assert(hist);
+    pthread_mutex_lock(&instrument.lock);
+    if ((s = slot_of(vt)) == -1) {
+        pthread_mutex_unlock(&instrument.lock);
+        free(hist);
+        return 0;
+    }
+    for (size_t op = 0; op < NOPS; ++op) {
+        mmap_op_stats st = { .name = op_names[op], .min_ns = UINT64_MAX };
+
+        memset(hist, 0, NBUCKETS * sizeof hist[0]);
+        for (struct thread_counters *tc = instrument.slots[s].threads; tc;
+             tc = tc->next) {
+            struct op_counters *const c = &tc->ops[op];
+            uint64_t x;
+            st.calls += __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+            st.total_ns += __atomic_load_n(&c->total_ns, __ATOMIC_RELAXED);
+            if ((x = __atomic_load_n(&c->min_ns, __ATOMIC_RELAXED)) < st.min_ns)
+                st.min_ns = x;
+            if ((x = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED)) > st.max_ns)
+                st.max_ns = x;
+            for (unsigned b = 0; b < NBUCKETS; ++b)
+                hist[b] += __atomic_load_n(&c->hist[b], __ATOMIC_RELAXED);
+        }
+        if (st.calls == 0)
+            continue;
+        st.p50_ns = percentile(hist, st.calls, 0.50, st.max_ns);
+        st.p90_ns = percentile(hist, st.calls, 0.90, st.max_ns);
+        st.p99_ns = percentile(hist, st.calls, 0.99, st.max_ns);
+        all[count++] = st;
+    }
+    pthread_mutex_unlock(&instrument.lock);
+    free(hist);
+
+    qsort(all, count, sizeof all[0], stats_cmp);
+    if (count > n)
+        count = n;
+    memcpy(stats, all, count * sizeof all[0]);
+    return count;
+}
+
+int
+mmap_instrument_dump(const_mmap_vtable vt, FILE *fp,
+                     mmap_instrument_format format)
+{
+    mmap_op_stats stats[NOPS];
+    const size_t n = mmap_instrument_stats(vt, stats, NOPS);
+    uint64_t total = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < n; ++i)
+        total += stats[i].total_ns;
+    if (format == MMAP_INSTRUMENT_JSON) {
+        ret |= fprintf(fp, "{\"backend\": \"%s\", \"total_ns\": %" PRIu64
+                       ", \"ops\": [", vt->name ? vt->name : "", total) < 0;
+        for (size_t i = 0; i < n; ++i) {
+            const mmap_op_stats *const st = &stats[i];
+            ret |= fprintf(fp, "%s\n  {\"op\": \"%s\", \"calls\": %" PRIu64
+                           ", \"total_ns\": %" PRIu64 ", \"mean_ns\": %" PRIu64
+                           ", \"min_ns\": %" PRIu64 ", \"p50_ns\": %" PRIu64
+                           ", \"p90_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+                           ", \"max_ns\": %" PRIu64 "}",
+                           i ? "," : "", st->name, st->calls, st->total_ns,
+                           st->total_ns / st->calls, st->min_ns, st->p50_ns,
+                           st->p90_ns, st->p99_ns, st->max_ns) < 0;
+        }
+        ret |= fprintf(fp, "\n]}\n") < 0;
+    } else {
+        ret |= fprintf(fp, "%-22s %12s %14s %6s %10s %10s %10s %10s %10s\n",
+                       "op", "calls", "total ns", "%", "mean ns", "p50 ns",
+                       "p90 ns", "p99 ns", "max ns") < 0;
+        for (size_t i = 0; i < n; ++i) {
+            const mmap_op_stats *const st = &stats[i];
+            ret |= fprintf(fp, "%-22s %12" PRIu64 " %14" PRIu64 " %6.2f %10"
+                           PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+                           " %10" PRIu64 "\n",
+                           st->name, st->calls, st->total_ns,
+                           total ? 100.0 * st->total_ns / total : 0.0,
+                           st->total_ns / st->calls, st->p50_ns, st->p90_ns,
+                           st->p99_ns, st->max_ns) < 0;
+        }
+    }
+    return ret ? MMAP_ERR : MMAP_OK;
+}
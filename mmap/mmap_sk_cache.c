@@ -0,0 +1,302 @@
+#include "mmap.h"
+#include "mmap_buf.h"
+#include <assert.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A cache file is a header, the description of everything the key was
+ * generated from (its name is a hash of this), the generator state that key
+ * generation left behind, and the key as sk->fwrite writes it.  Everything
+ * is in host byte order. */
+
+#define CACHE_MAGIC "MMAPKEYC"
+#define CACHE_VERSION 1
+#define CACHE_SUFFIX ".sk"
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t desc_size;
+    uint64_t rng_size;
+    uint64_t sk_size;
+};
+
+struct cache_entry {
+    char *path;
+    off_t size;
+    struct timespec mtime;
+};
+
+static void
+put_u64(FILE *fp, uint64_t x)
+{
+    fwrite(&x, sizeof x, 1, fp);
+}
+
+/* Everything a key depends on, as bytes.  ncores is included because
+ * backends keep it in the key (the dummy backend encodes batches on that many
+ * threads), and a loaded key cannot be given another.  verbose only changes
+ * what key generation prints, so it is left out. */
+static char *
+cache_describe(const mmap_vtable *mmap, const mmap_sk_params *params,
+               const mmap_sk_opt_params *opts, size_t ncores,
+               const void *seed, size_t seed_len, size_t *size)
+{
+    char *desc = NULL;
+    FILE *fp;
+
+    if ((fp = open_memstream(&desc, size)) == NULL)
+        return NULL;
+    fwrite(mmap->name, strlen(mmap->name) + 1, 1, fp);
+    put_u64(fp, params->lambda);
+    put_u64(fp, params->kappa);
+    put_u64(fp, params->gamma);
+    put_u64(fp, params->pows != NULL);
+    for (size_t i = 0; params->pows && i < params->gamma; ++i)
+        put_u64(fp, (uint64_t) (int64_t) params->pows[i]);
+    put_u64(fp, opts != NULL);
+    if (opts) {
+        put_u64(fp, opts->nslots);
+        put_u64(fp, opts->is_polylog);
+        put_u64(fp, opts->modulus != NULL);
+        if (opts->modulus)
+            mpz_out_raw(fp, *opts->modulus);
+    }
+    put_u64(fp, ncores);
+    put_u64(fp, seed_len);
+    fwrite(seed, 1, seed_len, fp);
+    if (fclose(fp) != 0) {
+        free(desc);
+        return NULL;
+    }
+    return desc;
+}
+
+/* FNV-1a */
+static uint64_t
+cache_hash(const char *buf, size_t size)
+{
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char) buf[i];
+        h *= UINT64_C(0x100000001b3);
+    }
+    return h;
+}
+
+/* Loads the key at path if it was generated from exactly desc, restoring
+ * the generator state saved with it into rng, and marks it as used */
+static mmap_sk
+cache_load(const mmap_vtable *mmap, const char *path, const char *desc,
+           size_t desc_size, aes_randstate_t rng)
+{
+    struct cache_header header;
+    struct stat st;
+    mmap_sk sk = NULL;
+    char *buf = NULL;
+    FILE *fp;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+        return NULL;
+    if (fstat(fileno(fp), &st) == -1
+        || fread(&header, sizeof header, 1, fp) != 1
+        || memcmp(header.magic, CACHE_MAGIC, sizeof header.magic) != 0
+        || header.version != CACHE_VERSION
+        || header.desc_size != desc_size
+        || header.rng_size > (uint64_t) st.st_size
+        || header.sk_size > (uint64_t) st.st_size
+        || (uint64_t) st.st_size != sizeof header + header.desc_size
+                                    + header.rng_size + header.sk_size)
+        goto done;
+    buf = malloc(st.st_size - sizeof header);
+    if (buf == NULL
+        || fread(buf, 1, st.st_size - sizeof header, fp)
+           != st.st_size - sizeof header
+        || memcmp(buf, desc, desc_size) != 0)
+        goto done;
+    {
+        const char *const rng_buf = buf + desc_size;
+        const char *const sk_buf = rng_buf + header.rng_size;
+        FILE *in;
+
+        if (mmap->sk->from_buf) {
+            sk = mmap->sk->from_buf(sk_buf, header.sk_size);
+        } else if ((in = mmap_buf_open(sk_buf, header.sk_size)) != NULL) {
+            sk = mmap->sk->fread(in);
+            fclose(in);
+        }
+        if (sk && (in = mmap_buf_open(rng_buf, header.rng_size)) != NULL) {
+            (void) aes_randstate_fread(rng, in);
+            fclose(in);
+        }
+    }
+    if (sk)
+        (void) futimens(fileno(fp), NULL);
+done:
+    free(buf);
+    fclose(fp);
+    return sk;
+}
+
+/* Writes to a temporary file and renames it into place, so readers never
+ * see a partial key */
+static void
+cache_store(const mmap_vtable *mmap, const char *dir, const char *path,
+            const char *desc, size_t desc_size, const mmap_sk sk,
+            aes_randstate_t rng)
+{
+    struct cache_header header = {
+        .version = CACHE_VERSION,
+        .desc_size = desc_size,
+    };
+    char *rng_buf = NULL, *sk_buf = NULL, *tmp;
+    size_t rng_size = 0, sk_size = 0;
+    bool ok = false;
+    FILE *fp;
+    int fd;
+
+    memcpy(header.magic, CACHE_MAGIC, sizeof header.magic);
+    if ((fp = open_memstream(&rng_buf, &rng_size)) != NULL) {
+        (void) aes_randstate_fwrite(rng, fp);
+        ok = fclose(fp) == 0;
+    }
+    if (ok && (fp = open_memstream(&sk_buf, &sk_size)) != NULL) {
+        ok = mmap->sk->fwrite(sk, fp) == MMAP_OK;
+        ok &= fclose(fp) == 0;
+    }
+    header.rng_size = rng_size;
+    header.sk_size = sk_size;
+
+    if ((tmp = malloc(strlen(dir) + sizeof "/.tmp-XXXXXX")) == NULL)
+        ok = false;
+    else
+        sprintf(tmp, "%s/.tmp-XXXXXX", dir);
+    if (ok && (fd = mkstemp(tmp)) != -1) {
+        if ((fp = fdopen(fd, "wb")) == NULL) {
+            close(fd);
+            ok = false;
+        } else {
+            ok = fwrite(&header, sizeof header, 1, fp) == 1
+                && fwrite(desc, 1, desc_size, fp) == desc_size
+                && fwrite(rng_buf, 1, rng_size, fp) == rng_size
+                && fwrite(sk_buf, 1, sk_size, fp) == sk_size
+                && fflush(fp) == 0
+                && fsync(fd) == 0;
+            ok &= fclose(fp) == 0;
+        }
+        if (!ok || rename(tmp, path) == -1)
+            unlink(tmp);
+    }
+    free(tmp);
+    free(rng_buf);
+    free(sk_buf);
+}
+
+static int
+cache_entry_cmp(const void *a_, const void *b_)
+{
+    const struct cache_entry *a = a_, *b = b_;
+
+    if (a->mtime.tv_sec != b->mtime.tv_sec)
+        return a->mtime.tv_sec < b->mtime.tv_sec ? -1 : 1;
+    if (a->mtime.tv_nsec != b->mtime.tv_nsec)
+        return a->mtime.tv_nsec < b->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/* Removes the least recently used keys, other than keep, until the keys in
+ * dir take at most max_bytes.  Loads mark keys as used by touching them. */
+static void
+cache_evict(const char *dir, size_t max_bytes, const char *keep)
+{
+    struct cache_entry *entries = NULL;
+    size_t n = 0, cap = 0;
+    uint64_t total = 0;
+    struct dirent *d;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+        return;
+    while ((d = readdir(dp)) != NULL) {
+        const size_t len = strlen(d->d_name);
+        struct stat st;
+        char *path;
+
+        if (d->d_name[0] == '.' || len < strlen(CACHE_SUFFIX)
+            || strcmp(d->d_name + len - strlen(CACHE_SUFFIX), CACHE_SUFFIX))
+            continue;
+        if ((path = malloc(strlen(dir) + len + 2)) == NULL)
+            break;
+        sprintf(path, "%s/%s", dir, d->d_name);
+        if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? 2 * cap : 16;
+            entries = realloc(entries, cap * sizeof entries[0]);
+            assert(entries);
+        }
+        entries[n++] = (struct cache_entry) {
+            .path = path,
+            .size = st.st_size,
+            .mtime = st.st_mtim,
+        };
+        total += st.st_size;
+    }
+    closedir(dp);
+
+    qsort(entries, n, sizeof entries[0], cache_entry_cmp);
+    for (size_t i = 0; i < n; ++i) {
+        if (total > max_bytes && strcmp(entries[i].path, keep) != 0
+            && unlink(entries[i].path) == 0)
+            total -= entries[i].size;
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+mmap_sk
+mmap_sk_cache_new(const_mmap_vtable mmap, const char *dir, size_t max_bytes,
+                  const mmap_sk_params *params, const mmap_sk_opt_params *opts,
+                  size_t ncores, const void *seed, size_t seed_len,
+                  aes_randstate_t rng, bool verbose)
+{
+    char *desc = NULL, *path = NULL;
+    size_t desc_size;
+    mmap_sk sk;
+
+    aes_randinit_seedn(rng, (char *) seed, seed_len, NULL, 0);
+    if (mmap->name == NULL)
+        return mmap->sk->new(params, opts, ncores, rng, verbose);
+
+    desc = cache_describe(mmap, params, opts, ncores, seed, seed_len,
+                          &desc_size);
+    if (desc) {
+        if ((path = malloc(strlen(dir) + strlen(mmap->name) + 32)) == NULL)
+            goto keygen;
+        sprintf(path, "%s/%s-%016" PRIx64 CACHE_SUFFIX, dir, mmap->name,
+                cache_hash(desc, desc_size));
+        if ((sk = cache_load(mmap, path, desc, desc_size, rng)) != NULL)
+            goto done;
+    }
+
+keygen:
+    sk = mmap->sk->new(params, opts, ncores, rng, verbose);
+    if (sk && path) {
+        (void) mkdir(dir, 0777);
+        cache_store(mmap, dir, path, desc, desc_size, sk, rng);
+        if (max_bytes)
+            cache_evict(dir, max_bytes, path);
+    }
+done:
+    free(desc);
+    free(path);
+    return sk;
+}
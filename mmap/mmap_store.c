@@ -0,0 +1,385 @@
+#include "mmap.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A store file is a header, the payloads starting on the second page, and
+ * after the last payload an index of (offset, size) pairs followed by the
+ * matrix records.  Payloads are payload_write layouts when the backend has
+ * them, and fwrite output otherwise.  Layouts of a page or more start on a
+ * page boundary; smaller ones, and fwrite output, which is always copied out,
+ * start on a cache line, as giving each its own page would mostly store
+ * padding.  Everything is in host byte order. */
+
+#define STORE_MAGIC "MMAPSTOR"
+#define STORE_VERSION 2
+#define STORE_PAGE_SIZE 4096
+#define STORE_DATA_OFFSET STORE_PAGE_SIZE
+#define STORE_LINE_SIZE 64
+
+struct store_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t fixed;             /* payloads are payload_write layouts */
+    uint64_t payload_size;      /* of each payload, if fixed */
+    uint64_t count;
+    uint64_t index;             /* offset of the index */
+    uint64_t nmats;
+    uint64_t mats;              /* offset of the matrix records */
+};
+
+struct store_entry {
+    uint64_t offset;
+    uint64_t size;
+};
+
+/* A matrix is a run of consecutive encodings in row-major order */
+struct store_mat {
+    uint64_t first;
+    uint32_t nrows;
+    uint32_t ncols;
+};
+
+struct _mmap_store_writer_struct {
+    const mmap_vtable *mmap;
+    mmap_pp pp;
+    FILE *fp;
+    struct store_header header;
+    uint64_t offset;
+    void *buf;                  /* one payload, if fixed */
+    struct store_entry *index;
+    size_t cap;
+    struct store_mat *mats;
+    size_t mats_cap;
+    bool ok;
+};
+
+struct _mmap_store_struct {
+    const mmap_vtable *mmap;
+    mmap_pp pp;
+    const char *base;
+    size_t length;
+    bool fixed;
+    size_t payload_size;        /* if fixed */
+    size_t count;
+    const struct store_entry *index;
+    size_t nmats;
+    const struct store_mat *mats;
+    /* Materialized on first use, and accessed atomically until then.  Matrix
+     * views point into this array. */
+    mmap_enc *encs;
+};
+
+/* Alignment of every payload in a store */
+static size_t
+store_payload_align(bool fixed, uint64_t payload_size)
+{
+    return fixed && payload_size >= STORE_PAGE_SIZE ? STORE_PAGE_SIZE
+                                                    : STORE_LINE_SIZE;
+}
+
+static bool
+store_pad(FILE *fp, uint64_t *offset, size_t align)
+{
+    static const char zeros[STORE_PAGE_SIZE];
+    const size_t pad = (align - *offset % align) % align;
+
+    *offset += pad;
+    return fwrite(zeros, 1, pad, fp) == pad;
+}
+
+/* Maps a whole file read-only; the callers' vtable parameters shadow mmap */
+static const char *
+store_map(int fd, size_t length)
+{
+    void *base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    return base == MAP_FAILED ? NULL : base;
+}
+
+mmap_store_writer *
+mmap_store_writer_new(const_mmap_vtable mmap, const mmap_pp params,
+                      const char *path)
+{
+    mmap_store_writer *w;
+    FILE *fp;
+
+    if ((fp = fopen(path, "wb")) == NULL)
+        return NULL;
+    w = calloc(1, sizeof w[0]);
+    w->mmap = mmap;
+    w->pp = params;
+    w->fp = fp;
+    memcpy(w->header.magic, STORE_MAGIC, sizeof w->header.magic);
+    w->header.version = STORE_VERSION;
+    w->header.fixed = mmap->enc->payload_view != NULL;
+    if (w->header.fixed) {
+        w->header.payload_size = mmap->enc->payload_size(params);
+        w->buf = malloc(w->header.payload_size);
+    }
+    /* Room for the header, written last */
+    w->offset = 1;
+    w->ok = fputc(0, fp) != EOF;
+    w->ok &= store_pad(fp, &w->offset, STORE_DATA_OFFSET);
+    return w;
+}
+
+int
+mmap_store_writer_add(mmap_store_writer *w, const mmap_enc *encs, size_t n)
+{
+    const mmap_vtable *const mmap = w->mmap;
+    struct store_header *const header = &w->header;
+    const size_t align =
+        store_payload_align(header->fixed, header->payload_size);
+
+    if (header->count + n > w->cap) {
+        w->cap *= 2;
+        if (w->cap < header->count + n)
+            w->cap = header->count + n;
+        w->index = realloc(w->index, w->cap * sizeof w->index[0]);
+        assert(w->index);
+    }
+    for (size_t i = 0; w->ok && i < n; ++i) {
+        struct store_entry *const e = &w->index[header->count++];
+        w->ok &= store_pad(w->fp, &w->offset, align);
+        e->offset = w->offset;
+        if (header->fixed) {
+            mmap->enc->payload_write(w->buf, encs[i], w->pp);
+            w->ok &= fwrite(w->buf, header->payload_size, 1, w->fp) == 1;
+            e->size = header->payload_size;
+        } else {
+            w->ok &= mmap->enc->fwrite(encs[i], w->fp) == MMAP_OK;
+            e->size = (uint64_t) ftello(w->fp) - w->offset;
+        }
+        w->offset += e->size;
+    }
+    return w->ok ? MMAP_OK : MMAP_ERR;
+}
+
+int
+mmap_store_writer_add_mat(mmap_store_writer *w, const mmap_enc_mat_t m)
+{
+    struct store_header *const header = &w->header;
+
+    if (header->nmats == w->mats_cap) {
+        w->mats_cap = w->mats_cap ? 2 * w->mats_cap : 8;
+        w->mats = realloc(w->mats, w->mats_cap * sizeof w->mats[0]);
+        assert(w->mats);
+    }
+    w->mats[header->nmats++] = (struct store_mat) {
+        .first = header->count,
+        .nrows = m->nrows,
+        .ncols = m->ncols,
+    };
+    return mmap_store_writer_add(w, m->data, (size_t) m->nrows * m->ncols);
+}
+
+int
+mmap_store_writer_close(mmap_store_writer *w)
+{
+    struct store_header *const header = &w->header;
+    bool ok = w->ok;
+
+    ok &= store_pad(w->fp, &w->offset, sizeof(uint64_t));
+    header->index = w->offset;
+    header->mats = header->index + header->count * sizeof w->index[0];
+    ok &= fwrite(w->index, sizeof w->index[0], header->count, w->fp)
+        == header->count;
+    ok &= fwrite(w->mats, sizeof w->mats[0], header->nmats, w->fp)
+        == header->nmats;
+    ok &= fseeko(w->fp, 0, SEEK_SET) == 0;
+    ok &= fwrite(header, sizeof header[0], 1, w->fp) == 1;
+    ok &= fclose(w->fp) == 0;
+    free(w->buf);
+    free(w->index);
+    free(w->mats);
+    free(w);
+    return ok ? MMAP_OK : MMAP_ERR;
+}
+
+int
+mmap_store_write(const_mmap_vtable mmap, const mmap_pp params,
+                 const char *path, const mmap_enc *encs, size_t n)
+{
+    mmap_store_writer *w;
+
+    if ((w = mmap_store_writer_new(mmap, params, path)) == NULL)
+        return MMAP_ERR;
+    (void) mmap_store_writer_add(w, encs, n);
+    return mmap_store_writer_close(w);
+}
+
+mmap_store *
+mmap_store_open(const_mmap_vtable mmap, const mmap_pp params,
+                const char *path)
+{
+    const struct store_header *header;
+    mmap_store *store;
+    struct stat st;
+    const char *base;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < STORE_DATA_OFFSET) {
+        close(fd);
+        return NULL;
+    }
+    base = store_map(fd, st.st_size);
+    close(fd);
+    if (base == NULL)
+        return NULL;
+
+    header = (const struct store_header *) base;
+    if (memcmp(header->magic, STORE_MAGIC, sizeof header->magic) != 0
+        || header->version != STORE_VERSION
+        || header->fixed != (mmap->enc->payload_view != NULL)
+        || (header->fixed
+            && header->payload_size != mmap->enc->payload_size(params))
+        || header->index > (uint64_t) st.st_size
+        || header->index % sizeof(uint64_t) != 0
+        || header->count > ((uint64_t) st.st_size - header->index)
+                           / sizeof(struct store_entry)
+        || header->mats != header->index
+                           + header->count * sizeof(struct store_entry)
+        || header->nmats > ((uint64_t) st.st_size - header->mats)
+                           / sizeof(struct store_mat)) {
+        munmap((void *) base, st.st_size);
+        return NULL;
+    }
+
+    store = calloc(1, sizeof store[0]);
+    store->mmap = mmap;
+    store->pp = params;
+    store->base = base;
+    store->length = st.st_size;
+    store->fixed = header->fixed;
+    store->payload_size = header->payload_size;
+    store->count = header->count;
+    store->index = (const struct store_entry *) (store->base + header->index);
+    store->nmats = header->nmats;
+    store->mats = (const struct store_mat *) (store->base + header->mats);
+    store->encs = calloc(store->count ? store->count : 1, sizeof store->encs[0]);
+    assert(store->encs);
+    return store;
+}
+
+size_t
+mmap_store_count(const mmap_store *store)
+{
+    return store->count;
+}
+
+mmap_enc
+mmap_store_get(mmap_store *store, size_t i)
+{
+    const struct store_entry *e;
+    mmap_enc enc, expected = NULL;
+
+    if (i >= store->count)
+        return NULL;
+    if ((enc = __atomic_load_n(&store->encs[i], __ATOMIC_ACQUIRE)) != NULL)
+        return enc;
+    e = &store->index[i];
+    if (e->offset > store->length || e->size > store->length - e->offset)
+        return NULL;
+    /* payload_view reads a whole payload_size, from an aligned payload */
+    if (store->fixed
+        && (e->size != store->payload_size
+            || e->offset % store_payload_align(true, e->size) != 0))
+        return NULL;
+    if (store->fixed) {
+        enc = store->mmap->enc->payload_view(store->pp, store->base + e->offset);
+    } else if (store->mmap->enc->from_buf) {
+        enc = store->mmap->enc->from_buf(store->base + e->offset, e->size);
+    } else {
+        FILE *fp = fmemopen((void *) (store->base + e->offset), e->size, "rb");
+        if (fp == NULL)
+            return NULL;
+        enc = store->mmap->enc->fread(fp);
+        fclose(fp);
+    }
+    if (enc == NULL)
+        return NULL;
+    if (!store->fixed && store->mmap->enc->compatible
+        && !store->mmap->enc->compatible(enc, store->pp)) {
+        store->mmap->enc->free(enc);
+        return NULL;
+    }
+    /* Another thread may have got there first */
+    if (!__atomic_compare_exchange_n(&store->encs[i], &expected, enc, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        store->mmap->enc->free(enc);
+        enc = expected;
+    }
+    return enc;
+}
+
+mmap_enc *
+mmap_store_get_range(mmap_store *store, size_t first, size_t n)
+{
+    bool ok = true;
+
+    if (first > store->count || n > store->count - first)
+        return NULL;
+    if (n == 0)
+        return store->encs + first;
+    {
+        /* Start reading the whole range in before decoding it */
+        const size_t page = STORE_PAGE_SIZE;
+        const size_t begin = store->index[first].offset / page * page;
+        const size_t end = store->index[first + n - 1].offset
+            + store->index[first + n - 1].size;
+        if (begin < end && end <= store->length)
+            (void) madvise((void *) (store->base + begin), end - begin,
+                           MADV_WILLNEED);
+    }
+#pragma omp parallel for schedule(dynamic, 64) reduction(&&:ok)
+    for (size_t i = first; i < first + n; ++i)
+        ok = mmap_store_get(store, i) != NULL && ok;
+    return ok ? store->encs + first : NULL;
+}
+
+size_t
+mmap_store_nmats(const mmap_store *store)
+{
+    return store->nmats;
+}
+
+mmap_enc_mat_view
+mmap_store_get_mat(mmap_store *store, size_t k)
+{
+    mmap_enc_mat_view v = { NULL, 0, 0, 0, 0 };
+    const struct store_mat *m;
+
+    if (k >= store->nmats)
+        return v;
+    m = &store->mats[k];
+    v.data = mmap_store_get_range(store, m->first,
+                                  (size_t) m->nrows * m->ncols);
+    if (v.data) {
+        v.nrows = m->nrows;
+        v.ncols = m->ncols;
+        v.rstride = m->ncols;
+        v.cstride = 1;
+    }
+    return v;
+}
+
+void
+mmap_store_close(mmap_store *store)
+{
+    if (store == NULL)
+        return;
+    for (size_t i = 0; i < store->count; ++i) {
+        mmap_enc enc = store->encs[i];
+        if (enc)
+            store->mmap->enc->free(enc);
+    }
+    munmap((void *) store->base, store->length);
+    free(store->encs);
+    free(store);
+}
@@ -0,0 +1,934 @@
+#include "mmap.h"
+#include "mmap_trace.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Like the instrumenting wrapper, a tracing vtable needs methods of its own
+ * for each backend it wraps, generated here for a fixed number of slots.
+ * Only methods that create, change, zero-test or free encodings, or create
+ * keys, are traced; the others are the backend's own. */
+
+#define TRACE_SLOTS 4
+
+#define SK_TRACED(V, R, S)                                              \
+    R(S, sk, new, mmap_sk,                                              \
+      (const mmap_sk_params *params, const mmap_sk_opt_params *opts,    \
+       size_t ncores, aes_randstate_t rng, bool verbose),               \
+      (params, opts, ncores, rng, verbose))                             \
+    R(S, sk, fread, mmap_sk, (FILE *fp), (fp))                          \
+    R(S, sk, from_buf, mmap_sk, (const void *buf, size_t size), (buf, size))
+
+#define ENC_TRACED(V, R, S)                                             \
+    R(S, enc, new, mmap_enc, (const mmap_pp pp), (pp))                  \
+    V(S, enc, free, (mmap_enc enc), (enc))                              \
+    R(S, enc, fread, mmap_enc, (FILE *fp), (fp))                        \
+    R(S, enc, from_buf, mmap_enc, (const void *buf, size_t size), (buf, size)) \
+    V(S, enc, set, (mmap_enc dest, const mmap_enc src), (dest, src))    \
+    V(S, enc, swap, (mmap_enc *a, mmap_enc *b), (a, b))                 \
+    R(S, enc, add, int,                                                 \
+      (mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b), \
+      (dest, pp, a, b))                                                 \
+    R(S, enc, sub, int,                                                 \
+      (mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b), \
+      (dest, pp, a, b))                                                 \
+    R(S, enc, mul, int,                                                 \
+      (mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b), \
+      (dest, pp, a, b))                                                 \
+    R(S, enc, fma, int,                                                 \
+      (mmap_enc dest, const mmap_pp pp, const mmap_enc a, const mmap_enc b), \
+      (dest, pp, a, b))                                                 \
+    R(S, enc, dot, int,                                                 \
+      (mmap_enc dest, const mmap_pp pp, const mmap_enc *as,             \
+       const mmap_enc *bs, size_t n),                                   \
+      (dest, pp, as, bs, n))                                            \
+    R(S, enc, is_zero, bool, (const mmap_enc enc, const mmap_pp pp), (enc, pp)) \
+    V(S, enc, is_zero_batch,                                            \
+      (bool *results, const mmap_enc *encs, size_t count, const mmap_pp pp), \
+      (results, encs, count, pp))                                       \
+    R(S, enc, encode, int,                                              \
+      (mmap_enc enc, const mmap_sk sk, size_t n, const mpz_t *plaintext, \
+       const int *pows, size_t level),                                  \
+      (enc, sk, n, plaintext, pows, level))                             \
+    R(S, enc, encode_batch, int,                                        \
+      (mmap_enc *encs, const mmap_sk sk, size_t count, size_t n,        \
+       const mpz_t *const *plaintexts, const int *const *pows, size_t level), \
+      (encs, sk, count, n, plaintexts, pows, level))                    \
+    V(S, enc, init, (mmap_enc enc, const mmap_pp pp), (enc, pp))        \
+    V(S, enc, clear, (mmap_enc enc), (enc))                             \
+    R(S, enc, payload_view, mmap_enc, (const mmap_pp pp, const void *buf), \
+      (pp, buf))
+
+#define SK_PASSED(inner)                                                \
+    .free = inner->sk->free,                                            \
+    .fwrite = inner->sk->fwrite,                                        \
+    .serialized_size = inner->sk->serialized_size,                      \
+    .to_buf = inner->sk->to_buf,                                        \
+    .pp = inner->sk->pp,                                                \
+    .plaintext_fields = inner->sk->plaintext_fields,                    \
+    .nslots = inner->sk->nslots,                                        \
+    .nzs = inner->sk->nzs,
+
+#define ENC_PASSED(inner)                                               \
+    .fwrite = inner->enc->fwrite,                                       \
+    .serialized_size = inner->enc->serialized_size,                     \
+    .to_buf = inner->enc->to_buf,                                       \
+    .compatible = inner->enc->compatible,                               \
+    .degree = inner->enc->degree,                                       \
+    .print = inner->enc->print,                                         \
+    .size = inner->enc->size,                                           \
+    .payload_size = inner->enc->payload_size,                           \
+    .payload_write = inner->enc->payload_write,
+
+/* Encoding handles to trace numbers, with linear probing */
+struct id_map {
+    uintptr_t *keys;            // 0 for empty
+    uint64_t *ids;
+    size_t cap;                 // a power of two
+    size_t count;
+};
+
+struct tracer {
+    const mmap_vtable *inner;
+    struct decorated *dec;
+    FILE *fp;
+    pthread_mutex_t lock;
+    struct id_map map;
+    uint64_t next_id;
+    uint64_t epoch;
+    uint64_t last_start;
+    bool ok;
+};
+
+struct decorated {
+    mmap_vtable vt;
+    mmap_sk_vtable sk;
+    mmap_enc_vtable enc;
+};
+
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tracer tracers[TRACE_SLOTS];
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+map_slot(const struct id_map *m, uintptr_t key)
+{
+    /* Handles are at least 8-byte aligned */
+    return ((key >> 3) * UINT64_C(0x9e3779b97f4a7c15)) & (m->cap - 1);
+}
+
+static void map_put(struct id_map *m, uintptr_t key, uint64_t id);
+
+static void
+map_grow(struct id_map *m)
+{
+    uintptr_t *const keys = m->keys;
+    uint64_t *const ids = m->ids;
+    const size_t cap = m->cap;
+
+    m->cap = cap ? 2 * cap : 1024;
+    m->keys = calloc(m->cap, sizeof m->keys[0]);
+    m->ids = malloc(m->cap * sizeof m->ids[0]);
+    assert(m->keys && m->ids);
+    m->count = 0;
+    for (size_t i = 0; i < cap; ++i) {
+        if (keys[i])
+            map_put(m, keys[i], ids[i]);
+    }
+    free(keys);
+    free(ids);
+}
+
+static void
+map_put(struct id_map *m, uintptr_t key, uint64_t id)
+{
+    size_t i;
+
+    if (2 * (m->count + 1) > m->cap)
+        map_grow(m);
+    for (i = map_slot(m, key); m->keys[i] && m->keys[i] != key;
+         i = (i + 1) & (m->cap - 1))
+        ;
+    if (m->keys[i] == 0)
+        m->count++;
+    m->keys[i] = key;
+    m->ids[i] = id;
+}
+
+static uint64_t
+map_get(const struct id_map *m, uintptr_t key)
+{
+    if (m->cap == 0)
+        return 0;
+    for (size_t i = map_slot(m, key); m->keys[i]; i = (i + 1) & (m->cap - 1)) {
+        if (m->keys[i] == key)
+            return m->ids[i];
+    }
+    return 0;
+}
+
+/* Removes key, shifting back the entries probed past it */
+static uint64_t
+map_remove(struct id_map *m, uintptr_t key)
+{
+    size_t i, j;
+    uint64_t id;
+
+    if (m->cap == 0)
+        return 0;
+    for (i = map_slot(m, key); m->keys[i] != key; i = (i + 1) & (m->cap - 1)) {
+        if (m->keys[i] == 0)
+            return 0;
+    }
+    id = m->ids[i];
+    m->count--;
+    for (j = (i + 1) & (m->cap - 1); m->keys[j]; j = (j + 1) & (m->cap - 1)) {
+        const size_t home = map_slot(m, m->keys[j]);
+        /* Move j into the hole at i unless its home lies cyclically in
+         * (i, j] */
+        if ((j > i && (home <= i || home > j))
+            || (j < i && home <= i && home > j)) {
+            m->keys[i] = m->keys[j];
+            m->ids[i] = m->ids[j];
+            i = j;
+        }
+    }
+    m->keys[i] = 0;
+    return id;
+}
+
+/* Writers below are called with the tracer locked */
+
+static void
+put(struct tracer *t, uint64_t x)
+{
+    unsigned char buf[10];
+    size_t n = 0;
+
+    do {
+        buf[n++] = (x & 0x7f) | (x > 0x7f ? 0x80 : 0);
+        x >>= 7;
+    } while (x);
+    t->ok &= fwrite(buf, 1, n, t->fp) == n;
+}
+
+static void
+put_record(struct tracer *t, mmap_trace_op op, uint64_t start, uint64_t end)
+{
+    const int64_t delta = (int64_t) (start - t->last_start);
+
+    t->ok &= fputc(op, t->fp) != EOF;
+    put(t, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+    put(t, end - start);
+    t->last_start = start;
+}
+
+static void
+put_pows(struct tracer *t, const int *pows, size_t n)
+{
+    put(t, pows ? n : 0);
+    for (size_t i = 0; pows && i < n; ++i)
+        put(t, (uint32_t) pows[i]);
+}
+
+static uint64_t
+fresh_id(struct tracer *t, const mmap_enc enc)
+{
+    const uint64_t id = ++t->next_id;
+    map_put(&t->map, (uintptr_t) enc, id);
+    return id;
+}
+
+/* The number of enc, recording it as loaded if the trace has not seen it */
+static uint64_t
+id_of(struct tracer *t, const mmap_enc enc)
+{
+    uint64_t id = map_get(&t->map, (uintptr_t) enc);
+
+    if (id == 0) {
+        const uint64_t now = now_ns() - t->epoch;
+        id = fresh_id(t, enc);
+        put_record(t, MMAP_TRACE_LOAD, now, now);
+        put(t, id);
+    }
+    return id;
+}
+
+#define BEGIN(t) const uint64_t start = now_ns() - (t)->epoch
+#define END(t) const uint64_t end = now_ns() - (t)->epoch
+
+static void
+trace_created(struct tracer *t, mmap_trace_op op, const mmap_enc enc,
+              uint64_t start, uint64_t end)
+{
+    if (enc == NULL)
+        return;
+    pthread_mutex_lock(&t->lock);
+    put_record(t, op, start, end);
+    put(t, fresh_id(t, enc));
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void
+trace_freed(struct tracer *t, mmap_enc enc, void (*f)(mmap_enc))
+{
+    uint64_t id;
+    BEGIN(t);
+
+    /* Forget the handle first, as another thread may get the memory back as
+     * soon as it is freed */
+    pthread_mutex_lock(&t->lock);
+    id = map_remove(&t->map, (uintptr_t) enc);
+    pthread_mutex_unlock(&t->lock);
+    f(enc);
+    END(t);
+    if (id) {
+        pthread_mutex_lock(&t->lock);
+        put_record(t, MMAP_TRACE_FREE, start, end);
+        put(t, id);
+        pthread_mutex_unlock(&t->lock);
+    }
+}
+
+static void
+trace_binary(struct tracer *t, mmap_trace_op op, const mmap_enc dest,
+             const mmap_enc a, const mmap_enc b, uint64_t start, uint64_t end)
+{
+    uint64_t ids[3];
+
+    pthread_mutex_lock(&t->lock);
+    ids[0] = id_of(t, dest);
+    ids[1] = id_of(t, a);
+    ids[2] = id_of(t, b);
+    put_record(t, op, start, end);
+    for (size_t i = 0; i < 3; ++i)
+        put(t, ids[i]);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static mmap_sk
+trace_sk_new(struct tracer *t, const mmap_sk_params *params,
+             const mmap_sk_opt_params *opts, size_t ncores,
+             aes_randstate_t rng, bool verbose)
+{
+    BEGIN(t);
+    mmap_sk sk = t->inner->sk->new(params, opts, ncores, rng, verbose);
+    END(t);
+
+    if (sk) {
+        pthread_mutex_lock(&t->lock);
+        put_record(t, MMAP_TRACE_SK_NEW, start, end);
+        put(t, params->lambda);
+        put(t, params->kappa);
+        put(t, params->gamma);
+        put_pows(t, params->pows, params->gamma);
+        put(t, opts ? opts->nslots : 0);
+        pthread_mutex_unlock(&t->lock);
+    }
+    return sk;
+}
+
+static mmap_sk
+trace_sk_loaded(struct tracer *t, mmap_sk sk, uint64_t start, uint64_t end)
+{
+    if (sk) {
+        pthread_mutex_lock(&t->lock);
+        put_record(t, MMAP_TRACE_SK_LOAD, start, end);
+        put(t, t->inner->sk->nzs(sk));
+        put(t, t->inner->sk->nslots(sk));
+        pthread_mutex_unlock(&t->lock);
+    }
+    return sk;
+}
+
+static mmap_sk
+trace_sk_fread(struct tracer *t, FILE *fp)
+{
+    BEGIN(t);
+    mmap_sk sk = t->inner->sk->fread(fp);
+    END(t);
+    return trace_sk_loaded(t, sk, start, end);
+}
+
+static mmap_sk
+trace_sk_from_buf(struct tracer *t, const void *buf, size_t size)
+{
+    BEGIN(t);
+    mmap_sk sk = t->inner->sk->from_buf(buf, size);
+    END(t);
+    return trace_sk_loaded(t, sk, start, end);
+}
+
+static mmap_enc
+trace_enc_new(struct tracer *t, const mmap_pp pp)
+{
+    BEGIN(t);
+    mmap_enc enc = t->inner->enc->new(pp);
+    END(t);
+    trace_created(t, MMAP_TRACE_NEW, enc, start, end);
+    return enc;
+}
+
+static void
+trace_enc_init(struct tracer *t, mmap_enc enc, const mmap_pp pp)
+{
+    BEGIN(t);
+    t->inner->enc->init(enc, pp);
+    END(t);
+    trace_created(t, MMAP_TRACE_NEW, enc, start, end);
+}
+
+static void
+trace_enc_free(struct tracer *t, mmap_enc enc)
+{
+    trace_freed(t, enc, t->inner->enc->free);
+}
+
+static void
+trace_enc_clear(struct tracer *t, mmap_enc enc)
+{
+    trace_freed(t, enc, t->inner->enc->clear);
+}
+
+static mmap_enc
+trace_enc_fread(struct tracer *t, FILE *fp)
+{
+    BEGIN(t);
+    mmap_enc enc = t->inner->enc->fread(fp);
+    END(t);
+    trace_created(t, MMAP_TRACE_LOAD, enc, start, end);
+    return enc;
+}
+
+static mmap_enc
+trace_enc_from_buf(struct tracer *t, const void *buf, size_t size)
+{
+    BEGIN(t);
+    mmap_enc enc = t->inner->enc->from_buf(buf, size);
+    END(t);
+    trace_created(t, MMAP_TRACE_LOAD, enc, start, end);
+    return enc;
+}
+
+static mmap_enc
+trace_enc_payload_view(struct tracer *t, const mmap_pp pp, const void *buf)
+{
+    BEGIN(t);
+    mmap_enc enc = t->inner->enc->payload_view(pp, buf);
+    END(t);
+    trace_created(t, MMAP_TRACE_LOAD, enc, start, end);
+    return enc;
+}
+
+static void
+trace_enc_set(struct tracer *t, mmap_enc dest, const mmap_enc src)
+{
+    uint64_t d, s;
+    BEGIN(t);
+    t->inner->enc->set(dest, src);
+    END(t);
+
+    pthread_mutex_lock(&t->lock);
+    d = id_of(t, dest);
+    s = id_of(t, src);
+    put_record(t, MMAP_TRACE_SET, start, end);
+    put(t, d);
+    put(t, s);
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* Exchanging handles leaves every encoding as it was, so only exchanging
+ * contents is traced */
+static void
+trace_enc_swap(struct tracer *t, mmap_enc *a, mmap_enc *b)
+{
+    const mmap_enc old = *a;
+    uint64_t ia, ib;
+    BEGIN(t);
+    t->inner->enc->swap(a, b);
+    END(t);
+
+    if (*a != old)
+        return;
+    pthread_mutex_lock(&t->lock);
+    ia = id_of(t, *a);
+    ib = id_of(t, *b);
+    put_record(t, MMAP_TRACE_SWAP, start, end);
+    put(t, ia);
+    put(t, ib);
+    pthread_mutex_unlock(&t->lock);
+}
+
+#define TRACE_BINARY(name, op)                                          \
+    static int                                                          \
+    trace_enc_##name(struct tracer *t, mmap_enc dest, const mmap_pp pp, \
+                     const mmap_enc a, const mmap_enc b)                \
+    {                                                                   \
+        BEGIN(t);                                                       \
+        const int ret = t->inner->enc->name(dest, pp, a, b);            \
+        END(t);                                                         \
+        trace_binary(t, op, dest, a, b, start, end);                    \
+        return ret;                                                     \
+    }
+
+TRACE_BINARY(add, MMAP_TRACE_ADD)
+TRACE_BINARY(sub, MMAP_TRACE_SUB)
+TRACE_BINARY(mul, MMAP_TRACE_MUL)
+TRACE_BINARY(fma, MMAP_TRACE_FMA)
+
+static int
+trace_enc_dot(struct tracer *t, mmap_enc dest, const mmap_pp pp,
+              const mmap_enc *as, const mmap_enc *bs, size_t n)
+{
+    uint64_t *ids = malloc((2 * n + 1) * sizeof ids[0]);
+    BEGIN(t);
+    const int ret = t->inner->enc->dot(dest, pp, as, bs, n);
+    END(t);
+
+    assert(ids);
+    pthread_mutex_lock(&t->lock);
+    ids[0] = id_of(t, dest);
+    for (size_t i = 0; i < n; ++i) {
+        ids[1 + i] = id_of(t, as[i]);
+        ids[1 + n + i] = id_of(t, bs[i]);
+    }
+    put_record(t, MMAP_TRACE_DOT, start, end);
+    put(t, ids[0]);
+    put(t, n);
+    for (size_t i = 1; i < 2 * n + 1; ++i)
+        put(t, ids[i]);
+    pthread_mutex_unlock(&t->lock);
+    free(ids);
+    return ret;
+}
+
+static bool
+trace_enc_is_zero(struct tracer *t, const mmap_enc enc, const mmap_pp pp)
+{
+    uint64_t id;
+    BEGIN(t);
+    const bool ret = t->inner->enc->is_zero(enc, pp);
+    END(t);
+
+    pthread_mutex_lock(&t->lock);
+    id = id_of(t, enc);
+    put_record(t, MMAP_TRACE_IS_ZERO, start, end);
+    put(t, id);
+    put(t, ret);
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+static void
+trace_enc_is_zero_batch(struct tracer *t, bool *results, const mmap_enc *encs,
+                        size_t count, const mmap_pp pp)
+{
+    uint64_t *ids = malloc((count ? count : 1) * sizeof ids[0]);
+    BEGIN(t);
+    t->inner->enc->is_zero_batch(results, encs, count, pp);
+    END(t);
+
+    assert(ids);
+    pthread_mutex_lock(&t->lock);
+    for (size_t k = 0; k < count; ++k)
+        ids[k] = id_of(t, encs[k]);
+    put_record(t, MMAP_TRACE_IS_ZERO_BATCH, start, end);
+    put(t, count);
+    for (size_t k = 0; k < count; ++k)
+        put(t, ids[k]);
+    for (size_t k = 0; k < count; ++k)
+        put(t, results[k]);
+    pthread_mutex_unlock(&t->lock);
+    free(ids);
+}
+
+static int
+trace_enc_encode(struct tracer *t, mmap_enc enc, const mmap_sk sk, size_t n,
+                 const mpz_t *plaintext, const int *pows, size_t level)
+{
+    const size_t nzs = t->inner->sk->nzs(sk);
+    uint64_t id;
+    BEGIN(t);
+    const int ret = t->inner->enc->encode(enc, sk, n, plaintext, pows, level);
+    END(t);
+
+    pthread_mutex_lock(&t->lock);
+    id = id_of(t, enc);
+    put_record(t, MMAP_TRACE_ENCODE, start, end);
+    put(t, id);
+    put(t, n);
+    put(t, level);
+    put_pows(t, pows, nzs);
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+static int
+trace_enc_encode_batch(struct tracer *t, mmap_enc *encs, const mmap_sk sk,
+                       size_t count, size_t n, const mpz_t *const *plaintexts,
+                       const int *const *pows, size_t level)
+{
+    const size_t nzs = t->inner->sk->nzs(sk);
+    uint64_t *ids = malloc((count ? count : 1) * sizeof ids[0]);
+    BEGIN(t);
+    const int ret = t->inner->enc->encode_batch(encs, sk, count, n, plaintexts,
+                                                pows, level);
+    END(t);
+
+    assert(ids);
+    pthread_mutex_lock(&t->lock);
+    for (size_t k = 0; k < count; ++k)
+        ids[k] = id_of(t, encs[k]);
+    put_record(t, MMAP_TRACE_ENCODE_BATCH, start, end);
+    put(t, count);
+    put(t, n);
+    put(t, level);
+    for (size_t k = 0; k < count; ++k) {
+        put(t, ids[k]);
+        put_pows(t, pows[k], nzs);
+    }
+    pthread_mutex_unlock(&t->lock);
+    free(ids);
+    return ret;
+}
+
+#define FORWARD_V(S, g, n, p, a)                                        \
+    static void                                                         \
+    slot##S##_##g##_##n p                                               \
+    {                                                                   \
+        trace_##g##_##n(&tracers[S], UNPAREN a);                        \
+    }
+#define FORWARD_R(S, g, n, t, p, a)                                     \
+    static t                                                            \
+    slot##S##_##g##_##n p                                               \
+    {                                                                   \
+        return trace_##g##_##n(&tracers[S], UNPAREN a);                 \
+    }
+#define UNPAREN(...) __VA_ARGS__
+
+/* Methods the backend lacks stay NULL, since callers test for them */
+#define INIT_V(S, g, n, p, a) .n = inner->g->n ? slot##S##_##g##_##n : NULL,
+#define INIT_R(S, g, n, t, p, a) INIT_V(S, g, n, p, a)
+
+#define DEFINE_SLOT(S)                                                  \
+    SK_TRACED(FORWARD_V, FORWARD_R, S)                                  \
+    ENC_TRACED(FORWARD_V, FORWARD_R, S)                                 \
+    static void                                                         \
+    slot##S##_init(struct decorated *dec, const mmap_vtable *inner)     \
+    {                                                                   \
+        const mmap_sk_vtable sk = {                                     \
+            SK_TRACED(INIT_V, INIT_R, S) SK_PASSED(inner)               \
+        };                                                              \
+        const mmap_enc_vtable enc = {                                   \
+            ENC_TRACED(INIT_V, INIT_R, S) ENC_PASSED(inner)             \
+        };                                                              \
+        memcpy(&dec->sk, &sk, sizeof sk);                               \
+        memcpy(&dec->enc, &enc, sizeof enc);                            \
+    }
+
+DEFINE_SLOT(0)
+DEFINE_SLOT(1)
+DEFINE_SLOT(2)
+DEFINE_SLOT(3)
+
+static void (*const slot_init[TRACE_SLOTS])(struct decorated *,
+                                            const mmap_vtable *) = {
+    slot0_init, slot1_init, slot2_init, slot3_init,
+};
+
+const mmap_vtable *
+mmap_vtable_trace(const_mmap_vtable inner, FILE *fp)
+{
+    struct tracer *t = NULL;
+    struct decorated *dec;
+    const uint32_t version = MMAP_TRACE_VERSION;
+
+    pthread_mutex_lock(&slots_lock);
+    for (size_t s = 0; s < TRACE_SLOTS; ++s) {
+        if (tracers[s].inner == NULL) {
+            t = &tracers[s];
+            break;
+        }
+    }
+    if (t == NULL
+        || fwrite(MMAP_TRACE_MAGIC, 1, strlen(MMAP_TRACE_MAGIC), fp)
+           != strlen(MMAP_TRACE_MAGIC)
+        || fwrite(&version, sizeof version, 1, fp) != 1) {
+        pthread_mutex_unlock(&slots_lock);
+        return NULL;
+    }
+    dec = malloc(sizeof dec[0]);
+    assert(dec);
+    slot_init[t - tracers](dec, inner);
+    {
+        const mmap_vtable vt = {
+            .pp = inner->pp,
+            .sk = &dec->sk,
+            .enc = &dec->enc,
+            .name = inner->name,
+        };
+        memcpy(&dec->vt, &vt, sizeof vt);
+    }
+    memset(&t->map, 0, sizeof t->map);
+    pthread_mutex_init(&t->lock, NULL);
+    t->dec = dec;
+    t->fp = fp;
+    t->next_id = 0;
+    t->epoch = now_ns();
+    t->last_start = 0;
+    t->ok = true;
+    t->inner = inner;
+    pthread_mutex_unlock(&slots_lock);
+    return &dec->vt;
+}
+
+int
+mmap_vtable_trace_close(const_mmap_vtable vt)
+{
+    int ret = MMAP_ERR;
+
+    pthread_mutex_lock(&slots_lock);
+    for (size_t s = 0; s < TRACE_SLOTS; ++s) {
+        struct tracer *const t = &tracers[s];
+        if (t->dec == NULL || &t->dec->vt != vt)
+            continue;
+        t->ok &= fflush(t->fp) == 0;
+        ret = t->ok ? MMAP_OK : MMAP_ERR;
+        pthread_mutex_destroy(&t->lock);
+        free(t->map.keys);
+        free(t->map.ids);
+        free(t->dec);
+        t->dec = NULL;
+        t->inner = NULL;
+        break;
+    }
+    pthread_mutex_unlock(&slots_lock);
+    return ret;
+}
+
+/* Reading */
+
+static const char *const op_names[MMAP_TRACE_NOPS] = {
+    [MMAP_TRACE_SK_NEW] = "sk_new",
+    [MMAP_TRACE_SK_LOAD] = "sk_load",
+    [MMAP_TRACE_NEW] = "new",
+    [MMAP_TRACE_LOAD] = "load",
+    [MMAP_TRACE_FREE] = "free",
+    [MMAP_TRACE_ENCODE] = "encode",
+    [MMAP_TRACE_ENCODE_BATCH] = "encode_batch",
+    [MMAP_TRACE_SET] = "set",
+    [MMAP_TRACE_SWAP] = "swap",
+    [MMAP_TRACE_ADD] = "add",
+    [MMAP_TRACE_SUB] = "sub",
+    [MMAP_TRACE_MUL] = "mul",
+    [MMAP_TRACE_FMA] = "fma",
+    [MMAP_TRACE_DOT] = "dot",
+    [MMAP_TRACE_IS_ZERO] = "is_zero",
+    [MMAP_TRACE_IS_ZERO_BATCH] = "is_zero_batch",
+};
+
+const char *
+mmap_trace_op_name(int op)
+{
+    return op > 0 && op < MMAP_TRACE_NOPS ? op_names[op] : "?";
+}
+
+struct reader {
+    FILE *fp;
+    mmap_trace *trace;
+    size_t args_cap;
+    size_t nargs;
+    bool ok;
+};
+
+static uint64_t
+get(struct reader *r)
+{
+    uint64_t x = 0;
+    int c;
+
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if ((c = getc(r->fp)) == EOF) {
+            r->ok = false;
+            return 0;
+        }
+        x |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return x;
+    }
+    r->ok = false;
+    return 0;
+}
+
+static uint64_t
+get_arg(struct reader *r)
+{
+    const uint64_t x = get(r);
+    mmap_trace *const trace = r->trace;
+
+    if (r->nargs == r->args_cap) {
+        r->args_cap = r->args_cap ? 2 * r->args_cap : 1024;
+        trace->args = realloc(trace->args,
+                              r->args_cap * sizeof trace->args[0]);
+        assert(trace->args);
+    }
+    trace->args[r->nargs++] = x;
+    return x;
+}
+
+static void
+get_id(struct reader *r)
+{
+    const uint64_t id = get_arg(r);
+    if (id > r->trace->max_id)
+        r->trace->max_id = id;
+}
+
+/* Counts come from the file, so a failed read stops the loops they drive */
+static void
+get_pows(struct reader *r)
+{
+    for (uint64_t n = get_arg(r); r->ok && n; --n)
+        (void) get_arg(r);
+}
+
+static void
+get_operands(struct reader *r, int op)
+{
+    uint64_t n;
+
+    switch (op) {
+    case MMAP_TRACE_SK_NEW:
+        for (int i = 0; i < 3; ++i)
+            (void) get_arg(r);
+        get_pows(r);
+        (void) get_arg(r);
+        break;
+    case MMAP_TRACE_SK_LOAD:
+        (void) get_arg(r);
+        (void) get_arg(r);
+        break;
+    case MMAP_TRACE_NEW:
+    case MMAP_TRACE_LOAD:
+    case MMAP_TRACE_FREE:
+        get_id(r);
+        break;
+    case MMAP_TRACE_ENCODE:
+        get_id(r);
+        (void) get_arg(r);
+        (void) get_arg(r);
+        get_pows(r);
+        break;
+    case MMAP_TRACE_ENCODE_BATCH:
+        n = get_arg(r);
+        (void) get_arg(r);
+        (void) get_arg(r);
+        for (; r->ok && n; --n) {
+            get_id(r);
+            get_pows(r);
+        }
+        break;
+    case MMAP_TRACE_SET:
+    case MMAP_TRACE_SWAP:
+        get_id(r);
+        get_id(r);
+        break;
+    case MMAP_TRACE_ADD:
+    case MMAP_TRACE_SUB:
+    case MMAP_TRACE_MUL:
+    case MMAP_TRACE_FMA:
+        for (int i = 0; i < 3; ++i)
+            get_id(r);
+        break;
+    case MMAP_TRACE_DOT:
+        get_id(r);
+        n = get_arg(r);
+        for (uint64_t i = 0; r->ok && i < 2 * n; ++i)
+            get_id(r);
+        break;
+    case MMAP_TRACE_IS_ZERO:
+        get_id(r);
+        (void) get_arg(r);
+        break;
+    case MMAP_TRACE_IS_ZERO_BATCH:
+        n = get_arg(r);
+        for (uint64_t i = 0; r->ok && i < n; ++i)
+            get_id(r);
+        for (uint64_t i = 0; r->ok && i < n; ++i)
+            (void) get_arg(r);
+        break;
+    default:
+        r->ok = false;
+        break;
+    }
+}
+
+int
+mmap_trace_read(FILE *fp, mmap_trace *trace)
+{
+    struct reader r = { .fp = fp, .trace = trace, .ok = true };
+    char magic[sizeof MMAP_TRACE_MAGIC - 1];
+    size_t cap = 0;
+    uint64_t start = 0;
+    uint32_t version;
+    int op;
+
+    memset(trace, 0, sizeof trace[0]);
+    if (fread(magic, sizeof magic, 1, fp) != 1
+        || memcmp(magic, MMAP_TRACE_MAGIC, sizeof magic) != 0
+        || fread(&version, sizeof version, 1, fp) != 1
+        || version != MMAP_TRACE_VERSION)
+        return MMAP_ERR;
+    while (r.ok && (op = getc(fp)) != EOF) {
+        uint64_t delta;
+        if (trace->n + 1 >= cap) {
+            cap = cap ? 2 * cap : 1024;
+            trace->ops = realloc(trace->ops, cap * sizeof trace->ops[0]);
+            trace->start_ns = realloc(trace->start_ns,
+                                      cap * sizeof trace->start_ns[0]);
+            trace->duration_ns = realloc(trace->duration_ns,
+                                         cap * sizeof trace->duration_ns[0]);
+            trace->first = realloc(trace->first, cap * sizeof trace->first[0]);
+            assert(trace->ops && trace->start_ns && trace->duration_ns
+                   && trace->first);
+        }
+        delta = get(&r);
+        start += (delta >> 1) ^ -(delta & 1);
+        trace->ops[trace->n] = op;
+        trace->start_ns[trace->n] = start;
+        trace->duration_ns[trace->n] = get(&r);
+        trace->first[trace->n] = r.nargs;
+        get_operands(&r, op);
+        trace->n++;
+    }
+    if (!r.ok) {
+        mmap_trace_clear(trace);
+        return MMAP_ERR;
+    }
+    if (trace->first == NULL) {
+        trace->first = malloc(sizeof trace->first[0]);
+        assert(trace->first);
+    }
+    trace->first[trace->n] = r.nargs;
+    return MMAP_OK;
+}
+
+void
+mmap_trace_clear(mmap_trace *trace)
+{
+    free(trace->ops);
+    free(trace->start_ns);
+    free(trace->duration_ns);
+    free(trace->first);
+    free(trace->args);
+    memset(trace, 0, sizeof trace[0]);
+}
@@ -0,0 +1,75 @@
+#ifndef _LIBMMAP_MMAP_TRACE_H
+#define _LIBMMAP_MMAP_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Traces written by mmap_vtable_trace, for mmap_replay.  Not installed.
+ *
+ * A trace is MMAP_TRACE_MAGIC and a uint32_t version, followed by records
+ * in the order the calls returned.  A record is its operation as one byte,
+ * its start as the zigzag-coded difference in nanoseconds from the previous
+ * record's start, its duration in nanoseconds and its operands, all as
+ * LEB128 varints.  Encodings are numbered from 1 in the order they appear,
+ * and a number is never reused.  The operands of each operation are:
+ *
+ *   SK_NEW         lambda kappa gamma npows pows[npows] nslots
+ *   SK_LOAD        nzs nslots
+ *   NEW LOAD FREE  id
+ *   ENCODE         id n level npows pows[npows]
+ *   ENCODE_BATCH   count n level, then count times: id npows pows[npows]
+ *   SET SWAP       a b
+ *   ADD SUB MUL    dest a b
+ *   FMA            dest a b
+ *   DOT            dest n as[n] bs[n]
+ *   IS_ZERO        id result
+ *   IS_ZERO_BATCH  count ids[count] results[count]
+ *
+ * LOAD stands for encodings read from files or buffers, and for encodings
+ * the trace first sees as operands.  Plaintexts are not recorded. */
+
+#define MMAP_TRACE_MAGIC "MMAPTRCE"
+#define MMAP_TRACE_VERSION 1
+
+typedef enum {
+    MMAP_TRACE_SK_NEW = 1,
+    MMAP_TRACE_SK_LOAD,
+    MMAP_TRACE_NEW,
+    MMAP_TRACE_LOAD,
+    MMAP_TRACE_FREE,
+    MMAP_TRACE_ENCODE,
+    MMAP_TRACE_ENCODE_BATCH,
+    MMAP_TRACE_SET,
+    MMAP_TRACE_SWAP,
+    MMAP_TRACE_ADD,
+    MMAP_TRACE_SUB,
+    MMAP_TRACE_MUL,
+    MMAP_TRACE_FMA,
+    MMAP_TRACE_DOT,
+    MMAP_TRACE_IS_ZERO,
+    MMAP_TRACE_IS_ZERO_BATCH,
+    MMAP_TRACE_NOPS,
+} mmap_trace_op;
+
+/* A whole trace in memory.  The operands of record i, as listed above, are
+ * args[first[i]] to args[first[i + 1] - 1]. */
+typedef struct {
+    size_t n;
+    uint8_t *ops;
+    uint64_t *start_ns;         // since the first record started
+    uint64_t *duration_ns;
+    size_t *first;
+    uint64_t *args;
+    uint64_t max_id;
+} mmap_trace;
+
+/* Returns MMAP_ERR, leaving trace empty, if fp does not hold a whole trace */
+int
+mmap_trace_read(FILE *fp, mmap_trace *trace);
+void
+mmap_trace_clear(mmap_trace *trace);
+const char *
+mmap_trace_op_name(int op);
+
+#endif
@@ -8,14 +8,65 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "utils.h"
 
 const ulong lambdas[] = {8, 16, 24, 32};
 bool deterministic = false;
 
+/* Checks that to_buf writes exactly what fwrite does, into exactly
+ * serialized_size bytes, and returns that buffer */
+static char *
+serialize(const char *desc, int *ok, int (*fwrite_)(void *, FILE *),
+          size_t (*size)(void *), int (*to_buf)(void *, void *, size_t),
+          void *obj, size_t *len)
+{
+    char msg[64], *expected, *buf;
+    FILE *f = tmpfile();
+    long n;
+
+    fwrite_(obj, f);
+    n = ftell(f);
+    rewind(f);
+    expected = malloc(n);
+    (void) fread(expected, 1, n, f);
+    fclose(f);
+
+    *len = size(obj);
+    buf = malloc(*len);
+    snprintf(msg, sizeof msg, "%s: serialized_size", desc);
+    *ok &= expect(msg, n, *len);
+    snprintf(msg, sizeof msg, "%s: to_buf", desc);
+    *ok &= expect(msg, 1, to_buf(obj, buf, *len) == MMAP_OK
+                  && memcmp(buf, expected, *len) == 0);
+    snprintf(msg, sizeof msg, "%s: to_buf too small", desc);
+    *ok &= expect(msg, MMAP_ERR, to_buf(obj, buf, *len - 1));
+    free(expected);
+    return buf;
+}
+
+/* Writes encs to a fresh store file and opens it again */
+static mmap_store *
+store_roundtrip(const mmap_vtable *mmap, const mmap_pp pp,
+                const mmap_enc *encs, size_t n)
+{
+    char path[] = "/tmp/test_mmap_store_XXXXXX";
+    mmap_store *store = NULL;
+    int fd;
+
+    if ((fd = mkstemp(path)) == -1)
+        return NULL;
+    close(fd);
+    if (mmap_store_write(mmap, pp, path, encs, n) == MMAP_OK)
+        store = mmap_store_open(mmap, pp, path);
+    unlink(path);
+    return store;
+}
+
 static int test(const mmap_vtable *mmap, ulong lambda, bool is_gghlite)
 {
     const size_t nzs = 10;
@@ -72,6 +123,25 @@ static int test(const mmap_vtable *mmap, ulong lambda, bool is_gghlite)
         pp2 = mmap->pp->fread(f);
         fclose(f);
     }
+    if (mmap->sk->to_buf) {
+        /* ... and to memory */
+        char *buf;
+        size_t len;
+
+        buf = serialize("sk", &ok, mmap->sk->fwrite, mmap->sk->serialized_size,
+                        mmap->sk->to_buf, sk2, &len);
+        mmap->sk->free(sk2);
+        sk2 = mmap->sk->from_buf(buf, len);
+        ok &= expect("sk: from_buf", 1, sk2 != NULL);
+        free(buf);
+
+        buf = serialize("pp", &ok, mmap->pp->fwrite, mmap->pp->serialized_size,
+                        mmap->pp->to_buf, pp2, &len);
+        mmap->pp->free(pp2);
+        pp2 = mmap->pp->from_buf(buf, len);
+        ok &= expect("pp: from_buf", 1, pp2 != NULL);
+        free(buf);
+    }
     pp1 = mmap->sk->pp(sk1);
 
     mpz_init_set_ui(x1, 0);
@@ -148,6 +218,10 @@ static int test(const mmap_vtable *mmap, ulong lambda, bool is_gghlite)
     mmap->enc->sub(enc, pp1, enc0, enc1);
     ok &= expect("is_zero(x - x)", 1, mmap->enc->is_zero(enc, pp1));
 
+    mmap->enc->swap(&enc, &enc1);
+    ok &= expect("is_zero(swap(x - x, x))", 0, mmap->enc->is_zero(enc, pp1));
+    ok &= expect("is_zero(swap(x, x - x))", 1, mmap->enc->is_zero(enc1, pp1));
+
     mmap->enc->free(enc0);
     mmap->enc->free(enc1);
     mmap->enc->free(enc);
@@ -173,6 +247,39 @@ static int test(const mmap_vtable *mmap, ulong lambda, bool is_gghlite)
     mmap->enc->mul(enc, pp2, enc0, enc1);
     ok &= expect("is_zero(x * x)", 0, mmap->enc->is_zero(enc, pp2));
 
+    if (mmap->enc->to_buf) {
+        char *buf;
+        size_t len;
+        mmap_enc read;
+
+        buf = serialize("enc", &ok, mmap->enc->fwrite,
+                        mmap->enc->serialized_size, mmap->enc->to_buf, enc,
+                        &len);
+        ok &= expect("enc: from_buf truncated", 1,
+                     mmap->enc->from_buf(buf, len - 1) == NULL);
+        read = mmap->enc->from_buf(buf, len);
+        ok &= expect("enc: from_buf", 1, read != NULL);
+        mmap->enc->sub(read, pp2, read, enc);
+        ok &= expect("enc: is_zero(from_buf(x * x) - x * x)", 1, mmap->enc->is_zero(read, pp2));
+        mmap->enc->free(read);
+        free(buf);
+    }
+
+    {
+        mmap_store *store = store_roundtrip(mmap, pp2, (mmap_enc []) { enc0, enc1 }, 2);
+        ok &= expect("store: open", 1, store != NULL);
+        if (store) {
+            ok &= expect("store: count", 2, mmap_store_count(store));
+            ok &= expect("store: out of range", 1, mmap_store_get(store, 2) == NULL);
+            /* enc still holds x * x */
+            mmap->enc->mul(enc0, pp2, mmap_store_get(store, 0), mmap_store_get(store, 1));
+            ok &= expect("store: is_zero(x * x)", 0, mmap->enc->is_zero(enc0, pp2));
+            mmap->enc->sub(enc0, pp2, enc0, enc);
+            ok &= expect("store: is_zero(x * x - x * x)", 1, mmap->enc->is_zero(enc0, pp2));
+            mmap_store_close(store);
+        }
+    }
+
     mmap->enc->free(enc0);
     mmap->enc->free(enc1);
     mmap->enc->free(enc);
@@ -185,6 +292,473 @@ static int test(const mmap_vtable *mmap, ulong lambda, bool is_gghlite)
     return !ok;
 }
 
+static const mmap_op_stats *
+find_stats(const mmap_op_stats *stats, size_t n, const char *name)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (strcmp(stats[i].name, name) == 0)
+            return &stats[i];
+    }
+    return NULL;
+}
+
+#ifdef HAVE_GGHLITE
+/* Writes obj into a new buffer, or returns NULL */
+static char *
+write_buf(int (*fwrite_)(void *, FILE *), void *obj, size_t *len)
+{
+    char *buf = NULL;
+    FILE *f;
+    int ret;
+
+    if ((f = open_memstream(&buf, len)) == NULL)
+        return NULL;
+    ret = fwrite_(obj, f);
+    if (fclose(f) != 0 || ret != MMAP_OK) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static void *
+read_buf(void *(*fread_)(FILE *), const char *buf, size_t len)
+{
+    FILE *f;
+    void *obj;
+
+    if ((f = fmemopen((void *) buf, len, "rb")) == NULL)
+        return NULL;
+    obj = fread_(f);
+    fclose(f);
+    return obj;
+}
+
+/* A gghlite key and its parameters must read back to objects that write the
+ * same bytes and still encode, and truncated or corrupt files must be
+ * rejected */
+static int test_gghlite_io(ulong lambda)
+{
+    const mmap_vtable *const mmap = &gghlite_vtable;
+    int pows[] = { 1, 1 };
+    mmap_sk_params params = {
+        .lambda = lambda,
+        .kappa = 2,
+        .gamma = 2,
+        .pows = pows,
+    };
+    /* The magic, the version and the scalars that precede q */
+    const size_t q_offset = 8 + 8 * 8;
+    const uint64_t huge = (uint64_t) 1 << 40;
+    aes_randstate_t rng;
+    mmap_sk sk, sk2;
+    mmap_pp pp, pp2;
+    mmap_enc a, b, d;
+    char *sk_buf, *pp_buf, *buf;
+    size_t sk_len, pp_len, len;
+    mpz_t x;
+    int ok = 1;
+
+    aes_randinit(rng);
+    sk = mmap->sk->new(&params, NULL, 0, rng, false);
+    pp = mmap->sk->pp(sk);
+    sk_buf = write_buf(mmap->sk->fwrite, sk, &sk_len);
+    pp_buf = write_buf(mmap->pp->fwrite, pp, &pp_len);
+    if (!expect("gghlite: fwrite", 1, sk_buf != NULL && pp_buf != NULL))
+        return 1;
+
+    sk2 = read_buf(mmap->sk->fread, sk_buf, sk_len);
+    pp2 = read_buf(mmap->pp->fread, pp_buf, pp_len);
+    if (!expect("gghlite: fread", 1, sk2 != NULL && pp2 != NULL))
+        return 1;
+    buf = write_buf(mmap->sk->fwrite, sk2, &len);
+    ok &= expect("gghlite sk: round trip", 1, buf != NULL && len == sk_len
+                 && memcmp(buf, sk_buf, len) == 0);
+    free(buf);
+    buf = write_buf(mmap->pp->fwrite, pp2, &len);
+    ok &= expect("gghlite pp: round trip", 1, buf != NULL && len == pp_len
+                 && memcmp(buf, pp_buf, len) == 0);
+    free(buf);
+
+    /* The key read back still encodes, and zero-tests against the
+     * parameters read back */
+    mpz_init_set_ui(x, 1);
+    a = mmap->enc->new(pp2);
+    b = mmap->enc->new(pp2);
+    d = mmap->enc->new(pp2);
+    mmap->enc->encode(a, sk2, 1, (const mpz_t *) &x, pows, 0);
+    mmap->enc->encode(b, sk2, 1, (const mpz_t *) &x, pows, 0);
+    mmap->enc->sub(d, pp2, a, b);
+    ok &= expect("gghlite: is_zero(x - x)", 1, mmap->enc->is_zero(d, pp2));
+    mmap->enc->add(d, pp2, a, b);
+    ok &= expect("gghlite: is_zero(x + x)", 0, mmap->enc->is_zero(d, pp2));
+
+    /* Encodings use the binary format too */
+    buf = write_buf(mmap->enc->fwrite, a, &len);
+    ok &= expect("gghlite enc: fwrite", 1, buf != NULL);
+    if (buf) {
+        mmap_enc e = read_buf(mmap->enc->fread, buf, len);
+        ok &= expect("gghlite enc: fread", 1, e != NULL);
+        if (e) {
+            mmap->enc->sub(d, pp2, e, b);
+            ok &= expect("gghlite enc: is_zero(read(x) - x)", 1,
+                         mmap->enc->is_zero(d, pp2));
+            mmap->enc->free(e);
+        }
+        e = read_buf(mmap->enc->fread, buf, len / 2);
+        ok &= expect("gghlite enc: truncated", 1, e == NULL);
+        if (e)
+            mmap->enc->free(e);
+        free(buf);
+    }
+    mmap->enc->free(a);
+    mmap->enc->free(b);
+    mmap->enc->free(d);
+    mpz_clear(x);
+
+    /* Cut short anywhere before the random state at the end */
+    for (size_t k = 0; k < 8; ++k) {
+        const size_t cut = 1 + (sk_len - 1) * k / 10;
+        mmap_sk bad = read_buf(mmap->sk->fread, sk_buf, cut);
+        ok &= expect("gghlite sk: truncated", 1, bad == NULL);
+        if (bad)
+            mmap->sk->free(bad);
+    }
+    for (size_t k = 0; k < 8; ++k) {
+        const size_t cut = 1 + (pp_len - 1) * k / 8;
+        mmap_pp bad = read_buf(mmap->pp->fread, pp_buf, cut);
+        ok &= expect("gghlite pp: truncated", 1, bad == NULL);
+        if (bad)
+            mmap->pp->free(bad);
+    }
+    {
+        /* sigma follows q, as its precision and then its kind */
+        const uint64_t bad_kind = 7;
+        uint64_t q_limbs;
+        mmap_pp bad;
+        memcpy(&q_limbs, pp_buf + q_offset, sizeof q_limbs);
+        q_limbs &= ~((uint64_t) 1 << 63);
+        buf = malloc(pp_len);
+        memcpy(buf, pp_buf, pp_len);
+        memcpy(buf + q_offset + 8 + 8 * q_limbs + 8, &bad_kind, sizeof bad_kind);
+        bad = read_buf(mmap->pp->fread, buf, pp_len);
+        ok &= expect("gghlite pp: bad mpfr kind", 1, bad == NULL);
+        if (bad)
+            mmap->pp->free(bad);
+        free(buf);
+    }
+    /* A limb count far beyond the file */
+    memcpy(pp_buf + q_offset, &huge, sizeof huge);
+    mmap->pp->free(pp);
+    pp = read_buf(mmap->pp->fread, pp_buf, pp_len);
+    ok &= expect("gghlite pp: corrupt", 1, pp == NULL);
+    if (pp)
+        mmap->pp->free(pp);
+
+    free(sk_buf);
+    free(pp_buf);
+    mmap->pp->free(pp2);
+    mmap->sk->free(sk2);
+    mmap->sk->free(sk);
+    aes_randclear(rng);
+    return !ok;
+}
+#endif
+
+/* Runs the tests through an instrumented vtable, and checks what it counted
+ * there and across threads */
+static int test_instrument(const mmap_vtable *inner)
+{
+    const mmap_vtable *mmap = mmap_vtable_instrument(inner);
+    mmap_op_stats stats[MMAP_INSTRUMENT_NOPS];
+    const mmap_op_stats *st;
+    aes_randstate_t rng;
+    mmap_sk sk;
+    size_t n;
+    int ok = 1;
+    FILE *fp;
+
+    if (!expect("instrument", 1, mmap != NULL))
+        return 1;
+    ok &= expect("same name", 1, mmap->name == inner->name);
+    ok &= expect("same optional methods", inner->enc->fma == NULL,
+                 mmap->enc->fma == NULL);
+    ok &= !test(mmap, lambdas[0], false);
+
+    n = mmap_instrument_stats(mmap, stats, MMAP_INSTRUMENT_NOPS);
+    for (size_t i = 1; i < n; ++i)
+        ok &= expect("sorted by time", 1,
+                     stats[i - 1].total_ns >= stats[i].total_ns);
+    st = find_stats(stats, n, "enc.mul");
+    ok &= expect("enc.mul counted", 1, st != NULL && st->calls > 0);
+    if (st)
+        ok &= expect("percentiles ordered", 1,
+                     st->min_ns <= st->p50_ns && st->p50_ns <= st->p90_ns
+                     && st->p90_ns <= st->p99_ns
+                     && st->p99_ns <= st->max_ns);
+    ok &= expect("sk.new counted", 1, find_stats(stats, n, "sk.new") != NULL);
+    fp = tmpfile();
+    ok &= expect("text dump", MMAP_OK,
+                 mmap_instrument_dump(mmap, fp, MMAP_INSTRUMENT_TEXT));
+    ok &= expect("json dump", MMAP_OK,
+                 mmap_instrument_dump(mmap, fp, MMAP_INSTRUMENT_JSON));
+    fclose(fp);
+
+    aes_randinit(rng);
+    {
+        mmap_sk_params params = {
+            .lambda = lambdas[0],
+            .kappa = 1,
+            .gamma = 1,
+            .pows = NULL,
+        };
+        sk = mmap->sk->new(&params, NULL, 0, rng, false);
+    }
+    mmap_instrument_reset(mmap);
+    ok &= expect("reset", 0, mmap_instrument_stats(mmap, stats, MMAP_INSTRUMENT_NOPS));
+#pragma omp parallel for
+    for (int i = 0; i < 1000; ++i)
+        (void) mmap->sk->nzs(sk);
+    n = mmap_instrument_stats(mmap, stats, MMAP_INSTRUMENT_NOPS);
+    ok &= expect("only sk.nzs", 1, n == 1 && strcmp(stats[0].name, "sk.nzs") == 0);
+    ok &= expect("merged across threads", 1000, n ? stats[0].calls : 0);
+    /* Resetting while other threads count */
+#pragma omp parallel for
+    for (int i = 0; i < 1000; ++i) {
+        if (i % 100 == 0)
+            mmap_instrument_reset(mmap);
+        (void) mmap->sk->nzs(sk);
+    }
+    n = mmap_instrument_stats(mmap, stats, MMAP_INSTRUMENT_NOPS);
+    ok &= expect("concurrent reset", 1, n <= 1 && (n == 0 || stats[0].calls <= 1000));
+    mmap_instrument_reset(mmap);
+    ok &= expect("reset after", 0, mmap_instrument_stats(mmap, stats, MMAP_INSTRUMENT_NOPS));
+    mmap->sk->free(sk);
+    aes_randclear(rng);
+
+    mmap_vtable_instrument_free(mmap);
+    return !ok;
+}
+
+/* Checks every slot of a multi-slot dummy encoding against mpz arithmetic,
+ * as is_zero(computed - expected).  Slot counts that are not a multiple of
+ * the vector width exercise the scalar tail of the slot kernels. */
+static int test_slots(ulong lambda, size_t nslots, bool wide_first)
+{
+    const mmap_vtable *mmap = &dummy_vtable;
+    int pows[] = {1, 1};
+    aes_randstate_t rng;
+    mmap_sk sk;
+    mmap_pp pp;
+    mmap_enc ex, ey, expect_enc, r, read;
+    mpz_t *moduli, *x, *y, *z, first;
+    int ok = 1;
+
+    aes_randinit(rng);
+    mpz_init(first);
+    /* 2^64 - 59 is prime, so sums can wrap a word */
+    mpz_setbit(first, 64);
+    mpz_sub_ui(first, first, 59);
+    mmap_sk_params params = {
+        .lambda = lambda,
+        .kappa = 1,
+        .gamma = 2,
+        .pows = pows,
+    };
+    mmap_sk_opt_params opts = {
+        .nslots = nslots,
+        .modulus = wide_first ? &first : NULL,
+        .is_polylog = false,
+    };
+    sk = mmap->sk->new(&params, &opts, 0, rng, false);
+    pp = mmap->sk->pp(sk);
+    moduli = mmap->sk->plaintext_fields(sk);
+
+    x = calloc(nslots, sizeof x[0]);
+    y = calloc(nslots, sizeof y[0]);
+    z = calloc(nslots, sizeof z[0]);
+    for (size_t i = 0; i < nslots; ++i) {
+        mpz_inits(x[i], y[i], z[i], NULL);
+        mpz_urandomm_aes(x[i], rng, moduli[i]);
+        mpz_urandomm_aes(y[i], rng, moduli[i]);
+    }
+    /* Push the first slot to its extremes */
+    mpz_sub_ui(x[0], moduli[0], 1);
+    mpz_sub_ui(y[0], moduli[0], 2);
+
+    ex = mmap->enc->new(pp);
+    ey = mmap->enc->new(pp);
+    expect_enc = mmap->enc->new(pp);
+    r = mmap->enc->new(pp);
+    mmap->enc->encode(ex, sk, nslots, (const mpz_t *) x, pows, 0);
+    mmap->enc->encode(ey, sk, nslots, (const mpz_t *) y, pows, 0);
+
+    for (size_t i = 0; i < nslots; ++i) {
+        mpz_add(z[i], x[i], y[i]);
+        mpz_mod(z[i], z[i], moduli[i]);
+    }
+    mmap->enc->encode(expect_enc, sk, nslots, (const mpz_t *) z, pows, 0);
+    mmap->enc->add(r, pp, ex, ey);
+    mmap->enc->sub(r, pp, r, expect_enc);
+    ok &= expect("slots: x + y", 1, mmap->enc->is_zero(r, pp));
+
+    {
+        /* Mixes an encoding read back from disk with fresh ones */
+        FILE *f = tmpfile();
+        mmap->enc->fwrite(ex, f);
+        rewind(f);
+        read = mmap->enc->fread(f);
+        fclose(f);
+        mmap->enc->add(r, pp, read, ey);
+        mmap->enc->sub(r, pp, r, expect_enc);
+        ok &= expect("slots: fread(x) + y", 1, mmap->enc->is_zero(r, pp));
+        mmap->enc->free(read);
+    }
+
+    {
+        /* Lazily reduced sums are written out reduced */
+        FILE *f = tmpfile(), *g = tmpfile();
+        bool same = true;
+        int c;
+        mmap->enc->add(r, pp, ex, ey);
+        mmap->enc->fwrite(r, f);
+        mmap->enc->fwrite(expect_enc, g);
+        rewind(f);
+        rewind(g);
+        while ((c = fgetc(f)) != EOF)
+            same &= c == fgetc(g);
+        same &= fgetc(g) == EOF;
+        fclose(f);
+        fclose(g);
+        ok &= expect("slots: fwrite(x + y)", 1, same);
+        free(serialize("slots: x + y", &ok, mmap->enc->fwrite,
+                       mmap->enc->serialized_size, mmap->enc->to_buf, r,
+                       &(size_t) { 0 }));
+    }
+
+    {
+        /* Lazily reduced sums, and copies of them, outlive the parameters
+         * they were computed under */
+        const size_t pp_size = mmap->pp->serialized_size(pp);
+        char *pp_buf = malloc(pp_size);
+        mmap_pp pp2;
+        mmap_enc sum, copy;
+        size_t size;
+        char *buf;
+
+        mmap->pp->to_buf(pp, pp_buf, pp_size);
+        pp2 = mmap->pp->from_buf(pp_buf, pp_size);
+        free(pp_buf);
+        sum = mmap->enc->new(pp2);
+        copy = mmap->enc->new(pp);
+        mmap->enc->add(sum, pp2, ex, ey);
+        mmap->enc->set(copy, sum);
+        mmap->pp->free(pp2);
+        size = mmap->enc->serialized_size(sum);
+        buf = malloc(size);
+        ok &= expect("slots: to_buf(x + y) after its pp", MMAP_OK,
+                     mmap->enc->to_buf(sum, buf, size));
+        free(buf);
+        mmap->enc->sub(r, pp, sum, expect_enc);
+        ok &= expect("slots: x + y after its pp", 1, mmap->enc->is_zero(r, pp));
+        mmap->enc->sub(r, pp, copy, expect_enc);
+        ok &= expect("slots: set(x + y)", 1, mmap->enc->is_zero(r, pp));
+        mmap->enc->free(sum);
+        mmap->enc->free(copy);
+    }
+
+    {
+        /* Views over mapped payloads, one of them stored lazily reduced */
+        mmap_store *store;
+        mmap->enc->add(r, pp, ex, ey);
+        store = store_roundtrip(mmap, pp, (mmap_enc []) { ex, r }, 2);
+        ok &= expect("slots: store", 1, store != NULL);
+        if (store) {
+            mmap->enc->add(r, pp, mmap_store_get(store, 0), ey);
+            mmap->enc->sub(r, pp, r, expect_enc);
+            ok &= expect("slots: store(x) + y", 1, mmap->enc->is_zero(r, pp));
+            mmap->enc->sub(r, pp, mmap_store_get(store, 1), expect_enc);
+            ok &= expect("slots: store(x + y)", 1, mmap->enc->is_zero(r, pp));
+            mmap_store_close(store);
+        }
+    }
+
+    /* Enough doublings to overflow any lazy-reduction headroom */
+    for (size_t i = 0; i < nslots; ++i) {
+        mpz_mul_2exp(z[i], x[i], 200);
+        mpz_mod(z[i], z[i], moduli[i]);
+    }
+    mmap->enc->encode(expect_enc, sk, nslots, (const mpz_t *) z, pows, 0);
+    mmap->enc->set(r, ex);
+    for (int i = 0; i < 200; ++i)
+        mmap->enc->add(r, pp, r, r);
+    mmap->enc->sub(r, pp, r, expect_enc);
+    ok &= expect("slots: 2^200 x", 1, mmap->enc->is_zero(r, pp));
+
+    for (size_t i = 0; i < nslots; ++i) {
+        mpz_sub(z[i], y[i], x[i]);
+        mpz_mod(z[i], z[i], moduli[i]);
+    }
+    mmap->enc->encode(expect_enc, sk, nslots, (const mpz_t *) z, pows, 0);
+    mmap->enc->sub(r, pp, ey, ex);
+    mmap->enc->sub(r, pp, r, expect_enc);
+    ok &= expect("slots: y - x", 1, mmap->enc->is_zero(r, pp));
+
+    for (size_t i = 0; i < nslots; ++i) {
+        mpz_mul(z[i], x[i], y[i]);
+        mpz_mod(z[i], z[i], moduli[i]);
+    }
+    mmap->enc->encode(expect_enc, sk, nslots, (const mpz_t *) z, pows, 0);
+    mmap->enc->mul(r, pp, ex, ey);
+    mmap->enc->sub(r, pp, r, expect_enc);
+    ok &= expect("slots: x * y", 1, mmap->enc->is_zero(r, pp));
+
+    /* Fused operations, with the destination also an input */
+    for (size_t i = 0; i < nslots; ++i) {
+        mpz_set(z[i], x[i]);
+        mpz_addmul(z[i], x[i], y[i]);
+        mpz_mod(z[i], z[i], moduli[i]);
+    }
+    mmap->enc->encode(expect_enc, sk, nslots, (const mpz_t *) z, pows, 0);
+    mmap->enc->set(r, ex);
+    mmap->enc->fma(r, pp, r, ey);
+    mmap->enc->sub(r, pp, r, expect_enc);
+    ok &= expect("slots: x + x * y", 1, mmap->enc->is_zero(r, pp));
+
+    for (size_t i = 0; i < nslots; ++i) {
+        mpz_mul(z[i], x[i], y[i]);
+        mpz_addmul(z[i], y[i], y[i]);
+        mpz_addmul(z[i], x[i], x[i]);
+        mpz_mod(z[i], z[i], moduli[i]);
+    }
+    mmap->enc->encode(expect_enc, sk, nslots, (const mpz_t *) z, pows, 0);
+    mmap->enc->set(r, ex);
+    mmap->enc->dot(r, pp, (mmap_enc []) { ex, ey, r },
+                   (mmap_enc []) { ey, ey, r }, 3);
+    mmap->enc->sub(r, pp, r, expect_enc);
+    ok &= expect("slots: x * y + y * y + x * x", 1, mmap->enc->is_zero(r, pp));
+
+    for (size_t i = 0; i < nslots; ++i)
+        mpz_set_ui(z[i], i == nslots - 1);
+    mmap->enc->encode(r, sk, nslots, (const mpz_t *) z, pows, 0);
+    ok &= expect("slots: last slot nonzero", 0, mmap->enc->is_zero(r, pp));
+
+    for (size_t i = 0; i < nslots; ++i)
+        mpz_clears(x[i], y[i], z[i], NULL);
+    free(x);
+    free(y);
+    free(z);
+    mmap->enc->free(ex);
+    mmap->enc->free(ey);
+    mmap->enc->free(expect_enc);
+    mmap->enc->free(r);
+    mmap->pp->free(pp);
+    mmap->sk->free(sk);
+    mpz_clear(first);
+    aes_randclear(rng);
+    return !ok;
+}
+
 static int test_lambdas(const mmap_vtable *vtable, bool is_gghlite)
 {
     for (size_t i = 0; i < sizeof(lambdas) / (sizeof(lambdas[0])); ++i) {
@@ -195,6 +769,67 @@ static int test_lambdas(const mmap_vtable *vtable, bool is_gghlite)
     return 0;
 }
 
+/* A matrix read under parameters with another number or width of slots is
+ * rejected rather than swapped into place */
+static int test_mat_mismatch(void)
+{
+    const mmap_vtable *mmap = &dummy_vtable;
+    const struct { ulong lambda; size_t nslots; } shapes[] = {
+        { 80, 4 },              /* the one written, with mpz_t slots */
+        { 80, 1 },
+        { 16, 4 },              /* word slots, too narrow for the residues */
+    };
+    const size_t nshapes = sizeof shapes / sizeof shapes[0];
+    int pows[] = { 1, 1 };
+    mmap_sk sks[3];
+    mmap_pp pps[3];
+    aes_randstate_t rng;
+    mmap_enc_mat_t m;
+    mpz_t xs[4];
+    FILE *fp;
+    int ok = 1;
+
+    aes_randinit(rng);
+    for (size_t k = 0; k < nshapes; ++k) {
+        mmap_sk_params params = {
+            .lambda = shapes[k].lambda,
+            .kappa = 1,
+            .gamma = 2,
+            .pows = pows,
+        };
+        mmap_sk_opt_params opts = { .nslots = shapes[k].nslots };
+        sks[k] = mmap->sk->new(&params, &opts, 0, rng, false);
+        pps[k] = mmap->sk->pp(sks[k]);
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        mpz_init_set(xs[i], mmap->sk->plaintext_fields(sks[0])[i]);
+        mpz_sub_ui(xs[i], xs[i], 1);
+    }
+    mmap_enc_mat_init(mmap, pps[0], m, 1, 2);
+    mmap->enc->encode(m->m[0][0], sks[0], 4, (const mpz_t *) xs, pows, 0);
+    mmap->enc->encode(m->m[0][1], sks[0], 4, (const mpz_t *) xs, pows, 0);
+    fp = tmpfile();
+    ok &= expect("mismatch: fwrite", MMAP_OK, mmap_enc_mat_fwrite(mmap, m, fp));
+    mmap_enc_mat_clear(mmap, m);
+    for (size_t k = 0; k < nshapes; ++k) {
+        int ret;
+        rewind(fp);
+        ret = mmap_enc_mat_fread(mmap, pps[k], m, fp);
+        ok &= expect("mismatch: fread", k == 0 ? MMAP_OK : MMAP_ERR, ret);
+        if (ret == MMAP_OK)
+            mmap_enc_mat_clear(mmap, m);
+    }
+    fclose(fp);
+    for (size_t i = 0; i < 4; ++i)
+        mpz_clear(xs[i]);
+    for (size_t k = 0; k < nshapes; ++k) {
+        mmap->pp->free(pps[k]);
+        mmap->sk->free(sks[k]);
+    }
+    aes_randclear(rng);
+    return !ok;
+}
+
 int main(int argc, char **argv)
 {
     (void) argv;
@@ -202,9 +837,30 @@ int main(int argc, char **argv)
     printf("* Dummy\n");
     if (test_lambdas(&dummy_vtable, false))
         return 1;
+    /* Moduli wider than a word take the mpz_t path */
+    printf("** lambda = 80\n");
+    if (test(&dummy_vtable, 80, false))
+        return 1;
+    printf("** slots\n");
+    for (size_t i = 0; i < sizeof(lambdas) / (sizeof(lambdas[0])); ++i) {
+        if (test_slots(lambdas[i], 37, false))
+            return 1;
+    }
+    if (test_slots(63, 37, true) || test_slots(80, 37, false))
+        return 1;
+    if (test_mat_mismatch())
+        return 1;
     printf("* CLT13\n");
     if (test_lambdas(&clt_vtable, false))
         return 1;
+    printf("* Instrumented\n");
+    if (test_instrument(&dummy_vtable) || test_instrument(&clt_vtable))
+        return 1;
+#ifdef HAVE_GGHLITE
+    printf("* GGHLite I/O\n");
+    if (test_gghlite_io(lambdas[0]))
+        return 1;
+#endif
 #ifdef HAVE_LIBGGHLITE
     printf("* GGHLite\n");
     if (test_lambdas(&gghlite_vtable, true))
@@ -1,209 +1,1073 @@
 #include <mmap/mmap.h>
 #include <mmap/mmap_clt.h>
-#ifdef HAVE_GGHLITE
-#  include <mmap/mmap_gghlite.h>
-#endif
 #include <mmap/mmap_dummy.h>
-#include <flint/fmpz.h>
+#include <mmap/mmap_trace.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "utils.h"
 
-/* XXX: Currently, fmpz_modp_matrix_inverse is part of gghlite, whereas it
-   should really be within libmmap or something.  This should be fixed! */
-#ifdef HAVE_LIBGGHLITE
-
-ulong nzs = 2;
-ulong kappa = 2;
+const size_t nzs = 2;
+const size_t kappa = 2;
 
 const ulong lambdas[] = {8, 16, 24, 32};
 
+/* Plaintext matrices are row-major arrays of mpz_t */
+typedef struct {
+    int nrows;
+    int ncols;
+    mpz_t *m;
+} pt_mat;
+
+static void
+pt_mat_init(pt_mat *m, int nrows, int ncols)
+{
+    m->nrows = nrows;
+    m->ncols = ncols;
+    m->m = calloc(nrows * ncols, sizeof m->m[0]);
+    for (int i = 0; i < nrows * ncols; ++i)
+        mpz_init(m->m[i]);
+}
+
+static void
+pt_mat_clear(pt_mat *m)
+{
+    for (int i = 0; i < m->nrows * m->ncols; ++i)
+        mpz_clear(m->m[i]);
+    free(m->m);
+}
+
+static mpz_t *
+pt_mat_entry(const pt_mat *m, int i, int j)
+{
+    return &m->m[i * m->ncols + j];
+}
+
+static void
+pt_mat_set_ui(pt_mat *m, const unsigned long *vals)
+{
+    for (int i = 0; i < m->nrows * m->ncols; ++i)
+        mpz_set_ui(m->m[i], vals[i]);
+}
+
+/* a = b * c mod p */
+static void
+pt_mat_mul_mod(pt_mat *a, const pt_mat *b, const pt_mat *c, const mpz_t p)
+{
+    pt_mat r;
+
+    pt_mat_init(&r, b->nrows, c->ncols);
+    for (int i = 0; i < b->nrows; ++i) {
+        for (int j = 0; j < c->ncols; ++j) {
+            for (int k = 0; k < b->ncols; ++k)
+                mpz_addmul(*pt_mat_entry(&r, i, j), *pt_mat_entry(b, i, k),
+                           *pt_mat_entry(c, k, j));
+            mpz_mod(*pt_mat_entry(&r, i, j), *pt_mat_entry(&r, i, j), p);
+        }
+    }
+    pt_mat_clear(a);
+    *a = r;
+}
+
+/* Random invertible 2x2 matrix m and its inverse */
+static void
+pt_mat_init_rand(pt_mat *m, pt_mat *inv, aes_randstate_t rng, const mpz_t p)
+{
+    mpz_t det;
+
+    pt_mat_init(m, 2, 2);
+    pt_mat_init(inv, 2, 2);
+    mpz_init(det);
+    do {
+        for (int i = 0; i < 4; ++i)
+            mpz_urandomm_aes(m->m[i], rng, p);
+        mpz_mul(det, m->m[0], m->m[3]);
+        mpz_submul(det, m->m[1], m->m[2]);
+        mpz_mod(det, det, p);
+    } while (mpz_invert(det, det, p) == 0);
+    mpz_mul(inv->m[0], m->m[3], det);
+    mpz_neg(inv->m[1], m->m[1]);
+    mpz_mul(inv->m[1], inv->m[1], det);
+    mpz_neg(inv->m[2], m->m[2]);
+    mpz_mul(inv->m[2], inv->m[2], det);
+    mpz_mul(inv->m[3], m->m[0], det);
+    for (int i = 0; i < 4; ++i)
+        mpz_mod(inv->m[i], inv->m[i], p);
+    mpz_clear(det);
+}
+
 static void encode(const mmap_vtable *vtable, mmap_sk sk,
-                   mmap_enc_mat_t out, fmpz_mat_t in, int idx, int nrows,
-                   int ncols, aes_randstate_t rand)
+                   mmap_enc_mat_t out, const pt_mat *in, int idx)
 {
+    const size_t count = in->nrows * in->ncols;
+    const mpz_t **plaintexts;
+    const int **ixs;
     int *pows;
 
-    pows = calloc(nzs, sizeof(int));
+    pows = calloc(vtable->sk->nzs(sk), sizeof(int));
     pows[idx] = 1;
-
-    for (int i = 0; i < nrows; ++i) {
-        for (int j = 0; j < ncols; ++j) {
-            vtable->enc->encode(out->m[i][j], sk, 1, fmpz_mat_entry(in, i, j),
-                                pows);
-        }
+    plaintexts = calloc(count, sizeof plaintexts[0]);
+    ixs = calloc(count, sizeof ixs[0]);
+    for (size_t k = 0; k < count; ++k) {
+        plaintexts[k] = (const mpz_t *) &in->m[k];
+        ixs[k] = pows;
     }
+    vtable->enc->encode_batch(out->data, sk, count, 1, plaintexts, ixs, 0);
+    free(plaintexts);
+    free(ixs);
     free(pows);
 }
 
-static void
-_fmpz_mat_init_rand(fmpz_mat_t m, long n, aes_randstate_t rand, fmpz_t field)
+static int
+test_products(const mmap_vtable *vtable, const mmap_pp pp,
+              mmap_enc_mat_t zero_enc_1, mmap_enc_mat_t one_enc_1,
+              mmap_enc_mat_t zero_enc_2, mmap_enc_mat_t one_enc_2)
 {
-    fmpz_mat_t inverse;
+    mmap_enc_mat_t result;
+    int ok = 1;
 
-    fmpz_mat_init(m, n, n);
-    fmpz_mat_init(inverse, n, n);
-    while (true) {
-        for (int i = 0; i < n; i++) {
-            for(int j = 0; j < n; j++) {
-                fmpz_randm_aes(fmpz_mat_entry(m, i, j), rand, field);
-            }
-        }
-        fmpz_modp_matrix_inverse(inverse, m, n, field);
-        for (int i = 0; i < n; i++) {
-            for(int j = 0; j < n; j++) {
-                if (!fmpz_is_zero(fmpz_mat_entry(inverse, i, j)))
-                    goto done;
-            }
-        }
+    mmap_enc_mat_init(vtable, pp, result, 1, 2);
+    mmap_enc_mat_mul(vtable, pp, result, zero_enc_1, zero_enc_2);
+    ok &= expect("[1 0] * [1 0][0 0]", 1, vtable->enc->is_zero(result->m[0][1], pp));
+    mmap_enc_mat_mul(vtable, pp, result, zero_enc_1, one_enc_2);
+    ok &= expect("[1 0] * [1 0][0 1]", 1, vtable->enc->is_zero(result->m[0][1], pp));
+    mmap_enc_mat_mul(vtable, pp, result, one_enc_1, zero_enc_2);
+    ok &= expect("[1 1] * [1 0][0 0]", 1, vtable->enc->is_zero(result->m[0][1], pp));
+    mmap_enc_mat_mul_par(vtable, pp, result, one_enc_1, one_enc_2);
+    ok &= expect("[1 1] * [1 0][0 1]", 0, vtable->enc->is_zero(result->m[0][1], pp));
+    /* Either kernel, depending on the threads available */
+    {
+        const mmap_mat_threshold table[] = { { 4, 1 }, { 2, 4 } };
+        mmap_mat_threshold many[MMAP_MAT_THRESHOLDS_MAX + 1] = { { 0, 0 } };
+        ok &= expect("thresholds", MMAP_OK,
+                     mmap_enc_mat_mul_set_thresholds(vtable, table, 2));
+        ok &= expect("too many thresholds", MMAP_ERR,
+                     mmap_enc_mat_mul_set_thresholds(vtable, many, MMAP_MAT_THRESHOLDS_MAX + 1));
     }
-done:
-    fmpz_mat_clear(inverse);
+    mmap_enc_mat_mul_auto(vtable, pp, result, one_enc_1, zero_enc_2);
+    ok &= expect("auto: [1 1] * [1 0][0 0]", 1, vtable->enc->is_zero(result->m[0][1], pp));
+    mmap_enc_mat_mul_auto(vtable, pp, result, one_enc_1, one_enc_2);
+    ok &= expect("auto: [1 1] * [1 0][0 1]", 0, vtable->enc->is_zero(result->m[0][1], pp));
+    mmap_enc_mat_clear(vtable, result);
+    return ok;
 }
 
-static inline void
-fmpz_mat_mul_mod(fmpz_mat_t a, fmpz_mat_t b, fmpz_mat_t c, fmpz_t p)
+static int
+test_in_place(const mmap_vtable *vtable, const mmap_pp pp,
+              mmap_enc_mat_t zero_enc_1, mmap_enc_mat_t one_enc_1,
+              mmap_enc_mat_t one_enc_2)
 {
-    fmpz_mat_mul(a, b, c);
-    fmpz_mat_scalar_mod_fmpz(a, a, p);
+    mmap_enc_mat_t result, other;
+    int ok = 1;
+
+    mmap_enc_mat_init(vtable, pp, result, 1, 2);
+    mmap_enc_mat_init(vtable, pp, other, 1, 2);
+    mmap_enc_mat_view_set(vtable, mmap_enc_mat_as_view(result),
+                          mmap_enc_mat_as_view(one_enc_1));
+    mmap_enc_mat_view_set(vtable, mmap_enc_mat_as_view(other),
+                          mmap_enc_mat_as_view(zero_enc_1));
+    mmap_enc_mat_view_swap(vtable, mmap_enc_mat_as_view(result),
+                           mmap_enc_mat_as_view(other));
+    mmap_enc_mat_mul(vtable, pp, result, result, one_enc_2);
+    ok &= expect("r = [1 0], r * [1 0][0 1]", 1, vtable->enc->is_zero(result->m[0][1], pp));
+    mmap_enc_mat_mul_par(vtable, pp, other, other, one_enc_2);
+    ok &= expect("r = [1 1], r * [1 0][0 1]", 0, vtable->enc->is_zero(other->m[0][1], pp));
+    mmap_enc_mat_clear(vtable, result);
+    mmap_enc_mat_clear(vtable, other);
+    return ok;
 }
 
-static inline void
-fmpz_layer_mul_left(fmpz_mat_t zero, fmpz_mat_t one, fmpz_mat_t m, fmpz_t p)
+static int
+test_vec(const mmap_vtable *vtable, const mmap_pp pp,
+         mmap_enc_mat_t zero_enc_1, mmap_enc_mat_t one_enc_1,
+         mmap_enc_mat_t zero_enc_2, mmap_enc_mat_t one_enc_2)
 {
-    fmpz_mat_mul_mod(zero, m, zero, p);
-    fmpz_mat_mul_mod(one, m, one, p);
+    mmap_enc_mat_t result, col, empty_v, empty_m;
+    mmap_enc_vec_eval_t ev;
+    int ok = 1;
+
+    mmap_enc_mat_init(vtable, pp, result, 1, 1);
+    mmap_enc_vec_mat_mul(vtable, pp, result, zero_enc_1, one_enc_2);
+    ok &= expect("[1 0] * [1 0][0 1]", 1, vtable->enc->is_zero(result->m[0][1], pp));
+    mmap_enc_vec_mat_mul(vtable, pp, result, one_enc_1, one_enc_2);
+    ok &= expect("[1 1] * [1 0][0 1]", 0, vtable->enc->is_zero(result->m[0][1], pp));
+
+    mmap_enc_mat_init(vtable, pp, col, 2, 1);
+    mmap_enc_mat_view_set(vtable, mmap_enc_mat_as_view(col),
+                          mmap_enc_mat_view_transpose(mmap_enc_mat_as_view(one_enc_1)));
+    mmap_enc_mat_vec_mul(vtable, pp, result, zero_enc_2, col);
+    ok &= expect("[1 0][0 0] * [1 1]^T (0)", 0, vtable->enc->is_zero(result->m[0][0], pp));
+    ok &= expect("[1 0][0 0] * [1 1]^T (1)", 1, vtable->enc->is_zero(result->m[1][0], pp));
+
+    mmap_enc_vec_eval_init(vtable, pp, ev, one_enc_1);
+    mmap_enc_vec_eval_step(vtable, pp, ev, zero_enc_2);
+    ok &= expect("eval [1 1] * [1 0][0 0] (0)", 0,
+                 vtable->enc->is_zero(mmap_enc_mat_view_get(mmap_enc_vec_eval_result(ev), 0, 0), pp));
+    ok &= expect("eval [1 1] * [1 0][0 0] (1)", 1,
+                 vtable->enc->is_zero(mmap_enc_mat_view_get(mmap_enc_vec_eval_result(ev), 0, 1), pp));
+    mmap_enc_vec_eval_clear(vtable, ev);
+
+    /* Empty inner dimension: the product is zero, even in a reused result */
+    mmap_enc_vec_mat_mul(vtable, pp, result, one_enc_1, one_enc_2);
+    mmap_enc_mat_init(vtable, pp, empty_v, 1, 0);
+    mmap_enc_mat_init(vtable, pp, empty_m, 0, 2);
+    mmap_enc_vec_mat_mul(vtable, pp, result, empty_v, empty_m);
+    ok &= expect("[] * [] (0)", 1, vtable->enc->is_zero(result->m[0][0], pp));
+    ok &= expect("[] * [] (1)", 1, vtable->enc->is_zero(result->m[0][1], pp));
+    mmap_enc_mat_clear(vtable, empty_m);
+    /* No columns at all */
+    mmap_enc_mat_init(vtable, pp, empty_m, 2, 0);
+    mmap_enc_vec_mat_mul(vtable, pp, result, one_enc_1, empty_m);
+    ok &= expect("[1 1] * 2x0", 0, result->ncols);
+    mmap_enc_mat_clear(vtable, empty_m);
+    mmap_enc_mat_clear(vtable, empty_v);
+
+    mmap_enc_mat_clear(vtable, col);
+    mmap_enc_mat_clear(vtable, result);
+    return ok;
 }
 
-static void
-fmpz_layer_mul_right(fmpz_mat_t zero, fmpz_mat_t one, fmpz_mat_t m, fmpz_t p)
+static int
+test_views(const mmap_vtable *vtable, const mmap_pp pp,
+           mmap_enc_mat_t one_enc_1, mmap_enc_mat_t one_enc_2)
+{
+    mmap_enc_mat_t result;
+    mmap_enc_mat_view col;
+    int ok = 1;
+
+    /* [1 1] * second column of [1 0][0 1] */
+    mmap_enc_mat_init(vtable, pp, result, 2, 2);
+    col = mmap_enc_mat_col(one_enc_2, 1);
+    mmap_enc_mat_view_mul(vtable, pp, mmap_enc_mat_block(result, 1, 0, 1, 1),
+                          mmap_enc_mat_row(one_enc_1, 0), col);
+    ok &= expect("[1 1] * [0 1]^T", 0, vtable->enc->is_zero(result->m[1][0], pp));
+    /* 1x1 blocks, one of them through a transposed view */
+    mmap_enc_mat_view_mul_par(vtable, pp, mmap_enc_mat_block(result, 0, 1, 1, 1),
+                              mmap_enc_mat_block(one_enc_1, 0, 1, 1, 1),
+                              mmap_enc_mat_view_transpose(mmap_enc_mat_block(one_enc_2, 0, 0, 1, 1)));
+    ok &= expect("[1] * [1]", 0, vtable->enc->is_zero(result->m[0][1], pp));
+    mmap_enc_mat_clear(vtable, result);
+    return ok;
+}
+
+static int
+test_is_zero(const mmap_vtable *vtable, const mmap_pp pp, mmap_sk sk,
+             mmap_enc_mat_t zero_enc_2)
 {
-    fmpz_mat_mul_mod(zero, zero, m, p);
-    fmpz_mat_mul_mod(one, one, m, p);
+    mmap_enc_mat_t id, result;
+    uint64_t bitmap[MMAP_BITMAP_WORDS(4)];
+    pt_mat m;
+    int ok = 1;
+
+    /* I * [1 0][0 0] is zero everywhere but (0,0) */
+    pt_mat_init(&m, 2, 2);
+    pt_mat_set_ui(&m, (unsigned long []) { 1, 0, 0, 1 });
+    mmap_enc_mat_init(vtable, pp, id, 2, 2);
+    encode(vtable, sk, id, &m, 0);
+    mmap_enc_mat_init(vtable, pp, result, 2, 2);
+    mmap_enc_mat_mul(vtable, pp, result, id, zero_enc_2);
+
+    ok &= expect("all: stop", -1, mmap_enc_mat_is_zero(vtable, pp, bitmap, result, MMAP_ZT_ALL));
+    ok &= expect("all: bitmap", 14, bitmap[0]);
+    ok &= expect("until zero: stop", 1, mmap_enc_mat_is_zero(vtable, pp, bitmap, result, MMAP_ZT_UNTIL_ZERO));
+    ok &= expect("until zero: bitmap", 2, bitmap[0]);
+    ok &= expect("until nonzero: stop", 0, mmap_enc_mat_is_zero(vtable, pp, bitmap, result, MMAP_ZT_UNTIL_NONZERO));
+    ok &= expect("until nonzero: bitmap", 0, bitmap[0]);
+    mmap_enc_mat_view_swap(vtable, mmap_enc_mat_row(result, 0), mmap_enc_mat_row(result, 1));
+    ok &= expect("until nonzero, swapped: stop", 2, mmap_enc_mat_is_zero(vtable, pp, bitmap, result, MMAP_ZT_UNTIL_NONZERO));
+    ok &= expect("until nonzero, swapped: bitmap", 3, bitmap[0]);
+
+    mmap_enc_mat_clear(vtable, id);
+    mmap_enc_mat_clear(vtable, result);
+    pt_mat_clear(&m);
+    return ok;
 }
 
-static int test(const mmap_vtable *vtable, ulong lambda, bool is_gghlite)
+static int
+test_fused(const mmap_vtable *vtable, const mmap_pp pp,
+           mmap_enc_mat_t zero_enc_1, mmap_enc_mat_t one_enc_1,
+           mmap_enc_mat_t one_enc_2)
 {
+    mmap_enc r;
     int ok = 1;
-    mmap_sk sk = malloc(vtable->sk->size);
-    const mmap_pp *pp;
 
+    r = vtable->enc->new(pp);
+    /* [1 0] . [0 1] and [1 1] . [0 1] */
+    mmap_enc_dot(vtable, pp, r, zero_enc_1->data,
+                 (mmap_enc []) { one_enc_2->m[0][1], one_enc_2->m[1][1] }, 2);
+    ok &= expect("[1 0] . [0 1]", 1, vtable->enc->is_zero(r, pp));
+    mmap_enc_dot(vtable, pp, r, one_enc_1->data,
+                 (mmap_enc []) { one_enc_2->m[0][1], one_enc_2->m[1][1] }, 2);
+    ok &= expect("[1 1] . [0 1]", 0, vtable->enc->is_zero(r, pp));
+    /* 0 * 0 + 1 * 1 */
+    vtable->enc->mul(r, pp, zero_enc_1->m[0][1], one_enc_2->m[0][1]);
+    ok &= expect("0 * 0", 1, vtable->enc->is_zero(r, pp));
+    mmap_enc_fma(vtable, pp, r, one_enc_1->m[0][1], one_enc_2->m[1][1]);
+    ok &= expect("0 * 0 + 1 * 1", 0, vtable->enc->is_zero(r, pp));
+    vtable->enc->free(r);
+    return ok;
+}
+
+static int
+test_chain(const mmap_vtable *vtable, ulong lambda)
+{
+    const size_t n = 4;
+    const unsigned long vals[][4] = {
+        { 1, 0, 0, 1 },         /* identity */
+        { 0, 1, 1, 0 },         /* swap */
+        { 1, 0, 0, 0 },
+        { 0, 1, 1, 0 },         /* swap */
+    };
+    mmap_enc_mat_t mats[n], result;
+    mmap_sk sk;
+    mmap_pp pp;
     aes_randstate_t rng;
+    pt_mat m;
+    int ok = 1;
+
     aes_randinit(rng);
+    mmap_sk_params params = {
+        .lambda = lambda,
+        .kappa = n,
+        .gamma = n,
+        .pows = NULL,
+    };
+    sk = vtable->sk->new(&params, NULL, 0, rng, false);
+    pp = vtable->sk->pp(sk);
 
-    fmpz_t *moduli;
+    /* [1 1] * I * swap * [1 0][0 0] */
+    for (size_t i = 0; i < n; ++i) {
+        pt_mat_init(&m, i == 0 ? 1 : 2, 2);
+        pt_mat_set_ui(&m, i == 0 ? (unsigned long []) { 1, 1 } : vals[i - 1]);
+        mmap_enc_mat_init(vtable, pp, mats[i], m.nrows, m.ncols);
+        encode(vtable, sk, mats[i], &m, i);
+        pt_mat_clear(&m);
+    }
+    mmap_enc_mat_init(vtable, pp, result, 1, 1);
+    ok &= expect("vector chain cost", 12, mmap_enc_mat_chain_cost(mats, n));
+    mmap_enc_mat_chain_mul(vtable, pp, result, mats, n);
+    ok &= expect("[1 1] * I * swap * [1 0][0 0] (0,0)", 0, vtable->enc->is_zero(result->m[0][0], pp));
+    ok &= expect("[1 1] * I * swap * [1 0][0 0] (0,1)", 1, vtable->enc->is_zero(result->m[0][1], pp));
+    for (size_t i = 0; i < n; ++i)
+        mmap_enc_mat_clear(vtable, mats[i]);
 
-    vtable->sk->init(sk, lambda, kappa, nzs, NULL, 0, 0, rng, false);
-    moduli = vtable->sk->plaintext_fields(sk);
+    /* I * swap * [1 0][0 0] * swap */
+    for (size_t i = 0; i < n; ++i) {
+        pt_mat_init(&m, 2, 2);
+        pt_mat_set_ui(&m, vals[i]);
+        mmap_enc_mat_init(vtable, pp, mats[i], 2, 2);
+        encode(vtable, sk, mats[i], &m, i);
+        pt_mat_clear(&m);
+    }
+    ok &= expect("square chain cost", 24, mmap_enc_mat_chain_cost(mats, n));
+    mmap_enc_mat_chain_mul(vtable, pp, mats[0], mats, n);
+    ok &= expect("I * swap * [1 0][0 0] * swap (0,0)", 1, vtable->enc->is_zero(mats[0]->m[0][0], pp));
+    ok &= expect("I * swap * [1 0][0 0] * swap (1,1)", 0, vtable->enc->is_zero(mats[0]->m[1][1], pp));
+    for (size_t i = 0; i < n; ++i)
+        mmap_enc_mat_clear(vtable, mats[i]);
+
+    mmap_enc_mat_clear(vtable, result);
+    vtable->pp->free(pp);
+    vtable->sk->free(sk);
+    aes_randclear(rng);
+    return !ok;
+}
+
+static int
+test_pool(const mmap_vtable *vtable, const mmap_pp pp,
+          mmap_enc_mat_t one_enc_1)
+{
+    const mmap_enc one = one_enc_1->m[0][1];
+    mmap_enc_pool *pool;
+    mmap_enc a, b;
+    int ok = 1;
+
+    pool = mmap_enc_pool_new(vtable, pp, 1);
+    a = mmap_enc_pool_acquire(pool);
+    b = mmap_enc_pool_acquire(pool);
+    vtable->enc->set(a, one);
+    mmap_enc_pool_release(pool, a);
+    ok &= expect("reused", 1, mmap_enc_pool_acquire(pool) == a);
+    ok &= expect("kept value", 0, vtable->enc->is_zero(a, pp));
+    mmap_enc_pool_release(pool, b);
+    mmap_enc_pool_release(pool, a);
+
+    {
+        /* Using more pools than a thread remembers does not strand what
+         * this thread released into the first one */
+        mmap_enc_pool *others[16];
+        for (int i = 0; i < 16; ++i) {
+            others[i] = mmap_enc_pool_new(vtable, pp, 0);
+            mmap_enc_pool_release(others[i], mmap_enc_pool_acquire(others[i]));
+        }
+        ok &= expect("reused after other pools", 1, mmap_enc_pool_acquire(pool) == a);
+        mmap_enc_pool_release(pool, a);
+        for (int i = 0; i < 16; ++i)
+            mmap_enc_pool_free(others[i]);
+    }
+
+#pragma omp parallel for reduction(&:ok)
+    for (int i = 0; i < 256; ++i) {
+        mmap_enc encs[40];
+        /* more than a thread's cache holds, so some go through the pool */
+        const int n = 1 + i % 40;
+        for (int j = 0; j < n; ++j) {
+            encs[j] = mmap_enc_pool_acquire(pool);
+            if (j % 2)
+                vtable->enc->set(encs[j], one);
+            else
+                vtable->enc->sub(encs[j], pp, one, one);
+        }
+        for (int j = 0; j < n; ++j) {
+            ok &= vtable->enc->is_zero(encs[j], pp) == (j % 2 == 0);
+            mmap_enc_pool_release(pool, encs[j]);
+        }
+    }
+    ok &= expect("parallel", 1, ok);
+    mmap_enc_pool_free(pool);
+    return ok;
+}
+
+/* Patches the store at path in place; offsets follow struct store_header */
+static int
+test_store_corrupt(const mmap_vtable *vtable, const mmap_pp pp,
+                   const char *path)
+{
+    uint64_t index, size, zero = 0, misaligned;
+    mmap_store *store;
+    int fd, ok = 1;
+
+    if ((fd = open(path, O_RDWR)) == -1)
+        return 0;
+    ok &= pread(fd, &index, sizeof index, 32) == sizeof index;
+    /* A fixed-size entry shorter than a payload */
+    ok &= pread(fd, &size, sizeof size, index + 8) == sizeof size;
+    --size;
+    ok &= pwrite(fd, &size, sizeof size, index + 8) == sizeof size;
+    store = mmap_store_open(vtable, pp, path);
+    ok &= expect("store: open short entry", 1, store != NULL);
+    if (store && vtable->enc->payload_view)
+        ok &= expect("store: short entry", 1, mmap_store_get(store, 0) == NULL);
+    mmap_store_close(store);
+    /* An index that is not aligned, holding nothing */
+    misaligned = index + 1;
+    ok &= pwrite(fd, &zero, sizeof zero, 24) == sizeof zero;
+    ok &= pwrite(fd, &misaligned, sizeof misaligned, 32) == sizeof misaligned;
+    ok &= pwrite(fd, &zero, sizeof zero, 40) == sizeof zero;
+    ok &= pwrite(fd, &misaligned, sizeof misaligned, 48) == sizeof misaligned;
+    ok &= expect("store: misaligned index", 1,
+                 mmap_store_open(vtable, pp, path) == NULL);
+    close(fd);
+    return ok;
+}
+
+static int
+test_store(const mmap_vtable *vtable, const mmap_pp pp,
+           mmap_enc_mat_t zero_enc_1, mmap_enc_mat_t one_enc_2)
+{
+    char path[] = "/tmp/test_mmap_mat_XXXXXX";
+    mmap_store_writer *w;
+    mmap_store *store;
+    mmap_enc_mat_t result;
+    mmap_enc_mat_view v;
+    int fd, ok = 1;
+
+    if ((fd = mkstemp(path)) == -1)
+        return 0;
+    close(fd);
+    w = mmap_store_writer_new(vtable, pp, path);
+    ok &= expect("writer", 1, w != NULL);
+    if (w == NULL)
+        return 0;
+    mmap_store_writer_add_mat(w, zero_enc_1);
+    mmap_store_writer_add(w, &one_enc_2->m[1][1], 1);
+    mmap_store_writer_add_mat(w, one_enc_2);
+    ok &= expect("write", MMAP_OK, mmap_store_writer_close(w));
+    store = mmap_store_open(vtable, pp, path);
+    ok &= expect("open", 1, store != NULL);
+    if (store == NULL) {
+        unlink(path);
+        return 0;
+    }
+
+    ok &= expect("count", 7, mmap_store_count(store));
+    ok &= expect("nmats", 2, mmap_store_nmats(store));
+    ok &= expect("out of range", 1, mmap_store_get_range(store, 7, 1) == NULL);
+    ok &= expect("matrix out of range", 1, mmap_store_get_mat(store, 2).data == NULL);
+    /* Only the second matrix is loaded */
+    v = mmap_store_get_mat(store, 1);
+    ok &= expect("shape", 1, v.nrows == 2 && v.ncols == 2);
+    ok &= expect("lazy", 1, mmap_store_get_range(store, 0, 0)[0] == NULL);
+
+    mmap_enc_mat_init(vtable, pp, result, 1, 2);
+    mmap_enc_mat_view_mul(vtable, pp, mmap_enc_mat_as_view(result),
+                          mmap_store_get_mat(store, 0), v);
+    ok &= expect("store: [1 0] * I (0)", 0, vtable->enc->is_zero(result->m[0][0], pp));
+    ok &= expect("store: [1 0] * I (1)", 1, vtable->enc->is_zero(result->m[0][1], pp));
+    vtable->enc->mul(result->m[0][0], pp, mmap_store_get(store, 0), mmap_store_get(store, 2));
+    ok &= expect("store: 1 * 1", 0, vtable->enc->is_zero(result->m[0][0], pp));
+    mmap_enc_mat_clear(vtable, result);
+    mmap_store_close(store);
+    /* The mapping is shared, so only patch the file once it is closed */
+    ok &= test_store_corrupt(vtable, pp, path);
+    unlink(path);
+    return ok;
+}
+
+/* Payloads of a page or more start on a page boundary */
+static int
+test_store_pages(void)
+{
+    const mmap_vtable *vtable = &dummy_vtable;
+    char path[] = "/tmp/test_mmap_mat_XXXXXX";
+    int pows[] = {1, 1};
+    mmap_sk_params params = {
+        .lambda = 80,
+        .kappa = 1,
+        .gamma = 2,
+        .pows = pows,
+    };
+    mmap_sk_opt_params opts = {
+        .nslots = 512,
+        .modulus = NULL,
+        .is_polylog = false,
+    };
+    aes_randstate_t rng;
+    mmap_enc encs[2];
+    mmap_store *store;
+    mmap_sk sk;
+    mmap_pp pp;
+    mpz_t *xs;
+    uint64_t index, offsets[2];
+    int fd, ok = 1;
+
+    if ((fd = mkstemp(path)) == -1)
+        return 0;
+    aes_randinit(rng);
+    sk = vtable->sk->new(&params, &opts, 0, rng, false);
     pp = vtable->sk->pp(sk);
+    xs = calloc(opts.nslots, sizeof xs[0]);
+    for (int k = 0; k < 2; ++k) {
+        for (size_t i = 0; i < opts.nslots; ++i)
+            mpz_init_set_ui(xs[i], k);
+        encs[k] = vtable->enc->new(pp);
+        vtable->enc->encode(encs[k], sk, opts.nslots, (const mpz_t *) xs, pows, 0);
+        for (size_t i = 0; i < opts.nslots; ++i)
+            mpz_clear(xs[i]);
+    }
+    ok &= expect("pages: payload", 1, vtable->enc->payload_size(pp) >= 4096);
+    ok &= expect("pages: write", MMAP_OK,
+                 mmap_store_write(vtable, pp, path, encs, 2));
+    /* The index offset follows struct store_header */
+    ok &= pread(fd, &index, sizeof index, 32) == sizeof index;
+    ok &= pread(fd, &offsets[0], sizeof offsets[0], index) == sizeof offsets[0];
+    ok &= pread(fd, &offsets[1], sizeof offsets[1], index + 16) == sizeof offsets[1];
+    ok &= expect("pages: aligned", 1,
+                 offsets[0] % 4096 == 0 && offsets[1] % 4096 == 0);
+    close(fd);
+    store = mmap_store_open(vtable, pp, path);
+    ok &= expect("pages: open", 1, store != NULL);
+    if (store) {
+        ok &= expect("pages: 0", 1, vtable->enc->is_zero(mmap_store_get(store, 0), pp));
+        ok &= expect("pages: 1", 0, vtable->enc->is_zero(mmap_store_get(store, 1), pp));
+        mmap_store_close(store);
+    }
+    unlink(path);
+    vtable->enc->free(encs[0]);
+    vtable->enc->free(encs[1]);
+    free(xs);
+    vtable->sk->free(sk);
+    aes_randclear(rng);
+    return ok;
+}
+
+struct stream_state {
+    const mmap_vtable *vtable;
+    mmap_pp pp;
+    int ok;
+};
+
+/* Expects [1 0] and then I */
+static int
+check_streamed(mmap_enc_mat_t m, size_t k, void *arg)
+{
+    struct stream_state *st = arg;
+    const int nrows = k == 0 ? 1 : 2;
+    st->ok &= expect("stream: shape", 1, m->nrows == nrows && m->ncols == 2);
+    st->ok &= expect("stream: (0,0)", 0, st->vtable->enc->is_zero(m->m[0][0], st->pp));
+    st->ok &= expect("stream: (0,1)", 1, st->vtable->enc->is_zero(m->m[0][1], st->pp));
+    return k < 1 ? MMAP_OK : 42;
+}
+
+static int
+test_io(const mmap_vtable *vtable, const mmap_pp pp,
+        mmap_enc_mat_t zero_enc_1, mmap_enc_mat_t one_enc_2)
+{
+    struct stream_state st = { vtable, pp, 1 };
+    mmap_enc_mat_t a, b, result;
+    mmap_enc *encs;
+    size_t n = 0;
+    FILE *f;
+    int ok = 1;
+
+    f = tmpfile();
+    ok &= expect("fwrite", MMAP_OK, mmap_enc_mat_fwrite(vtable, zero_enc_1, f));
+    ok &= expect("fwrite", MMAP_OK, mmap_enc_mat_fwrite(vtable, one_enc_2, f));
+    ok &= expect("fwrite", MMAP_OK, mmap_enc_mat_fwrite(vtable, one_enc_2, f));
+    ok &= expect("array fwrite", MMAP_OK, mmap_enc_array_fwrite(vtable, one_enc_2->data, 4, f));
+    rewind(f);
+    ok &= expect("fread", MMAP_OK, mmap_enc_mat_fread(vtable, pp, a, f));
+    ok &= expect("fread", MMAP_OK, mmap_enc_mat_fread(vtable, pp, b, f));
+    mmap_enc_mat_init(vtable, pp, result, 1, 2);
+    mmap_enc_mat_mul(vtable, pp, result, a, b);
+    ok &= expect("fread: [1 0] * I (0)", 0, vtable->enc->is_zero(result->m[0][0], pp));
+    ok &= expect("fread: [1 0] * I (1)", 1, vtable->enc->is_zero(result->m[0][1], pp));
+    mmap_enc_mat_clear(vtable, a);
+    mmap_enc_mat_clear(vtable, b);
+    ok &= expect("fread: skip", MMAP_OK, mmap_enc_mat_fread(vtable, pp, a, f));
+    mmap_enc_mat_clear(vtable, a);
+
+    encs = mmap_enc_array_fread(vtable, &n, f);
+    ok &= expect("array fread", 4, encs ? (int) n : -1);
+    if (encs) {
+        vtable->enc->mul(result->m[0][0], pp, zero_enc_1->m[0][0], encs[3]);
+        ok &= expect("array fread: 1 * 1", 0, vtable->enc->is_zero(result->m[0][0], pp));
+        vtable->enc->mul(result->m[0][0], pp, zero_enc_1->m[0][0], encs[2]);
+        ok &= expect("array fread: 1 * 0", 1, vtable->enc->is_zero(result->m[0][0], pp));
+        for (size_t i = 0; i < n; ++i)
+            vtable->enc->free(encs[i]);
+        free(encs);
+    }
+    ok &= expect("fread at end", MMAP_ERR, mmap_enc_mat_fread(vtable, pp, a, f));
+    mmap_enc_mat_clear(vtable, result);
+
+    /* The callback stops the stream at the second matrix */
+    rewind(f);
+    ok &= expect("stream", 42, mmap_enc_mat_fread_stream(vtable, pp, f, check_streamed, &st));
+    ok &= st.ok;
+    fclose(f);
+
+    {
+        /* A frame claiming far more bytes than follow it, in a file and in
+         * a stream whose length is unknown */
+        const uint64_t header[2] = { 1, (uint64_t) 1 << 40 };
+        char data[sizeof header + 64] = { 0 };
+        memcpy(data, header, sizeof header);
+        f = tmpfile();
+        ok &= expect("oversized frame: write", 1, fwrite(data, sizeof data, 1, f) == 1);
+        rewind(f);
+        ok &= expect("oversized frame: file", 1, mmap_enc_array_fread(vtable, &n, f) == NULL);
+        fclose(f);
+        f = fmemopen(data, sizeof data, "rb");
+        ok &= expect("oversized frame: stream", 1, mmap_enc_array_fread(vtable, &n, f) == NULL);
+        fclose(f);
+    }
+    return ok;
+}
+
+/* Calls f, if given, on each file in dir and returns how many there are */
+static size_t
+dir_apply(const char *dir, int (*f)(const char *path))
+{
+    struct dirent *d;
+    size_t n = 0;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+        return 0;
+    while ((d = readdir(dp)) != NULL) {
+        char *path;
+        if (d->d_name[0] == '.')
+            continue;
+        path = malloc(strlen(dir) + strlen(d->d_name) + 2);
+        sprintf(path, "%s/%s", dir, d->d_name);
+        if (f)
+            (void) f(path);
+        free(path);
+        ++n;
+    }
+    closedir(dp);
+    return n;
+}
+
+static int
+truncate_key(const char *path)
+{
+    return truncate(path, 16);
+}
+
+static int
+same_key(const mmap_vtable *vtable, mmap_sk a, mmap_sk b)
+{
+    char *abuf = NULL, *bbuf = NULL;
+    size_t asize, bsize;
+    FILE *fp;
+    int same;
+
+    fp = open_memstream(&abuf, &asize);
+    vtable->sk->fwrite(a, fp);
+    fclose(fp);
+    fp = open_memstream(&bbuf, &bsize);
+    vtable->sk->fwrite(b, fp);
+    fclose(fp);
+    same = asize == bsize && memcmp(abuf, bbuf, asize) == 0;
+    free(abuf);
+    free(bbuf);
+    return same;
+}
+
+static int
+test_sk_cache(const mmap_vtable *vtable, ulong lambda)
+{
+    char dir[] = "/tmp/test_mmap_mat_XXXXXX";
+    mmap_sk_params params = {
+        .lambda = lambda,
+        .kappa = kappa,
+        .gamma = nzs,
+        .pows = NULL,
+    };
+    aes_randstate_t rng;
+    mmap_sk sk1, sk2, sk3;
+    int ok = 1;
+
+    if (mkdtemp(dir) == NULL)
+        return 0;
+    sk1 = mmap_sk_cache_new(vtable, dir, 0, &params, NULL, 0, "a", 1, rng, false);
+    aes_randclear(rng);
+    ok &= expect("cache: stored", 1, dir_apply(dir, NULL));
+    sk2 = mmap_sk_cache_new(vtable, dir, 0, &params, NULL, 0, "a", 1, rng, false);
+    aes_randclear(rng);
+    ok &= expect("cache: loaded", 1, dir_apply(dir, NULL));
+    ok &= expect("cache: same key", 1, same_key(vtable, sk1, sk2));
+    vtable->sk->free(sk2);
+
+    sk2 = mmap_sk_cache_new(vtable, dir, 0, &params, NULL, 0, "b", 1, rng, false);
+    aes_randclear(rng);
+    ok &= expect("cache: other seed", 2, dir_apply(dir, NULL));
+    ok &= expect("cache: other key", 0, same_key(vtable, sk1, sk2));
+    vtable->sk->free(sk2);
+
+    /* Keys keep the thread count they were made with, so another count is
+     * another entry, identical to a key generated with that count */
+    sk2 = mmap_sk_cache_new(vtable, dir, 0, &params, NULL, 2, "a", 1, rng, false);
+    aes_randclear(rng);
+    ok &= expect("cache: other ncores", 3, dir_apply(dir, NULL));
+    vtable->sk->free(sk2);
+    sk2 = mmap_sk_cache_new(vtable, dir, 0, &params, NULL, 2, "a", 1, rng, false);
+    aes_randclear(rng);
+    ok &= expect("cache: ncores loaded", 3, dir_apply(dir, NULL));
+    aes_randinit_seedn(rng, "a", 1, NULL, 0);
+    sk3 = vtable->sk->new(&params, NULL, 2, rng, false);
+    aes_randclear(rng);
+    ok &= expect("cache: ncores kept", 1, same_key(vtable, sk2, sk3));
+    vtable->sk->free(sk3);
+    vtable->sk->free(sk2);
+
+    /* Broken keys are generated again, and the limit evicts all but the
+     * newest */
+    dir_apply(dir, truncate_key);
+    sk2 = mmap_sk_cache_new(vtable, dir, 1, &params, NULL, 0, "a", 1, rng, false);
+    aes_randclear(rng);
+    ok &= expect("cache: regenerated", 1, same_key(vtable, sk1, sk2));
+    ok &= expect("cache: evicted", 1, dir_apply(dir, NULL));
+    vtable->sk->free(sk2);
+    vtable->sk->free(sk1);
+
+    dir_apply(dir, unlink);
+    rmdir(dir);
+    return ok;
+}
+
+/* Traces a product through a tracing vtable and reads the trace back */
+static int
+test_trace(const mmap_vtable *vtable, const mmap_pp pp, mmap_enc_mat_t a,
+           mmap_enc_mat_t b)
+{
+    const mmap_vtable *traced;
+    size_t counts[MMAP_TRACE_NOPS] = { 0 };
+    mmap_enc_mat_t r;
+    mmap_trace trace;
+    FILE *fp = tmpfile();
+    int ok = 1;
+
+    traced = mmap_vtable_trace(vtable, fp);
+    if (!expect("trace", 1, traced != NULL))
+        return 0;
+    mmap_enc_mat_init(traced, pp, r, a->nrows, b->ncols);
+    mmap_enc_mat_mul(traced, pp, r, a, b);
+    ok &= expect("trace: [1 0] * [1 0][0 1]", 1, traced->enc->is_zero(r->m[0][1], pp));
+    mmap_enc_mat_clear(traced, r);
+    ok &= expect("trace: close", MMAP_OK, mmap_vtable_trace_close(traced));
 
-    if (is_gghlite)
-        return 0;               /* TODO: Support gghlite */
+    rewind(fp);
+    ok &= expect("trace: read", MMAP_OK, mmap_trace_read(fp, &trace));
+    fclose(fp);
+    for (size_t i = 0; i < trace.n; ++i)
+        counts[trace.ops[i]]++;
+    /* The inputs were created without tracing */
+    ok &= expect("trace: loads", 6, counts[MMAP_TRACE_LOAD]);
+    /* The result, and any scratch encodings the product needs */
+    ok &= expect("trace: news", 1, counts[MMAP_TRACE_NEW] >= 2);
+    ok &= expect("trace: frees", counts[MMAP_TRACE_NEW], counts[MMAP_TRACE_FREE]);
+    ok &= expect("trace: zero tests", 1, counts[MMAP_TRACE_IS_ZERO]);
+    ok &= expect("trace: products", 1,
+                 counts[MMAP_TRACE_MUL] + counts[MMAP_TRACE_FMA]
+                 + counts[MMAP_TRACE_DOT] > 0);
+    ok &= expect("trace: numbers", 6 + counts[MMAP_TRACE_NEW], trace.max_id);
+    mmap_trace_clear(&trace);
+    return ok;
+}
+
+/* Evaluates small circuits over entries of [1 1] and the identity */
+static int
+test_circuit(const mmap_vtable *vtable, const mmap_pp pp,
+             mmap_enc_mat_t one_enc_1, mmap_enc_mat_t one_enc_2)
+{
+    const mmap_enc inputs[] = {
+        one_enc_1->m[0][0], one_enc_1->m[0][1],
+        one_enc_2->m[0][0], one_enc_2->m[0][1],
+    };
+    mmap_circuit *c;
+    size_t a0, a1, b0, b1, s, z, s0, sum;
+    bool results[4];
+    int ok = 1;
+
+    c = mmap_circuit_new();
+    a0 = mmap_circuit_input(c);
+    a1 = mmap_circuit_input(c);
+    b0 = mmap_circuit_input(c);
+    b1 = mmap_circuit_input(c);
+    mmap_circuit_output(c, mmap_circuit_mul(c, mmap_circuit_sub(c, a0, a1), b0));
+    mmap_circuit_output(c, mmap_circuit_mul(c, mmap_circuit_add(c, a0, a1), b0));
+    /* A tree of independent products, for the threads to share */
+    sum = mmap_circuit_mul(c, a0, b1);
+    for (int i = 1; i < 64; ++i)
+        sum = mmap_circuit_add(c, sum, mmap_circuit_mul(c, i % 2 ? a1 : a0, b1));
+    mmap_circuit_output(c, sum);
+    /* Never an output, so never computed */
+    mmap_circuit_mul(c, a0, b0);
+    ok &= expect("circuit: eval", MMAP_OK,
+                 mmap_circuit_eval(vtable, pp, c, inputs, results));
+    ok &= expect("circuit: (1 - 1) * 1", 1, results[0]);
+    ok &= expect("circuit: (1 + 1) * 1", 0, results[1]);
+    ok &= expect("circuit: sum of 1 * 0", 1, results[2]);
+    mmap_circuit_free(c);
+
+    /* A long chain needs only a few encodings at a time */
+    c = mmap_circuit_new();
+    a0 = mmap_circuit_input(c);
+    a1 = mmap_circuit_input(c);
+    b0 = mmap_circuit_input(c);
+    b1 = mmap_circuit_input(c);
+    s = s0 = mmap_circuit_mul(c, a0, b0);
+    z = mmap_circuit_mul(c, a1, b1);
+    for (int i = 0; i < 200; ++i)
+        s = mmap_circuit_add(c, s, z);
+    mmap_circuit_output(c, mmap_circuit_sub(c, s, s0));
+    mmap_circuit_output(c, s0);
+    ok &= expect("circuit: chain eval", MMAP_OK,
+                 mmap_circuit_eval(vtable, pp, c, inputs, results));
+    ok &= expect("circuit: chain", 1, results[0]);
+    ok &= expect("circuit: chain start", 0, results[1]);
+    ok &= expect("circuit: chain peak", 1, mmap_circuit_peak(c) <= 4);
+    mmap_circuit_free(c);
+
+    c = mmap_circuit_new();
+    a0 = mmap_circuit_input(c);
+    ok &= expect("circuit: bad operand", 1,
+                 mmap_circuit_add(c, a0, 7) == SIZE_MAX);
+    ok &= expect("circuit: bad eval", MMAP_ERR,
+                 mmap_circuit_eval(vtable, pp, c, inputs, results));
+    mmap_circuit_free(c);
+    return ok;
+}
+
+static int test(const mmap_vtable *vtable, ulong lambda)
+{
+    int ok = 1;
+    mmap_sk sk;
+    mmap_pp pp;
+    aes_randstate_t rng;
+    mpz_t *moduli;
 
-    fmpz_mat_t zero_1, one_1, zero_2, one_2, rand, res;
-    fmpz_mat_init(zero_1, 1, 2);
-    fmpz_mat_init(one_1,  1, 2);
-    fmpz_mat_init(zero_2, 2, 2);
-    fmpz_mat_init(one_2,  2, 2);
-    fmpz_mat_init(res,    1, 2);
+    aes_randinit(rng);
 
-    fmpz_set_ui(fmpz_mat_entry(zero_1, 0, 0), 1);
-    fmpz_set_ui(fmpz_mat_entry(zero_1, 0, 1), 0);
+    mmap_sk_params params = {
+        .lambda = lambda,
+        .kappa = kappa,
+        .gamma = nzs,
+        .pows = NULL,
+    };
 
-    fmpz_set_ui(fmpz_mat_entry(one_1, 0, 0), 1);
-    fmpz_set_ui(fmpz_mat_entry(one_1, 0, 1), 1);
+    sk = vtable->sk->new(&params, NULL, 0, rng, false);
+    moduli = vtable->sk->plaintext_fields(sk);
+    pp = vtable->sk->pp(sk);
 
-    fmpz_set_ui(fmpz_mat_entry(zero_2, 0, 0), 1);
-    fmpz_set_ui(fmpz_mat_entry(zero_2, 0, 1), 0);
-    fmpz_set_ui(fmpz_mat_entry(zero_2, 1, 0), 0);
-    fmpz_set_ui(fmpz_mat_entry(zero_2, 1, 1), 0);
+    pt_mat zero_1, one_1, zero_2, one_2, rand, inv;
+    pt_mat_init(&zero_1, 1, 2);
+    pt_mat_init(&one_1,  1, 2);
+    pt_mat_init(&zero_2, 2, 2);
+    pt_mat_init(&one_2,  2, 2);
 
-    fmpz_set_ui(fmpz_mat_entry(one_2, 0, 0), 1);
-    fmpz_set_ui(fmpz_mat_entry(one_2, 0, 1), 0);
-    fmpz_set_ui(fmpz_mat_entry(one_2, 1, 0), 0);
-    fmpz_set_ui(fmpz_mat_entry(one_2, 1, 1), 1);
+    pt_mat_set_ui(&zero_1, (unsigned long []) { 1, 0 });
+    pt_mat_set_ui(&one_1,  (unsigned long []) { 1, 1 });
+    pt_mat_set_ui(&zero_2, (unsigned long []) { 1, 0, 0, 0 });
+    pt_mat_set_ui(&one_2,  (unsigned long []) { 1, 0, 0, 1 });
 
-    mmap_enc_mat_t zero_enc_1, one_enc_1, zero_enc_2, one_enc_2, result;
+    mmap_enc_mat_t zero_enc_1, one_enc_1, zero_enc_2, one_enc_2;
     mmap_enc_mat_init(vtable, pp, zero_enc_1, 1, 2);
     mmap_enc_mat_init(vtable, pp, one_enc_1,  1, 2);
     mmap_enc_mat_init(vtable, pp, zero_enc_2, 2, 2);
     mmap_enc_mat_init(vtable, pp, one_enc_2,  2, 2);
-    mmap_enc_mat_init(vtable, pp, result,     1, 2);
 
-    encode(vtable, sk, zero_enc_1, zero_1, 0, 1, 2, rng);
-    encode(vtable, sk, one_enc_1,  one_1,  0, 1, 2, rng);
-    encode(vtable, sk, zero_enc_2, zero_2, 1, 2, 2, rng);
-    encode(vtable, sk, one_enc_2,  one_2,  1, 2, 2, rng);
+    encode(vtable, sk, zero_enc_1, &zero_1, 0);
+    encode(vtable, sk, one_enc_1,  &one_1,  0);
+    encode(vtable, sk, zero_enc_2, &zero_2, 1);
+    encode(vtable, sk, one_enc_2,  &one_2,  1);
 
     printf("* Matrix multiplication\n");
-    mmap_enc_mat_mul(vtable, pp, result, zero_enc_1, zero_enc_2);
-    ok &= expect("[1 0] * [1 0][0 0]", 1, vtable->enc->is_zero(result->m[0][1], pp));
-    mmap_enc_mat_mul(vtable, pp, result, zero_enc_1, one_enc_2);
-    ok &= expect("[1 0] * [1 0][0 1]", 1, vtable->enc->is_zero(result->m[0][1], pp));
-    mmap_enc_mat_mul(vtable, pp, result, one_enc_1, zero_enc_2);
-    ok &= expect("[1 1] * [1 0][0 0]", 1, vtable->enc->is_zero(result->m[0][1], pp));
-    mmap_enc_mat_mul(vtable, pp, result, one_enc_1, one_enc_2);
-    ok &= expect("[1 1] * [1 0][0 1]", 0, vtable->enc->is_zero(result->m[0][1], pp));
+    ok &= test_products(vtable, pp, zero_enc_1, one_enc_1, zero_enc_2, one_enc_2);
+    printf("* In-place matrix multiplication\n");
+    ok &= test_in_place(vtable, pp, zero_enc_1, one_enc_1, one_enc_2);
+    printf("* Vector-matrix multiplication\n");
+    ok &= test_vec(vtable, pp, zero_enc_1, one_enc_1, zero_enc_2, one_enc_2);
+    printf("* Matrix views\n");
+    ok &= test_views(vtable, pp, one_enc_1, one_enc_2);
+    printf("* Fused operations\n");
+    ok &= test_fused(vtable, pp, zero_enc_1, one_enc_1, one_enc_2);
+    printf("* Batched zero-testing\n");
+    ok &= test_is_zero(vtable, pp, sk, zero_enc_2);
+    printf("* Matrix I/O\n");
+    ok &= test_io(vtable, pp, zero_enc_1, one_enc_2);
+    printf("* Encoding stores\n");
+    ok &= test_store(vtable, pp, zero_enc_1, one_enc_2);
+    printf("* Encoding pools\n");
+    ok &= test_pool(vtable, pp, one_enc_1);
+    printf("* Operation traces\n");
+    ok &= test_trace(vtable, pp, zero_enc_1, one_enc_2);
+    printf("* Circuits\n");
+    ok &= test_circuit(vtable, pp, one_enc_1, one_enc_2);
 
-    _fmpz_mat_init_rand(rand, 2, rng, moduli[0]);
-    fmpz_layer_mul_right(zero_1, one_1, rand, moduli[0]);
-    fmpz_modp_matrix_inverse(rand, rand, 2, moduli[0]);
-    fmpz_layer_mul_left(zero_2, one_2, rand, moduli[0]);
+    pt_mat_init_rand(&rand, &inv, rng, moduli[0]);
+    pt_mat_mul_mod(&zero_1, &zero_1, &rand, moduli[0]);
+    pt_mat_mul_mod(&one_1, &one_1, &rand, moduli[0]);
+    pt_mat_mul_mod(&zero_2, &inv, &zero_2, moduli[0]);
+    pt_mat_mul_mod(&one_2, &inv, &one_2, moduli[0]);
 
-    encode(vtable, sk, zero_enc_1, zero_1, 0, 1, 2, rng);
-    encode(vtable, sk, one_enc_1,  one_1,  0, 1, 2, rng);
-    encode(vtable, sk, zero_enc_2, zero_2, 1, 2, 2, rng);
-    encode(vtable, sk, one_enc_2,  one_2,  1, 2, 2, rng);
+    encode(vtable, sk, zero_enc_1, &zero_1, 0);
+    encode(vtable, sk, one_enc_1,  &one_1,  0);
+    encode(vtable, sk, zero_enc_2, &zero_2, 1);
+    encode(vtable, sk, one_enc_2,  &one_2,  1);
 
     printf("* Randomized matrix multiplication\n");
-    mmap_enc_mat_mul(vtable, pp, result, zero_enc_1, zero_enc_2);
-    ok &= expect("[1 0] * [1 0][0 0]", 1, vtable->enc->is_zero(result->m[0][1], pp));
-    mmap_enc_mat_mul(vtable, pp, result, zero_enc_1, one_enc_2);
-    ok &= expect("[1 0] * [1 0][0 1]", 1, vtable->enc->is_zero(result->m[0][1], pp));
-    mmap_enc_mat_mul(vtable, pp, result, one_enc_1, zero_enc_2);
-    ok &= expect("[1 1] * [1 0][0 0]", 1, vtable->enc->is_zero(result->m[0][1], pp));
-    mmap_enc_mat_mul(vtable, pp, result, one_enc_1, one_enc_2);
-    ok &= expect("[1 1] * [1 0][0 1]", 0, vtable->enc->is_zero(result->m[0][1], pp));
+    ok &= test_products(vtable, pp, zero_enc_1, one_enc_1, zero_enc_2, one_enc_2);
 
-    free(moduli);
+    mmap_enc_mat_clear(vtable, zero_enc_1);
+    mmap_enc_mat_clear(vtable, one_enc_1);
+    mmap_enc_mat_clear(vtable, zero_enc_2);
+    mmap_enc_mat_clear(vtable, one_enc_2);
+    pt_mat_clear(&zero_1);
+    pt_mat_clear(&one_1);
+    pt_mat_clear(&zero_2);
+    pt_mat_clear(&one_2);
+    pt_mat_clear(&rand);
+    pt_mat_clear(&inv);
+    vtable->pp->free(pp);
+    vtable->sk->free(sk);
+    aes_randclear(rng);
 
     return !ok;
 }
 
-static int test_lambdas(const mmap_vtable *vtable, bool is_gghlite)
+static int test_lambdas(const mmap_vtable *vtable)
 {
     int err = 0;
-    for (int i = 0; i < sizeof(lambdas) / (sizeof(lambdas[0])); ++i) {
+    for (size_t i = 0; i < sizeof(lambdas) / (sizeof(lambdas[0])); ++i) {
         printf("** lambda = %lu\n", lambdas[i]);
-        err |= test(vtable, lambdas[i], is_gghlite);
+        err |= test(vtable, lambdas[i]);
+        printf("* Matrix chains\n");
+        err |= test_chain(vtable, lambdas[i]);
+        printf("* Key cache\n");
+        err |= !test_sk_cache(vtable, lambdas[i]);
     }
     return err;
 }
 
-int main(void)
+static void *
+alloc_one(void *arg)
+{
+    mpz_init_set_ui(*(mpz_t *) arg, 1);
+    return NULL;
+}
+
+/* Threads that exit after one small allocation each hand the rest of their
+ * chunk back, so later threads do not map more */
+static int
+test_alloc_threads(void)
+{
+    enum { NTHREADS = 1100 };
+    mmap_alloc_stats before, after;
+    mpz_t *xs = malloc(NTHREADS * sizeof xs[0]);
+    int ok = 1;
+
+    mmap_alloc_get_stats(&before);
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, alloc_one, &xs[i]) != 0) {
+            ok = 0;
+            mpz_init(xs[i]);
+            continue;
+        }
+        pthread_join(thread, NULL);
+    }
+    mmap_alloc_get_stats(&after);
+    /* Without the hand-back this maps over 64 MiB */
+    ok &= expect("threads: mapped", 1, after.mapped - before.mapped <= (32 << 20));
+    for (int i = 0; i < NTHREADS; ++i)
+        mpz_clear(xs[i]);
+    free(xs);
+    return ok;
+}
+
+/* Runs everything again on top of the arena allocator */
+static int test_alloc(void)
 {
+    mmap_alloc_stats stats;
     int err = 0;
+
+    printf("* Arena allocator\n");
+    if (!expect("install", MMAP_OK, mmap_alloc_install(MMAP_ALLOC_HUGE_PAGES)))
+        return 1;
+    err |= !expect("install twice", MMAP_ERR, mmap_alloc_install(0));
     printf("* Dummy\n");
-    err |= test_lambdas(&dummy_vtable, false);
+    err |= test_lambdas(&dummy_vtable);
     printf("* CLT13\n");
-    err |= test_lambdas(&clt_vtable, false);
-#ifdef HAVE_GGHLITE
-    printf("* GGHLite\n");
-    err |= test_lambdas(&gghlite_vtable, true);
-#endif
+    err |= test_lambdas(&clt_vtable);
+    mmap_alloc_get_stats(&stats);
+    err |= !expect("mapped", 1, stats.mapped > 0);
+    err |= !expect("peak", 1, stats.peak >= stats.in_use);
+    err |= !test_alloc_threads();
+    mmap_alloc_uninstall();
     return err;
 }
 
-#else
-
 int main(void)
 {
-    return 0;
+    int err = 0;
+    printf("* Dummy\n");
+    err |= test_lambdas(&dummy_vtable);
+    printf("* Page-aligned stores\n");
+    err |= !test_store_pages();
+    printf("* CLT13\n");
+    err |= test_lambdas(&clt_vtable);
+    err |= test_alloc();
+    return err;
 }
-
-#endif
-
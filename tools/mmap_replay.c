@@ -0,0 +1,635 @@
+#include <mmap/mmap.h>
+#include <mmap/mmap_clt.h>
+#include <mmap/mmap_dummy.h>
+#include <mmap/mmap_trace.h>
+#include <inttypes.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Re-executes a trace written by mmap_vtable_trace against a backend, first
+ * in trace order and then, with more than one thread, as a task graph that
+ * only orders operations on the same encodings.  It also reports the
+ * parallelism the trace allows: the total time of its operations over that
+ * of the longest chain of dependent ones.
+ *
+ * usage: mmap_replay [-b dummy|clt] [-l lambda] [-k kappa] [-t threads] trace
+ *
+ * The key is generated from the first key record in the trace, with lambda
+ * and kappa overridable; later key records are ignored.  Plaintexts are not
+ * in traces, so encodings get arbitrary ones, and keys loaded from files
+ * get kappa 2 unless -k says otherwise. */
+
+struct replay {
+    const mmap_trace *trace;
+    const mmap_vtable *mmap;
+    mmap_sk sk;
+    mmap_pp pp;
+    mpz_t *moduli;
+    size_t nslots;
+    size_t nzs;
+    mmap_enc *encs;             // by number
+    bool *live;                 // created before the replay starts
+    /* The dependency graph: successors of record i are
+     * succs[succ_first[i]] to succs[succ_first[i + 1] - 1] */
+    size_t *succ_first;
+    size_t *succs;
+    size_t *npreds;
+    size_t nedges;
+    double *replay_ns;          // per record, from the sequential run
+};
+
+static double
+current_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const uint64_t *
+args_of(const mmap_trace *trace, size_t i)
+{
+    return trace->args + trace->first[i];
+}
+
+static bool
+make_key(struct replay *r, size_t lambda, size_t kappa)
+{
+    const mmap_trace *const trace = r->trace;
+    mmap_sk_params params = { 0 };
+    mmap_sk_opt_params opts = { 0 };
+    aes_randstate_t rng;
+    int *pows = NULL;
+    size_t i;
+
+    for (i = 0; i < trace->n; ++i) {
+        if (trace->ops[i] == MMAP_TRACE_SK_NEW
+            || trace->ops[i] == MMAP_TRACE_SK_LOAD)
+            break;
+    }
+    if (i == trace->n) {
+        fprintf(stderr, "error: the trace has no key\n");
+        return false;
+    }
+    {
+        const uint64_t *a = args_of(trace, i);
+        if (trace->ops[i] == MMAP_TRACE_SK_NEW) {
+            params.lambda = a[0];
+            params.kappa = a[1];
+            params.gamma = a[2];
+            if (a[3]) {
+                pows = calloc(a[3], sizeof pows[0]);
+                for (uint64_t k = 0; k < a[3]; ++k)
+                    pows[k] = (int) (uint32_t) a[4 + k];
+                params.pows = pows;
+            }
+            opts.nslots = a[4 + a[3]];
+        } else {
+            params.lambda = 16;
+            params.kappa = 2;
+            params.gamma = a[0];
+            opts.nslots = a[1];
+        }
+    }
+    if (lambda)
+        params.lambda = lambda;
+    if (kappa)
+        params.kappa = kappa;
+
+    aes_randinit_seedn(rng, (char *) "mmap_replay", 11, NULL, 0);
+    r->sk = r->mmap->sk->new(&params, opts.nslots ? &opts : NULL,
+                             omp_get_max_threads(), rng, false);
+    aes_randclear(rng);
+    free(pows);
+    if (r->sk == NULL)
+        return false;
+    r->pp = r->mmap->sk->pp(r->sk);
+    r->moduli = r->mmap->sk->plaintext_fields(r->sk);
+    r->nslots = r->mmap->sk->nslots(r->sk);
+    r->nzs = r->mmap->sk->nzs(r->sk);
+    return true;
+}
+
+/* Encodes arbitrary plaintexts, derived from the encoding's number, at the
+ * index set in pows, which holds npows entries for the key of the trace */
+static void
+encode(struct replay *r, uint64_t id, size_t n, size_t level,
+       const uint64_t *pows, size_t npows)
+{
+    /* The trace's count sizes xs, so bound it first */
+    if (n > r->nslots)
+        n = r->nslots;
+    int ix[r->nzs];
+    mpz_t xs[n ? n : 1];
+
+    for (size_t k = 0; k < r->nzs; ++k)
+        ix[k] = k < npows ? (int) (uint32_t) pows[k] : 1;
+    for (size_t k = 0; k < n; ++k) {
+        mpz_init_set_ui(xs[k], (id * 2654435761u + k) | 1);
+        mpz_mod(xs[k], xs[k], r->moduli[k % r->nslots]);
+    }
+    if (r->encs[id] == NULL)
+        r->encs[id] = r->mmap->enc->new(r->pp);
+    r->mmap->enc->encode(r->encs[id], r->sk, n, (const mpz_t *) xs, ix, level);
+    for (size_t k = 0; k < n; ++k)
+        mpz_clear(xs[k]);
+}
+
+static void
+execute(struct replay *r, size_t i)
+{
+    const mmap_vtable *const mmap = r->mmap;
+    const uint64_t *a = args_of(r->trace, i);
+    mmap_enc *const e = r->encs;
+
+    switch (r->trace->ops[i]) {
+    case MMAP_TRACE_NEW:
+    case MMAP_TRACE_LOAD:
+        if (e[a[0]] == NULL)
+            e[a[0]] = mmap->enc->new(r->pp);
+        break;
+    case MMAP_TRACE_FREE:
+        if (e[a[0]]) {
+            mmap->enc->free(e[a[0]]);
+            e[a[0]] = NULL;
+        }
+        break;
+    case MMAP_TRACE_ENCODE:
+        encode(r, a[0], a[1], a[2], a + 4, a[3]);
+        break;
+    case MMAP_TRACE_ENCODE_BATCH:
+        a += 3;
+        for (uint64_t k = 0; k < args_of(r->trace, i)[0]; ++k) {
+            encode(r, a[0], args_of(r->trace, i)[1], args_of(r->trace, i)[2],
+                   a + 2, a[1]);
+            a += 2 + a[1];
+        }
+        break;
+    case MMAP_TRACE_SET:
+        mmap->enc->set(e[a[0]], e[a[1]]);
+        break;
+    case MMAP_TRACE_SWAP:
+        mmap->enc->swap(&e[a[0]], &e[a[1]]);
+        break;
+    case MMAP_TRACE_ADD:
+        mmap->enc->add(e[a[0]], r->pp, e[a[1]], e[a[2]]);
+        break;
+    case MMAP_TRACE_SUB:
+        mmap->enc->sub(e[a[0]], r->pp, e[a[1]], e[a[2]]);
+        break;
+    case MMAP_TRACE_MUL:
+        mmap->enc->mul(e[a[0]], r->pp, e[a[1]], e[a[2]]);
+        break;
+    case MMAP_TRACE_FMA:
+        mmap_enc_fma(mmap, r->pp, e[a[0]], e[a[1]], e[a[2]]);
+        break;
+    case MMAP_TRACE_DOT: {
+        const size_t n = a[1];
+        mmap_enc *as = malloc((2 * n + 1) * sizeof as[0]);
+        for (size_t k = 0; k < 2 * n; ++k)
+            as[k] = e[a[2 + k]];
+        mmap_enc_dot(mmap, r->pp, e[a[0]], as, as + n, n);
+        free(as);
+        break;
+    }
+    case MMAP_TRACE_IS_ZERO:
+        (void) mmap->enc->is_zero(e[a[0]], r->pp);
+        break;
+    case MMAP_TRACE_IS_ZERO_BATCH: {
+        const size_t n = a[0];
+        mmap_enc *encs = malloc((n ? n : 1) * sizeof encs[0]);
+        bool *results = malloc((n ? n : 1) * sizeof results[0]);
+        for (size_t k = 0; k < n; ++k)
+            encs[k] = e[a[1 + k]];
+        mmap->enc->is_zero_batch(results, encs, n, r->pp);
+        free(encs);
+        free(results);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* Calls f(r, i, id, writes) for each encoding record i uses */
+static void
+for_each_operand(struct replay *r, size_t i,
+                 void (*f)(struct replay *, size_t, uint64_t, bool, void *),
+                 void *arg)
+{
+    const uint64_t *a = args_of(r->trace, i);
+
+    switch (r->trace->ops[i]) {
+    case MMAP_TRACE_NEW:
+    case MMAP_TRACE_LOAD:
+    case MMAP_TRACE_FREE:
+    case MMAP_TRACE_ENCODE:
+        f(r, i, a[0], true, arg);
+        break;
+    case MMAP_TRACE_ENCODE_BATCH:
+        a += 3;
+        for (uint64_t k = 0; k < args_of(r->trace, i)[0]; ++k) {
+            f(r, i, a[0], true, arg);
+            a += 2 + a[1];
+        }
+        break;
+    case MMAP_TRACE_SET:
+        f(r, i, a[0], true, arg);
+        f(r, i, a[1], false, arg);
+        break;
+    case MMAP_TRACE_SWAP:
+        f(r, i, a[0], true, arg);
+        f(r, i, a[1], true, arg);
+        break;
+    case MMAP_TRACE_ADD:
+    case MMAP_TRACE_SUB:
+    case MMAP_TRACE_MUL:
+    case MMAP_TRACE_FMA:
+        f(r, i, a[0], true, arg);
+        f(r, i, a[1], false, arg);
+        f(r, i, a[2], false, arg);
+        break;
+    case MMAP_TRACE_DOT:
+        f(r, i, a[0], true, arg);
+        for (uint64_t k = 0; k < 2 * a[1]; ++k)
+            f(r, i, a[2 + k], false, arg);
+        break;
+    case MMAP_TRACE_IS_ZERO:
+        f(r, i, a[0], false, arg);
+        break;
+    case MMAP_TRACE_IS_ZERO_BATCH:
+        for (uint64_t k = 0; k < a[0]; ++k)
+            f(r, i, a[1 + k], false, arg);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Encodings the replay must create up front: those used before any record
+ * creates them */
+static void
+note_live(struct replay *r, size_t i, uint64_t id, bool writes, void *seen_)
+{
+    bool *const seen = seen_;
+    const int op = r->trace->ops[i];
+
+    (void) writes;
+    if (!seen[id] && op != MMAP_TRACE_NEW && op != MMAP_TRACE_LOAD)
+        r->live[id] = true;
+    seen[id] = true;
+}
+
+/* Builds the dependency graph one record at a time: a record depends on the
+ * last record that wrote each encoding it uses, and one that writes an
+ * encoding also on the records that read it since */
+struct deps {
+    size_t *last_writer;        // by number, plus one; 0 for none
+    size_t *readers;            // heads of reader lists, plus one
+    size_t *reader_op;          // list nodes
+    size_t *reader_next;
+    size_t nreaders, readers_cap;
+    size_t *edge_from, *edge_to;
+    size_t nedges, edges_cap;
+    size_t *mark;               // the last record each record was made a
+                                // predecessor of, plus one
+};
+
+static void
+add_edge(struct deps *d, size_t from, size_t to)
+{
+    if (from == to || d->mark[from] == to + 1)
+        return;
+    d->mark[from] = to + 1;
+    if (d->nedges == d->edges_cap) {
+        d->edges_cap = d->edges_cap ? 2 * d->edges_cap : 1024;
+        d->edge_from = realloc(d->edge_from,
+                               d->edges_cap * sizeof d->edge_from[0]);
+        d->edge_to = realloc(d->edge_to, d->edges_cap * sizeof d->edge_to[0]);
+    }
+    d->edge_from[d->nedges] = from;
+    d->edge_to[d->nedges++] = to;
+}
+
+static void
+note_dep(struct replay *r, size_t i, uint64_t id, bool writes, void *d_)
+{
+    struct deps *const d = d_;
+
+    (void) r;
+    if (d->last_writer[id])
+        add_edge(d, d->last_writer[id] - 1, i);
+    if (!writes) {
+        if (d->nreaders == d->readers_cap) {
+            d->readers_cap = d->readers_cap ? 2 * d->readers_cap : 1024;
+            d->reader_op = realloc(d->reader_op,
+                                   d->readers_cap * sizeof d->reader_op[0]);
+            d->reader_next = realloc(d->reader_next,
+                                     d->readers_cap * sizeof d->reader_next[0]);
+        }
+        d->reader_op[d->nreaders] = i;
+        d->reader_next[d->nreaders] = d->readers[id];
+        d->readers[id] = ++d->nreaders;
+    }
+}
+
+static void
+note_write(struct replay *r, size_t i, uint64_t id, bool writes, void *d_)
+{
+    struct deps *const d = d_;
+
+    (void) r;
+    if (!writes)
+        return;
+    for (size_t k = d->readers[id]; k; k = d->reader_next[k - 1])
+        add_edge(d, d->reader_op[k - 1], i);
+    d->readers[id] = 0;
+    d->last_writer[id] = i + 1;
+}
+
+static void
+build_graph(struct replay *r)
+{
+    const mmap_trace *const trace = r->trace;
+    struct deps d = { 0 };
+
+    d.last_writer = calloc(trace->max_id + 1, sizeof d.last_writer[0]);
+    d.readers = calloc(trace->max_id + 1, sizeof d.readers[0]);
+    d.mark = calloc(trace->n ? trace->n : 1, sizeof d.mark[0]);
+    for (size_t i = 0; i < trace->n; ++i) {
+        for_each_operand(r, i, note_dep, &d);
+        for_each_operand(r, i, note_write, &d);
+    }
+
+    r->nedges = d.nedges;
+    r->succ_first = calloc(trace->n + 1, sizeof r->succ_first[0]);
+    r->succs = malloc((d.nedges ? d.nedges : 1) * sizeof r->succs[0]);
+    r->npreds = calloc(trace->n ? trace->n : 1, sizeof r->npreds[0]);
+    for (size_t e = 0; e < d.nedges; ++e) {
+        r->succ_first[d.edge_from[e] + 1]++;
+        r->npreds[d.edge_to[e]]++;
+    }
+    for (size_t i = 0; i < trace->n; ++i)
+        r->succ_first[i + 1] += r->succ_first[i];
+    {
+        size_t *fill = calloc(trace->n ? trace->n : 1, sizeof fill[0]);
+        for (size_t e = 0; e < d.nedges; ++e) {
+            const size_t from = d.edge_from[e];
+            r->succs[r->succ_first[from] + fill[from]++] = d.edge_to[e];
+        }
+        free(fill);
+    }
+    free(d.last_writer);
+    free(d.readers);
+    free(d.reader_op);
+    free(d.reader_next);
+    free(d.edge_from);
+    free(d.edge_to);
+    free(d.mark);
+}
+
+/* The length of the longest chain of dependent records, with record i taking
+ * ns[i].  Edges go forward in the trace, so one pass in order suffices. */
+static double
+span(const struct replay *r, const double *ns)
+{
+    double *finish = calloc(r->trace->n ? r->trace->n : 1, sizeof finish[0]);
+    double longest = 0.0;
+
+    for (size_t i = 0; i < r->trace->n; ++i) {
+        finish[i] += ns[i];
+        if (finish[i] > longest)
+            longest = finish[i];
+        for (size_t k = r->succ_first[i]; k < r->succ_first[i + 1]; ++k) {
+            const size_t s = r->succs[k];
+            if (finish[i] > finish[s])
+                finish[s] = finish[i];
+        }
+    }
+    free(finish);
+    return longest;
+}
+
+static void
+setup(struct replay *r)
+{
+    for (uint64_t id = 0; id <= r->trace->max_id; ++id) {
+        r->encs[id] = NULL;
+        if (r->live[id])
+            r->encs[id] = r->mmap->enc->new(r->pp);
+    }
+}
+
+static void
+teardown(struct replay *r)
+{
+    for (uint64_t id = 0; id <= r->trace->max_id; ++id) {
+        if (r->encs[id])
+            r->mmap->enc->free(r->encs[id]);
+        r->encs[id] = NULL;
+    }
+}
+
+static double
+run_sequential(struct replay *r)
+{
+    double start, total;
+
+    setup(r);
+    start = current_time();
+    for (size_t i = 0; i < r->trace->n; ++i) {
+        const double t = current_time();
+        execute(r, i);
+        r->replay_ns[i] = (current_time() - t) * 1e9;
+    }
+    total = current_time() - start;
+    teardown(r);
+    return total;
+}
+
+/* Runs record i, then whichever successors it makes ready: the first in this
+ * task, the others in tasks of their own */
+static void
+run_ready(struct replay *r, size_t *pending, size_t i)
+{
+    for (;;) {
+        size_t next = SIZE_MAX;
+
+        execute(r, i);
+        for (size_t k = r->succ_first[i]; k < r->succ_first[i + 1]; ++k) {
+            const size_t s = r->succs[k];
+            if (__atomic_sub_fetch(&pending[s], 1, __ATOMIC_ACQ_REL) != 0)
+                continue;
+            if (next == SIZE_MAX) {
+                next = s;
+            } else {
+#pragma omp task firstprivate(s)
+                run_ready(r, pending, s);
+            }
+        }
+        if (next == SIZE_MAX)
+            return;
+        i = next;
+    }
+}
+
+static double
+run_parallel(struct replay *r, int nthreads)
+{
+    size_t *pending = malloc((r->trace->n ? r->trace->n : 1) * sizeof pending[0]);
+    double start, total;
+
+    memcpy(pending, r->npreds, r->trace->n * sizeof pending[0]);
+    setup(r);
+    start = current_time();
+#pragma omp parallel num_threads(nthreads)
+#pragma omp single
+    for (size_t i = 0; i < r->trace->n; ++i) {
+        if (r->npreds[i] == 0) {
+#pragma omp task firstprivate(i)
+            run_ready(r, pending, i);
+        }
+    }
+    total = current_time() - start;
+    teardown(r);
+    free(pending);
+    return total;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-b dummy|clt] [-l lambda] [-k kappa] [-t threads] trace\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    struct replay r = { .mmap = &dummy_vtable };
+    size_t lambda = 0, kappa = 0;
+    int nthreads = omp_get_max_threads();
+    double *recorded_ns;
+    double work = 0.0, wall = 0.0, seq;
+    mmap_trace trace;
+    FILE *fp;
+    int c;
+
+    while ((c = getopt(argc, argv, "b:l:k:t:")) != -1) {
+        switch (c) {
+        case 'b':
+            if (strcmp(optarg, "dummy") == 0) {
+                r.mmap = &dummy_vtable;
+            } else if (strcmp(optarg, "clt") == 0) {
+                r.mmap = &clt_vtable;
+            } else {
+                fprintf(stderr, "error: unknown backend '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            lambda = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            kappa = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || nthreads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if ((fp = fopen(argv[optind], "rb")) == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (mmap_trace_read(fp, &trace) != MMAP_OK) {
+        fprintf(stderr, "error: '%s' is not a whole trace\n", argv[optind]);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    r.trace = &trace;
+    if (!make_key(&r, lambda, kappa))
+        return 1;
+
+    r.encs = calloc(trace.max_id + 1, sizeof r.encs[0]);
+    r.live = calloc(trace.max_id + 1, sizeof r.live[0]);
+    {
+        bool *seen = calloc(trace.max_id + 1, sizeof seen[0]);
+        for (size_t i = 0; i < trace.n; ++i)
+            for_each_operand(&r, i, note_live, seen);
+        free(seen);
+    }
+    build_graph(&r);
+
+    recorded_ns = malloc((trace.n ? trace.n : 1) * sizeof recorded_ns[0]);
+    r.replay_ns = malloc((trace.n ? trace.n : 1) * sizeof r.replay_ns[0]);
+    for (size_t i = 0; i < trace.n; ++i) {
+        const uint64_t end = trace.start_ns[i] + trace.duration_ns[i];
+        recorded_ns[i] = trace.duration_ns[i];
+        work += recorded_ns[i];
+        if (end > wall)
+            wall = end;
+    }
+    printf("trace: %zu records, %" PRIu64 " encodings, %zu dependencies\n",
+           trace.n, trace.max_id, r.nedges);
+    printf("recorded: %.6f s wall, %.6f s of operations, parallelism %.2f "
+           "(used %.2f)\n", wall / 1e9, work / 1e9,
+           work / (span(&r, recorded_ns) ? span(&r, recorded_ns) : 1.0),
+           work / (wall ? wall : 1.0));
+
+    seq = run_sequential(&r);
+    {
+        double replay_work = 0.0, s;
+        for (size_t i = 0; i < trace.n; ++i)
+            replay_work += r.replay_ns[i];
+        s = span(&r, r.replay_ns);
+        printf("replay (%s, sequential): %.6f s, parallelism %.2f\n",
+               r.mmap->name, seq, replay_work / (s ? s : 1.0));
+    }
+    if (nthreads > 1) {
+        const double par = run_parallel(&r, nthreads);
+        printf("replay (%s, %d threads): %.6f s, speedup %.2f\n",
+               r.mmap->name, nthreads, par, seq / par);
+    }
+
+    printf("\n%-14s %12s %14s %14s\n", "op", "count", "recorded ns",
+           "replay ns");
+    for (int op = 1; op < MMAP_TRACE_NOPS; ++op) {
+        double rec = 0.0, rep = 0.0;
+        size_t count = 0;
+        for (size_t i = 0; i < trace.n; ++i) {
+            if (trace.ops[i] != op)
+                continue;
+            count++;
+            rec += recorded_ns[i];
+            rep += r.replay_ns[i];
+        }
+        if (count)
+            printf("%-14s %12zu %14.0f %14.0f\n", mmap_trace_op_name(op),
+                   count, rec, rep);
+    }
+
+    free(recorded_ns);
+    free(r.replay_ns);
+    free(r.succ_first);
+    free(r.succs);
+    free(r.npreds);
+    free(r.encs);
+    free(r.live);
+    r.mmap->pp->free(r.pp);
+    r.mmap->sk->free(r.sk);
+    mmap_trace_clear(&trace);
+    return 0;
+}